@@ -39,6 +39,352 @@
 #define CP_BIT_n        3 // Input, active low, internal pull-up enabled.
 #define REQ_BIT_n       2 // Input, active low, internal pull-up enabled.
 
+#define BATCH_MAX_SEGMENTS  16
+#define BATCH_MAX_BYTES     1024
+
+#define STATUS_BUSY         0x5a
+#define STATUS_OK           0x00
+#define STATUS_TIMEOUT      0x01
+
+#define SEG_WRITE           0
+#define SEG_READ            1
+#define SEG_SELECT          2
+#define SEG_DESELECT        3
+#define SEG_POLL            4
+
+#define BATCH_SELECT        1
+#define BATCH_DESELECT      2
+
+#define POLL_MISMATCH       1
+#define POLL_BYTES          2
+
+#define CAPS_MAGIC          0x43
+#define FIRMWARE_ID         1
+#define PROTOCOL_VERSION    1
+
+// Control commands 0 to 9, except XFER_MODE and LBA.
+#define COMMANDS            0x3b7
+
+#define TIER_COUNT          6
+
+struct batch_segment
+{
+    uint8_t type;
+    uint8_t mask;
+    uint8_t value;
+    uint8_t flags;
+    uint16_t size;
+};
+
+// Stack pointer when idle in main(). The REQ interrupt handler resets the
+// stack to this value, so it doesn't matter how deep into a command (or a
+// helper function) the firmware was when REQ went high.
+static uint16_t idle_sp;
+
+static struct batch_segment batch_segs[BATCH_MAX_SEGMENTS];
+static uint8_t batch_buf[BATCH_MAX_BYTES];
+
+// Magic, firmware ID, protocol version, command bitmap, tier count and the
+// tier frequencies in kHz at 16 MHz.
+static const uint8_t caps[8 + 2 * TIER_COUNT] =
+{
+    CAPS_MAGIC, FIRMWARE_ID, PROTOCOL_VERSION,
+    0, 0, COMMANDS >> 8, COMMANDS & 0xff,
+    TIER_COUNT,
+    250 >> 8, 250 & 0xff,
+    500 >> 8, 500 & 0xff,
+    1000 >> 8, 1000 & 0xff,
+    2000 >> 8, 2000 & 0xff,
+    4000 >> 8, 4000 & 0xff,
+    8000 >> 8, 8000 & 0xff,
+};
+
+// SPCR and SPSR for each tier: fosc/64, /32, /16, /8, /4 and /2.
+static const uint8_t tier_spcr[TIER_COUNT] =
+{
+    (1 << SPE) | (1 << MSTR) | (1 << SPR1) | (1 << SPR0),
+    (1 << SPE) | (1 << MSTR) | (1 << SPR1),
+    (1 << SPE) | (1 << MSTR) | (1 << SPR0),
+    (1 << SPE) | (1 << MSTR) | (1 << SPR0),
+    (1 << SPE) | (1 << MSTR),
+    (1 << SPE) | (1 << MSTR),
+};
+
+static const uint8_t tier_spsr[TIER_COUNT] =
+{
+    (1 << SPI2X), (1 << SPI2X), 0, (1 << SPI2X), 0, (1 << SPI2X),
+};
+
+static uint8_t wait_clk(uint8_t dval)
+{
+    if (dval & (1 << CLK_BIT))
+    {
+        while (PIND & (1 << CLK_BIT))
+            ;
+    }
+    else
+    {
+        while (!(PIND & (1 << CLK_BIT)))
+            ;
+    }
+
+    return PIND;
+}
+
+static void drive_data(uint8_t value)
+{
+    PORTD = (value & 0xc0) | (1 << CP_BIT_n) | (1 << REQ_BIT_n);
+    PORTC = value;
+}
+
+static void drive_enable()
+{
+    DDRD = 0xc0 | (1 << ACT_BIT_n);
+    DDRC = 0x3f;
+}
+
+static uint8_t spi_transfer(uint8_t value)
+{
+    SPDR = value;
+
+    while (!(SPSR & (1 << SPIF)))
+        ;
+
+    return SPDR;
+}
+
+// Reads bytes until (byte & mask) == value, or != value with POLL_MISMATCH.
+// Gives up after limit ms, or limit bytes with POLL_BYTES. Timer 1 runs in
+// CTC mode and sets OCF1A once every ms.
+static uint8_t poll_spi(uint8_t mask, uint8_t value, uint8_t flags, uint16_t limit, uint8_t *result)
+{
+    uint8_t mismatch = flags & POLL_MISMATCH;
+    uint16_t count = 0;
+    uint8_t byte;
+
+    TCNT1 = 0;
+    TIFR1 = (1 << OCF1A);
+
+    while (1)
+    {
+        byte = spi_transfer(0xff);
+
+        if (((byte & mask) == value) != mismatch)
+            break;
+
+        if (flags & POLL_BYTES)
+            count++;
+        else if (TIFR1 & (1 << OCF1A))
+        {
+            TIFR1 = (1 << OCF1A);
+            count++;
+        }
+
+        if (count >= limit)
+            break;
+    }
+
+    *result = byte;
+    return ((byte & mask) == value) != mismatch;
+}
+
+// Returns the index of a poll that timed out, or count if all segments ran.
+static uint8_t run_batch(uint8_t flags, uint8_t count, uint16_t write_bytes)
+{
+    const uint8_t *src = batch_buf;
+    uint8_t *dst = batch_buf + write_bytes;
+    uint8_t i;
+
+    if (flags & BATCH_SELECT)
+        PORTB &= ~((1 << SS_BIT_n) | (1 << LED_BIT_n));
+
+    for (i = 0; i < count; i++)
+    {
+        struct batch_segment *seg = &batch_segs[i];
+        uint16_t size = seg->size;
+
+        switch (seg->type)
+        {
+            case SEG_WRITE:
+                while (size--)
+                    spi_transfer(*src++);
+                break;
+            case SEG_READ:
+                while (size--)
+                    *dst++ = spi_transfer(0xff);
+                break;
+            case SEG_SELECT:
+                PORTB &= ~((1 << SS_BIT_n) | (1 << LED_BIT_n));
+                break;
+            case SEG_DESELECT:
+                PORTB |= (1 << SS_BIT_n) | (1 << LED_BIT_n);
+                break;
+            case SEG_POLL:
+                if (!poll_spi(seg->mask, seg->value, seg->flags, size, dst++))
+                    goto out;
+                break;
+        }
+    }
+
+out:
+    if (flags & BATCH_DESELECT)
+        PORTB |= (1 << SS_BIT_n) | (1 << LED_BIT_n);
+
+    return i;
+}
+
+// The Amiga writes flags, segment count, segment descriptors (type and
+// size, followed by mask, value and flags for polls) and all write
+// payloads. After the turnaround CLK the port is driven with STATUS_BUSY
+// while the segments run, then with the status byte, and then the read
+// data is clocked out one byte per CLK toggle. A batch that can't be run
+// is never answered, the Amiga then falls back to single transfers.
+static void do_batch(uint8_t dval)
+{
+    uint8_t flags;
+    uint8_t count;
+    uint16_t write_bytes = 0;
+    uint16_t read_bytes = 0;
+
+    dval = wait_clk(dval);
+    flags = (dval & 0xc0) | PINC;
+
+    dval = wait_clk(dval);
+    count = (dval & 0xc0) | PINC;
+
+    if (count > BATCH_MAX_SEGMENTS)
+        return;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        struct batch_segment *seg = &batch_segs[i];
+
+        dval = wait_clk(dval);
+        seg->type = (dval & 0xc0) | PINC;
+
+        dval = wait_clk(dval);
+        seg->size = ((dval & 0xc0) | PINC) << 8;
+
+        dval = wait_clk(dval);
+        seg->size |= (dval & 0xc0) | PINC;
+
+        if (seg->type == SEG_POLL)
+        {
+            dval = wait_clk(dval);
+            seg->mask = (dval & 0xc0) | PINC;
+
+            dval = wait_clk(dval);
+            seg->value = (dval & 0xc0) | PINC;
+
+            dval = wait_clk(dval);
+            seg->flags = (dval & 0xc0) | PINC;
+
+            read_bytes++;
+        }
+        else if (seg->size > BATCH_MAX_BYTES)
+            return;
+        else if (seg->type == SEG_WRITE)
+            write_bytes += seg->size;
+        else if (seg->type == SEG_READ)
+            read_bytes += seg->size;
+    }
+
+    if (write_bytes + read_bytes > BATCH_MAX_BYTES)
+        return;
+
+    for (uint16_t i = 0; i < write_bytes; i++)
+    {
+        dval = wait_clk(dval);
+        batch_buf[i] = (dval & 0xc0) | PINC;
+    }
+
+    dval = wait_clk(dval);
+
+    drive_data(STATUS_BUSY);
+    drive_enable();
+
+    uint8_t done = run_batch(flags, count, write_bytes);
+
+    drive_data(done == count ? STATUS_OK : 0x80 | done);
+
+    for (uint16_t i = 0; i < read_bytes; i++)
+    {
+        dval = wait_clk(dval);
+        drive_data(batch_buf[write_bytes + i]);
+    }
+}
+
+// The Amiga writes mask, value, flags and a 16 bit limit. After the
+// turnaround CLK the port is driven with STATUS_BUSY while polling, then
+// with the status byte, and on the next CLK toggle with the last byte read.
+static void do_poll(uint8_t dval)
+{
+    uint8_t mask, value, flags;
+    uint16_t limit;
+    uint8_t result;
+
+    dval = wait_clk(dval);
+    mask = (dval & 0xc0) | PINC;
+
+    dval = wait_clk(dval);
+    value = (dval & 0xc0) | PINC;
+
+    dval = wait_clk(dval);
+    flags = (dval & 0xc0) | PINC;
+
+    dval = wait_clk(dval);
+    limit = ((dval & 0xc0) | PINC) << 8;
+
+    dval = wait_clk(dval);
+    limit |= (dval & 0xc0) | PINC;
+
+    dval = wait_clk(dval);
+
+    drive_data(STATUS_BUSY);
+    drive_enable();
+
+    uint8_t matched = poll_spi(mask, value, flags, limit, &result);
+
+    drive_data(matched ? STATUS_OK : STATUS_TIMEOUT);
+
+    dval = wait_clk(dval);
+    drive_data(result);
+}
+
+// The caps are driven one byte per CLK toggle after the turnaround CLK.
+static void do_caps(uint8_t dval)
+{
+    for (uint8_t i = 0; i < sizeof(caps); i++)
+    {
+        dval = wait_clk(dval);
+        drive_data(caps[i]);
+        drive_enable();
+    }
+}
+
+// The Amiga writes the tier index, which is echoed back after the
+// turnaround CLK, or 0xff if there is no such tier.
+static void do_tier(uint8_t dval)
+{
+    uint8_t tier;
+
+    dval = wait_clk(dval);
+    tier = (dval & 0xc0) | PINC;
+
+    if (tier < TIER_COUNT)
+    {
+        SPCR = tier_spcr[tier];
+        SPSR = tier_spsr[tier];
+    }
+    else
+        tier = 0xff;
+
+    dval = wait_clk(dval);
+
+    drive_data(tier);
+    drive_enable();
+}
+
 void start_command()
 {
     uint8_t dval;
@@ -46,6 +392,7 @@ void start_command()
     uint8_t next_port_d;
     uint8_t next_port_c;
     uint16_t byte_count;
+    uint8_t byte_count_hi = 0;
 
     dval = PIND;
     cval = PINC;
@@ -130,7 +477,51 @@ void start_command()
             else // Slow
                 SPCR = (1 << SPE) | (1 << MSTR) | (1 << SPR1) | (1 << SPR0);
 
+            SPSR = (1 << SPI2X);
+
+            PORTD &= ~(1 << ACT_BIT_n);
+        }
+        else if (cmd == 4) // BATCH
+        {
+            PORTD &= ~(1 << ACT_BIT_n);
+
+            do_batch(dval);
+        }
+        else if (cmd == 5) // POLL
+        {
+            PORTD &= ~(1 << ACT_BIT_n);
+
+            do_poll(dval);
+        }
+        else if (cmd == 7) // READ3 or WRITE3
+        {
+            PORTD &= ~(1 << ACT_BIT_n);
+
+            dval = wait_clk(dval);
+            byte_count_hi = (dval & 0xc0) | PINC;
+
+            dval = wait_clk(dval);
+            byte_count = ((dval & 0xc0) | PINC) << 8;
+
+            dval = wait_clk(dval);
+            byte_count |= (dval & 0xc0) | PINC;
+
+            if (cval & 1)
+                goto do_read;
+            else
+                goto do_write;
+        }
+        else if (cmd == 8) // GET_CAPS
+        {
+            PORTD &= ~(1 << ACT_BIT_n);
+
+            do_caps(dval);
+        }
+        else if (cmd == 9) // SPEED_TIER
+        {
             PORTD &= ~(1 << ACT_BIT_n);
+
+            do_tier(dval);
         }
 
         while (1)
@@ -175,6 +566,13 @@ read_loop:
         SPDR = 0xff;
         goto read_loop;
     }
+    else if (byte_count_hi)
+    {
+        byte_count_hi--;
+        byte_count = 0xffff;
+        SPDR = 0xff;
+        goto read_loop;
+    }
 
     while (1)
         ;
@@ -205,6 +603,12 @@ write_loop:
         byte_count--;
         goto write_loop;
     }
+    else if (byte_count_hi)
+    {
+        byte_count_hi--;
+        byte_count = 0xffff;
+        goto write_loop;
+    }
 
     while (1)
         ;
@@ -241,8 +645,10 @@ ISR(INT0_vect, ISR_NAKED)
     }
 
     uint16_t fn_int = (uint16_t)next_fn;
-    uint16_t sp = ((SPH << 8) | SPL) + 1;
-    uint8_t *p = (uint8_t *)sp;
+    uint16_t sp = idle_sp - 2;
+    SPH = sp >> 8;
+    SPL = sp & 0xff;
+    uint8_t *p = (uint8_t *)(sp + 1);
     *p++ = fn_int >> 8;
     *p++ = fn_int & 0xff;
 
@@ -266,6 +672,11 @@ void main()
     SPCR = (1 << SPE) | (1 << MSTR) | (1 << SPR1) | (1 << SPR0);
     SPSR |= (1 << SPI2X);
 
+    // Timer 1 in CTC mode, fosc/64, OCF1A set every 1 ms. Used by POLL.
+    OCR1A = 249;
+    TCCR1A = 0;
+    TCCR1B = (1 << WGM12) | (1 << CS11) | (1 << CS10);
+
     DDRD = (1 << ACT_BIT_n);
     PORTD =  (1 << ACT_BIT_n) | (1 << CP_BIT_n) | (1 << REQ_BIT_n);
 
@@ -277,6 +688,8 @@ void main()
     EIFR = (1 << 1) | (1 << 0);
     EIMSK = (1 << 1) | (1 << 0);
 
+    idle_sp = (SPH << 8) | SPL;
+
     sei();
 
     while (1)
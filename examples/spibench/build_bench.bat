@@ -0,0 +1 @@
+vc +kick13 spibench.c ../../spi-lib/spi.c ../../spi-lib/spi_low.asm -I../../spi-lib -O2 -lamiga -o spibench
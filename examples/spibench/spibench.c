@@ -0,0 +1,166 @@
+/*
+ * spibench.c
+ *
+ * Measures the raw throughput of the parallel port link with the
+ * adapter firmware in test mode, where reads return a known pattern
+ * and writes are checked against it, so no SPI device is involved and
+ * the data is verified as well.
+ *
+ * Usage: spibench [clk]
+ *
+ *   clk   use CLK-toggled transfers even if strobe mode is available
+ *
+ * Each size is read and written for a second. Handshakes per second
+ * are REQ cycles, one per transfer, two per select/deselect pair.
+ *
+ * Compile with build_bench.bat.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <exec/execbase.h>
+
+#include "spi.h"
+
+#define MAX_SIZE 8192
+
+extern struct ExecBase *SysBase;
+
+static unsigned char buf[MAX_SIZE];
+static unsigned long ticks_per_second;
+
+static volatile unsigned char * const todl = (volatile unsigned char *)0xbfe801;
+static volatile unsigned char * const todm = (volatile unsigned char *)0xbfe901;
+static volatile unsigned char * const todh = (volatile unsigned char *)0xbfea01;
+
+/* CIA-A TOD counts vertical blanks */
+static unsigned long tod_ticks(void)
+{
+    unsigned char l, m, h;
+
+    /* TOD registers latch on reading MSB, unlatch on reading LSB */
+    h = *todh;
+    m = *todm;
+    l = *todl;
+    return ((unsigned long)h << 16) | ((unsigned long)m << 8) | l;
+}
+
+typedef void (*bench_fn)(unsigned long size);
+
+static void bench_read(unsigned long size)
+{
+    spi_read(buf, size);
+}
+
+static void bench_write(unsigned long size)
+{
+    spi_write(buf, size);
+}
+
+static void bench_select(unsigned long size)
+{
+    spi_select();
+    spi_deselect();
+}
+
+static void bench_poll(unsigned long size)
+{
+    unsigned char in;
+    spi_poll(0xff, 0xff, SPI_POLL_MATCH | SPI_POLL_BYTES, 1, &in);
+}
+
+/* Calls fn for one second, starting on a tick edge, and returns the count */
+static unsigned long run(bench_fn fn, unsigned long size)
+{
+    unsigned long start = tod_ticks();
+    while (tod_ticks() == start)
+        ;
+
+    start = tod_ticks();
+    unsigned long calls = 0;
+    while (tod_ticks() - start < ticks_per_second) {
+        fn(size);
+        calls++;
+    }
+    return calls;
+}
+
+static void fill_pattern(unsigned long size)
+{
+    for (unsigned long i = 0; i < size; i++)
+        buf[i] = SPI_TEST_PATTERN(i);
+}
+
+static unsigned long check_pattern(unsigned long size)
+{
+    unsigned long errors = 0;
+    for (unsigned long i = 0; i < size; i++) {
+        if (buf[i] != SPI_TEST_PATTERN(i))
+            errors++;
+    }
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    int force_clk = argc > 1 && strcmp(argv[1], "clk") == 0;
+
+    ticks_per_second = SysBase->VBlankFrequency;
+
+    int res = spi_initialize(NULL);
+    if (res < 0) {
+        printf("spi_initialize failed: %d\n", res);
+        return 1;
+    }
+
+    struct spi_caps caps;
+    int have_caps = spi_get_caps(&caps) == 0;
+
+    /* Leaves the error count at zero */
+    int verify = spi_set_test_mode(1) >= 0;
+
+    spi_set_speed(SPI_SPEED_FAST);
+    long mode = spi_set_xfer_mode(force_clk ? SPI_XFER_CLK : SPI_XFER_STROBE);
+
+    printf("spibench: firmware %d, %s transfers, %s\n",
+           have_caps ? caps.firmware : 0,
+           mode == SPI_XFER_STROBE ? "strobe" : "CLK",
+           verify ? "data verified" : "no test mode, data not verified");
+
+    printf("\n size   read kB/s  xfers/s  write kB/s  xfers/s  errors\n");
+
+    unsigned long total_errors = 0;
+
+    for (unsigned long size = 1; size <= MAX_SIZE; size <<= 1) {
+        unsigned long reads = run(bench_read, size);
+        unsigned long errors = verify ? check_pattern(size) : 0;
+
+        fill_pattern(size);
+        unsigned long writes = run(bench_write, size);
+        if (verify)
+            errors += spi_set_test_mode(1);
+
+        printf("%5lu  %9lu  %7lu  %10lu  %7lu  %6lu\n", size,
+               reads * size / 1024, reads,
+               writes * size / 1024, writes, errors);
+
+        total_errors += errors;
+    }
+
+    unsigned long selects = run(bench_select, 0);
+    unsigned long polls = run(bench_poll, 0);
+
+    printf("\nselect/deselect: %lu handshakes/s\n", selects * 2);
+    printf("poll: %lu handshakes/s\n", polls);
+
+    if (verify) {
+        spi_set_test_mode(0);
+        printf("%lu bytes did not match the pattern\n", total_errors);
+    }
+
+    spi_set_speed(SPI_SPEED_SLOW);
+    spi_shutdown();
+
+    return total_errors ? 5 : 0;
+}
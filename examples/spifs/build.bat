@@ -0,0 +1 @@
+vc handler.c ../../spi-lib/spi.c ../../spi-lib/spi_low.asm -I../../spi-lib -O2 -nostdlib -lamiga -o spifs-handler
@@ -0,0 +1,882 @@
+/*
+ * handler.c - AmigaDOS file system handler for the FAT volume of the SD
+ * card, run by the adapter firmware.
+ *
+ * The RP2350 firmware mounts the FAT volume itself and runs file
+ * requests with spi_file_request(), so the Amiga only sends names and
+ * file data over the parallel port and never reads the FAT or the
+ * directories. Locks keep the path of their object, and each DOS packet
+ * becomes one or a few requests.
+ *
+ * Mounted with a mountlist entry, see README.md. Needs Kickstart 2.0 and
+ * firmware that reports SPI_CAP_FILE.
+ */
+
+#include <exec/types.h>
+#include <exec/memory.h>
+#include <exec/execbase.h>
+#include <dos/dos.h>
+#include <dos/dosextens.h>
+#include <dos/filehandler.h>
+#include <proto/exec.h>
+#include <proto/dos.h>
+
+#include <string.h>
+
+#include "spi.h"
+
+#define TARGET 0
+
+#define SIGB_CARD_CHANGE 30
+#define SIGF_CARD_CHANGE (1 << SIGB_CARD_CHANGE)
+
+#define PATH_MAX 256
+
+// Directory records fetched with one SPI_FILE_DIR_READ.
+#define RECORDS_SIZE 2048
+
+#define VOLUME_NAME "SD"
+
+struct ExecBase *SysBase;
+struct DosLibrary *DOSBase;
+
+struct lock
+{
+    struct FileLock fl;     // First, so that the BPTR of the lock is ours
+    struct lock *next;
+    char path[PATH_MAX];
+    LONG dir;               // Firmware directory handle, or -1
+    ULONG mount;            // Mount the directory handle is from
+    LONG records_size;
+    LONG records_pos;
+    UBYTE records[RECORDS_SIZE];
+};
+
+struct file
+{
+    LONG handle;
+    ULONG mount;
+};
+
+void handler();
+
+// The handler is entered at the start of its segment, so this must stay
+// the first function of the first file on the command line.
+void start()
+{
+    handler();
+}
+
+static struct MsgPort *port;
+static struct Task *task;
+static struct DeviceList *volume;
+static struct lock *locks;
+static BOOL mounted;
+static ULONG mount_count;
+
+static UBYTE params[PATH_MAX * 2 + 2];
+static UBYTE reply[SPI_FILE_RECORD_MAX];
+
+static void change_isr()
+{
+    Signal(task, SIGF_CARD_CHANGE);
+}
+
+static LONG dos_error(int status)
+{
+    switch (status)
+    {
+    case SPI_FILE_NOT_FOUND:    return ERROR_OBJECT_NOT_FOUND;
+    case SPI_FILE_EXISTS:       return ERROR_OBJECT_EXISTS;
+    case SPI_FILE_DENIED:       return ERROR_WRITE_PROTECTED;
+    case SPI_FILE_NO_HANDLE:    return ERROR_NO_FREE_STORE;
+    case SPI_FILE_BAD_HANDLE:   return ERROR_INVALID_LOCK;
+    case SPI_FILE_FULL:         return ERROR_DISK_FULL;
+    case SPI_FILE_PROTECTED:    return ERROR_DISK_WRITE_PROTECTED;
+    case SPI_FILE_NO_FS:        return ERROR_NOT_A_DOS_DISK;
+    case SPI_FILE_BAD_NAME:     return ERROR_INVALID_COMPONENT_NAME;
+    case SPI_FILE_IN_USE:       return ERROR_OBJECT_IN_USE;
+    case SPI_FILE_BAD_SEEK:     return ERROR_SEEK_ERROR;
+    case SPI_FILE_NO_CARD:
+    case SPI_FILE_TIMEOUT:      return ERROR_NO_DISK;
+    case SPI_FILE_UNSUPPORTED:  return ERROR_ACTION_NOT_KNOWN;
+    default:                    return ERROR_SEEK_ERROR;
+    }
+}
+
+static int request(long op, long size, const UBYTE *data, long data_size, UBYTE *buf, long buf_max, long *buf_size)
+{
+    long n;
+
+    if (!buf_size)
+        buf_size = &n;
+
+    spi_obtain(TARGET);
+    int status = spi_file_request(op, params, size, data, data_size, buf, buf_max, buf_size);
+    spi_release();
+
+    return status;
+}
+
+static void mount()
+{
+    struct lock *l;
+
+    mounted = request(SPI_FILE_MOUNT, 0, NULL, 0, reply, 0, NULL) == SPI_FILE_OK;
+    mount_count++;
+
+    // The firmware has forgotten every handle.
+    for (l = locks; l; l = l->next)
+        l->dir = -1;
+}
+
+// Makes the path of name, relative to the lock, in out. As in AmigaDOS
+// everything up to a colon is the volume, and an empty name between
+// slashes or a leading slash means the parent.
+static BOOL make_path(struct lock *base, BSTR bname, char *out)
+{
+    const UBYTE *b = BADDR(bname);
+    int len = b ? b[0] : 0;
+    const char *name = b ? (const char *)&b[1] : "";
+    int i, start = 0;
+
+    out[0] = 0;
+    if (base)
+        strcpy(out, base->path);
+
+    for (i = 0; i < len; i++)
+    {
+        if (name[i] == ':')
+        {
+            out[0] = 0;
+            start = i + 1;
+        }
+    }
+
+    i = start;
+    while (i < len)
+    {
+        int end = i;
+        while (end < len && name[end] != '/')
+            end++;
+
+        if (end == i)
+        {
+            char *slash = strrchr(out, '/');
+
+            if (!out[0])
+                return FALSE;
+
+            if (slash)
+                *slash = 0;
+            else
+                out[0] = 0;
+        }
+        else
+        {
+            int n = strlen(out);
+
+            if (n + 1 + (end - i) >= PATH_MAX)
+                return FALSE;
+
+            if (n)
+                out[n++] = '/';
+
+            memcpy(&out[n], &name[i], end - i);
+            out[n + end - i] = 0;
+        }
+
+        i = end + 1;
+    }
+
+    return TRUE;
+}
+
+static long put_path(const char *path)
+{
+    long n = strlen(path);
+    memcpy(params, path, n);
+    return n;
+}
+
+static struct lock *new_lock(const char *path, LONG access)
+{
+    struct lock *l = AllocVec(sizeof(struct lock), MEMF_PUBLIC | MEMF_CLEAR);
+    if (!l)
+        return NULL;
+
+    strcpy(l->path, path);
+    l->dir = -1;
+    l->fl.fl_Access = access;
+    l->fl.fl_Task = port;
+    l->fl.fl_Volume = MKBADDR(volume);
+
+    l->next = locks;
+    locks = l;
+    return l;
+}
+
+static void close_dir(struct lock *l)
+{
+    if (l->dir >= 0 && l->mount == mount_count)
+    {
+        params[0] = l->dir;
+        request(SPI_FILE_DIR_CLOSE, 1, NULL, 0, reply, 0, NULL);
+    }
+
+    l->dir = -1;
+}
+
+static void free_lock(struct lock *l)
+{
+    struct lock **p;
+
+    if (!l)
+        return;
+
+    close_dir(l);
+
+    for (p = &locks; *p; p = &(*p)->next)
+    {
+        if (*p == l)
+        {
+            *p = l->next;
+            break;
+        }
+    }
+
+    FreeVec(l);
+}
+
+// Fetches the record of path into reply.
+static int stat_path(const char *path)
+{
+    long n;
+    return request(SPI_FILE_STAT, put_path(path), NULL, 0, reply, sizeof(reply), &n);
+}
+
+// Days since 1 January 1978 of a FAT date, which starts with 1980.
+static LONG fat_days(UWORD date)
+{
+    static const UWORD before[12] = { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+    LONG year = 1980 + (date >> 9);
+    LONG month = (date >> 5) & 15;
+    LONG day = date & 31;
+
+    if (month < 1 || month > 12 || day < 1)
+        return 0;
+
+    LONG days = (year - 1978) * 365 + (year - 1977) / 4 + before[month - 1] + day - 1;
+    if (month > 2 && (year & 3) == 0)
+        days++;
+
+    return days;
+}
+
+static void fill_fib(struct FileInfoBlock *fib, const UBYTE *rec, BOOL root)
+{
+    int len = rec[0] - SPI_FILE_RECORD_HEADER;
+    ULONG size = ((ULONG)rec[2] << 24) | ((ULONG)rec[3] << 16) | (rec[4] << 8) | rec[5];
+    UWORD date = (rec[6] << 8) | rec[7];
+    UWORD time = (rec[8] << 8) | rec[9];
+
+    if (root)
+    {
+        len = strlen(VOLUME_NAME);
+        memcpy(&fib->fib_FileName[1], VOLUME_NAME, len);
+    }
+    else
+    {
+        if (len > 106)
+            len = 106;
+        memcpy(&fib->fib_FileName[1], &rec[SPI_FILE_RECORD_HEADER], len);
+    }
+    fib->fib_FileName[0] = len;
+    fib->fib_FileName[len + 1] = 0;
+
+    if (root)
+        fib->fib_DirEntryType = ST_ROOT;
+    else if (rec[1] & SPI_FILE_ATTR_DIR)
+        fib->fib_DirEntryType = ST_USERDIR;
+    else
+        fib->fib_DirEntryType = ST_FILE;
+    fib->fib_EntryType = fib->fib_DirEntryType;
+
+    // The bits are set where the action is not allowed.
+    fib->fib_Protection = rec[1] & SPI_FILE_ATTR_READONLY ? FIBF_WRITE | FIBF_DELETE : 0;
+    if (!(rec[1] & SPI_FILE_ATTR_ARCHIVE))
+        fib->fib_Protection |= FIBF_ARCHIVE;
+
+    fib->fib_Size = size;
+    fib->fib_NumBlocks = (size + 511) >> 9;
+    fib->fib_Date.ds_Days = fat_days(date);
+    fib->fib_Date.ds_Minute = (time >> 11) * 60 + ((time >> 5) & 63);
+    fib->fib_Date.ds_Tick = (time & 31) * 2 * TICKS_PER_SECOND;
+    fib->fib_Comment[0] = 0;
+}
+
+static LONG examine_object(struct lock *l, struct FileInfoBlock *fib, LONG *err)
+{
+    const char *path = l ? l->path : "";
+
+    if (l)
+        close_dir(l);
+
+    int status = stat_path(path);
+    if (status != SPI_FILE_OK)
+    {
+        *err = dos_error(status);
+        return DOSFALSE;
+    }
+
+    fill_fib(fib, reply, !path[0]);
+    fib->fib_DiskKey = 0;
+    return DOSTRUE;
+}
+
+// Hands out the records of the directory of the lock one by one, reading
+// as many as fit in the lock at a time.
+static LONG examine_next(struct lock *l, struct FileInfoBlock *fib, LONG *err)
+{
+    int status;
+
+    if (!l)
+    {
+        *err = ERROR_INVALID_LOCK;
+        return DOSFALSE;
+    }
+
+    if (l->dir < 0 || l->mount != mount_count)
+    {
+        long n;
+
+        status = request(SPI_FILE_DIR_OPEN, put_path(l->path), NULL, 0, reply, sizeof(reply), &n);
+        if (status != SPI_FILE_OK)
+        {
+            *err = dos_error(status);
+            return DOSFALSE;
+        }
+
+        l->dir = reply[0];
+        l->mount = mount_count;
+        l->records_size = 0;
+        l->records_pos = 0;
+
+        // Skip as many entries as the caller has seen already.
+        LONG skip = fib->fib_DiskKey;
+        while (skip > 0)
+        {
+            if (l->records_pos >= l->records_size)
+            {
+                params[0] = l->dir;
+                status = request(SPI_FILE_DIR_READ, 1, NULL, 0, l->records, RECORDS_SIZE, &l->records_size);
+                l->records_pos = 0;
+                if (status != SPI_FILE_OK || !l->records_size)
+                    break;
+            }
+
+            l->records_pos += l->records[l->records_pos];
+            skip--;
+        }
+    }
+
+    if (l->records_pos >= l->records_size)
+    {
+        params[0] = l->dir;
+        status = request(SPI_FILE_DIR_READ, 1, NULL, 0, l->records, RECORDS_SIZE, &l->records_size);
+        l->records_pos = 0;
+
+        if (status != SPI_FILE_OK)
+        {
+            *err = dos_error(status);
+            return DOSFALSE;
+        }
+    }
+
+    if (!l->records_size)
+    {
+        close_dir(l);
+        *err = ERROR_NO_MORE_ENTRIES;
+        return DOSFALSE;
+    }
+
+    fill_fib(fib, &l->records[l->records_pos], FALSE);
+    l->records_pos += l->records[l->records_pos];
+    fib->fib_DiskKey++;
+    return DOSTRUE;
+}
+
+static LONG open_file(struct FileHandle *fh, struct lock *base, BSTR name, long mode, LONG *err)
+{
+    char path[PATH_MAX];
+    long n;
+
+    if (!make_path(base, name, path) || !path[0])
+    {
+        *err = ERROR_OBJECT_WRONG_TYPE;
+        return DOSFALSE;
+    }
+
+    struct file *f = AllocVec(sizeof(struct file), MEMF_PUBLIC | MEMF_CLEAR);
+    if (!f)
+    {
+        *err = ERROR_NO_FREE_STORE;
+        return DOSFALSE;
+    }
+
+    long size = put_path(path) + 1;
+    memmove(&params[1], params, size - 1);
+    params[0] = mode;
+
+    int status = request(SPI_FILE_OPEN, size, NULL, 0, reply, sizeof(reply), &n);
+
+    // MODE_OLDFILE opens a read-only file, or one another handle writes
+    // to, for reading only.
+    if ((status == SPI_FILE_DENIED || status == SPI_FILE_IN_USE) &&
+            mode == (SPI_FILE_MODE_READ | SPI_FILE_MODE_WRITE))
+    {
+        params[0] = SPI_FILE_MODE_READ;
+        status = request(SPI_FILE_OPEN, size, NULL, 0, reply, sizeof(reply), &n);
+    }
+
+    if (status != SPI_FILE_OK)
+    {
+        FreeVec(f);
+        *err = dos_error(status);
+        return DOSFALSE;
+    }
+
+    f->handle = reply[0];
+    f->mount = mount_count;
+    fh->fh_Arg1 = (LONG)f;
+    fh->fh_Port = (struct MsgPort *)DOSFALSE;
+    return DOSTRUE;
+}
+
+static BOOL file_valid(struct file *f, LONG *err)
+{
+    if (f->mount != mount_count)
+    {
+        *err = ERROR_NO_DISK;
+        return FALSE;
+    }
+
+    params[0] = f->handle;
+    return TRUE;
+}
+
+static LONG read_file(struct file *f, UBYTE *buf, LONG length, LONG *err)
+{
+    LONG done = 0;
+
+    if (!file_valid(f, err))
+        return -1;
+
+    while (done < length)
+    {
+        long want = length - done > SPI_FILE_CHUNK ? SPI_FILE_CHUNK : length - done;
+        long n;
+
+        int status = request(SPI_FILE_READ, 1, NULL, 0, buf + done, want, &n);
+        if (status != SPI_FILE_OK)
+        {
+            *err = dos_error(status);
+            return -1;
+        }
+
+        done += n;
+        if (n < want)
+            break;
+    }
+
+    return done;
+}
+
+static LONG write_file(struct file *f, const UBYTE *buf, LONG length, LONG *err)
+{
+    LONG done = 0;
+
+    if (!file_valid(f, err))
+        return -1;
+
+    while (done < length)
+    {
+        long n = length - done > SPI_FILE_CHUNK ? SPI_FILE_CHUNK : length - done;
+
+        int status = request(SPI_FILE_WRITE, 1, buf + done, n, reply, 0, NULL);
+        if (status != SPI_FILE_OK)
+        {
+            *err = dos_error(status);
+            return -1;
+        }
+
+        done += n;
+    }
+
+    return done;
+}
+
+static LONG seek_file(struct file *f, LONG offset, LONG mode, LONG *err)
+{
+    long n;
+
+    if (!file_valid(f, err))
+        return -1;
+
+    params[1] = mode - OFFSET_BEGINNING;
+    params[2] = offset >> 24;
+    params[3] = offset >> 16;
+    params[4] = offset >> 8;
+    params[5] = offset;
+
+    int status = request(SPI_FILE_SEEK, 6, NULL, 0, reply, sizeof(reply), &n);
+    if (status != SPI_FILE_OK)
+    {
+        *err = dos_error(status);
+        return -1;
+    }
+
+    return ((ULONG)reply[0] << 24) | ((ULONG)reply[1] << 16) | (reply[2] << 8) | reply[3];
+}
+
+static void close_file(struct file *f)
+{
+    LONG err;
+
+    if (file_valid(f, &err))
+        request(SPI_FILE_CLOSE, 1, NULL, 0, reply, 0, NULL);
+
+    FreeVec(f);
+}
+
+static LONG disk_info(struct InfoData *id, LONG *err)
+{
+    long n;
+
+    memset(id, 0, sizeof(*id));
+    id->id_DiskState = ID_VALIDATED;
+    id->id_BytesPerBlock = 512;
+    id->id_DiskType = mounted ? ID_DOS_DISK : ID_NO_DISK_PRESENT;
+    id->id_VolumeNode = MKBADDR(volume);
+    id->id_InUse = locks ? DOSTRUE : DOSFALSE;
+
+    if (mounted && request(SPI_FILE_INFO, 0, NULL, 0, reply, sizeof(reply), &n) == SPI_FILE_OK)
+    {
+        ULONG sectors = ((ULONG)reply[0] << 24) | ((ULONG)reply[1] << 16) | (reply[2] << 8) | reply[3];
+        ULONG free = ((ULONG)reply[4] << 24) | ((ULONG)reply[5] << 16) | (reply[6] << 8) | reply[7];
+
+        id->id_NumBlocks = sectors;
+        id->id_NumBlocksUsed = sectors - free;
+    }
+
+    return DOSTRUE;
+}
+
+static LONG path_request(long op, struct lock *base, BSTR name, LONG *err)
+{
+    char path[PATH_MAX];
+
+    if (!make_path(base, name, path) || !path[0])
+    {
+        *err = ERROR_OBJECT_WRONG_TYPE;
+        return DOSFALSE;
+    }
+
+    int status = request(op, put_path(path), NULL, 0, reply, 0, NULL);
+    if (status != SPI_FILE_OK)
+    {
+        *err = op == SPI_FILE_DELETE && status == SPI_FILE_DENIED ? ERROR_DIRECTORY_NOT_EMPTY : dos_error(status);
+        return DOSFALSE;
+    }
+
+    return DOSTRUE;
+}
+
+static LONG rename_object(struct lock *from_lock, BSTR from, struct lock *to_lock, BSTR to, LONG *err)
+{
+    char from_path[PATH_MAX];
+    char to_path[PATH_MAX];
+
+    if (!make_path(from_lock, from, from_path) || !make_path(to_lock, to, to_path) || !from_path[0] || !to_path[0])
+    {
+        *err = ERROR_OBJECT_WRONG_TYPE;
+        return DOSFALSE;
+    }
+
+    long n = strlen(from_path);
+    memcpy(params, from_path, n);
+    params[n++] = 0;
+    strcpy((char *)&params[n], to_path);
+    n += strlen(to_path);
+
+    int status = request(SPI_FILE_RENAME, n, NULL, 0, reply, 0, NULL);
+    if (status != SPI_FILE_OK)
+    {
+        *err = dos_error(status);
+        return DOSFALSE;
+    }
+
+    return DOSTRUE;
+}
+
+static BPTR lock_path(const char *path, LONG access, LONG *err)
+{
+    int status = stat_path(path);
+    if (status != SPI_FILE_OK)
+    {
+        *err = dos_error(status);
+        return 0;
+    }
+
+    struct lock *l = new_lock(path, access);
+    if (!l)
+    {
+        *err = ERROR_NO_FREE_STORE;
+        return 0;
+    }
+
+    return MKBADDR(&l->fl);
+}
+
+static struct DeviceList *add_volume()
+{
+    struct DeviceList *v = AllocVec(sizeof(struct DeviceList), MEMF_PUBLIC | MEMF_CLEAR);
+    UBYTE *name = AllocVec(sizeof(VOLUME_NAME) + 1, MEMF_PUBLIC);
+
+    if (!v || !name)
+    {
+        FreeVec(v);
+        FreeVec(name);
+        return NULL;
+    }
+
+    name[0] = strlen(VOLUME_NAME);
+    memcpy(&name[1], VOLUME_NAME, name[0] + 1);
+
+    v->dl_Type = DLT_VOLUME;
+    v->dl_Task = port;
+    v->dl_DiskType = ID_DOS_DISK;
+    v->dl_Name = MKBADDR(name);
+    DateStamp(&v->dl_VolumeDate);
+
+    LockDosList(LDF_VOLUMES | LDF_WRITE);
+    AddDosEntry((struct DosList *)v);
+    UnLockDosList(LDF_VOLUMES | LDF_WRITE);
+
+    return v;
+}
+
+static void remove_volume()
+{
+    LockDosList(LDF_VOLUMES | LDF_WRITE);
+    RemDosEntry((struct DosList *)volume);
+    UnLockDosList(LDF_VOLUMES | LDF_WRITE);
+
+    FreeVec(BADDR(volume->dl_Name));
+    FreeVec(volume);
+}
+
+void handler()
+{
+    SysBase = *(struct ExecBase **)4;
+    task = FindTask(NULL);
+    port = &((struct Process *)task)->pr_MsgPort;
+
+    WaitPort(port);
+    struct DosPacket *pkt = (struct DosPacket *)GetMsg(port)->mn_Node.ln_Name;
+    struct DeviceNode *node = BADDR(pkt->dp_Arg3);
+
+    DOSBase = (struct DosLibrary *)OpenLibrary("dos.library", 36);
+    if (!DOSBase)
+    {
+        // Nothing to reply with, as ReplyPkt() is in dos.library.
+        return;
+    }
+
+    if (spi_initialize(&change_isr) < 0)
+    {
+        ReplyPkt(pkt, DOSFALSE, ERROR_NO_DISK);
+        CloseLibrary((struct Library *)DOSBase);
+        return;
+    }
+
+    mount();
+
+    volume = add_volume();
+    if (!volume)
+    {
+        spi_shutdown();
+        ReplyPkt(pkt, DOSFALSE, ERROR_NO_FREE_STORE);
+        CloseLibrary((struct Library *)DOSBase);
+        return;
+    }
+
+    node->dn_Task = port;
+    ReplyPkt(pkt, DOSTRUE, 0);
+
+    BOOL running = TRUE;
+    while (running)
+    {
+        ULONG sigs = Wait((1 << port->mp_SigBit) | SIGF_CARD_CHANGE);
+
+        if (sigs & SIGF_CARD_CHANGE)
+            mount();
+
+        struct Message *msg;
+        while ((msg = GetMsg(port)))
+        {
+            pkt = (struct DosPacket *)msg->mn_Node.ln_Name;
+
+            LONG res1 = DOSFALSE;
+            LONG res2 = 0;
+            struct lock *l;
+            char path[PATH_MAX];
+
+            if (!mounted && pkt->dp_Type != ACTION_DIE && pkt->dp_Type != ACTION_DISK_INFO &&
+                    pkt->dp_Type != ACTION_INFO && pkt->dp_Type != ACTION_IS_FILESYSTEM &&
+                    pkt->dp_Type != ACTION_FREE_LOCK && pkt->dp_Type != ACTION_END)
+            {
+                ReplyPkt(pkt, DOSFALSE, ERROR_NO_DISK);
+                continue;
+            }
+
+            switch (pkt->dp_Type)
+            {
+            case ACTION_LOCATE_OBJECT:
+                if (make_path(BADDR(pkt->dp_Arg1), pkt->dp_Arg2, path))
+                    res1 = lock_path(path, pkt->dp_Arg3, &res2);
+                else
+                    res2 = ERROR_OBJECT_NOT_FOUND;
+                break;
+
+            case ACTION_COPY_DIR:
+                l = BADDR(pkt->dp_Arg1);
+                res1 = lock_path(l ? l->path : "", SHARED_LOCK, &res2);
+                break;
+
+            case ACTION_PARENT:
+                l = BADDR(pkt->dp_Arg1);
+                if (!l || !l->path[0])
+                    res1 = 0;
+                else
+                {
+                    char *slash;
+
+                    strcpy(path, l->path);
+                    slash = strrchr(path, '/');
+                    if (slash)
+                        *slash = 0;
+                    else
+                        path[0] = 0;
+
+                    res1 = lock_path(path, SHARED_LOCK, &res2);
+                }
+                break;
+
+            case ACTION_FREE_LOCK:
+                free_lock(BADDR(pkt->dp_Arg1));
+                res1 = DOSTRUE;
+                break;
+
+            case ACTION_SAME_LOCK:
+            {
+                struct lock *a = BADDR(pkt->dp_Arg1);
+                struct lock *b = BADDR(pkt->dp_Arg2);
+                res1 = !strcmp(a ? a->path : "", b ? b->path : "") ? DOSTRUE : DOSFALSE;
+                break;
+            }
+
+            case ACTION_EXAMINE_OBJECT:
+                res1 = examine_object(BADDR(pkt->dp_Arg1), BADDR(pkt->dp_Arg2), &res2);
+                break;
+
+            case ACTION_EXAMINE_NEXT:
+                res1 = examine_next(BADDR(pkt->dp_Arg1), BADDR(pkt->dp_Arg2), &res2);
+                break;
+
+            case ACTION_FINDINPUT:
+                res1 = open_file(BADDR(pkt->dp_Arg1), BADDR(pkt->dp_Arg2), pkt->dp_Arg3,
+                        SPI_FILE_MODE_READ | SPI_FILE_MODE_WRITE, &res2);
+                break;
+
+            case ACTION_FINDOUTPUT:
+                res1 = open_file(BADDR(pkt->dp_Arg1), BADDR(pkt->dp_Arg2), pkt->dp_Arg3,
+                        SPI_FILE_MODE_READ | SPI_FILE_MODE_WRITE | SPI_FILE_MODE_CREATE_ALWAYS, &res2);
+                break;
+
+            case ACTION_FINDUPDATE:
+                res1 = open_file(BADDR(pkt->dp_Arg1), BADDR(pkt->dp_Arg2), pkt->dp_Arg3,
+                        SPI_FILE_MODE_READ | SPI_FILE_MODE_WRITE | SPI_FILE_MODE_OPEN_ALWAYS, &res2);
+                break;
+
+            case ACTION_READ:
+                res1 = read_file((struct file *)pkt->dp_Arg1, (UBYTE *)pkt->dp_Arg2, pkt->dp_Arg3, &res2);
+                break;
+
+            case ACTION_WRITE:
+                res1 = write_file((struct file *)pkt->dp_Arg1, (const UBYTE *)pkt->dp_Arg2, pkt->dp_Arg3, &res2);
+                break;
+
+            case ACTION_SEEK:
+                res1 = seek_file((struct file *)pkt->dp_Arg1, pkt->dp_Arg2, pkt->dp_Arg3, &res2);
+                break;
+
+            case ACTION_END:
+                close_file((struct file *)pkt->dp_Arg1);
+                res1 = DOSTRUE;
+                break;
+
+            case ACTION_DELETE_OBJECT:
+                res1 = path_request(SPI_FILE_DELETE, BADDR(pkt->dp_Arg1), pkt->dp_Arg2, &res2);
+                break;
+
+            case ACTION_CREATE_DIR:
+                res1 = path_request(SPI_FILE_MKDIR, BADDR(pkt->dp_Arg1), pkt->dp_Arg2, &res2);
+                if (res1 && make_path(BADDR(pkt->dp_Arg1), pkt->dp_Arg2, path))
+                    res1 = lock_path(path, SHARED_LOCK, &res2);
+                break;
+
+            case ACTION_RENAME_OBJECT:
+                res1 = rename_object(BADDR(pkt->dp_Arg1), pkt->dp_Arg2, BADDR(pkt->dp_Arg3), pkt->dp_Arg4, &res2);
+                break;
+
+            case ACTION_DISK_INFO:
+                res1 = disk_info(BADDR(pkt->dp_Arg1), &res2);
+                break;
+
+            case ACTION_INFO:
+                res1 = disk_info(BADDR(pkt->dp_Arg2), &res2);
+                break;
+
+            case ACTION_IS_FILESYSTEM:
+                res1 = DOSTRUE;
+                break;
+
+            case ACTION_CURRENT_VOLUME:
+                res1 = MKBADDR(volume);
+                break;
+
+            case ACTION_DIE:
+                if (locks)
+                    res2 = ERROR_OBJECT_IN_USE;
+                else
+                {
+                    res1 = DOSTRUE;
+                    running = FALSE;
+                }
+                break;
+
+            default:
+                res2 = ERROR_ACTION_NOT_KNOWN;
+                break;
+            }
+
+            ReplyPkt(pkt, res1, res2);
+        }
+    }
+
+    node->dn_Task = NULL;
+    remove_volume();
+    spi_shutdown();
+    CloseLibrary((struct Library *)DOSBase);
+}
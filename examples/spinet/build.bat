@@ -0,0 +1 @@
+vc romtag.c version.c device.c ../../spi-lib/spi.c ../../spi-lib/spi_low.asm -I../../spi-lib -O2 -nostdlib -lamiga -o spinet.device
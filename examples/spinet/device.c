@@ -0,0 +1,773 @@
+/*
+ * SANA-II network driver for the WiFi of the RP2350 (Pico 2 W) adapter.
+ *
+ * The firmware, in the combined mode built with PAR_SPI_NET, forwards
+ * Ethernet frames between its WiFi and the Amiga. The task of this
+ * driver moves them in batches with spi_net_send() and spi_net_receive(),
+ * so each REQ cycle carries as many frames as are waiting. When there is
+ * nothing left to receive, the adapter pulses IRQ for the next frame and
+ * the task sleeps until then.
+ *
+ * The structure follows spisd.device: BeginIO passes the requests that
+ * need the adapter to the task, which runs them between the transfers.
+ */
+
+#include <exec/types.h>
+#include <exec/devices.h>
+#include <exec/errors.h>
+#include <exec/execbase.h>
+#include <exec/memory.h>
+#include <exec/ports.h>
+#include <exec/tasks.h>
+#include <libraries/dos.h>
+#include <devices/sana2.h>
+#include <devices/timer.h>
+#include <utility/tagitem.h>
+#include <proto/exec.h>
+#include <proto/alib.h>
+
+#include <string.h>
+
+#include "version.h"
+#include "spi.h"
+
+#define TASK_STACK_SIZE 4096
+#define TASK_PRIORITY 10
+
+// The NET command doesn't use a chip select; the target is only taken
+// for spi_obtain().
+#define NET_TARGET 0
+
+#define SIGB_OP_REQUEST 29
+#define SIGB_TIMER 28
+#define SIGB_NET_RX 27
+
+#define SIGF_OP_REQUEST (1 << SIGB_OP_REQUEST)
+#define SIGF_TIMER (1 << SIGB_TIMER)
+#define SIGF_NET_RX (1 << SIGB_NET_RX)
+
+// How long to wait before sending again when the adapter's transmit ring
+// was full.
+#define TX_RETRY_US 1000
+
+#define ETH_ADDR_SIZE 6
+#define ETH_HEADER_SIZE 14
+#define ETH_MTU 1500
+
+// Bits per second told to the stack, from the 350 kB/s limit of the
+// parallel port.
+#define LINK_BPS (350000 * 8)
+
+typedef BOOL (*copy_fn)(__reg("a0") APTR to, __reg("a1") APTR from, __reg("d0") ULONG len);
+
+struct opener
+{
+    struct MinNode node;
+    struct MinList reads;
+    struct MinList orphan_reads;
+    copy_fn copy_to_buff;
+    copy_fn copy_from_buff;
+};
+
+struct ExecBase *SysBase;
+static BPTR saved_seg_list;
+static struct timerequest tr;
+static struct Task *task;
+static struct MsgPort mp;
+static struct MsgPort timer_mp;
+
+static struct MinList openers;
+static struct MinList writes;
+
+static BOOL online;
+static BOOL configured;
+static BOOL rx_more;
+static BOOL timer_pending;
+static UBYTE mac[ETH_ADDR_SIZE];
+static struct Sana2DeviceStats stats;
+
+static UBYTE rx_batch[SPI_NET_BATCH_MAX];
+static UBYTE tx_batch[SPI_NET_BATCH_MAX];
+static struct IOSana2Req *tx_reqs[SPI_NET_BATCH_MAX / (ETH_HEADER_SIZE + 2)];
+
+static const UBYTE broadcast[ETH_ADDR_SIZE] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+static void reply_error(struct IOSana2Req *ior, BYTE error, ULONG wire_error)
+{
+    ior->ios2_Req.io_Error = error;
+    ior->ios2_WireError = wire_error;
+    ReplyMsg(&ior->ios2_Req.io_Message);
+}
+
+// Replies to every read of every opener, and every queued write.
+static void abort_all(BYTE error, ULONG wire_error)
+{
+    struct opener *o;
+    struct IOSana2Req *ior;
+
+    Forbid();
+    for (o = (struct opener *)openers.mlh_Head; o->node.mln_Succ; o = (struct opener *)o->node.mln_Succ)
+    {
+        while ((ior = (struct IOSana2Req *)RemHead((struct List *)&o->reads)))
+            reply_error(ior, error, wire_error);
+        while ((ior = (struct IOSana2Req *)RemHead((struct List *)&o->orphan_reads)))
+            reply_error(ior, error, wire_error);
+    }
+
+    while ((ior = (struct IOSana2Req *)RemHead((struct List *)&writes)))
+        reply_error(ior, error, wire_error);
+    Permit();
+}
+
+static BYTE go_online()
+{
+    if (online)
+        return 0;
+
+    spi_obtain(NET_TARGET);
+    int res = spi_net_open(mac);
+    spi_release();
+
+    if (res != SPI_NET_OK)
+        return S2ERR_OUTOFSERVICE;
+
+    online = TRUE;
+    rx_more = TRUE;
+    stats.Reconfigurations++;
+    return 0;
+}
+
+static void go_offline()
+{
+    if (!online)
+        return;
+
+    spi_obtain(NET_TARGET);
+    spi_net_close();
+    spi_release();
+
+    online = FALSE;
+    abort_all(S2ERR_OUTOFSERVICE, S2WERR_UNIT_OFFLINE);
+}
+
+static BOOL is_read(struct IOSana2Req *ior)
+{
+    return ior->ios2_Req.io_Command == CMD_READ;
+}
+
+// Hands the frame to the first read of each opener that asks for its
+// type, or else to an orphan read. Returns TRUE if some read took it.
+static BOOL deliver(const UBYTE *frame, ULONG len)
+{
+    ULONG type = (frame[12] << 8) | frame[13];
+    BOOL taken = FALSE;
+    struct opener *o;
+
+    Forbid();
+    for (int orphan = 0; orphan < 2 && !taken; orphan++)
+    {
+        for (o = (struct opener *)openers.mlh_Head; o->node.mln_Succ; o = (struct opener *)o->node.mln_Succ)
+        {
+            struct MinList *list = orphan ? &o->orphan_reads : &o->reads;
+            struct IOSana2Req *ior;
+
+            for (ior = (struct IOSana2Req *)list->mlh_Head; ior->ios2_Req.io_Message.mn_Node.ln_Succ;
+                    ior = (struct IOSana2Req *)ior->ios2_Req.io_Message.mn_Node.ln_Succ)
+            {
+                if (orphan || ior->ios2_PacketType == type)
+                    break;
+            }
+
+            if (!ior->ios2_Req.io_Message.mn_Node.ln_Succ)
+                continue;
+
+            Remove((struct Node *)ior);
+
+            BOOL raw = (ior->ios2_Req.io_Flags & SANA2IOF_RAW) != 0;
+            const UBYTE *data = raw ? frame : frame + ETH_HEADER_SIZE;
+            ULONG size = raw ? len : len - ETH_HEADER_SIZE;
+
+            memcpy(ior->ios2_SrcAddr, frame + ETH_ADDR_SIZE, ETH_ADDR_SIZE);
+            memcpy(ior->ios2_DstAddr, frame, ETH_ADDR_SIZE);
+            ior->ios2_PacketType = type;
+            ior->ios2_DataLength = size;
+
+            ior->ios2_Req.io_Flags &= ~(SANA2IOF_BCAST | SANA2IOF_MCAST);
+            if (!memcmp(frame, broadcast, ETH_ADDR_SIZE))
+                ior->ios2_Req.io_Flags |= SANA2IOF_BCAST;
+            else if (frame[0] & 1)
+                ior->ios2_Req.io_Flags |= SANA2IOF_MCAST;
+
+            if (o->copy_to_buff(ior->ios2_Data, (APTR)data, size))
+                reply_error(ior, 0, 0);
+            else
+                reply_error(ior, S2ERR_NO_RESOURCES, S2WERR_BUFF_ERROR);
+
+            taken = TRUE;
+        }
+    }
+    Permit();
+
+    return taken;
+}
+
+// Fetches batches of frames until the adapter has none left. It then
+// pulses IRQ for the next one, which signals SIGF_NET_RX.
+static void receive()
+{
+    long size;
+
+    while (rx_more && online)
+    {
+        spi_obtain(NET_TARGET);
+        int res = spi_net_receive(rx_batch, sizeof(rx_batch), &size, SIGF_NET_RX);
+        spi_release();
+
+        if (res != SPI_NET_OK || size < 1)
+        {
+            rx_more = FALSE;
+            break;
+        }
+
+        rx_more = (rx_batch[0] & SPI_NET_MORE) != 0;
+
+        long pos = 1;
+        while (pos + 2 <= size)
+        {
+            ULONG len = (rx_batch[pos] << 8) | rx_batch[pos + 1];
+            pos += 2;
+
+            if (pos + len > size)
+                break;
+
+            if (len < ETH_HEADER_SIZE)
+                stats.BadData++;
+            else
+            {
+                stats.PacketsReceived++;
+                if (!deliver(&rx_batch[pos], len))
+                    stats.UnknownTypesReceived++;
+            }
+
+            pos += len;
+        }
+    }
+}
+
+// Builds the frame of a write at p, returning its size or 0 on an error,
+// which has then been replied.
+static ULONG build_frame(struct IOSana2Req *ior, UBYTE *p)
+{
+    struct opener *o = ior->ios2_BufferManagement;
+    ULONG len;
+
+    if (ior->ios2_Req.io_Flags & SANA2IOF_RAW)
+    {
+        len = ior->ios2_DataLength;
+        if (len < ETH_HEADER_SIZE || len > ETH_HEADER_SIZE + ETH_MTU)
+        {
+            reply_error(ior, S2ERR_MTU_EXCEEDED, 0);
+            return 0;
+        }
+
+        if (!o->copy_from_buff(p, ior->ios2_Data, len))
+        {
+            reply_error(ior, S2ERR_NO_RESOURCES, S2WERR_BUFF_ERROR);
+            return 0;
+        }
+
+        // A WiFi station may only send from its own address.
+        memcpy(p + ETH_ADDR_SIZE, mac, ETH_ADDR_SIZE);
+        return len;
+    }
+
+    if (ior->ios2_DataLength > ETH_MTU)
+    {
+        reply_error(ior, S2ERR_MTU_EXCEEDED, 0);
+        return 0;
+    }
+
+    if (ior->ios2_Req.io_Command == S2_BROADCAST)
+        memcpy(p, broadcast, ETH_ADDR_SIZE);
+    else
+        memcpy(p, ior->ios2_DstAddr, ETH_ADDR_SIZE);
+
+    memcpy(p + ETH_ADDR_SIZE, mac, ETH_ADDR_SIZE);
+    p[12] = ior->ios2_PacketType >> 8;
+    p[13] = ior->ios2_PacketType;
+
+    if (!o->copy_from_buff(p + ETH_HEADER_SIZE, ior->ios2_Data, ior->ios2_DataLength))
+    {
+        reply_error(ior, S2ERR_NO_RESOURCES, S2WERR_BUFF_ERROR);
+        return 0;
+    }
+
+    return ETH_HEADER_SIZE + ior->ios2_DataLength;
+}
+
+// Sends the queued writes, as many per batch as fit. Those the adapter
+// had no room for are tried again after TX_RETRY_US.
+static void send()
+{
+    while (online)
+    {
+        long count = 0;
+        long size = 0;
+        struct IOSana2Req *ior;
+
+        Forbid();
+        while ((ior = (struct IOSana2Req *)writes.mlh_Head)->ios2_Req.io_Message.mn_Node.ln_Succ)
+        {
+            if (size + 2 + ETH_HEADER_SIZE + ETH_MTU > sizeof(tx_batch))
+                break;
+
+            Remove((struct Node *)ior);
+
+            ULONG len = build_frame(ior, &tx_batch[size + 2]);
+            if (!len)
+                continue;
+
+            tx_batch[size] = len >> 8;
+            tx_batch[size + 1] = len;
+            size += 2 + len;
+            tx_reqs[count++] = ior;
+        }
+        Permit();
+
+        if (!count)
+            return;
+
+        long accepted;
+
+        spi_obtain(NET_TARGET);
+        int res = spi_net_send(tx_batch, size, &accepted);
+        spi_release();
+
+        if (res != SPI_NET_OK)
+            accepted = 0;
+
+        for (long i = 0; i < accepted; i++)
+        {
+            stats.PacketsSent++;
+            reply_error(tx_reqs[i], 0, 0);
+        }
+
+        if (accepted == count)
+            continue;
+
+        // Back to the front of the queue, in order.
+        Forbid();
+        for (long i = count - 1; i >= accepted; i--)
+            AddHead((struct List *)&writes, (struct Node *)tx_reqs[i]);
+        Permit();
+
+        if (res != SPI_NET_OK)
+        {
+            abort_all(S2ERR_TX_FAILURE, S2WERR_GENERIC_ERROR);
+            return;
+        }
+
+        if (!timer_pending)
+        {
+            tr.tr_node.io_Command = TR_ADDREQUEST;
+            tr.tr_time.tv_secs = 0;
+            tr.tr_time.tv_micro = TX_RETRY_US;
+            SendIO((struct IORequest *)&tr);
+            timer_pending = TRUE;
+        }
+        return;
+    }
+}
+
+static void process_request(struct IOSana2Req *ior)
+{
+    struct opener *o = ior->ios2_BufferManagement;
+    BYTE error = 0;
+    ULONG wire_error = 0;
+
+    switch (ior->ios2_Req.io_Command)
+    {
+    case CMD_READ:
+    case S2_READORPHAN:
+        if (!online)
+        {
+            error = S2ERR_OUTOFSERVICE;
+            wire_error = S2WERR_UNIT_OFFLINE;
+            break;
+        }
+
+        Forbid();
+        AddTail((struct List *)(is_read(ior) ? &o->reads : &o->orphan_reads), (struct Node *)ior);
+        Permit();
+        return;
+
+    case CMD_WRITE:
+    case S2_BROADCAST:
+    case S2_MULTICAST:
+        if (!online)
+        {
+            error = S2ERR_OUTOFSERVICE;
+            wire_error = S2WERR_UNIT_OFFLINE;
+            break;
+        }
+
+        Forbid();
+        AddTail((struct List *)&writes, (struct Node *)ior);
+        Permit();
+        return;
+
+    case S2_CONFIGINTERFACE:
+        if (configured)
+        {
+            error = S2ERR_BAD_STATE;
+            wire_error = S2WERR_IS_CONFIGURED;
+            break;
+        }
+
+        error = go_online();
+        if (!error)
+        {
+            configured = TRUE;
+            memcpy(ior->ios2_SrcAddr, mac, ETH_ADDR_SIZE);
+        }
+        break;
+
+    case S2_GETSTATIONADDRESS:
+        // The address is the adapter's, which it tells when going online.
+        error = go_online();
+        if (!error)
+        {
+            memcpy(ior->ios2_SrcAddr, mac, ETH_ADDR_SIZE);
+            memcpy(ior->ios2_DstAddr, mac, ETH_ADDR_SIZE);
+        }
+        break;
+
+    case S2_ONLINE:
+        error = go_online();
+        break;
+
+    case S2_OFFLINE:
+        go_offline();
+        break;
+    }
+
+    reply_error(ior, error, wire_error);
+}
+
+static void task_run()
+{
+    while (1)
+    {
+        ULONG sigs = Wait(SIGF_OP_REQUEST | SIGF_NET_RX | SIGF_TIMER);
+
+        if (sigs & SIGF_TIMER)
+        {
+            if (GetMsg(&timer_mp))
+                timer_pending = FALSE;
+        }
+
+        struct IOSana2Req *ior;
+        while ((ior = (struct IOSana2Req *)GetMsg(&mp)))
+            process_request(ior);
+
+        if (sigs & SIGF_NET_RX)
+            rx_more = TRUE;
+
+        receive();
+
+        if (!timer_pending)
+            send();
+    }
+}
+
+static void begin_io(__reg("a6") struct Library *dev, __reg("a1") struct IOSana2Req *ior)
+{
+    if (!ior)
+        return;
+
+    ior->ios2_Req.io_Error = 0;
+    ior->ios2_WireError = 0;
+
+    switch (ior->ios2_Req.io_Command)
+    {
+    case CMD_READ:
+    case CMD_WRITE:
+    case S2_BROADCAST:
+    case S2_MULTICAST:
+    case S2_READORPHAN:
+    case S2_CONFIGINTERFACE:
+    case S2_GETSTATIONADDRESS:
+    case S2_ONLINE:
+    case S2_OFFLINE:
+        PutMsg(&mp, (struct Message *)&ior->ios2_Req.io_Message);
+        ior->ios2_Req.io_Flags &= ~IOF_QUICK;
+        ior = NULL;
+        break;
+
+    case S2_DEVICEQUERY:
+    {
+        struct Sana2DeviceQuery *q = ior->ios2_StatData;
+
+        if (!q)
+        {
+            ior->ios2_Req.io_Error = S2ERR_BAD_ARGUMENT;
+            ior->ios2_WireError = S2WERR_NULL_POINTER;
+            break;
+        }
+
+        q->SizeSupplied = sizeof(*q) < q->SizeAvailable ? sizeof(*q) : q->SizeAvailable;
+        q->DevQueryFormat = 0;
+        q->DeviceLevel = 0;
+        q->AddrFieldSize = ETH_ADDR_SIZE * 8;
+        q->MTU = ETH_MTU;
+        q->BPS = LINK_BPS;
+        q->HardwareType = S2WireType_Ethernet;
+        break;
+    }
+
+    case S2_GETGLOBALSTATS:
+        if (ior->ios2_StatData)
+            CopyMem(&stats, ior->ios2_StatData, sizeof(stats));
+        else
+        {
+            ior->ios2_Req.io_Error = S2ERR_BAD_ARGUMENT;
+            ior->ios2_WireError = S2WERR_NULL_POINTER;
+        }
+        break;
+
+    case CMD_FLUSH:
+        abort_all(IOERR_ABORTED, 0);
+        break;
+
+    // Every frame the adapter sees is passed on, so there is nothing to
+    // set up for these.
+    case S2_ADDMULTICASTADDRESS:
+    case S2_DELMULTICASTADDRESS:
+    case S2_TRACKTYPE:
+    case S2_UNTRACKTYPE:
+        break;
+
+    default:
+        ior->ios2_Req.io_Error = S2ERR_NOT_SUPPORTED;
+        ior->ios2_WireError = S2WERR_GENERIC_ERROR;
+        break;
+    }
+
+    if (ior && !(ior->ios2_Req.io_Flags & IOF_QUICK))
+        ReplyMsg(&ior->ios2_Req.io_Message);
+}
+
+static ULONG abort_io(__reg("a6") struct Library *dev, __reg("a1") struct IOSana2Req *ior)
+{
+    struct opener *o;
+    struct IOSana2Req *r;
+    struct MinList *lists[3];
+    int found = 0;
+
+    Forbid();
+    for (o = (struct opener *)openers.mlh_Head; o->node.mln_Succ && !found; o = (struct opener *)o->node.mln_Succ)
+    {
+        lists[0] = &o->reads;
+        lists[1] = &o->orphan_reads;
+        lists[2] = &writes;
+
+        for (int i = 0; i < 3 && !found; i++)
+        {
+            for (r = (struct IOSana2Req *)lists[i]->mlh_Head; r->ios2_Req.io_Message.mn_Node.ln_Succ;
+                    r = (struct IOSana2Req *)r->ios2_Req.io_Message.mn_Node.ln_Succ)
+            {
+                if (r == ior)
+                {
+                    Remove((struct Node *)ior);
+                    reply_error(ior, IOERR_ABORTED, 0);
+                    found = 1;
+                    break;
+                }
+            }
+        }
+    }
+    Permit();
+
+    return found ? 0 : IOERR_NOCMD;
+}
+
+static struct Library *init_device(__reg("a6") struct ExecBase *sys_base, __reg("a0") BPTR seg_list, __reg("d0") struct Library *dev)
+{
+    SysBase = *(struct ExecBase **)4;
+    saved_seg_list = seg_list;
+
+    dev->lib_Node.ln_Type = NT_DEVICE;
+    dev->lib_Node.ln_Name = device_name;
+    dev->lib_Flags = LIBF_SUMUSED | LIBF_CHANGED;
+    dev->lib_Version = VERSION;
+    dev->lib_Revision = REVISION;
+    dev->lib_IdString = (APTR)id_string;
+
+    NewList((struct List *)&openers);
+    NewList((struct List *)&writes);
+
+    Forbid();
+
+    tr.tr_node.io_Message.mn_Node.ln_Type = NT_REPLYMSG;
+    tr.tr_node.io_Message.mn_ReplyPort = &timer_mp;
+    tr.tr_node.io_Message.mn_Length = sizeof(tr);
+
+    if (OpenDevice(TIMERNAME, UNIT_MICROHZ, (struct IORequest *)&tr, 0))
+        goto fail1;
+
+    task = CreateTask(device_name, TASK_PRIORITY, (char *)&task_run, TASK_STACK_SIZE);
+    if (!task)
+        goto fail2;
+
+    // Card changes are for the SD card drivers; an IRQ pulse only wakes
+    // this driver while it waits for a frame.
+    if (spi_initialize(NULL) < 0)
+        goto fail3;
+
+    mp.mp_Node.ln_Type = NT_MSGPORT;
+    mp.mp_Flags = PA_SIGNAL;
+    mp.mp_SigBit = SIGB_OP_REQUEST;
+    mp.mp_SigTask = task;
+    NewList(&mp.mp_MsgList);
+
+    timer_mp.mp_Node.ln_Type = NT_MSGPORT;
+    timer_mp.mp_Flags = PA_SIGNAL;
+    timer_mp.mp_SigBit = SIGB_TIMER;
+    timer_mp.mp_SigTask = task;
+    NewList(&timer_mp.mp_MsgList);
+
+    Permit();
+    return dev;
+
+fail3:
+    DeleteTask(task);
+
+fail2:
+    CloseDevice((struct IORequest *)&tr);
+
+fail1:
+    Permit();
+    FreeMem((char *)dev - dev->lib_NegSize, dev->lib_NegSize + dev->lib_PosSize);
+    return NULL;
+}
+
+static BPTR expunge(__reg("a6") struct Library *dev)
+{
+    if (dev->lib_OpenCnt != 0)
+    {
+        dev->lib_Flags |= LIBF_DELEXP;
+        return 0;
+    }
+
+    spi_shutdown();
+
+    DeleteTask(task);
+
+    if (timer_pending)
+    {
+        AbortIO((struct IORequest *)&tr);
+        WaitIO((struct IORequest *)&tr);
+    }
+    CloseDevice((struct IORequest *)&tr);
+
+    BPTR seg_list = saved_seg_list;
+    Remove(&dev->lib_Node);
+    FreeMem((char *)dev - dev->lib_NegSize, dev->lib_NegSize + dev->lib_PosSize);
+    return seg_list;
+}
+
+// Takes the buffer management functions from the tags the opener passes
+// in ios2_BufferManagement, which then points at the opener instead.
+static void open(__reg("a6") struct Library *dev, __reg("a1") struct IOSana2Req *ior, __reg("d0") ULONG unitnum, __reg("d1") ULONG flags)
+{
+    struct TagItem *tag = ior->ios2_BufferManagement;
+    struct opener *o;
+
+    ior->ios2_Req.io_Error = IOERR_OPENFAIL;
+    ior->ios2_Req.io_Message.mn_Node.ln_Type = NT_REPLYMSG;
+
+    if (unitnum != 0 || ior->ios2_Req.io_Message.mn_Length < sizeof(struct IOSana2Req))
+        return;
+
+    o = AllocMem(sizeof(struct opener), MEMF_PUBLIC | MEMF_CLEAR);
+    if (!o)
+        return;
+
+    while (tag && tag->ti_Tag != TAG_DONE)
+    {
+        switch (tag->ti_Tag)
+        {
+        case TAG_MORE:
+            tag = (struct TagItem *)tag->ti_Data;
+            continue;
+        case TAG_SKIP:
+            tag += tag->ti_Data + 1;
+            continue;
+        case S2_CopyToBuff:
+            o->copy_to_buff = (copy_fn)tag->ti_Data;
+            break;
+        case S2_CopyFromBuff:
+            o->copy_from_buff = (copy_fn)tag->ti_Data;
+            break;
+        }
+        tag++;
+    }
+
+    if (!o->copy_to_buff || !o->copy_from_buff)
+    {
+        FreeMem(o, sizeof(struct opener));
+        return;
+    }
+
+    NewList((struct List *)&o->reads);
+    NewList((struct List *)&o->orphan_reads);
+
+    Forbid();
+    AddTail((struct List *)&openers, (struct Node *)o);
+    Permit();
+
+    ior->ios2_BufferManagement = o;
+    ior->ios2_Req.io_Unit = (struct Unit *)o;
+
+    dev->lib_OpenCnt++;
+    ior->ios2_Req.io_Error = 0;
+}
+
+static BPTR close(__reg("a6") struct Library *dev, __reg("a1") struct IOSana2Req *ior)
+{
+    struct opener *o = ior->ios2_BufferManagement;
+
+    Forbid();
+    Remove((struct Node *)o);
+    Permit();
+    FreeMem(o, sizeof(struct opener));
+
+    ior->ios2_Req.io_Device = NULL;
+    ior->ios2_Req.io_Unit = NULL;
+
+    dev->lib_OpenCnt--;
+
+    if (dev->lib_OpenCnt == 0 && (dev->lib_Flags & LIBF_DELEXP))
+        return expunge(dev);
+
+    return 0;
+}
+
+static ULONG device_vectors[] =
+{
+    (ULONG)open,
+    (ULONG)close,
+    (ULONG)expunge,
+    0,
+    (ULONG)begin_io,
+    (ULONG)abort_io,
+    -1,
+};
+
+ULONG auto_init_tables[] =
+{
+    sizeof(struct Library),
+    (ULONG)device_vectors,
+    0,
+    (ULONG)init_device,
+};
@@ -0,0 +1,12 @@
+#ifndef VERSION_H_
+#define VERSION_H_
+
+#define NAME "spinet"
+#define VERSION 1
+#define REVISION 0
+#define DATE "16.10.2026"
+
+extern char device_name[];
+extern char id_string[];
+
+#endif
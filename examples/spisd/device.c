@@ -30,13 +30,19 @@
 
 #define DEBOUNCE_TIMEOUT_US 100000
 
+// Chip select the SD card is on. spi_obtain() keeps other drivers that share
+// the adapter off it for the duration of each request.
+#define SD_TARGET 0
+
 #define SIGB_CARD_CHANGE 30
 #define SIGB_OP_REQUEST 29
 #define SIGB_TIMER 28
+#define SIGB_CARD_READY 27
 
 #define SIGF_CARD_CHANGE (1 << SIGB_CARD_CHANGE)
 #define SIGF_OP_REQUEST (1 << SIGB_OP_REQUEST)
 #define SIGF_OP_TIMER (1 << SIGB_TIMER)
+#define SIGF_CARD_READY (1 << SIGB_CARD_READY)
 
 // How much of struct NSDeviceQueryResult we use/need. It could be extended
 // and we don't want that to change the behaviour of the code.
@@ -83,6 +89,8 @@ static void handle_changed()
     tr.tr_time.tv_micro = DEBOUNCE_TIMEOUT_US;
     DoIO((struct IORequest *)&tr);
 
+    spi_obtain(SD_TARGET);
+
     int res = spi_get_card_present();
 
     if (res == 1 && sd_open() == 0)
@@ -90,6 +98,8 @@ static void handle_changed()
     else
         card_opened = FALSE;
 
+    spi_release();
+
     Forbid();
     card_present = res == 1;
     card_change_num++;
@@ -115,6 +125,8 @@ static void process_request(struct IOStdReq *ior)
         ior->io_Error = TDERR_NotSpecified;
     else
     {
+        spi_obtain(SD_TARGET);
+
         switch (ior->io_Command)
         {
         case TD_GETGEOMETRY:
@@ -143,7 +155,15 @@ static void process_request(struct IOStdReq *ior)
             else
                 ior->io_Error = TDERR_NotSpecified;
             break;
+
+        case CMD_UPDATE:
+            // The adapter may still hold written sectors.
+            if (sd_flush() != 0)
+                ior->io_Error = TDERR_NotSpecified;
+            break;
         }
+
+        spi_release();
     }
 
     ReplyMsg(&ior->io_Message);
@@ -151,8 +171,13 @@ static void process_request(struct IOStdReq *ior)
 
 static void task_run()
 {
+    // Sleep through SD busy time instead of polling the card.
+    sd_set_ready_signals(SIGF_CARD_READY);
+
+    spi_obtain(SD_TARGET);
     if (card_present && sd_open() == 0)
         card_opened = TRUE;
+    spi_release();
 
     while (1)
     {
@@ -221,7 +246,6 @@ static void begin_io(__reg("a6") struct Library *dev, __reg("a1") struct IOStdRe
     {
     case CMD_RESET:
     case CMD_CLEAR:
-    case CMD_UPDATE:
     case TD_MOTOR:
     case TD_PROTSTATUS:
         ior->io_Actual = 0;
@@ -279,6 +303,7 @@ static void begin_io(__reg("a6") struct Library *dev, __reg("a1") struct IOStdRe
     case TD_FORMAT:
     case CMD_WRITE:
     case CMD_READ:
+    case CMD_UPDATE:
     case TD_READ64:
     case TD_WRITE64:
     case NSCMD_TD_READ64:
@@ -34,8 +34,10 @@
 #define FAST_CLOCK			3000000
 
 #define READY_TIMEOUT_MS	500
+#define READY_POLL_BYTES	64
 #define INIT_TIMEOUT_MS		1000
 #define MAX_RESPONSE_POLLS	10
+#define CALIBRATE_PASSES	2
 
 /* MMC/SD command */
 #define CMD0	(0)			/* GO_IDLE_STATE */
@@ -61,6 +63,24 @@
 
 static sd_card_info_t sd_card_info;
 
+/*! Set while calibrating the SPI clock to check the CRC of data blocks */
+static int sd_check_crc;
+static uint8_t sd_calibrate_buf[SD_SECTOR_SIZE];
+
+/*! Signals the caller's task sleeps on while the card is busy */
+static uint32_t sd_ready_signals;
+
+#ifdef SD_LBA
+/* Largest sector count of a single LBA command */
+#define LBA_MAX_COUNT		0x8000
+
+/*! Set when the adapter firmware runs the SD protocol */
+static int sd_lba;
+
+/*! Set when the adapter firmware can fill sectors with a single value */
+static int sd_lba_fill;
+#endif
+
 /*! Utility function for parsing CSD fields */
 static int sd_parse_csd(sd_card_info_t *ci, const uint32_t *bits)
 {
@@ -175,46 +195,54 @@ static int sd_parse_cid(sd_card_info_t *ci, const uint32_t *bits)
 }
 
 
+/*! CRC16 of SD data blocks (CCITT polynomial, zero initial value) */
+static uint16_t sd_crc16(const uint8_t *buf, unsigned int size)
+{
+	uint16_t crc = 0;
+	int i;
+
+	while (size--) {
+		crc ^= (uint16_t)*buf++ << 8;
+		for (i = 0; i < 8; i++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+
+	return crc;
+}
+
 static int sd_wait_ready(void)
 {
-	uint32_t timeout;
 	uint8_t in;
 
-	timeout = timer_get_tick_count() + TIMER_MILLIS(READY_TIMEOUT_MS);
-	do {
-		spi_read(&in, 1);
-	} while (in != 0xff && (int32_t)(timer_get_tick_count() - timeout) < 0);
+	/* Short waits are cheaper to poll than to sleep through */
+	if (spi_poll(0xff, 0xff, SPI_POLL_MATCH | SPI_POLL_BYTES, READY_POLL_BYTES, &in) == 0) {
+		return 0;
+	}
+
+	if (spi_wait_ready(sd_ready_signals, READY_TIMEOUT_MS) < 0) {
+		return sdError_Timeout;
+	}
 
-	return (in == 0xff) ? 0 : sdError_Timeout;
+	return 0;
 }
 
-static void sd_deselect(void)
+void sd_set_ready_signals(uint32_t signals)
 {
-	spi_deselect();
+	sd_ready_signals = signals;
 }
 
-static int sd_select(void)
+static void sd_deselect(void)
 {
-	spi_select();
-	if (sd_wait_ready() == 0) {
-		return 0;
-	}
 	spi_deselect();
-
-	ERROR("Timeout waiting for card ready\n");
-	return sdError_Timeout;
 }
 
 static int sd_read_block(uint8_t *buf, unsigned int size)
 {
-	uint32_t timeout;
 	uint8_t token, crc[2];
 
 	/* Wait for data start token */
-	timeout = timer_get_tick_count() + TIMER_MILLIS(READY_TIMEOUT_MS);
-	do {
-		spi_read(&token, 1);
-	} while (token == 0xff && (int32_t)(timer_get_tick_count() - timeout) < 0);
+	spi_poll(0xff, 0xff, SPI_POLL_MISMATCH | SPI_POLL_MS, READY_TIMEOUT_MS, &token);
 	if (token != 0xfe) {
 		ERROR("No data token received\n");
 		return sdError_Timeout;
@@ -224,6 +252,11 @@ static int sd_read_block(uint8_t *buf, unsigned int size)
 	spi_read(buf, size);
 	spi_read(crc, 2);
 
+	if (sd_check_crc && sd_crc16(buf, size) != (((uint16_t)crc[0] << 8) | crc[1])) {
+		ERROR("Bad data CRC\n");
+		return sdError_BadResponse;
+	}
+
 	return 0;
 }
 
@@ -266,8 +299,12 @@ static int sd_write_block(const uint8_t *buf, uint8_t token)
 static uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg)
 {
 	uint8_t res;
+	uint8_t ready;
+	uint8_t skip;
 	uint8_t buf[6];
-	int n;
+	struct spi_segment segs[6];
+	long done;
+	int n = 0;
 
 	if (cmd & 0x80) {
 		/* Send CMD55 prior to ACMD */
@@ -280,10 +317,17 @@ static uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg)
 
 	/* Select the card and wait for ready except for abort */
 	if (cmd != CMD12) {
-		sd_deselect();
-		if (sd_select() < 0) {
-			return 0xff;
-		}
+		segs[n].type = SPI_SEG_DESELECT;
+		n++;
+		segs[n].type = SPI_SEG_SELECT;
+		n++;
+		segs[n].type = SPI_SEG_POLL;
+		segs[n].flags = SPI_POLL_MATCH | SPI_POLL_MS;
+		segs[n].mask = 0xff;
+		segs[n].value = 0xff;
+		segs[n].size = READY_TIMEOUT_MS;
+		segs[n].buf = &ready;
+		n++;
 	}
 
 	/* Build command */
@@ -299,19 +343,35 @@ static uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg)
 	} else {
 		buf[5] = 0x01; /* Dummy CRC and stop */
 	}
-	spi_write(buf, sizeof(buf));
+	segs[n].type = SPI_SEG_WRITE;
+	segs[n].size = sizeof(buf);
+	segs[n].buf = buf;
+	n++;
 
 	/* Receive command response */
 	if (cmd == CMD12) {
 		/* Skip first byte */
-		spi_read(&res, 1);
+		segs[n].type = SPI_SEG_READ;
+		segs[n].size = 1;
+		segs[n].buf = &skip;
+		n++;
 	}
 
-	for (n = 0; n < MAX_RESPONSE_POLLS; n++) {
-		spi_read(&res, 1);
-		if (!(res & 0x80)) {
-			break;
-		}
+	segs[n].type = SPI_SEG_POLL;
+	segs[n].flags = SPI_POLL_MATCH | SPI_POLL_BYTES;
+	segs[n].mask = 0x80;
+	segs[n].value = 0x00;
+	segs[n].size = MAX_RESPONSE_POLLS;
+	segs[n].buf = &res;
+	n++;
+
+	/* The whole command runs as one batch. If the card never became
+	 * ready the batch stops at the first poll. */
+	done = spi_transfer_batch(segs, n, 0);
+	if (cmd != CMD12 && done < 3) {
+		spi_deselect();
+		ERROR("Timeout waiting for card ready\n");
+		return 0xff;
 	}
 
 	return res;
@@ -325,12 +385,156 @@ static uint32_t sd_get_r7_resp(void)
 	return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | ((uint32_t)buf[3] << 0);
 }
 
+#ifdef SD_LBA
+/*! Maps spi_lba_*() return values to sd_error_t */
+static int sd_lba_error(int status)
+{
+	switch (status) {
+	case SPI_LBA_OK:
+		return 0;
+	case SPI_LBA_TIMEOUT:
+		return sdError_Timeout;
+	case SPI_LBA_NO_CARD:
+		return sdError_NoCard;
+	default:
+		return sdError_BadResponse;
+	}
+}
+
+/*! Lets the adapter firmware initialize the card.
+ * Returns 1 if the firmware doesn't support LBA mode. */
+static int sd_open_lba(void)
+{
+	sd_card_info_t *ci = &sd_card_info;
+	struct spi_caps caps;
+	uint8_t info[SPI_LBA_INFO_SIZE];
+	uint32_t bits[4];
+	int err;
+
+	err = spi_lba_open(info);
+	if (err == SPI_LBA_UNSUPPORTED) {
+		return 1;
+	}
+	if (err != SPI_LBA_OK) {
+		return sd_lba_error(err);
+	}
+
+	ci->type = info[0];
+	memcpy(bits, &info[1], sizeof(bits));
+	err = sd_parse_cid(ci, bits);
+	if (err == 0) {
+		memcpy(bits, &info[17], sizeof(bits));
+		err = sd_parse_csd(ci, bits);
+	}
+	if (err < 0) {
+		ci->type = sdCardType_None;
+		return err;
+	}
+
+	/* The firmware has already switched to fast clock */
+	spi_set_speed(SPI_SPEED_FAST);
+	sd_lba = 1;
+	sd_lba_fill = spi_get_caps(&caps) == 0 && (caps.commands & SPI_CAP_LBA_UNIFORM);
+
+	return 0;
+}
+
+/*! Returns the number of sectors, up to max, at the start of buf that have
+ * every byte equal to buf[0] */
+static uint32_t sd_uniform_sectors(const uint8_t *buf, uint32_t max)
+{
+	uint32_t n;
+	unsigned int i;
+
+	for (n = 0; n < max; n++) {
+		const uint8_t *p = buf + (n << SD_SECTOR_SHIFT);
+		for (i = 0; i < SD_SECTOR_SIZE; i++) {
+			if (p[i] != buf[0]) {
+				return n;
+			}
+		}
+	}
+
+	return n;
+}
+#endif
+
+/*! Reads CID, CSD and sector 0 and checks them against the CID and CSD
+ * read at the slow clock and the CRC of each block */
+static int sd_verify(const uint32_t *cid, const uint32_t *csd)
+{
+	uint32_t resp[4];
+
+	if (sd_send_cmd(CMD10, 0) != 0 || sd_read_block((uint8_t*)resp, sizeof(resp)) < 0 ||
+			memcmp(resp, cid, sizeof(resp)) != 0) {
+		return sdError_BadResponse;
+	}
+	if (sd_send_cmd(CMD9, 0) != 0 || sd_read_block((uint8_t*)resp, sizeof(resp)) < 0 ||
+			memcmp(resp, csd, sizeof(resp)) != 0) {
+		return sdError_BadResponse;
+	}
+	if (sd_send_cmd(CMD17, 0) != 0 || sd_read_block(sd_calibrate_buf, SD_SECTOR_SIZE) < 0) {
+		return sdError_BadResponse;
+	}
+
+	return 0;
+}
+
+/*! Steps the SPI clock up through the tiers offered by the adapter and
+ * keeps the fastest one at which the card reads back consistently.
+ * Adapters that don't report any tiers get the fixed fast clock. */
+static void sd_calibrate(const uint32_t *cid, const uint32_t *csd)
+{
+	struct spi_caps caps;
+	long best = -1;
+	long tier;
+	int pass;
+
+	if (spi_get_caps(&caps) < 0 || !(caps.commands & SPI_CAP_TIER) || caps.tier_count == 0) {
+		spi_set_speed(SPI_SPEED_FAST);
+		return;
+	}
+
+	sd_check_crc = 1;
+	for (tier = 0; tier < caps.tier_count; tier++) {
+		if (spi_set_tier(tier) < 0) {
+			break;
+		}
+		for (pass = 0; pass < CALIBRATE_PASSES; pass++) {
+			if (sd_verify(cid, csd) < 0) {
+				break;
+			}
+		}
+		if (pass < CALIBRATE_PASSES) {
+			break;
+		}
+		best = tier;
+	}
+	sd_check_crc = 0;
+
+	if (tier < caps.tier_count) {
+		/* A failed read may have left the card sending data. Clock it
+		 * out with CS high at the slow clock. */
+		spi_set_speed(SPI_SPEED_SLOW);
+		sd_deselect();
+		sd_get_r7_resp();
+		sd_get_r7_resp();
+		sd_get_r7_resp();
+	}
+
+	if (best < 0 || spi_set_tier(best) < 0) {
+		spi_set_speed(SPI_SPEED_SLOW);
+	}
+	INFO("SPI clock tier %ld\n", best);
+}
+
 int sd_open(void)
 {
 	sd_card_info_t *ci = &sd_card_info;
 	uint32_t timeout;
 	uint8_t cmd;
 	uint32_t resp[4];
+	uint32_t cid[4];
 	int err;
 
 	FUNCTION_TRACE;
@@ -341,6 +545,15 @@ int sd_open(void)
 	ci->total_sectors = 0;
 	ci->block_size = sdBlockSize_512;
 
+#ifdef SD_LBA
+	sd_lba = 0;
+	sd_lba_fill = 0;
+	err = sd_open_lba();
+	if (err <= 0) {
+		return err;
+	}
+#endif
+
 	/* Send dummy clocks with CS high (doing this sends 96 clocks) */
 	sd_deselect();
 	sd_get_r7_resp();
@@ -425,6 +638,7 @@ int sd_open(void)
 			err = sdError_BadResponse;
 		}
 		if (err == 0) {
+			memcpy(cid, resp, sizeof(cid));
 			err = sd_parse_cid(ci, resp);
 		}
 		if (err == 0) {
@@ -441,8 +655,12 @@ int sd_open(void)
 			err = sd_parse_csd(ci, resp);
 		}
 
-		/* Switch to fast clock */
-		spi_set_speed(SPI_SPEED_FAST);
+		/* Switch to the fastest clock that works with this card */
+		if (err == 0) {
+			sd_calibrate(cid, resp);
+		} else {
+			spi_set_speed(SPI_SPEED_FAST);
+		}
 	} else {
 		/* Card not present */
 		err = sdError_NoCard;
@@ -462,6 +680,20 @@ int sd_read(uint8_t *buf, uint32_t sector, uint32_t count)
 		ERROR("No card\n");
 		return sdError_NoCard;
 	}
+
+#ifdef SD_LBA
+	if (sd_lba) {
+		while (count && err == 0) {
+			uint32_t n = count < LBA_MAX_COUNT ? count : LBA_MAX_COUNT;
+			err = sd_lba_error(spi_lba_read(buf, sector, n));
+			buf += n << SD_SECTOR_SHIFT;
+			sector += n;
+			count -= n;
+		}
+		return err;
+	}
+#endif
+
 	if (ci->type != sdCardType_SDHC) {
 		/* Convert sector to byte addressing (x512) */
 		sector <<= 9;
@@ -508,6 +740,31 @@ int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count)
 		ERROR("No card\n");
 		return sdError_NoCard;
 	}
+
+#ifdef SD_LBA
+	if (sd_lba) {
+		while (count && err == 0) {
+			uint32_t max = count < LBA_MAX_COUNT ? count : LBA_MAX_COUNT;
+			uint32_t n = sd_lba_fill ? sd_uniform_sectors(buf, max) : 0;
+
+			if (n) {
+				/* Zeroed or formatted sectors aren't sent over the port */
+				err = sd_lba_error(spi_lba_fill(buf[0], sector, n));
+			} else {
+				n = sd_lba_fill ? 1 : max;
+				while (n < max && sd_uniform_sectors(buf + (n << SD_SECTOR_SHIFT), 1) == 0) {
+					n++;
+				}
+				err = sd_lba_error(spi_lba_write(buf, sector, n));
+			}
+			buf += n << SD_SECTOR_SHIFT;
+			sector += n;
+			count -= n;
+		}
+		return err;
+	}
+#endif
+
 	if (ci->type != sdCardType_SDHC) {
 		/* Convert sector to byte addressing (x512) */
 		sector <<= 9;
@@ -549,6 +806,18 @@ int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count)
 	return err;
 }
 
+/*! Waits until written sectors are on the card. In LBA mode firmware with
+ * a cache acknowledges writes before programming them. */
+int sd_flush(void)
+{
+#ifdef SD_LBA
+	if (sd_lba) {
+		return sd_lba_error(spi_lba_sync());
+	}
+#endif
+	return 0;
+}
+
 const sd_card_info_t* sd_get_card_info(void)
 {
 	return &sd_card_info;
@@ -115,6 +115,8 @@ int sd_open(void);
 void sd_close(void);
 int sd_read(uint8_t *buf, uint32_t sector, uint32_t count);
 int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count);
+int sd_flush(void);
 const sd_card_info_t* sd_get_card_info(void);
+void sd_set_ready_signals(uint32_t signals);
 
 #endif
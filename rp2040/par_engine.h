@@ -0,0 +1,31 @@
+/*
+ * par_engine.h - PIO and DMA engine for the byte-pump READ/WRITE transfers
+ *
+ * Two PIO state machines follow CLK and drive or sample D0-D7, and two
+ * DMA channels move the bytes between them and the SPI data register.
+ * Once a transfer is armed no byte passes through the CPU, which only
+ * watches for the end of the transfer or the Amiga releasing REQ.
+ */
+
+#ifndef PAR_ENGINE_H
+#define PAR_ENGINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hardware/spi.h"
+
+// Bytes clocked from SPI ahead of the Amiga on reads, at most the depth
+// of the PIO TX FIFO
+#ifndef PAR_READ_AHEAD
+#define PAR_READ_AHEAD  4
+#endif
+
+void par_engine_init(spi_inst_t *spi, uint pin_clk, uint pin_req);
+
+// Move count bytes, starting with CLK at prev_clk. They return when all
+// bytes have been moved, true, or REQ is released, false, with D0-D7
+// back under SIO control and the SPI FIFOs empty.
+bool par_engine_read(uint32_t prev_clk, uint32_t count);
+bool par_engine_write(uint32_t prev_clk, uint32_t count);
+
+#endif // PAR_ENGINE_H
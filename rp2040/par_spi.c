@@ -6,6 +6,12 @@
  */
 #include "hardware/gpio.h"
 #include "hardware/spi.h"
+#include "hardware/timer.h"
+#include "sd_spi.h"
+#include "spi_prefetch.h"
+#ifdef PAR_SPI_PIO
+#include "par_engine.h"
+#endif
 
 //      Pin name    GPIO    Direction   Comment     Description
 #define PIN_D(x)    (0+x)   // In/out
@@ -13,16 +19,827 @@
 #define PIN_ACT     9       // Output   Active low
 #define PIN_CLK     10      // Input
 #define PIN_REQ     11      // Input    Active low
+#define PIN_STB     12      // Input    Pull-up     /STROBE, optional
 #define PIN_MISO    16      // Input    Pull-up
 #define PIN_SS      17      // Output   Active low
 #define PIN_SCK     18      // Output
 #define PIN_MOSI    19      // Output
 #define PIN_CDET    20      // Input    Pull-up     Card Detect
+#define PIN_SS1     21      // Output   Active low  Chip select of target 1
+#define PIN_SS2     22      // Output   Active low  Chip select of target 2
+#define PIN_SS3     26      // Output   Active low  Chip select of target 3
+
+#define SS_MASK     ((1 << PIN_SS) | (1 << PIN_SS1) | (1 << PIN_SS2) | (1 << PIN_SS3))
 
 #define SPI_SLOW_FREQUENCY (400*1000)
 #define SPI_FAST_FREQUENCY (16*1000*1000)
 
 static uint32_t prev_cdet;
+static bool strobe_mode;
+
+// CIA-A pulses /STROBE low after every access to the data port. The falling
+// edge is latched in the raw interrupt status register even though the
+// interrupt is never enabled, so a short pulse can't slip between two polls.
+static inline bool strobe_edge_seen() {
+    return io_bank0_hw->intr[PIN_STB / 8] & (GPIO_IRQ_EDGE_FALL << (4 * (PIN_STB % 8)));
+}
+
+static inline void strobe_edge_clear() {
+    gpio_acknowledge_irq(PIN_STB, GPIO_IRQ_EDGE_FALL);
+}
+
+// Waits for the Amiga to toggle CLK. Returns false if REQ was released.
+static inline bool wait_clk(uint32_t *pins, uint32_t *prev_clk) {
+    while (1) {
+        *pins = gpio_get_all();
+        if ((*pins & (1 << PIN_CLK)) != *prev_clk)
+            break;
+
+        if (*pins & (1 << PIN_REQ))
+            return false;
+    }
+
+    *prev_clk = *pins & (1 << PIN_CLK);
+    return true;
+}
+
+// Waits for the Amiga to access the data port. Returns false if REQ was released.
+static inline bool wait_strobe() {
+    while (!strobe_edge_seen()) {
+        if (gpio_get_all() & (1 << PIN_REQ))
+            return false;
+    }
+
+    strobe_edge_clear();
+    return true;
+}
+
+static void read_strobe(uint32_t pins, uint32_t prev_clk, uint32_t byte_count) {
+    uint32_t prev_ss = pins & SS_MASK;
+
+    spi_prefetch_start(byte_count + 1);
+
+    // The first byte is still clocked by CLK, since the Amiga has to
+    // turn the data port around before it can start reading.
+    if (wait_clk(&pins, &prev_clk)) {
+        strobe_edge_clear();
+        gpio_put_all(prev_ss | spi_prefetch_get(0));
+        gpio_set_dir_out_masked(0xff);
+
+        for (uint32_t i = 1; i <= byte_count; i++) {
+            uint32_t value = spi_prefetch_get(i);
+
+            if (!wait_strobe())
+                break;
+
+            gpio_put_all(prev_ss | value);
+        }
+    }
+
+    spi_prefetch_finish();
+}
+
+static void write_strobe(uint32_t byte_count) {
+    while (1) {
+        if (!wait_strobe())
+            return;
+
+        spi_get_hw(spi0)->dr = gpio_get_all() & 0xff;
+
+        while (!spi_is_readable(spi0))
+            tight_loop_contents();
+
+        (void)spi_get_hw(spi0)->dr;
+
+        if (!byte_count)
+            break;
+
+        byte_count--;
+    }
+}
+
+#define TARGET_COUNT        4
+
+// Each chip select remembers its SPI clock, SPI mode (CPOL << 1 | CPHA)
+// and transfer mode. SPEED, SPEED_TIER, SPI_MODE and XFER_MODE change
+// those of the active target, and TARGET switches between them.
+struct target {
+    uint pin;
+    uint32_t baud;
+    uint8_t mode;
+    bool strobe;
+};
+
+static struct target targets[TARGET_COUNT] = {
+    { PIN_SS, SPI_SLOW_FREQUENCY, 0, false },
+    { PIN_SS1, SPI_SLOW_FREQUENCY, 0, false },
+    { PIN_SS2, SPI_SLOW_FREQUENCY, 0, false },
+    { PIN_SS3, SPI_SLOW_FREQUENCY, 0, false },
+};
+
+static struct target *active_target = &targets[0];
+
+static void set_spi_mode(uint8_t mode) {
+    spi_set_format(spi0, 8,
+            mode & 2 ? SPI_CPOL_1 : SPI_CPOL_0,
+            mode & 1 ? SPI_CPHA_1 : SPI_CPHA_0,
+            SPI_MSB_FIRST);
+}
+
+// Releases all chip selects and applies the settings of target t.
+static void use_target(uint32_t t) {
+    struct target *next = &targets[t];
+
+    gpio_put_masked(SS_MASK, SS_MASK);
+
+    if (next == active_target)
+        return;
+
+    active_target->baud = spi_get_baudrate(spi0);
+    active_target->strobe = strobe_mode;
+
+    spi_set_baudrate(spi0, next->baud);
+    if (next->mode != active_target->mode)
+        set_spi_mode(next->mode);
+    strobe_mode = next->strobe;
+
+    active_target = next;
+}
+
+#define BATCH_MAX_SEGMENTS  16
+#define BATCH_MAX_BYTES     1024
+
+#define STATUS_BUSY         0x5a
+#define STATUS_OK           0x00
+#define STATUS_TIMEOUT      0x01
+
+#define SEG_WRITE           0
+#define SEG_READ            1
+#define SEG_SELECT          2
+#define SEG_DESELECT        3
+#define SEG_POLL            4
+
+#define BATCH_SELECT        1
+#define BATCH_DESELECT      2
+
+#define POLL_MISMATCH       1
+#define POLL_BYTES          2
+
+struct batch_segment {
+    uint8_t type;
+    uint8_t mask;
+    uint8_t value;
+    uint8_t flags;
+    uint16_t size;
+};
+
+static struct batch_segment batch_segs[BATCH_MAX_SEGMENTS];
+static uint8_t batch_buf[BATCH_MAX_BYTES];
+
+static inline bool read_byte(uint32_t *pins, uint32_t *prev_clk, uint8_t *value) {
+    if (!wait_clk(pins, prev_clk))
+        return false;
+
+    *value = *pins & 0xff;
+    return true;
+}
+
+// Reads bytes until (byte & mask) == value, or != value with POLL_MISMATCH.
+// Gives up after limit ms, or limit bytes with POLL_BYTES.
+static bool poll_spi(uint8_t mask, uint8_t value, uint8_t flags, uint32_t limit, uint8_t *result) {
+    bool mismatch = flags & POLL_MISMATCH;
+    uint32_t start = time_us_32();
+    uint32_t count = 0;
+    uint8_t byte;
+
+    while (1) {
+        spi_read_blocking(spi0, 0xff, &byte, 1);
+        count++;
+
+        if (((byte & mask) == value) != mismatch)
+            break;
+
+        if (flags & POLL_BYTES) {
+            if (count >= limit)
+                break;
+        } else if (time_us_32() - start >= limit * 1000) {
+            break;
+        }
+    }
+
+    *result = byte;
+    return ((byte & mask) == value) != mismatch;
+}
+
+// Returns the index of a poll that timed out, or count if all segments ran.
+static uint32_t run_batch(uint8_t flags, uint32_t count, uint32_t write_bytes) {
+    const uint8_t *src = batch_buf;
+    uint8_t *dst = batch_buf + write_bytes;
+    uint32_t i;
+
+    if (flags & BATCH_SELECT)
+        gpio_put(active_target->pin, 0);
+
+    for (i = 0; i < count; i++) {
+        struct batch_segment *seg = &batch_segs[i];
+
+        switch (seg->type) {
+            case SEG_WRITE:
+                spi_write_blocking(spi0, src, seg->size);
+                src += seg->size;
+                break;
+            case SEG_READ:
+                spi_read_blocking(spi0, 0xff, dst, seg->size);
+                dst += seg->size;
+                break;
+            case SEG_SELECT:
+                gpio_put(active_target->pin, 0);
+                break;
+            case SEG_DESELECT:
+                gpio_put(active_target->pin, 1);
+                break;
+            case SEG_POLL:
+                if (!poll_spi(seg->mask, seg->value, seg->flags, seg->size, dst++))
+                    goto out;
+                break;
+        }
+    }
+
+out:
+    if (flags & BATCH_DESELECT)
+        gpio_put(active_target->pin, 1);
+
+    return i;
+}
+
+// The Amiga writes flags, segment count, segment descriptors (type and
+// size, followed by mask, value and flags for polls) and all write
+// payloads. After the turnaround CLK the port is driven with STATUS_BUSY
+// while the segments run, then with the status byte, and then the read
+// data is clocked out one byte per CLK toggle.
+static void handle_batch(uint32_t pins, uint32_t prev_clk) {
+    uint8_t flags;
+    uint8_t count;
+
+    if (!read_byte(&pins, &prev_clk, &flags))
+        return;
+
+    if (!read_byte(&pins, &prev_clk, &count))
+        return;
+
+    // Never drive the port for a batch that can't be run. The Amiga reads
+    // an undriven port as 0xff and falls back to single transfers.
+    if (count > BATCH_MAX_SEGMENTS)
+        return;
+
+    uint32_t write_bytes = 0;
+    uint32_t read_bytes = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct batch_segment *seg = &batch_segs[i];
+        uint8_t hi, lo;
+
+        if (!read_byte(&pins, &prev_clk, &seg->type) ||
+                !read_byte(&pins, &prev_clk, &hi) ||
+                !read_byte(&pins, &prev_clk, &lo))
+            return;
+
+        seg->size = (hi << 8) | lo;
+
+        if (seg->type == SEG_POLL) {
+            if (!read_byte(&pins, &prev_clk, &seg->mask) ||
+                    !read_byte(&pins, &prev_clk, &seg->value) ||
+                    !read_byte(&pins, &prev_clk, &seg->flags))
+                return;
+
+            read_bytes++;
+        } else if (seg->type == SEG_WRITE) {
+            write_bytes += seg->size;
+        } else if (seg->type == SEG_READ) {
+            read_bytes += seg->size;
+        }
+    }
+
+    if (write_bytes + read_bytes > BATCH_MAX_BYTES)
+        return;
+
+    for (uint32_t i = 0; i < write_bytes; i++) {
+        if (!read_byte(&pins, &prev_clk, &batch_buf[i]))
+            return;
+    }
+
+    if (!wait_clk(&pins, &prev_clk))
+        return;
+
+    gpio_put_masked(0xff, STATUS_BUSY);
+    gpio_set_dir_out_masked(0xff);
+
+    uint32_t done = run_batch(flags, count, write_bytes);
+
+    gpio_put_masked(0xff, done == count ? STATUS_OK : 0x80 | done);
+
+    for (uint32_t i = 0; i < read_bytes; i++) {
+        if (!wait_clk(&pins, &prev_clk))
+            return;
+
+        gpio_put_masked(0xff, batch_buf[write_bytes + i]);
+    }
+}
+
+// The Amiga writes mask, value, flags and a 16 bit limit. After the
+// turnaround CLK the port is driven with STATUS_BUSY while polling, then
+// with the status byte, and on the next CLK toggle with the last byte read.
+static void handle_poll(uint32_t pins, uint32_t prev_clk) {
+    uint8_t mask, value, flags, hi, lo;
+    uint8_t result;
+
+    if (!read_byte(&pins, &prev_clk, &mask) ||
+            !read_byte(&pins, &prev_clk, &value) ||
+            !read_byte(&pins, &prev_clk, &flags) ||
+            !read_byte(&pins, &prev_clk, &hi) ||
+            !read_byte(&pins, &prev_clk, &lo))
+        return;
+
+    if (!wait_clk(&pins, &prev_clk))
+        return;
+
+    gpio_put_masked(0xff, STATUS_BUSY);
+    gpio_set_dir_out_masked(0xff);
+
+    bool matched = poll_spi(mask, value, flags, (hi << 8) | lo, &result);
+
+    gpio_put_masked(0xff, matched ? STATUS_OK : STATUS_TIMEOUT);
+
+    if (!wait_clk(&pins, &prev_clk))
+        return;
+
+    gpio_put_masked(0xff, result);
+}
+
+#define LBA_OPEN            0
+#define LBA_READ            1
+#define LBA_WRITE           2
+#define LBA_READ_UNIFORM    3
+#define LBA_FILL            4
+
+// Status of a sector that is sent as a single value byte.
+#define LBA_UNIFORM         0x10
+
+// Reads a whole sector before answering. A sector with all bytes the same
+// is sent as LBA_UNIFORM followed by the value, any other sector as
+// STATUS_OK followed by the data.
+static bool send_sector_uniform(uint32_t *pins, uint32_t *prev_clk) {
+    bool uniform = true;
+
+    for (int j = 0; j < SD_SECTOR_SIZE; j++) {
+        batch_buf[j] = sd_spi_xfer(0xff);
+        uniform &= batch_buf[j] == batch_buf[0];
+    }
+
+    gpio_put_masked(0xff, uniform ? LBA_UNIFORM : STATUS_OK);
+
+    int size = uniform ? 1 : SD_SECTOR_SIZE;
+
+    for (int j = 0; j < size; j++) {
+        if (!wait_clk(pins, prev_clk))
+            return false;
+
+        gpio_put_masked(0xff, batch_buf[j]);
+    }
+
+    return true;
+}
+
+// The Amiga writes an op byte, a 32 bit LBA and a 16 bit sector count.
+// Every status byte is preceded by a CLK toggle, after which the port is
+// driven with STATUS_BUSY until the status is ready. For reads, each OK
+// status is followed by a sector clocked out one byte per CLK toggle, and
+// a final status after the last sector. For writes, the status of the
+// command is followed by, for each sector, a CLK toggle that releases the
+// port, the sector clocked in and the status of the sector, and finally
+// a last status once the write has been stopped. LBA_READ_UNIFORM is a
+// read where sectors may be sent with send_sector_uniform(). LBA_FILL has
+// the fill value as an extra parameter byte and only a single status.
+static void handle_lba(uint32_t pins, uint32_t prev_clk) {
+    uint8_t op;
+    uint8_t b[6];
+    uint8_t value = 0;
+
+    if (!read_byte(&pins, &prev_clk, &op))
+        return;
+
+    // LBA mode always runs the SD card on target 0.
+    if (active_target != &targets[0])
+        use_target(0);
+
+    for (int i = 0; i < 6; i++) {
+        if (!read_byte(&pins, &prev_clk, &b[i]))
+            return;
+    }
+
+    if (op == LBA_FILL && !read_byte(&pins, &prev_clk, &value))
+        return;
+
+    uint32_t lba = ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+    uint32_t count = (b[4] << 8) | b[5];
+
+    if (!wait_clk(&pins, &prev_clk))
+        return;
+
+    gpio_put_masked(0xff, STATUS_BUSY);
+    gpio_set_dir_out_masked(0xff);
+
+    if (op == LBA_OPEN) {
+        int err = sd_spi_open(batch_buf);
+        gpio_put_masked(0xff, err);
+
+        if (err != SD_OK)
+            return;
+
+        for (int i = 0; i < SD_INFO_SIZE; i++) {
+            if (!wait_clk(&pins, &prev_clk))
+                return;
+
+            gpio_put_masked(0xff, batch_buf[i]);
+        }
+    } else if (op == LBA_READ || op == LBA_READ_UNIFORM) {
+        int err = sd_spi_read_start(lba, count);
+        bool started = err == SD_OK;
+
+        for (uint32_t i = 0; err == SD_OK; i++) {
+            if (i) {
+                if (!wait_clk(&pins, &prev_clk))
+                    break;
+
+                gpio_put_masked(0xff, STATUS_BUSY);
+                sd_spi_read_crc();
+            }
+
+            if (i == count)
+                break;
+
+            err = sd_spi_read_token();
+            if (err != SD_OK)
+                break;
+
+            if (op == LBA_READ_UNIFORM) {
+                if (!send_sector_uniform(&pins, &prev_clk)) {
+                    sd_spi_read_stop(count);
+                    return;
+                }
+                continue;
+            }
+
+            gpio_put_masked(0xff, STATUS_OK);
+
+            for (int j = 0; j < SD_SECTOR_SIZE; j++) {
+                uint8_t value = sd_spi_xfer(0xff);
+
+                if (!wait_clk(&pins, &prev_clk)) {
+                    sd_spi_read_stop(count);
+                    return;
+                }
+
+                gpio_put_masked(0xff, value);
+            }
+        }
+
+        if (started) {
+            int stop_err = sd_spi_read_stop(count);
+            if (err == SD_OK)
+                err = stop_err;
+        }
+
+        gpio_put_masked(0xff, err);
+    } else if (op == LBA_WRITE) {
+        int err = sd_spi_write_start(lba, count);
+        gpio_put_masked(0xff, err);
+
+        if (err != SD_OK)
+            return;
+
+        for (uint32_t i = 0; i < count && err == SD_OK; i++) {
+            // Let go of the port so the Amiga can write the sector.
+            if (!wait_clk(&pins, &prev_clk))
+                break;
+
+            gpio_set_dir_in_masked(0xff);
+            sd_spi_write_token(count);
+
+            for (int j = 0; j < SD_SECTOR_SIZE; j++) {
+                if (!wait_clk(&pins, &prev_clk))
+                    break;
+
+                sd_spi_xfer(pins & 0xff);
+            }
+
+            if (!wait_clk(&pins, &prev_clk))
+                break;
+
+            gpio_put_masked(0xff, STATUS_BUSY);
+            gpio_set_dir_out_masked(0xff);
+
+            err = sd_spi_write_finish();
+            gpio_put_masked(0xff, err);
+        }
+
+        if (err == SD_OK && wait_clk(&pins, &prev_clk)) {
+            gpio_put_masked(0xff, STATUS_BUSY);
+            err = sd_spi_write_stop(count);
+            gpio_put_masked(0xff, err);
+        } else {
+            sd_spi_write_stop(count);
+        }
+    } else if (op == LBA_FILL) {
+        int err = sd_spi_write_start(lba, count);
+
+        if (err == SD_OK) {
+            for (uint32_t i = 0; i < count && err == SD_OK; i++) {
+                sd_spi_write_token(count);
+
+                for (int j = 0; j < SD_SECTOR_SIZE; j++)
+                    sd_spi_xfer(value);
+
+                err = sd_spi_write_finish();
+            }
+
+            int stop_err = sd_spi_write_stop(count);
+            if (err == SD_OK)
+                err = stop_err;
+        }
+
+        gpio_put_masked(0xff, err);
+    }
+}
+
+#define CAPS_MAGIC          0x43
+#define FIRMWARE_ID         2
+#define PROTOCOL_VERSION    1
+#define COMMANDS            0x13fff // Control commands 0 to 13, uniform LBA sectors
+
+// SD cards in SPI mode are specified up to 25 MHz. The actual rates depend
+// on the peripheral clock, and are what GET_CAPS reports.
+static const uint32_t spi_tiers[] = {
+    SPI_SLOW_FREQUENCY,
+    1000*1000,
+    2000*1000,
+    4000*1000,
+    8000*1000,
+    12000*1000,
+    SPI_FAST_FREQUENCY,
+    25000*1000,
+};
+
+#define TIER_COUNT          (sizeof(spi_tiers) / sizeof(spi_tiers[0]))
+
+static uint8_t caps[8 + 2 * TIER_COUNT];
+
+static void build_caps() {
+    uint8_t *p = caps;
+
+    *p++ = CAPS_MAGIC;
+    *p++ = FIRMWARE_ID;
+    *p++ = PROTOCOL_VERSION;
+    *p++ = (COMMANDS >> 24) & 0xff;
+    *p++ = (COMMANDS >> 16) & 0xff;
+    *p++ = (COMMANDS >> 8) & 0xff;
+    *p++ = COMMANDS & 0xff;
+    *p++ = TIER_COUNT;
+
+    for (int i = 0; i < TIER_COUNT; i++) {
+        uint32_t khz = spi_set_baudrate(spi0, spi_tiers[i]) / 1000;
+        *p++ = khz >> 8;
+        *p++ = khz;
+    }
+
+    spi_set_baudrate(spi0, SPI_SLOW_FREQUENCY);
+}
+
+// The caps are driven one byte per CLK toggle after the turnaround CLK.
+static void handle_caps(uint32_t pins, uint32_t prev_clk) {
+    for (int i = 0; i < sizeof(caps); i++) {
+        if (!wait_clk(&pins, &prev_clk))
+            return;
+
+        gpio_put_masked(0xff, caps[i]);
+        gpio_set_dir_out_masked(0xff);
+    }
+}
+
+// The Amiga writes the tier index, and the index is echoed back after the
+// turnaround CLK once the new rate is in effect, or 0xff if there is no
+// such tier.
+static void handle_tier(uint32_t pins, uint32_t prev_clk) {
+    uint8_t tier;
+
+    if (!read_byte(&pins, &prev_clk, &tier))
+        return;
+
+    if (tier < TIER_COUNT)
+        spi_set_baudrate(spi0, spi_tiers[tier]);
+    else
+        tier = 0xff;
+
+    if (!wait_clk(&pins, &prev_clk))
+        return;
+
+    gpio_put_masked(0xff, tier);
+    gpio_set_dir_out_masked(0xff);
+}
+
+// The Amiga writes the target index. Its settings are applied and, with
+// the A bit set, its chip select asserted, so switching to another device
+// costs a single command.
+static void handle_target(uint32_t pins, uint32_t prev_clk) {
+    bool select = pins & 1;
+    uint8_t t;
+
+    if (!read_byte(&pins, &prev_clk, &t) || t >= TARGET_COUNT)
+        return;
+
+    use_target(t);
+
+    if (select)
+        gpio_put(active_target->pin, 0);
+}
+
+// The Amiga writes the SPI mode of the active target.
+static void handle_spi_mode(uint32_t pins, uint32_t prev_clk) {
+    uint8_t mode;
+
+    if (!read_byte(&pins, &prev_clk, &mode))
+        return;
+
+    active_target->mode = mode & 3;
+    set_spi_mode(active_target->mode);
+}
+
+#define IRQ_PULSE_US        5
+
+static bool notify_armed;
+static uint32_t notify_start;
+static uint32_t notify_limit;
+
+// Gives CIA-A FLG a falling edge. If IRQ is already held low for a card
+// change it is let go first, and held again afterwards.
+static void pulse_irq() {
+    bool held = gpio_get_dir(PIN_IRQ);
+
+    if (held) {
+        gpio_set_dir(PIN_IRQ, false);
+        busy_wait_us_32(IRQ_PULSE_US);
+    }
+
+    gpio_put(PIN_IRQ, false);
+    gpio_set_dir(PIN_IRQ, true);
+    busy_wait_us_32(IRQ_PULSE_US);
+
+    if (!held)
+        gpio_set_dir(PIN_IRQ, false);
+}
+
+// The Amiga writes a 16 bit limit in ms and releases REQ. From then on
+// the idle loop calls poll_notify().
+static void handle_notify(uint32_t pins, uint32_t prev_clk) {
+    uint8_t hi, lo;
+
+    if (!read_byte(&pins, &prev_clk, &hi) ||
+            !read_byte(&pins, &prev_clk, &lo))
+        return;
+
+    notify_limit = (hi << 8) | lo;
+    notify_start = time_us_32();
+    notify_armed = true;
+}
+
+// Reads one byte with CS as the Amiga left it, and pulses IRQ once the
+// card no longer reads busy or the limit has passed.
+static void poll_notify() {
+    uint8_t byte;
+
+    spi_read_blocking(spi0, 0xff, &byte, 1);
+
+    if (byte == 0xff || time_us_32() - notify_start >= notify_limit * 1000) {
+        notify_armed = false;
+        pulse_irq();
+    }
+}
+
+#define TEST_PATTERN(i)     (((i) + ((i) >> 8)) & 0xff)
+
+static bool test_mode;
+static uint32_t test_errors;
+
+// In test mode reads send TEST_PATTERN(i) as byte i and writes are checked
+// against it, without touching SPI, so that only the parallel link is
+// exercised.
+static void transfer_test(uint32_t pins, uint32_t prev_clk, bool read, uint32_t byte_count) {
+    uint32_t prev_ss = pins & SS_MASK;
+
+    for (uint32_t i = 0; i <= byte_count; i++) {
+        if (read) {
+            // The first byte is always clocked by CLK, see read_strobe().
+            if (i == 0 || !strobe_mode) {
+                if (!wait_clk(&pins, &prev_clk))
+                    return;
+                strobe_edge_clear();
+            } else if (!wait_strobe()) {
+                return;
+            }
+
+            gpio_put_all(prev_ss | TEST_PATTERN(i));
+            gpio_set_dir_out_masked(0xff);
+        } else {
+            if (strobe_mode) {
+                if (!wait_strobe())
+                    return;
+                pins = gpio_get_all();
+            } else if (!wait_clk(&pins, &prev_clk)) {
+                return;
+            }
+
+            if ((pins & 0xff) != TEST_PATTERN(i))
+                test_errors++;
+        }
+    }
+}
+
+// Turns test mode on or off with the A bit, and replies with the number of
+// mismatched test writes since the last TEST_MODE, big endian, one byte
+// per CLK toggle after the turnaround CLK.
+static void handle_test_mode(uint32_t pins, uint32_t prev_clk) {
+    uint32_t errors = test_errors;
+
+    test_mode = pins & 1;
+    test_errors = 0;
+
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        if (!wait_clk(&pins, &prev_clk))
+            return;
+
+        gpio_put_masked(0xff, errors >> shift);
+        gpio_set_dir_out_masked(0xff);
+    }
+}
+
+static void transfer(uint32_t pins, uint32_t prev_clk, bool read, uint32_t byte_count) {
+    if (test_mode) {
+        transfer_test(pins, prev_clk, read, byte_count);
+        return;
+    }
+
+    if (read && strobe_mode) {
+        read_strobe(pins, prev_clk, byte_count);
+#ifdef PAR_SPI_PIO
+    } else if (read) {
+        par_engine_read(prev_clk, byte_count + 1);
+    } else if (!strobe_mode) {
+        par_engine_write(prev_clk, byte_count + 1);
+#endif
+    } else if (read) {
+        uint32_t prev_ss = pins & SS_MASK;
+
+        spi_prefetch_start(byte_count + 1);
+
+        for (uint32_t i = 0; i <= byte_count; i++) {
+            uint32_t value = spi_prefetch_get(i);
+
+            if (!wait_clk(&pins, &prev_clk))
+                break;
+
+            gpio_put_all(prev_ss | value);
+            gpio_set_dir_out_masked(0xff);
+        }
+
+        spi_prefetch_finish();
+    } else if (strobe_mode) {
+        write_strobe(byte_count);
+    } else {
+        while (1) {
+            while (1) {
+                pins = gpio_get_all();
+                if ((pins & (1 << PIN_CLK)) != prev_clk)
+                    break;
+
+                if (pins & (1 << PIN_REQ))
+                    return;
+            }
+
+            spi_get_hw(spi0)->dr = pins & 0xff;
+
+            while (!spi_is_readable(spi0))
+                tight_loop_contents();
+
+            (void)spi_get_hw(spi0)->dr;
+
+            if (!byte_count)
+                break;
+
+            prev_clk = pins & (1 << PIN_CLK);
+            byte_count--;
+        }
+    }
+}
 
 static void handle_request() {
     uint32_t pins;
@@ -36,11 +853,22 @@ static void handle_request() {
             gpio_put(PIN_IRQ, false);
             gpio_set_dir(PIN_IRQ, true);
             prev_cdet = pins & (1 << PIN_CDET);
+
+            // The Amiga learns about the change through CARD_PRESENT.
+            notify_armed = false;
+        } else if (notify_armed) {
+            poll_notify();
         }
     }
 
+    // Any command ends a NOTIFY_READY watch.
+    notify_armed = false;
+
     uint32_t prev_clk = pins & (1 << PIN_CLK);
 
+    // Forget the edge caused by writing the command byte.
+    strobe_edge_clear();
+
     if ((pins & 0xc0) != 0xc0) {
         uint32_t byte_count = 0;
         bool read = false;
@@ -67,18 +895,25 @@ static void handle_request() {
             read = !!(pins & 0x80);
             byte_count |= pins & 0x7f;
             prev_clk = pins & (1 << PIN_CLK);
+            strobe_edge_clear();
         }
 
-        if (read) {
-            spi_get_hw(spi0)->dr = 0xff;
-
-            uint32_t prev_ss = pins & (1 << PIN_SS);
-
-            while (1) {
-                while (!spi_is_readable(spi0))
-                    tight_loop_contents();
-
-                uint32_t value = spi_get_hw(spi0)->dr;
+        transfer(pins, prev_clk, read, byte_count);
+    } else {
+        switch ((pins & 0x3e) >> 1) {
+            case 0: { // SPI_SELECT
+                if (pins & 1)
+                    gpio_put(active_target->pin, 0);
+                else
+                    gpio_put_masked(SS_MASK, SS_MASK);
+                gpio_put(PIN_ACT, 0);
+                break;
+            }
+            case 1: { // CARD_PRESENT
+                // IRQ is only held after a card change.
+                bool changed = gpio_get_dir(PIN_IRQ);
+                gpio_set_dir(PIN_IRQ, false);
+                gpio_put(PIN_ACT, 0);
 
                 while (1) {
                     pins = gpio_get_all();
@@ -89,71 +924,102 @@ static void handle_request() {
                         return;
                 }
 
-                gpio_put_all(prev_ss | value);
+                gpio_put(PIN_D(0), !gpio_get(PIN_CDET));
+                gpio_put(PIN_D(1), changed);
                 gpio_set_dir_out_masked(0xff);
+                break;
+            }
+            case 2: { // SPEED
+                spi_set_baudrate(spi0, pins & 1 ?
+                        SPI_FAST_FREQUENCY :
+                        SPI_SLOW_FREQUENCY);
 
-                if (!byte_count)
-                    break;
-
-                spi_get_hw(spi0)->dr = 0xff;
-                prev_clk = pins & (1 << PIN_CLK);
-                byte_count--;
+                gpio_put(PIN_ACT, 0);
+                break;
             }
-        } else {
-            while (1) {
-                while (1) {
-                    pins = gpio_get_all();
-                    if ((pins & (1 << PIN_CLK)) != prev_clk)
-                        break;
+            case 3: { // XFER_MODE
+                bool want_strobe = pins & 1;
 
-                    if (pins & (1 << PIN_REQ))
-                        return;
-                }
+                gpio_put(PIN_ACT, 0);
+
+                // The Amiga writes two probe bytes, each followed by a CLK
+                // toggle. Only accept strobe mode if the second write was
+                // seen on /STROBE, i.e. the line is actually connected.
+                if (!wait_clk(&pins, &prev_clk))
+                    return;
 
-                spi_get_hw(spi0)->dr = pins & 0xff;
+                strobe_edge_clear();
 
-                while (!spi_is_readable(spi0))
-                    tight_loop_contents();
+                if (!wait_clk(&pins, &prev_clk))
+                    return;
 
-                (void)spi_get_hw(spi0)->dr;
+                strobe_mode = want_strobe && strobe_edge_seen();
 
-                if (!byte_count)
-                    break;
+                if (!wait_clk(&pins, &prev_clk))
+                    return;
 
-                prev_clk = pins & (1 << PIN_CLK);
-                byte_count--;
+                gpio_put_masked(0xff, strobe_mode ? 1 : 0);
+                gpio_set_dir_out_masked(0xff);
+                break;
             }
-        }
-    } else {
-        switch ((pins & 0x3e) >> 1) {
-            case 0: { // SPI_SELECT
-                gpio_put(PIN_SS, !(pins & 1));
+            case 4: { // BATCH
                 gpio_put(PIN_ACT, 0);
+                handle_batch(pins, prev_clk);
                 break;
             }
-            case 1: { // CARD_PRESENT
-                gpio_set_dir(PIN_IRQ, false);
+            case 5: { // POLL
                 gpio_put(PIN_ACT, 0);
+                handle_poll(pins, prev_clk);
+                break;
+            }
+            case 6: { // LBA
+                gpio_put(PIN_ACT, 0);
+                handle_lba(pins, prev_clk);
+                break;
+            }
+            case 7: { // READ3 or WRITE3
+                bool read = pins & 1;
+                uint8_t len[3];
 
-                while (1) {
-                    pins = gpio_get_all();
-                    if ((pins & (1 << PIN_CLK)) != prev_clk)
-                        break;
+                gpio_put(PIN_ACT, 0);
 
-                    if (pins & (1 << PIN_REQ))
+                for (int i = 0; i < 3; i++) {
+                    if (!read_byte(&pins, &prev_clk, &len[i]))
                         return;
                 }
 
-                gpio_put(PIN_D(0), !gpio_get(PIN_CDET));
-                gpio_set_dir_out_masked(0xff);
+                strobe_edge_clear();
+                transfer(pins, prev_clk, read, (len[0] << 16) | (len[1] << 8) | len[2]);
                 break;
             }
-            case 2: { // SPEED
-                spi_set_baudrate(spi0, pins & 1 ?
-                        SPI_FAST_FREQUENCY :
-                        SPI_SLOW_FREQUENCY);
-
+            case 8: { // GET_CAPS
+                gpio_put(PIN_ACT, 0);
+                handle_caps(pins, prev_clk);
+                break;
+            }
+            case 9: { // SPEED_TIER
+                gpio_put(PIN_ACT, 0);
+                handle_tier(pins, prev_clk);
+                break;
+            }
+            case 10: { // NOTIFY_READY
                 gpio_put(PIN_ACT, 0);
+                handle_notify(pins, prev_clk);
+                break;
+            }
+            case 11: { // TEST_MODE
+                gpio_put(PIN_ACT, 0);
+                handle_test_mode(pins, prev_clk);
+                break;
+            }
+            case 12: { // TARGET
+                gpio_put(PIN_ACT, 0);
+                handle_target(pins, prev_clk);
+                break;
+            }
+            case 13: { // SPI_MODE
+                gpio_put(PIN_ACT, 0);
+                handle_spi_mode(pins, prev_clk);
                 break;
             }
         }
@@ -168,19 +1034,30 @@ static void handle_request() {
 
 int main() {
     spi_init(spi0, SPI_SLOW_FREQUENCY);
+    sd_spi_setup(spi0, PIN_SS, SPI_FAST_FREQUENCY);
+    build_caps();
+    spi_prefetch_init(spi0);
+#ifdef PAR_SPI_PIO
+    par_engine_init(spi0, PIN_CLK, PIN_REQ);
+#endif
 
     gpio_set_function(PIN_SCK, GPIO_FUNC_SPI);
     gpio_set_function(PIN_MOSI, GPIO_FUNC_SPI);
     gpio_set_function(PIN_MISO, GPIO_FUNC_SPI);
     gpio_pull_up(PIN_MISO);
 
-    gpio_init(PIN_SS);
-    gpio_put(PIN_SS, 1);
-    gpio_set_dir(PIN_SS, GPIO_OUT);
+    for (int i = 0; i < TARGET_COUNT; i++) {
+        gpio_init(targets[i].pin);
+        gpio_put(targets[i].pin, 1);
+        gpio_set_dir(targets[i].pin, GPIO_OUT);
+    }
 
     gpio_init(PIN_CDET);
     gpio_pull_up(PIN_CDET);
 
+    gpio_init(PIN_STB);
+    gpio_pull_up(PIN_STB);
+
     for (int i = 0; i < 12; i++)
         gpio_init(i);
 
@@ -0,0 +1,49 @@
+/*
+ * sd_spi.h - SD card protocol over SPI, run by the bridge firmware
+ *
+ * Used by the LBA block-device commands, where the Amiga only asks for
+ * sectors and the firmware does the SD commands, token waits, CRC bytes
+ * and busy polling itself.
+ */
+
+#ifndef SD_SPI_H
+#define SD_SPI_H
+
+#include <stdint.h>
+#include "hardware/spi.h"
+
+// Status codes, also sent to the Amiga as LBA status bytes
+#define SD_OK               0x00
+#define SD_TIMEOUT          0x01
+#define SD_ERROR            0x02
+#define SD_NO_CARD          0x03
+
+// Card types, same values as sd_card_type_t in examples/spisd/sd.h
+#define SD_TYPE_NONE        0
+#define SD_TYPE_SD1         1
+#define SD_TYPE_SD2         2
+#define SD_TYPE_SDHC        3
+#define SD_TYPE_MMC         4
+
+#define SD_SECTOR_SIZE      512
+
+// Card type followed by the raw CID and CSD registers
+#define SD_INFO_SIZE        33
+
+void sd_spi_setup(spi_inst_t *spi, uint pin_ss, uint fast_frequency);
+
+int sd_spi_open(uint8_t *info);
+
+int sd_spi_read_start(uint32_t lba, uint32_t count);
+int sd_spi_read_token(void);
+void sd_spi_read_crc(void);
+int sd_spi_read_stop(uint32_t count);
+
+int sd_spi_write_start(uint32_t lba, uint32_t count);
+void sd_spi_write_token(uint32_t count);
+int sd_spi_write_finish(void);
+int sd_spi_write_stop(uint32_t count);
+
+uint8_t sd_spi_xfer(uint8_t value);
+
+#endif // SD_SPI_H
@@ -0,0 +1,55 @@
+/*
+ * spi_prefetch.h - DMA read-ahead for the CPU read loops
+ *
+ * Once the byte count of a READ is known, DMA clocks the transfer from
+ * SPI into a ring in SRAM at the full SPI clock, and the loop serving CLK
+ * or /STROBE takes each byte from the ring as soon as it has arrived.
+ */
+
+#ifndef SPI_PREFETCH_H
+#define SPI_PREFETCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hardware/dma.h"
+#include "hardware/spi.h"
+
+// The ring holds 1 << SPI_PREFETCH_BITS bytes, a whole READ2.
+#define SPI_PREFETCH_BITS   13
+#define SPI_PREFETCH_SIZE   (1 << SPI_PREFETCH_BITS)
+
+extern uint8_t spi_prefetch_buf[SPI_PREFETCH_SIZE];
+extern int spi_prefetch_rx_chan;
+
+void spi_prefetch_init(spi_inst_t *spi);
+
+// Starts clocking count bytes into the ring.
+void spi_prefetch_start(uint32_t count);
+
+// Lets SPI run further ahead once byte i is the next one wanted.
+void spi_prefetch_more(uint32_t i);
+
+// SPI never gets a whole ring ahead of byte i, so the write position of
+// the receive channel tells whether byte i has arrived.
+static inline bool spi_prefetch_arrived(uint32_t i) {
+    uint32_t written = dma_channel_hw_addr(spi_prefetch_rx_chan)->write_addr -
+                       (uintptr_t)spi_prefetch_buf;
+    return (written - i) & (SPI_PREFETCH_SIZE - 1);
+}
+
+// Waits for byte i of the transfer to arrive.
+static inline uint32_t spi_prefetch_get(uint32_t i) {
+    if (!(i & 0xff))
+        spi_prefetch_more(i);
+
+    while (!spi_prefetch_arrived(i))
+        spi_prefetch_more(i);
+
+    return spi_prefetch_buf[i & (SPI_PREFETCH_SIZE - 1)];
+}
+
+// Stops the transfer, which may have been aborted part way, and empties
+// the SPI FIFOs.
+void spi_prefetch_finish(void);
+
+#endif // SPI_PREFETCH_H
@@ -65,8 +65,14 @@
 
 /* SMP port only */
 /* Enable SMP: number of physical cores to use */
+#ifdef PAR_SPI_COMBINED
+/* Core 0 runs the Amiga bridge outside FreeRTOS */
+#define configNUMBER_OF_CORES          1
+#define configUSE_CORE_AFFINITY        0
+#else
 #define configNUMBER_OF_CORES          2
 #define configUSE_CORE_AFFINITY        1
+#endif
 #define configUSE_PASSIVE_IDLE_HOOK    0
 #define configTICK_CORE                         0
 #define configRUN_MULTIPLE_PRIORITIES           0
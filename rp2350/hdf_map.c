@@ -0,0 +1,254 @@
+/*
+ * hdf_map.c - hard disk image on the SD card as the LBA block device
+ *
+ * FatFS opens the image and builds the cluster link map of fast seek
+ * with f_lseek(CREATE_LINKMAP). Each fragment of that map, a cluster
+ * count and the first cluster, is turned in place into the first LBA and
+ * card sector of the run, so a lookup is a binary search and no request
+ * reads the FAT. The map is allocated at the size FatFS asks for, so a
+ * fragmented image only costs RAM, 8 bytes per fragment.
+ *
+ * The volume is only mounted while the image is opened, unless the FILE
+ * command has it mounted, in which case that mount is used.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "hdf_map.h"
+#include "ff.h"
+
+#if !FF_USE_FASTSEEK
+#error "PAR_SPI_HDF needs FF_USE_FASTSEEK in ffconf.h"
+#endif
+
+// The Amiga sees the capacity in units of 512 kB, the CSD C_SIZE unit
+#define CSD_UNIT_SHIFT  10
+
+enum map_state {
+    MAP_CLOSED,     // Not opened since a card change, no access
+    MAP_RAW,        // No image, LBAs are card sectors
+    MAP_IMAGE,      // LBAs are sectors of the image
+};
+
+// Takes the place of a fragment of the link map
+struct extent {
+    uint32_t lba;
+    uint32_t sector;
+};
+
+static enum map_state state;
+static DWORD *link_map;
+static struct extent *extents;
+static uint32_t n_extents;
+static uint32_t image_sectors;
+static DWORD image_cluster;
+
+static FATFS fs;
+
+static int status(FRESULT res) {
+    switch (res) {
+    case FR_OK:         return SD_OK;
+    case FR_NOT_READY:  return SD_NO_CARD;
+    case FR_TIMEOUT:    return SD_TIMEOUT;
+    default:            return SD_ERROR;
+    }
+}
+
+// Has FatFS make the link map of the open image, and turns it into the
+// table of runs.
+static int build_map(FIL *fil) {
+    DWORD size = 1;
+
+    free(link_map);
+    link_map = NULL;
+    extents = NULL;
+    n_extents = 0;
+
+    // The first call only tells the size
+    fil->cltbl = &size;
+    FRESULT res = f_lseek(fil, CREATE_LINKMAP);
+    if (res != FR_NOT_ENOUGH_CORE)
+        return status(res == FR_OK ? FR_INT_ERR : res);
+
+    link_map = malloc(size * sizeof(DWORD));
+    if (!link_map)
+        return SD_ERROR;
+
+    link_map[0] = size;
+    fil->cltbl = link_map;
+    res = f_lseek(fil, CREATE_LINKMAP);
+    fil->cltbl = NULL;
+    if (res != FR_OK)
+        return status(res);
+
+    const FATFS *f = fil->obj.fs;
+    uint32_t lba = 0;
+
+    extents = (struct extent *)&link_map[1];
+
+    for (DWORD *p = &link_map[1]; p[0]; p += 2) {
+        uint32_t clusters = p[0];
+        uint32_t first = p[1];
+
+        extents[n_extents].lba = lba;
+        extents[n_extents].sector = f->database + (first - 2) * f->csize;
+        n_extents++;
+
+        lba += clusters * f->csize;
+    }
+
+    return lba >= image_sectors ? SD_OK : SD_ERROR;
+}
+
+static uint8_t crc7(const uint8_t *p, int n) {
+    uint8_t crc = 0;
+
+    for (int i = 0; i < n; i++) {
+        uint8_t d = p[i];
+
+        for (int b = 0; b < 8; b++) {
+            crc <<= 1;
+            if ((d ^ crc) & 0x80)
+                crc ^= 0x09;
+            d <<= 1;
+        }
+    }
+
+    return crc & 0x7f;
+}
+
+// Makes the info from LBA_OPEN describe an SDHC card of the image size,
+// a version 2.0 CSD with C_SIZE set.
+static void set_capacity(uint8_t *info) {
+    static const uint8_t csd_v2[16] = {
+        0x40, 0x0e, 0x00, 0x32, 0x5b, 0x59, 0x00, 0x00,
+        0x00, 0x00, 0x7f, 0x80, 0x0a, 0x40, 0x00, 0x00,
+    };
+    uint32_t c_size = (image_sectors >> CSD_UNIT_SHIFT) - 1;
+    uint8_t *csd = &info[17];
+
+    memcpy(csd, csd_v2, sizeof(csd_v2));
+    csd[7] = (c_size >> 16) & 0x3f;
+    csd[8] = c_size >> 8;
+    csd[9] = c_size;
+    csd[15] = (crc7(csd, 15) << 1) | 1;
+
+    info[0] = SD_TYPE_SDHC;
+}
+
+// Called after sd_spi_open() has filled in info. Maps the image if the
+// card has one and makes info describe it, otherwise leaves the whole
+// card to the Amiga. Fails if the image can't be mapped. FatFS's driver
+// sets the SPI clock of its own.
+int hdf_map_open(uint8_t *info) {
+    FIL fil;
+    bool mounted = false;
+
+    state = MAP_CLOSED;
+
+    FRESULT res = f_open(&fil, HDF_MAP_NAME, FA_READ);
+    if (res == FR_NOT_ENABLED) {
+        f_mount(&fs, "", 0);
+        mounted = true;
+        res = f_open(&fil, HDF_MAP_NAME, FA_READ);
+    }
+
+    int err = SD_OK;
+
+    if (res == FR_OK) {
+        image_sectors = f_size(&fil) / SD_SECTOR_SIZE;
+        image_cluster = fil.obj.sclust;
+
+        if (image_sectors >> CSD_UNIT_SHIFT)
+            err = build_map(&fil);
+        else
+            err = SD_ERROR;
+
+        f_close(&fil);
+
+        if (err == SD_OK)
+            state = MAP_IMAGE;
+    } else if (res == FR_NO_FILE || res == FR_NO_PATH || res == FR_NO_FILESYSTEM) {
+        state = MAP_RAW;
+    } else {
+        err = status(res);
+    }
+
+    if (mounted)
+        f_mount(NULL, "", 0);
+
+    if (state == MAP_IMAGE)
+        set_capacity(info);
+
+    return err;
+}
+
+// Forgets the map after a card change. Until the next hdf_map_open()
+// lookups fail with SD_NO_CARD.
+void hdf_map_reset(void) {
+    state = MAP_CLOSED;
+}
+
+bool hdf_map_active(void) {
+    return state == MAP_IMAGE;
+}
+
+// Gets the card sector of sector lba and the number of sectors from there
+// that follow it on the card.
+int hdf_map_lookup(uint32_t lba, uint32_t *sector, uint32_t *run) {
+    if (state == MAP_CLOSED)
+        return SD_NO_CARD;
+
+    if (state == MAP_RAW) {
+        *sector = lba;
+        *run = UINT32_MAX - lba;
+        return SD_OK;
+    }
+
+    if (lba >= image_sectors)
+        return SD_ERROR;
+
+    // Last run that starts at or before lba
+    uint32_t lo = 0;
+    uint32_t hi = n_extents;
+
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (extents[mid].lba <= lba)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    uint32_t end = lo + 1 < n_extents ? extents[lo + 1].lba : image_sectors;
+
+    *sector = extents[lo].sector + (lba - extents[lo].lba);
+    *run = end - lba;
+    return SD_OK;
+}
+
+// Whether path is the mapped image, which the FILE command mustn't
+// write, truncate, delete or rename. The file is told by its first
+// cluster, so any name FatFS finds it by counts.
+bool hdf_map_is_image(const char *path) {
+    FIL fil;
+
+    if (state != MAP_IMAGE || f_open(&fil, path, FA_READ) != FR_OK)
+        return false;
+
+    bool image = fil.obj.sclust == image_cluster;
+    f_close(&fil);
+    return image;
+}
+
+// Checks that sectors lba to lba + count - 1 can be accessed.
+int hdf_map_check(uint32_t lba, uint32_t count) {
+    if (state == MAP_CLOSED)
+        return SD_NO_CARD;
+
+    if (state == MAP_IMAGE && (lba > image_sectors || count > image_sectors - lba))
+        return SD_ERROR;
+
+    return SD_OK;
+}
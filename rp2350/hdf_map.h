@@ -0,0 +1,51 @@
+/*
+ * hdf_map.h - hard disk image on the SD card as the LBA block device
+ *
+ * With PAR_SPI_HDF, LBA_OPEN looks for an image file in the root
+ * directory of the FAT volume on the card. If there is one, the Amiga
+ * sees the image instead of the whole card: LBA 0 is the first sector of
+ * the file, and the card reported by LBA_OPEN is as large as the file.
+ * The FAT volume stays intact, so the FTP server can back up the image.
+ *
+ * The cluster chain of the file is walked once when the card is opened,
+ * by FatFS fast seek, and kept as a table of runs of consecutive
+ * sectors, so a request never reads the FAT. FatFS is core 1's in the
+ * combined mode, so there is no image there. Without PAR_SPI_HDF, or if
+ * the card has no image, LBAs are card sectors.
+ */
+
+#ifndef HDF_MAP_H
+#define HDF_MAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sd_spi.h"
+
+// Path of the image on the FAT volume
+#ifndef HDF_MAP_NAME
+#define HDF_MAP_NAME        "AMIGA.HDF"
+#endif
+
+#ifdef PAR_SPI_HDF
+int hdf_map_open(uint8_t *info);
+void hdf_map_reset(void);
+bool hdf_map_active(void);
+int hdf_map_lookup(uint32_t lba, uint32_t *sector, uint32_t *run);
+int hdf_map_check(uint32_t lba, uint32_t count);
+bool hdf_map_is_image(const char *path);
+#else
+static inline int hdf_map_open(uint8_t *info) { return SD_OK; }
+static inline void hdf_map_reset(void) {}
+static inline bool hdf_map_active(void) { return false; }
+
+static inline int hdf_map_lookup(uint32_t lba, uint32_t *sector, uint32_t *run) {
+    *sector = lba;
+    *run = UINT32_MAX - lba;
+    return SD_OK;
+}
+
+static inline int hdf_map_check(uint32_t lba, uint32_t count) { return SD_OK; }
+static inline bool hdf_map_is_image(const char *path) { return false; }
+#endif
+
+#endif // HDF_MAP_H
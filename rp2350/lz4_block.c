@@ -0,0 +1,114 @@
+/*
+ * lz4_block.c - LZ4 block compressor, used by compressed LBA reads
+ *
+ * A greedy single pass compressor with a hash table of 4 byte sequences.
+ * It compresses less than the reference implementation but is small and
+ * easily keeps up with reading sectors from the card.
+ */
+
+#include <string.h>
+#include "lz4_block.h"
+
+#define MIN_MATCH       4
+#define LAST_LITERALS   5   // The last 5 bytes of a block are literals
+#define MF_LIMIT        12  // The last match starts 12 bytes before the end
+#define MAX_OFFSET      65535
+#define HASH_BITS       12
+
+// Positions in the block being compressed, which are below 64 kB.
+static uint16_t hash_table[1 << HASH_BITS];
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *op, uint32_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+uint32_t lz4_compress(const uint8_t *in, uint32_t size, uint8_t *out, uint32_t max_out) {
+    const uint8_t *ip = in;
+    const uint8_t *anchor = in;
+    const uint8_t *end = in + size;
+    uint8_t *op = out;
+    uint8_t *op_end = out + max_out;
+
+    memset(hash_table, 0, sizeof(hash_table));
+
+    if (size > MF_LIMIT) {
+        const uint8_t *match_limit = end - LAST_LITERALS;
+        const uint8_t *mf_limit = end - MF_LIMIT;
+
+        while (ip <= mf_limit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash(seq);
+            const uint8_t *ref = in + hash_table[h];
+            hash_table[h] = ip - in;
+
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            const uint8_t *mp = ip + MIN_MATCH;
+            const uint8_t *rp = ref + MIN_MATCH;
+            while (mp < match_limit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            uint32_t lit = ip - anchor;
+            uint32_t mlen = mp - ip - MIN_MATCH;
+
+            // Token, literal length, literals, offset and match length.
+            if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > op_end)
+                return 0;
+
+            uint8_t *token = op++;
+            *token = ((lit >= 15 ? 15 : lit) << 4) | (mlen >= 15 ? 15 : mlen);
+
+            if (lit >= 15)
+                op = put_length(op, lit - 15);
+
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            uint32_t offset = ip - ref;
+            *op++ = offset;
+            *op++ = offset >> 8;
+
+            if (mlen >= 15)
+                op = put_length(op, mlen - 15);
+
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    // The block ends with a sequence of only literals.
+    uint32_t lit = end - anchor;
+    if (op + 1 + lit / 255 + 1 + lit > op_end)
+        return 0;
+
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+
+    if (lit >= 15)
+        op = put_length(op, lit - 15);
+
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    uint32_t n = op - out;
+    return n < max_out ? n : 0;
+}
@@ -0,0 +1,17 @@
+/*
+ * lz4_block.h - LZ4 block compressor, used by compressed LBA reads
+ *
+ * Produces plain LZ4 blocks (no frame header), which spi-lib decodes on
+ * the Amiga with spi_lz4_decode() in spi_low.asm.
+ */
+
+#ifndef LZ4_BLOCK_H
+#define LZ4_BLOCK_H
+
+#include <stdint.h>
+
+// Compresses size bytes (at most 65535) from in to out. Returns the size
+// of the compressed block, or 0 if it wouldn't be smaller than max_out.
+uint32_t lz4_compress(const uint8_t *in, uint32_t size, uint8_t *out, uint32_t max_out);
+
+#endif // LZ4_BLOCK_H
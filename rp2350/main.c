@@ -11,6 +11,9 @@
 #include <lwip/netif.h>
 #include "ff.h"
 #include "hardware/spi.h"
+#ifdef PAR_SPI_NET
+#include "net_bridge.h"
+#endif
 
 static FATFS g_fatfs;
 static bool g_sd_mounted = false;
@@ -57,6 +60,10 @@ void trigger_reboot_to_mode(uint32_t mode_flag) {
 }
 
 void monitor_button_for_mode_switch(uint32_t current_mode) {
+#ifdef PAR_SPI_COMBINED
+    // Both run at once, there is nothing to switch to
+    return;
+#endif
     static bool button_pressed_prev = false;
     static absolute_time_t press_start_time;
     static bool reboot_triggered = false;  // Prevent multiple triggers
@@ -79,6 +86,11 @@ void monitor_button_for_mode_switch(uint32_t current_mode) {
             reboot_triggered = true;  // Set flag to prevent re-trigger
             
             printf("Button held for 3+ seconds! Invoking reboot.\n");
+
+            // Don't lose sector writes the bridge has acknowledged
+            if (current_mode == BOOT_MODE_BARE_METAL)
+                par_spi_flush();
+
             uint32_t next_mode = (current_mode == BOOT_MODE_FREERTOS) ? BOOT_MODE_BARE_METAL : BOOT_MODE_FREERTOS;
             trigger_reboot_to_mode(next_mode);
             // Note: Should never return from trigger_reboot_to_mode (watchdog reboot)
@@ -118,6 +130,7 @@ void ftp_server_application_task(void *pvParameters) {
     // Brief delay to ensure WiFi is fully ready
     vTaskDelay(pdMS_TO_TICKS(1000));
     
+#ifndef PAR_SPI_COMBINED
     // ========================================================================
     // Initialize SPI hardware for SD card access
     // ========================================================================
@@ -143,12 +156,19 @@ void ftp_server_application_task(void *pvParameters) {
     gpio_pull_up(PIN_MISO);
     
     printf("FTP Task: SPI initialized successfully\n");
+#endif
     
     // ========================================================================
     // Mount SD card
     // ========================================================================
     printf("FTP Task: Mounting SD card...\n");
+#ifdef PAR_SPI_COMBINED
+    // Mounted on first use, and again after the card or the Amiga
+    // changed it
+    FRESULT res = f_mount(&g_fatfs, "", 0);
+#else
     FRESULT res = f_mount(&g_fatfs, "", 1);  // 1 = mount now
+#endif
     
     if (res != FR_OK) {
         printf("FTP Task: Failed to mount SD card, error=%d\n", res);
@@ -167,6 +187,7 @@ void ftp_server_application_task(void *pvParameters) {
     g_sd_mounted = true;
     printf("FTP Task: SD card mounted successfully\n");
     
+#ifndef PAR_SPI_COMBINED
     // ========================================================================
     // CRITICAL: Switch SD card to FAST SPI speed for normal operations
     // ========================================================================
@@ -177,6 +198,7 @@ void ftp_server_application_task(void *pvParameters) {
     if (actual < 1000000) {
         printf("FTP Task: WARNING - SPI speed unusually low! Check hardware.\n");
     }
+#endif
     
     // Get filesystem info
     DWORD fre_clust, fre_sect, tot_sect;
@@ -334,12 +356,29 @@ void wifi_management_task(void *pvParameters) {
     printf("WiFi: Netmask:    %s\n", ip4addr_ntoa(netif_ip4_netmask(netif_list)));
     printf("WiFi: Gateway:    %s\n", ip4addr_ntoa(netif_ip4_gw(netif_list)));
     printf("WiFi: Slow blinking LED indicates connected\n");
+
+#ifdef PAR_SPI_NET
+    // The Amiga shares the WiFi from now on
+    net_bridge_start();
+    printf("WiFi: Forwarding Ethernet frames to the Amiga\n");
+#endif
     
     // ========================================================================
     // STEP 5: Create FTP Server Task (on Core 1)
     // ========================================================================
     printf("WiFi: Creating FTP server task on Core 1...\n");
     
+#ifdef PAR_SPI_COMBINED
+    // FreeRTOS only runs on core 1
+    xTaskCreate(
+        ftp_server_application_task, 
+        "FTPTaskCore1", 
+        configMINIMAL_STACK_SIZE + 4096, 
+        NULL,
+        2,
+        NULL
+    );
+#else
     xTaskCreateAffinitySet(
         ftp_server_application_task, 
         "FTPTaskCore1", 
@@ -349,6 +388,7 @@ void wifi_management_task(void *pvParameters) {
         CORE_1_AFFINITY_MASK,
         NULL
     );
+#endif
     
     printf("WiFi: FTP server task created\n");
     
@@ -377,6 +417,32 @@ void wifi_management_task(void *pvParameters) {
     }
 }
 
+#ifdef PAR_SPI_COMBINED
+// -----------------------------------------------------------
+// COMBINED MODE (bridge on core 0, FreeRTOS/FTP on core 1)
+// -----------------------------------------------------------
+static void freertos_core1_entry(void) {
+    xTaskCreate(
+        wifi_management_task, 
+        "WiFiMgrCore1", 
+        configMINIMAL_STACK_SIZE + 4096, 
+        NULL,
+        1,
+        NULL
+    );
+
+    vTaskStartScheduler();
+}
+
+void launch_combined_mode() {
+    printf("Entering combined mode (bridge on Core 0, FreeRTOS on Core 1).\n");
+
+    multicore_launch_core1(freertos_core1_entry);
+
+    // Launch Amiga SPI bridge
+    par_spi_main();
+}
+#else
 // --- RTOS Launcher ---
 void launch_freertos_mode() {
     printf("Entering FreeRTOS mode (Core %d, WiFi Enabled).\n", get_core_num());
@@ -396,6 +462,7 @@ void launch_freertos_mode() {
     vTaskStartScheduler(); 
     // The scheduler takes over permanently.
 }
+#endif
 
 int main() {
     stdio_init_all();
@@ -415,6 +482,9 @@ int main() {
 
     sleep_ms(3000);
 
+#ifdef PAR_SPI_COMBINED
+    launch_combined_mode();
+#else
     // Check if we just rebooted from the watchdog and a flag is set
     if (watchdog_enable_caused_reboot()) {
         uint32_t boot_flag = *BOOT_FLAG_ADDR;
@@ -431,6 +501,7 @@ int main() {
         printf("Normal power-on detected. Launching bare metal.\n");
         launch_bare_metal_mode(); // Or your preferred default mode
     }
+#endif
 
     // Never reached
     return 0;
@@ -13,14 +13,20 @@
 #define PIN_ACT     9       // Output   Active low
 #define PIN_CLK     10      // Input
 #define PIN_REQ     11      // Input    Active low
+#define PIN_STB     12      // Input    Pull-up     /STROBE, optional
 #define PIN_MODE_SW 13      // Input    Pull-up     Mode switch button (3-second hold)
 #define PIN_MISO    16      // Input    Pull-up
 #define PIN_SS      17      // Output   Active low
 #define PIN_SCK     18      // Output
 #define PIN_MOSI    19      // Output
 #define PIN_CDET    20      // Input    Pull-up     Card Detect
+#define PIN_SS1     21      // Output   Active low  Chip select of target 1
+#define PIN_SS2     22      // Output   Active low  Chip select of target 2
+#define PIN_SS3     26      // Output   Active low  Chip select of target 3
 #define PIN_LED     28      // Output   SPI activity indicator
 
+#define SS_MASK     ((1 << PIN_SS) | (1 << PIN_SS1) | (1 << PIN_SS2) | (1 << PIN_SS3))
+
 #define SPI_SLOW_FREQUENCY (400*1000)
 #define SPI_FAST_FREQUENCY (16*1000*1000)
 
@@ -65,6 +71,7 @@
 // Main entry points (defined in main.c)
 void launch_freertos_mode(void);
 void launch_bare_metal_mode(void);
+void launch_combined_mode(void);        // Both at once, PAR_SPI_COMBINED
 void trigger_reboot_to_mode(uint32_t mode_flag);
 void monitor_button_for_mode_switch(uint32_t current_mode);
 void signal_interrupt_to_amiga(void);  // Signal Amiga before mode switch
@@ -76,6 +83,7 @@ void signal_interrupt_to_amiga(void);  // Signal Amiga before mode switch
 // Amiga SPI Bridge (defined in par_spi.c)
 // Runs in BOOT_MODE_BARE_METAL
 void par_spi_main(void);
+void par_spi_flush(void);               // Program buffered SD writes
 
 // FTP Server Functions (defined in ftp_server.c)
 // Runs in BOOT_MODE_FREERTOS
@@ -0,0 +1,257 @@
+/*
+ * net_bridge.c - Ethernet frames between the WiFi and the Amiga
+ *
+ * Frames go through two rings of fixed slots, one per direction, each
+ * with one core writing and the other reading. On core 1 the input
+ * function of the lwIP netif of the CYW43 is wrapped, so a frame is
+ * copied to the receive ring before lwIP gets it, and a task sends what
+ * the Amiga has queued in the transmit ring. Core 0 fills and empties
+ * the rings in NET requests and pulses IRQ for a frame that arrives
+ * while the Amiga waits for one.
+ */
+
+#include "net_bridge.h"
+#include "sd_spi.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#include "pico/cyw43_arch.h"
+#include "lwip/netif.h"
+#include "lwip/pbuf.h"
+#include <string.h>
+#include <FreeRTOS.h>
+#include <task.h>
+
+// How long the transmit task spins for another frame before it sleeps
+#define NET_SPIN_US         200
+
+struct frame {
+    uint16_t len;
+    uint8_t data[NET_FRAME_MAX];
+};
+
+// Written by core 1, read by core 0
+static struct frame rx_ring[NET_RX_FRAMES];
+static volatile uint32_t rx_head;
+static volatile bool online;
+static uint8_t mac[6];
+
+// Written by core 0, read by core 1
+static struct frame tx_ring[NET_TX_FRAMES];
+static volatile uint32_t tx_head;
+static volatile uint32_t rx_tail;
+static volatile uint32_t tx_tail;   // Written by core 1
+static volatile bool opened;
+
+// Set when the Amiga has emptied the receive ring, until IRQ is pulsed
+static volatile bool armed;
+
+static struct net_bridge_stats stats;
+
+// ============================================================================
+// Core 0
+// ============================================================================
+
+static uint32_t get16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+// Queues the frames of params while there are free slots, and replies
+// with how many were taken. The Amiga sends the rest again later.
+static int send_frames(const uint8_t *params, uint32_t size, uint8_t *reply, uint32_t *reply_size) {
+    uint32_t pos = 0;
+    uint32_t accepted = 0;
+    int err = SD_OK;
+
+    while (pos + 2 <= size) {
+        uint32_t len = get16(&params[pos]);
+
+        if (!len || len > NET_FRAME_MAX || pos + 2 + len > size) {
+            err = SD_ERROR;
+            break;
+        }
+
+        if (tx_head - tx_tail >= NET_TX_FRAMES)
+            break;
+
+        struct frame *f = &tx_ring[tx_head % NET_TX_FRAMES];
+        f->len = len;
+        memcpy(f->data, &params[pos + 2], len);
+
+        __dmb();
+        tx_head++;
+
+        pos += 2 + len;
+        accepted++;
+    }
+
+    reply[0] = accepted;
+    *reply_size = 1;
+    return err;
+}
+
+// Replies with a flag byte and as many queued frames as fit. IRQ is
+// pulsed for the next frame unless some are left.
+static int receive_frames(uint8_t *reply, uint32_t reply_max, uint32_t *reply_size) {
+    uint32_t n = 1;
+
+    if (reply_max < NET_FRAME_MAX + 3)
+        return SD_ERROR;
+
+    reply[0] = 0;
+
+    while (rx_tail != rx_head) {
+        __dmb();
+        struct frame *f = &rx_ring[rx_tail % NET_RX_FRAMES];
+
+        if (n + 2 + f->len > reply_max) {
+            reply[0] |= NET_MORE;
+            break;
+        }
+
+        reply[n++] = f->len >> 8;
+        reply[n++] = f->len;
+        memcpy(&reply[n], f->data, f->len);
+        n += f->len;
+
+        __dmb();
+        rx_tail++;
+        stats.rx_frames++;
+    }
+
+    // A frame that came in meanwhile is seen by net_bridge_notify_due()
+    armed = !(reply[0] & NET_MORE);
+
+    *reply_size = n;
+    return SD_OK;
+}
+
+// Runs one request. reply has room for reply_max bytes, which for
+// NET_RECEIVE must be at least NET_FRAME_MAX + 3.
+int net_bridge_request(uint8_t op, const uint8_t *params, uint32_t size,
+                       uint8_t *reply, uint32_t reply_max, uint32_t *reply_size) {
+    *reply_size = 0;
+
+    switch (op) {
+    case NET_OPEN:
+        if (!online)
+            return NET_OFFLINE;
+
+        __dmb();
+        rx_tail = rx_head;
+        opened = true;
+
+        memcpy(reply, mac, 6);
+        *reply_size = 6;
+        return SD_OK;
+
+    case NET_CLOSE:
+        opened = false;
+        armed = false;
+        rx_tail = rx_head;
+        return SD_OK;
+
+    case NET_SEND:
+        if (!opened)
+            return NET_NOT_OPEN;
+        return send_frames(params, size, reply, reply_size);
+
+    case NET_RECEIVE:
+        if (!opened)
+            return NET_NOT_OPEN;
+        return receive_frames(reply, reply_max, reply_size);
+
+    default:
+        return SD_ERROR;
+    }
+}
+
+// True while the Amiga waits for a frame and one is queued
+bool net_bridge_notify_pending(void) {
+    return armed && rx_tail != rx_head;
+}
+
+// Like net_bridge_notify_pending(), but only once per wait, as IRQ is
+// pulsed for it.
+bool net_bridge_notify_due(void) {
+    if (!net_bridge_notify_pending())
+        return false;
+
+    armed = false;
+    return true;
+}
+
+void net_bridge_get_stats(struct net_bridge_stats *s) {
+    *s = stats;
+}
+
+// ============================================================================
+// Core 1
+// ============================================================================
+
+static netif_input_fn wifi_input;
+
+// Queues the frame for the Amiga and passes it on to lwIP. A frame the
+// ring has no room for is dropped, as on a busy Ethernet.
+static err_t bridge_input(struct pbuf *p, struct netif *netif) {
+    if (opened && p->tot_len <= NET_FRAME_MAX) {
+        if (rx_head - rx_tail < NET_RX_FRAMES) {
+            struct frame *f = &rx_ring[rx_head % NET_RX_FRAMES];
+            f->len = pbuf_copy_partial(p, f->data, p->tot_len, 0);
+
+            __dmb();
+            rx_head++;
+
+            // Core 0 may be asleep
+            __sev();
+        } else {
+            stats.rx_dropped++;
+        }
+    }
+
+    return wifi_input(p, netif);
+}
+
+static void tx_task(void *params) {
+    uint32_t idle = time_us_32();
+
+    while (1) {
+        if (tx_tail == tx_head) {
+            if (time_us_32() - idle >= NET_SPIN_US)
+                vTaskDelay(1);
+            continue;
+        }
+
+        __dmb();
+        struct frame *f = &tx_ring[tx_tail % NET_TX_FRAMES];
+
+        cyw43_arch_lwip_begin();
+        int err = cyw43_send_ethernet(&cyw43_state, CYW43_ITF_STA, f->len, f->data, false);
+        cyw43_arch_lwip_end();
+
+        if (err)
+            stats.tx_dropped++;
+        else
+            stats.tx_frames++;
+
+        __dmb();
+        tx_tail++;
+        idle = time_us_32();
+    }
+}
+
+// Starts forwarding, once the WiFi is connected.
+void net_bridge_start(void) {
+    struct netif *netif = &cyw43_state.netif[CYW43_ITF_STA];
+
+    memcpy(mac, cyw43_state.mac, sizeof(mac));
+
+    cyw43_arch_lwip_begin();
+    wifi_input = netif->input;
+    netif->input = bridge_input;
+    cyw43_arch_lwip_end();
+
+    xTaskCreate(tx_task, "NetTx", configMINIMAL_STACK_SIZE + 512, NULL, 2, NULL);
+
+    __dmb();
+    online = true;
+}
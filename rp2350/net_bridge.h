@@ -0,0 +1,67 @@
+/*
+ * net_bridge.h - Ethernet frames between the WiFi and the Amiga
+ *
+ * In the combined mode core 1 runs the CYW43 and lwIP for the FTP
+ * server. With PAR_SPI_NET every frame the WiFi receives is also queued
+ * for the Amiga, and frames from the Amiga are sent on the WiFi as they
+ * are. The Amiga has a network stack of its own with a SANA-II driver,
+ * and shares the MAC address of the CYW43, which is the only one a WiFi
+ * station may send from. It needs an IP address other than the FTP
+ * server's.
+ *
+ * The NET command moves several frames per request in either direction,
+ * each as a 16 bit length and the frame without the FCS. When the Amiga
+ * finds nothing to receive, the next frame pulses IRQ.
+ */
+
+#ifndef NET_BRIDGE_H
+#define NET_BRIDGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Largest frame, with a VLAN tag but without the FCS
+#define NET_FRAME_MAX       1518
+
+// Frames queued in each direction
+#ifndef NET_RX_FRAMES
+#define NET_RX_FRAMES       16
+#endif
+#ifndef NET_TX_FRAMES
+#define NET_TX_FRAMES       8
+#endif
+
+// Largest parameter block and reply of a NET request
+#define NET_BATCH_MAX       8192
+
+#define NET_OPEN            0   // () -> (mac[6])
+#define NET_CLOSE           1   // () -> ()
+#define NET_SEND            2   // (frames) -> (accepted)
+#define NET_RECEIVE         3   // () -> (flags, frames)
+
+// Status codes after SD_OK and SD_ERROR
+#define NET_OFFLINE         3   // Not connected to the WiFi network
+#define NET_NOT_OPEN        4
+
+// Flags at the start of a NET_RECEIVE reply
+#define NET_MORE            0x01    // Frames are left that didn't fit
+#define NET_CARD_CHANGED    0x02    // CARD_PRESENT would report a change
+
+struct net_bridge_stats {
+    uint32_t rx_frames;
+    uint32_t rx_dropped;
+    uint32_t tx_frames;
+    uint32_t tx_dropped;
+};
+
+// Core 0
+int net_bridge_request(uint8_t op, const uint8_t *params, uint32_t size,
+                       uint8_t *reply, uint32_t reply_max, uint32_t *reply_size);
+bool net_bridge_notify_pending(void);
+bool net_bridge_notify_due(void);
+void net_bridge_get_stats(struct net_bridge_stats *stats);
+
+// Core 1
+void net_bridge_start(void);
+
+#endif // NET_BRIDGE_H
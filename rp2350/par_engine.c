@@ -0,0 +1,145 @@
+/*
+ * par_engine.c - PIO and DMA engine for the byte-pump READ/WRITE transfers
+ *
+ * On a read, one DMA channel feeds the SPI data register from the
+ * request words par_read pushes, one per byte driven, and the other
+ * moves the bytes clocked in to the TX FIFO of par_read. The CPU starts
+ * the first PAR_READ_AHEAD bytes itself. The transfer is done when the
+ * request channel has finished and the rest of the requests, which it
+ * wasn't asked to move, are all in the RX FIFO.
+ *
+ * On a write, one channel moves the bytes par_write samples to the SPI
+ * data register and the other empties the SPI RX FIFO. The Amiga can't
+ * send bytes faster than SPI clocks them out at the speed it has asked
+ * for, so the SPI TX FIFO never fills. The transfer is done when the
+ * last byte has been clocked out.
+ */
+
+#include "par_engine.h"
+#include "hardware/dma.h"
+#include "hardware/gpio.h"
+#include "hardware/pio.h"
+#include "par_engine.pio.h"
+
+#define PIN_DATA        0
+#define DATA_MASK       0xff
+
+// On the RP2350 PIO0 is used by WiFi and PIO1 has the ACT mirror
+#if NUM_PIOS > 2
+#define PAR_PIO         pio2
+#else
+#define PAR_PIO         pio0
+#endif
+
+static spi_inst_t *par_spi;
+static uint par_pin_req;
+
+static uint sm_read;
+static uint sm_write;
+static uint read_offset;
+static uint write_offset;
+
+static int spi_tx_chan;        // Into the SPI data register
+static int spi_rx_chan;        // Out of the SPI data register
+
+static uint32_t write_sink;
+
+void par_engine_init(spi_inst_t *spi, uint pin_clk, uint pin_req) {
+    par_spi = spi;
+    par_pin_req = pin_req;
+
+    read_offset = pio_add_program(PAR_PIO, &par_read_program);
+    write_offset = pio_add_program(PAR_PIO, &par_write_program);
+    sm_read = pio_claim_unused_sm(PAR_PIO, true);
+    sm_write = pio_claim_unused_sm(PAR_PIO, true);
+    par_read_program_init(PAR_PIO, sm_read, read_offset, PIN_DATA, pin_clk);
+    par_write_program_init(PAR_PIO, sm_write, write_offset, PIN_DATA, pin_clk);
+
+    spi_tx_chan = dma_claim_unused_channel(true);
+    spi_rx_chan = dma_claim_unused_channel(true);
+}
+
+static void start_dma(int chan, volatile void *write, const volatile void *read,
+                      uint32_t count, uint dreq) {
+    dma_channel_config c = dma_channel_get_default_config(chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, dreq);
+    dma_channel_configure(chan, &c, write, read, count, true);
+}
+
+static void start_sm(uint sm, uint entry) {
+    pio_sm_clear_fifos(PAR_PIO, sm);
+    pio_sm_restart(PAR_PIO, sm);
+    pio_sm_exec(PAR_PIO, sm, pio_encode_jmp(entry));
+    gpio_set_function_masked(DATA_MASK << PIN_DATA, PIO_FUNCSEL_NUM(PAR_PIO, PIN_DATA));
+    pio_sm_set_enabled(PAR_PIO, sm, true);
+}
+
+// Waits for done() or for the Amiga to release REQ, false on the latter.
+static bool wait_done(bool (*done)(uint32_t), uint32_t arg) {
+    while (!done(arg)) {
+        if (gpio_get_all() & (1 << par_pin_req))
+            return false;
+    }
+    return true;
+}
+
+static void stop(uint sm) {
+    pio_sm_set_enabled(PAR_PIO, sm, false);
+    gpio_set_function_masked(DATA_MASK << PIN_DATA, GPIO_FUNC_SIO);
+    pio_sm_set_pindirs_with_mask(PAR_PIO, sm, 0, DATA_MASK << PIN_DATA);
+    pio_sm_clear_fifos(PAR_PIO, sm);
+
+    dma_channel_abort(spi_tx_chan);
+    dma_channel_abort(spi_rx_chan);
+
+    while (spi_is_busy(par_spi))
+        tight_loop_contents();
+
+    while (spi_is_readable(par_spi))
+        (void)spi_get_hw(par_spi)->dr;
+}
+
+static bool read_done(uint32_t ahead) {
+    return !dma_channel_is_busy(spi_tx_chan) &&
+           pio_sm_get_rx_fifo_level(PAR_PIO, sm_read) >= ahead;
+}
+
+bool par_engine_read(uint32_t prev_clk, uint32_t count) {
+    uint32_t ahead = count < PAR_READ_AHEAD ? count : PAR_READ_AHEAD;
+
+    start_dma(spi_rx_chan, &PAR_PIO->txf[sm_read], &spi_get_hw(par_spi)->dr,
+              count, spi_get_dreq(par_spi, false));
+
+    if (count > ahead)
+        start_dma(spi_tx_chan, &spi_get_hw(par_spi)->dr, &PAR_PIO->rxf[sm_read],
+                  count - ahead, pio_get_dreq(PAR_PIO, sm_read, false));
+
+    for (uint32_t i = 0; i < ahead; i++)
+        spi_get_hw(par_spi)->dr = 0xff;
+
+    start_sm(sm_read, read_offset + (prev_clk ? par_read_offset_high_first :
+                                                par_read_offset_low_first));
+    bool completed = wait_done(read_done, ahead);
+    stop(sm_read);
+    return completed;
+}
+
+static bool write_done(uint32_t unused) {
+    return !dma_channel_is_busy(spi_rx_chan);
+}
+
+bool par_engine_write(uint32_t prev_clk, uint32_t count) {
+    start_dma(spi_rx_chan, &write_sink, &spi_get_hw(par_spi)->dr,
+              count, spi_get_dreq(par_spi, false));
+    start_dma(spi_tx_chan, &spi_get_hw(par_spi)->dr, &PAR_PIO->rxf[sm_write],
+              count, pio_get_dreq(PAR_PIO, sm_write, false));
+
+    start_sm(sm_write, write_offset + (prev_clk ? par_write_offset_high :
+                                                  par_write_offset_low));
+    bool completed = wait_done(write_done, 0);
+    stop(sm_write);
+    return completed;
+}
@@ -16,6 +16,7 @@
  * - 3-second button hold triggers watchdog reboot to FreeRTOS mode
  */
 
+#include <string.h>
 #include "main.h"
 #include "pico/stdlib.h"
 #include "hardware/gpio.h"
@@ -23,81 +24,1488 @@
 #include "hardware/pio.h"
 #include "hardware/irq.h"
 #include "hardware/sync.h"
+#include "hardware/clocks.h"
 #include "pico/time.h"
 #include "act_mirror.pio.h"
+#include "irq_pulse.pio.h"
+#include "sd_spi.h"
+#include "spi_prefetch.h"
+#include "telemetry.h"
+#include "lz4_block.h"
+#include "sd_cache.h"
+#include "hdf_map.h"
+#ifdef PAR_SPI_FILES
+#include "sd_files.h"
+#endif
+#ifdef PAR_SPI_PIO
+#include "par_engine.h"
+#endif
+#ifdef PAR_SPI_PIPE
+#include "spi_pipe.h"
+#endif
+#ifdef PAR_SPI_PROFILE
+#include "hardware/structs/m33.h"
+#endif
+#ifdef PAR_SPI_TRACE
+#include "trace.h"
+#endif
+#ifdef PAR_SPI_COMBINED
+#include "sd_share.h"
+#endif
+#ifdef PAR_SPI_NET
+#include "net_bridge.h"
+#endif
 
 static uint32_t prev_cdet;
 static volatile bool req_triggered = false;
 static volatile bool card_detect_enabled = true;
+static bool strobe_mode;
 
-// Card detect debouncing (prevents spurious interrupts from mechanical bouncing)
+// Set when IRQ is pulsed for a card change, reported by CARD_PRESENT.
+static volatile bool card_changed;
+
+// Set on a card change until the main loop has dropped the cache.
+static volatile bool cache_stale;
+
+// Set by NOTIFY_READY until the card reads ready or the limit passes.
+static volatile bool notify_armed;
+static uint32_t notify_start;
+static uint32_t notify_limit;
+
+// Card detect is sampled by a timer and reported once it has read the
+// same for CARD_DETECT_DEBOUNCE_MS (prevents spurious reports from
+// mechanical bouncing)
+#define CARD_DETECT_POLL_MS     10
 #define CARD_DETECT_DEBOUNCE_MS 50  // 50ms debounce time
-static volatile uint32_t last_card_detect_time = 0;
+static struct repeating_timer card_detect_timer;
+static uint32_t cdet_sample;
+static uint32_t cdet_stable_ms;
+
+// IRQ pulses come from a PIO state machine, so nothing waits them out
+#define IRQ_PULSE_US        10
+static uint irq_pulse_sm;
+static uint32_t irq_pulse_cycles;
+
+static inline void pulse_irq() {
+    pio_sm_put(pio1, irq_pulse_sm, irq_pulse_cycles);
+}
+
+// Button monitoring interval (check button every 100ms when idle)
+#define BUTTON_CHECK_INTERVAL_MS 100
+static absolute_time_t last_button_check_time;
+
+#ifdef PAR_SPI_LOW_LATENCY
+// The request path runs from SRAM, so its timing doesn't depend on the
+// XIP cache. The main loop spins on REQ instead of waiting for the
+// interrupt, and a timer says when the button is due.
+#define REQUEST_FUNC(name) __not_in_flash_func(name)
+
+static struct repeating_timer button_timer;
+static volatile bool button_check_due;
+
+static bool button_timer_callback(struct repeating_timer *timer) {
+    button_check_due = true;
+    return true;
+}
+
+// Core 1 waiting for the SD card also ends the spin
+static inline bool share_wanted() {
+#ifdef PAR_SPI_COMBINED
+    return sd_share_wanted();
+#else
+    return false;
+#endif
+}
+
+// So does a frame the Amiga is waiting for
+static inline bool net_wanted() {
+#ifdef PAR_SPI_NET
+    return net_bridge_notify_pending();
+#else
+    return false;
+#endif
+}
+#else
+#define REQUEST_FUNC(name) name
+#endif
+
+#ifdef PAR_SPI_PROFILE
+// CPU cycles printed by the main loop when idle: from seeing a CLK edge
+// in a READ/WRITE transfer until the loop is watching CLK again, and from
+// noticing REQ, in the interrupt handler or the spin loop, until the
+// command byte has been read.
+struct profile_stat {
+    uint32_t count;
+    uint32_t cycles;
+    uint32_t max;
+};
+
+static struct profile_stat clk_stat;
+static struct profile_stat req_stat;
+static uint32_t clk_edge;
+static uint32_t req_seen;
+
+#define PROFILE_START()     (clk_edge = 0)
+#define PROFILE_EDGE()      (clk_edge = m33_hw->dwt_cyccnt)
+#define PROFILE_READY()     profile_ready()
+#define PROFILE_REQ()       (req_seen = m33_hw->dwt_cyccnt)
+#define PROFILE_COMMAND()   profile_add(&req_stat, req_seen)
+
+static inline void profile_add(struct profile_stat *stat, uint32_t start) {
+    uint32_t cycles = m33_hw->dwt_cyccnt - start;
+    stat->count++;
+    stat->cycles += cycles;
+    if (cycles > stat->max)
+        stat->max = cycles;
+}
+
+static inline void profile_ready() {
+    if (!clk_edge)
+        return;
+
+    profile_add(&clk_stat, clk_edge);
+    clk_edge = 0;
+}
+
+static void profile_print(const char *name, struct profile_stat *stat) {
+    if (!stat->count)
+        return;
+
+    printf("%s: %lu, avg %lu, max %lu cycles\n",
+           name, stat->count, stat->cycles / stat->count, stat->max);
+    stat->count = stat->cycles = stat->max = 0;
+}
+
+static void profile_report() {
+    profile_print("REQ to command", &req_stat);
+    profile_print("CLK edge to ready", &clk_stat);
+}
+#else
+#define PROFILE_START()
+#define PROFILE_EDGE()
+#define PROFILE_READY()
+#define PROFILE_REQ()
+#define PROFILE_COMMAND()
+#endif
+
+/*
+ * EXCLUSIVE GPIO interrupt handler 
+ * Handles REQ only (time-critical), card detect is polled by a timer
+ */
+void __not_in_flash_func(gpio_irq_exclusive_handler)(void) {
+    uint32_t start = telemetry_now();
+    uint32_t events_req = gpio_get_irq_event_mask(PIN_REQ);
+    
+    // Handle REQ interrupt (time-critical, no debouncing)
+    if (events_req) {
+        gpio_acknowledge_irq(PIN_REQ, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL);
+        
+        if (events_req & GPIO_IRQ_EDGE_FALL) {
+            // REQ went low - transfer starting
+            PROFILE_REQ();
+            telemetry_req_noticed();
+            req_triggered = true;
+            
+            // Disable card detect during transfer (matches AVR)
+            card_detect_enabled = false;
+        }
+        
+        if (events_req & GPIO_IRQ_EDGE_RISE) {
+            // REQ went high - transfer ending
+            // Re-enable card detect when idle
+            card_detect_enabled = true;
+        }
+    }
+
+    telemetry_irq(start);
+}
+
+// Runs from the timer interrupt, below the REQ interrupt. A change seen
+// during a transfer is reported once REQ is released.
+static bool card_detect_callback(struct repeating_timer *timer) {
+    uint32_t cdet = gpio_get_all() & (1 << PIN_CDET);
+
+    if (cdet != cdet_sample) {
+        cdet_sample = cdet;
+        cdet_stable_ms = 0;
+        return true;
+    }
+
+    if (cdet == prev_cdet || !card_detect_enabled)
+        return true;
+
+    cdet_stable_ms += CARD_DETECT_POLL_MS;
+    if (cdet_stable_ms < CARD_DETECT_DEBOUNCE_MS)
+        return true;
+
+    // Card inserted or removed - signal Amiga
+    prev_cdet = cdet;
+    card_changed = true;
+    cache_stale = true;
+    notify_armed = false;
+    pulse_irq();
+    return true;
+}
+
+// CIA-A pulses /STROBE low after every access to the data port. The falling
+// edge is latched in the raw interrupt status register even though the
+// interrupt is never enabled, so a short pulse can't slip between two polls.
+static inline bool strobe_edge_seen() {
+    return io_bank0_hw->intr[PIN_STB / 8] & (GPIO_IRQ_EDGE_FALL << (4 * (PIN_STB % 8)));
+}
+
+static inline void strobe_edge_clear() {
+    gpio_acknowledge_irq(PIN_STB, GPIO_IRQ_EDGE_FALL);
+}
+
+// The falling edge of REQ is latched the same way, so the low latency
+// main loop can spin on it with the REQ interrupt disabled.
+static inline bool req_edge_seen() {
+    return io_bank0_hw->intr[PIN_REQ / 8] & (GPIO_IRQ_EDGE_FALL << (4 * (PIN_REQ % 8)));
+}
+
+static inline void req_edge_clear() {
+    gpio_acknowledge_irq(PIN_REQ, GPIO_IRQ_EDGE_FALL);
+}
+
+// Turns the REQ interrupt of core 0 on or off without acknowledging the
+// latched edge, as gpio_set_irq_enabled() would. An edge seen since the
+// last req_edge_seen() then raises the interrupt as soon as it is on.
+static inline void req_irq_enable(bool enable) {
+    io_rw_32 *inte = &io_bank0_hw->proc0_irq_ctrl.inte[PIN_REQ / 8];
+    uint32_t mask = GPIO_IRQ_EDGE_FALL << (4 * (PIN_REQ % 8));
+
+    if (enable)
+        hw_set_bits(inte, mask);
+    else
+        hw_clear_bits(inte, mask);
+}
+
+// Waits for the Amiga to toggle CLK. Returns false if REQ was released.
+static inline bool wait_clk(uint32_t *pins, uint32_t *prev_clk) {
+    while (1) {
+        *pins = gpio_get_all();
+        if ((*pins & (1 << PIN_CLK)) != *prev_clk)
+            break;
+
+        if (*pins & (1 << PIN_REQ)) {
+            telemetry_abort();
+            return false;
+        }
+    }
+
+    *prev_clk = *pins & (1 << PIN_CLK);
+    return true;
+}
+
+// Waits for the Amiga to access the data port. Returns false if REQ was released.
+static inline bool wait_strobe() {
+    while (!strobe_edge_seen()) {
+        if (gpio_get_all() & (1 << PIN_REQ)) {
+            telemetry_abort();
+            return false;
+        }
+    }
+
+    strobe_edge_clear();
+    return true;
+}
+
+static void REQUEST_FUNC(read_strobe)(uint32_t pins, uint32_t prev_clk, uint32_t byte_count) {
+    uint32_t prev_ss = pins & SS_MASK;
+    uint32_t spi_wait = 0;
+
+    spi_prefetch_start(byte_count + 1);
+
+    // The first byte is still clocked by CLK, since the Amiga has to
+    // turn the data port around before it can start reading.
+    if (wait_clk(&pins, &prev_clk)) {
+        strobe_edge_clear();
+        gpio_put_all(prev_ss | spi_prefetch_get(0));
+        gpio_set_dir_out_masked(0xff);
+
+        for (uint32_t i = 1; i <= byte_count; i++) {
+            uint32_t start = telemetry_now();
+            uint32_t value = spi_prefetch_get(i);
+            spi_wait += telemetry_now() - start;
+
+            if (!wait_strobe())
+                break;
+
+            gpio_put_all(prev_ss | value);
+        }
+    }
+
+    spi_prefetch_finish();
+    telemetry_spi_wait(spi_wait);
+}
+
+static void REQUEST_FUNC(write_strobe)(uint32_t byte_count) {
+    uint32_t spi_wait = 0;
+
+    while (1) {
+        if (!wait_strobe())
+            break;
+
+        spi_get_hw(spi0)->dr = gpio_get_all() & 0xff;
+
+        uint32_t start = telemetry_now();
+
+        while (!spi_is_readable(spi0))
+            tight_loop_contents();
+
+        spi_wait += telemetry_now() - start;
+        (void)spi_get_hw(spi0)->dr;
+
+        if (!byte_count)
+            break;
+
+        byte_count--;
+    }
+
+    telemetry_spi_wait(spi_wait);
+}
+
+#ifdef PAR_SPI_PIPE
+// READ and WRITE with core 1 on the SPI side. CLK is answered from the
+// ring, and only waits if core 1 falls a whole ring behind.
+static void REQUEST_FUNC(read_pipe)(uint32_t pins, uint32_t prev_clk, uint32_t byte_count) {
+    uint32_t prev_ss = pins & SS_MASK;
+    uint32_t value;
+    uint32_t spi_wait = 0;
+    bool done = false;
+
+    spi_pipe_read(byte_count + 1);
+    PROFILE_START();
+
+    while (wait_clk(&pins, &prev_clk)) {
+        PROFILE_EDGE();
+        uint32_t start = telemetry_now();
+
+        while (!spi_pipe_get(&spi_pipe_rx, &value))
+            tight_loop_contents();
+
+        spi_wait += telemetry_now() - start;
+        gpio_put_all(prev_ss | value);
+        gpio_set_dir_out_masked(0xff);
+        PROFILE_READY();
+
+        if (!byte_count) {
+            done = true;
+            break;
+        }
+
+        byte_count--;
+    }
+
+    spi_pipe_finish(!done);
+    telemetry_spi_wait(spi_wait);
+}
+
+static void REQUEST_FUNC(write_pipe)(uint32_t pins, uint32_t prev_clk, uint32_t byte_count) {
+    uint32_t spi_wait = 0;
+    bool done = false;
+
+    spi_pipe_write(byte_count + 1);
+    PROFILE_START();
+
+    while (1) {
+        uint32_t start = telemetry_now();
+
+        // Only waits when the SPI bus is slower than the Amiga
+        while (spi_pipe_used(&spi_pipe_tx) >= SPI_PIPE_WRITE_AHEAD)
+            tight_loop_contents();
+
+        spi_wait += telemetry_now() - start;
+
+        if (!wait_clk(&pins, &prev_clk))
+            break;
+
+        PROFILE_EDGE();
+        spi_pipe_put(&spi_pipe_tx, pins & 0xff);
+        PROFILE_READY();
+
+        if (!byte_count) {
+            done = true;
+            break;
+        }
+
+        byte_count--;
+    }
+
+    spi_pipe_finish(!done);
+    telemetry_spi_wait(spi_wait);
+}
+#endif
+
+#define TARGET_COUNT        4
+
+// Each chip select remembers its SPI clock, SPI mode (CPOL << 1 | CPHA)
+// and transfer mode. SPEED, SPEED_TIER, SPI_MODE and XFER_MODE change
+// those of the active target, and TARGET switches between them.
+struct target {
+    uint pin;
+    uint32_t baud;
+    uint8_t mode;
+    bool strobe;
+};
+
+static struct target targets[TARGET_COUNT] = {
+    { PIN_SS, SPI_SLOW_FREQUENCY, 0, false },
+    { PIN_SS1, SPI_SLOW_FREQUENCY, 0, false },
+    { PIN_SS2, SPI_SLOW_FREQUENCY, 0, false },
+    { PIN_SS3, SPI_SLOW_FREQUENCY, 0, false },
+};
+
+static struct target *active_target = &targets[0];
+
+static void REQUEST_FUNC(set_spi_mode)(uint8_t mode) {
+    spi_set_format(spi0, 8,
+            mode & 2 ? SPI_CPOL_1 : SPI_CPOL_0,
+            mode & 1 ? SPI_CPHA_1 : SPI_CPHA_0,
+            SPI_MSB_FIRST);
+}
+
+// Releases all chip selects and applies the settings of target t.
+static void REQUEST_FUNC(use_target)(uint32_t t) {
+    struct target *next = &targets[t];
+
+    gpio_put_masked(SS_MASK, SS_MASK);
+
+    if (next == active_target)
+        return;
+
+    active_target->baud = spi_get_baudrate(spi0);
+    active_target->strobe = strobe_mode;
+
+    spi_set_baudrate(spi0, next->baud);
+    if (next->mode != active_target->mode)
+        set_spi_mode(next->mode);
+    strobe_mode = next->strobe;
+
+    active_target = next;
+}
+
+#define BATCH_MAX_SEGMENTS  16
+#define BATCH_MAX_BYTES     1024
+
+#define STATUS_BUSY         0x5a
+#define STATUS_OK           0x00
+#define STATUS_TIMEOUT      0x01
+
+#define SEG_WRITE           0
+#define SEG_READ            1
+#define SEG_SELECT          2
+#define SEG_DESELECT        3
+#define SEG_POLL            4
+
+#define BATCH_SELECT        1
+#define BATCH_DESELECT      2
+
+#define POLL_MISMATCH       1
+#define POLL_BYTES          2
+
+struct batch_segment {
+    uint8_t type;
+    uint8_t mask;
+    uint8_t value;
+    uint8_t flags;
+    uint16_t size;
+};
+
+static struct batch_segment batch_segs[BATCH_MAX_SEGMENTS];
+static uint8_t batch_buf[BATCH_MAX_BYTES];
+
+static inline bool read_byte(uint32_t *pins, uint32_t *prev_clk, uint8_t *value) {
+    if (!wait_clk(pins, prev_clk))
+        return false;
+
+    *value = *pins & 0xff;
+    return true;
+}
+
+// Reads bytes until (byte & mask) == value, or != value with POLL_MISMATCH.
+// Gives up after limit ms, or limit bytes with POLL_BYTES.
+static bool REQUEST_FUNC(poll_spi)(uint8_t mask, uint8_t value, uint8_t flags, uint32_t limit, uint8_t *result) {
+    bool mismatch = flags & POLL_MISMATCH;
+    uint32_t start = time_us_32();
+    uint32_t count = 0;
+    uint8_t byte;
+
+    while (1) {
+        spi_read_blocking(spi0, 0xff, &byte, 1);
+        count++;
+
+        if (((byte & mask) == value) != mismatch)
+            break;
+
+        if (flags & POLL_BYTES) {
+            if (count >= limit)
+                break;
+        } else if (time_us_32() - start >= limit * 1000) {
+            break;
+        }
+    }
+
+    *result = byte;
+    return ((byte & mask) == value) != mismatch;
+}
+
+// Returns the index of a poll that timed out, or count if all segments ran.
+static uint32_t REQUEST_FUNC(run_batch)(uint8_t flags, uint32_t count, uint32_t write_bytes) {
+    const uint8_t *src = batch_buf;
+    uint8_t *dst = batch_buf + write_bytes;
+    uint32_t i;
+
+    if (flags & BATCH_SELECT)
+        gpio_put(active_target->pin, 0);
+
+    for (i = 0; i < count; i++) {
+        struct batch_segment *seg = &batch_segs[i];
+
+        switch (seg->type) {
+            case SEG_WRITE:
+                spi_write_blocking(spi0, src, seg->size);
+                src += seg->size;
+                break;
+            case SEG_READ:
+                spi_read_blocking(spi0, 0xff, dst, seg->size);
+                dst += seg->size;
+                break;
+            case SEG_SELECT:
+                gpio_put(active_target->pin, 0);
+                break;
+            case SEG_DESELECT:
+                gpio_put(active_target->pin, 1);
+                break;
+            case SEG_POLL:
+                if (!poll_spi(seg->mask, seg->value, seg->flags, seg->size, dst++))
+                    goto out;
+                break;
+        }
+    }
+
+out:
+    if (flags & BATCH_DESELECT)
+        gpio_put(active_target->pin, 1);
+
+    return i;
+}
+
+// The Amiga writes flags, segment count, segment descriptors (type and
+// size, followed by mask, value and flags for polls) and all write
+// payloads. After the turnaround CLK the port is driven with STATUS_BUSY
+// while the segments run, then with the status byte, and then the read
+// data is clocked out one byte per CLK toggle.
+static void REQUEST_FUNC(handle_batch)(uint32_t pins, uint32_t prev_clk) {
+    uint8_t flags;
+    uint8_t count;
+
+    if (!read_byte(&pins, &prev_clk, &flags))
+        return;
+
+    if (!read_byte(&pins, &prev_clk, &count))
+        return;
+
+    // Never drive the port for a batch that can't be run. The Amiga reads
+    // an undriven port as 0xff and falls back to single transfers.
+    if (count > BATCH_MAX_SEGMENTS)
+        return;
+
+    uint32_t write_bytes = 0;
+    uint32_t read_bytes = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct batch_segment *seg = &batch_segs[i];
+        uint8_t hi, lo;
+
+        if (!read_byte(&pins, &prev_clk, &seg->type) ||
+                !read_byte(&pins, &prev_clk, &hi) ||
+                !read_byte(&pins, &prev_clk, &lo))
+            return;
+
+        seg->size = (hi << 8) | lo;
+
+        if (seg->type == SEG_POLL) {
+            if (!read_byte(&pins, &prev_clk, &seg->mask) ||
+                    !read_byte(&pins, &prev_clk, &seg->value) ||
+                    !read_byte(&pins, &prev_clk, &seg->flags))
+                return;
+
+            read_bytes++;
+        } else if (seg->type == SEG_WRITE) {
+            write_bytes += seg->size;
+        } else if (seg->type == SEG_READ) {
+            read_bytes += seg->size;
+        }
+    }
+
+    if (write_bytes + read_bytes > BATCH_MAX_BYTES)
+        return;
+
+    for (uint32_t i = 0; i < write_bytes; i++) {
+        if (!read_byte(&pins, &prev_clk, &batch_buf[i]))
+            return;
+    }
+
+    if (!wait_clk(&pins, &prev_clk))
+        return;
+
+    gpio_put_masked(0xff, STATUS_BUSY);
+    gpio_set_dir_out_masked(0xff);
+
+    uint32_t done = run_batch(flags, count, write_bytes);
+
+    gpio_put_masked(0xff, done == count ? STATUS_OK : 0x80 | done);
+
+    for (uint32_t i = 0; i < read_bytes; i++) {
+        if (!wait_clk(&pins, &prev_clk))
+            return;
+
+        gpio_put_masked(0xff, batch_buf[write_bytes + i]);
+    }
+}
+
+// The Amiga writes mask, value, flags and a 16 bit limit. After the
+// turnaround CLK the port is driven with STATUS_BUSY while polling, then
+// with the status byte, and on the next CLK toggle with the last byte read.
+static void REQUEST_FUNC(handle_poll)(uint32_t pins, uint32_t prev_clk) {
+    uint8_t mask, value, flags, hi, lo;
+    uint8_t result;
+
+    if (!read_byte(&pins, &prev_clk, &mask) ||
+            !read_byte(&pins, &prev_clk, &value) ||
+            !read_byte(&pins, &prev_clk, &flags) ||
+            !read_byte(&pins, &prev_clk, &hi) ||
+            !read_byte(&pins, &prev_clk, &lo))
+        return;
+
+    if (!wait_clk(&pins, &prev_clk))
+        return;
+
+    gpio_put_masked(0xff, STATUS_BUSY);
+    gpio_set_dir_out_masked(0xff);
+
+    bool matched = poll_spi(mask, value, flags, (hi << 8) | lo, &result);
+
+    gpio_put_masked(0xff, matched ? STATUS_OK : STATUS_TIMEOUT);
+
+    if (!wait_clk(&pins, &prev_clk))
+        return;
+
+    gpio_put_masked(0xff, result);
+}
+
+#define LBA_OPEN            0
+#define LBA_READ            1
+#define LBA_WRITE           2
+#define LBA_READ_UNIFORM    3
+#define LBA_FILL            4
+#define LBA_READ_LZ4        5
+#define LBA_SYNC            6
+
+// Status of a sector that is sent as a single value byte.
+#define LBA_UNIFORM         0x10
+
+// Status of a block of sectors that is sent LZ4 compressed.
+#define LBA_LZ4             0x11
+
+#define LZ4_BLOCK_SECTORS   8
+#define LZ4_BLOCK_SIZE      (LZ4_BLOCK_SECTORS * SD_SECTOR_SIZE)
+
+static uint8_t lz4_in[LZ4_BLOCK_SIZE];
+static uint8_t lz4_out[LZ4_BLOCK_SIZE];
+
+// Sends a whole sector, as LBA_UNIFORM followed by the value if all its
+// bytes are the same, otherwise as STATUS_OK followed by the data.
+static bool REQUEST_FUNC(send_sector_uniform)(uint32_t *pins, uint32_t *prev_clk, const uint8_t *data) {
+    bool uniform = true;
+
+    for (int j = 1; j < SD_SECTOR_SIZE && uniform; j++)
+        uniform = data[j] == data[0];
+
+    gpio_put_masked(0xff, uniform ? LBA_UNIFORM : STATUS_OK);
+
+    int size = uniform ? 1 : SD_SECTOR_SIZE;
+
+    for (int j = 0; j < size; j++) {
+        if (!wait_clk(pins, prev_clk))
+            return false;
+
+        gpio_put_masked(0xff, data[j]);
+    }
+
+    return true;
+}
+
+static bool REQUEST_FUNC(send_bytes)(uint32_t *pins, uint32_t *prev_clk, const uint8_t *buf, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+        if (!wait_clk(pins, prev_clk))
+            return false;
+
+        gpio_put_masked(0xff, buf[i]);
+    }
+
+    return true;
+}
+
+// Like LBA_READ, but LZ4_BLOCK_SECTORS sectors at a time, with one status
+// per block. A block that compresses is sent as LBA_LZ4, a 16 bit length
+// and the LZ4 block, any other block as STATUS_OK and the sectors.
+static void REQUEST_FUNC(lba_read_lz4)(uint32_t pins, uint32_t prev_clk, uint32_t lba, uint32_t count) {
+    int err = SD_OK;
+    uint32_t i = 0;
+
+    while (1) {
+        if (i) {
+            if (!wait_clk(&pins, &prev_clk))
+                break;
+
+            gpio_put_masked(0xff, STATUS_BUSY);
+        }
+
+        if (i == count)
+            break;
+
+        uint32_t n = count - i < LZ4_BLOCK_SECTORS ? count - i : LZ4_BLOCK_SECTORS;
+        uint32_t size = n * SD_SECTOR_SIZE;
+
+        for (uint32_t j = 0; j < n && err == SD_OK; j++) {
+            const uint8_t *data;
+
+            err = sd_cache_read_sector(lba + i + j, &data);
+            if (err == SD_OK)
+                memcpy(lz4_in + j * SD_SECTOR_SIZE, data, SD_SECTOR_SIZE);
+        }
+
+        if (err != SD_OK)
+            break;
+
+        uint32_t len = lz4_compress(lz4_in, size, lz4_out, size);
+        bool sent;
+
+        if (len) {
+            uint8_t hdr[2] = { len >> 8, len };
+
+            gpio_put_masked(0xff, LBA_LZ4);
+            sent = send_bytes(&pins, &prev_clk, hdr, 2) &&
+                    send_bytes(&pins, &prev_clk, lz4_out, len);
+        } else {
+            gpio_put_masked(0xff, STATUS_OK);
+            sent = send_bytes(&pins, &prev_clk, lz4_in, size);
+        }
+
+        if (!sent) {
+            sd_cache_sync();
+            return;
+        }
+
+        i += n;
+    }
+
+    sd_cache_read_done(lba, i);
+    gpio_put_masked(0xff, err);
+}
+
+// Writes value to count card sectors from sector, with one multi-block
+// write.
+static int fill_sectors(uint32_t sector, uint32_t count, uint8_t value) {
+    int err = sd_spi_write_start(sector, count);
+    if (err != SD_OK)
+        return err;
+
+    for (uint32_t i = 0; i < count && err == SD_OK; i++) {
+        sd_spi_write_token(count);
+
+        for (int j = 0; j < SD_SECTOR_SIZE; j++)
+            sd_spi_xfer(value);
+
+        err = sd_spi_write_finish();
+    }
+
+    int stop_err = sd_spi_write_stop(count);
+    if (err == SD_OK)
+        err = stop_err;
+
+    return err;
+}
+
+// The Amiga writes an op byte, a 32 bit LBA and a 16 bit sector count.
+// Every status byte is preceded by a CLK toggle, after which the port is
+// driven with STATUS_BUSY until the status is ready. For reads, each OK
+// status is followed by a sector clocked out one byte per CLK toggle, and
+// a final status after the last sector. For writes, the status of the
+// command is followed by, for each sector, a CLK toggle that releases the
+// port, the sector clocked in and the status of the sector, and finally
+// a last status. LBA_READ_UNIFORM is a read where sectors may be sent
+// with send_sector_uniform(). LBA_FILL has the fill value as an extra
+// parameter byte and only a single status. LBA_READ_LZ4 is described at
+// lba_read_lz4(). Reads leave the card reading ahead into sd_cache.c and
+// writes are programmed from there after the final status. LBA_SYNC
+// finishes both and has a single status, the first error from
+// programming since the last LBA_SYNC, which is also reported as the
+// command status of the next LBA_WRITE.
+static void REQUEST_FUNC(handle_lba)(uint32_t pins, uint32_t prev_clk) {
+    uint8_t op;
+    uint8_t b[6];
+    uint8_t value = 0;
+
+    if (!read_byte(&pins, &prev_clk, &op))
+        return;
+
+    // LBA mode always runs the SD card on target 0.
+    if (active_target != &targets[0])
+        use_target(0);
+
+#ifdef PAR_SPI_COMBINED
+    sd_share_amiga_used(op == LBA_WRITE || op == LBA_FILL);
+#endif
+
+    for (int i = 0; i < 6; i++) {
+        if (!read_byte(&pins, &prev_clk, &b[i]))
+            return;
+    }
+
+    if (op == LBA_FILL && !read_byte(&pins, &prev_clk, &value))
+        return;
+
+    uint32_t lba = ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+    uint32_t count = (b[4] << 8) | b[5];
+
+    if (!wait_clk(&pins, &prev_clk))
+        return;
+
+    gpio_put_masked(0xff, STATUS_BUSY);
+    gpio_set_dir_out_masked(0xff);
+
+    if (op == LBA_OPEN) {
+        sd_cache_sync();
+        sd_cache_reset();
+
+        int err = sd_spi_open(batch_buf);
+        if (err == SD_OK) {
+            // FatFS's driver sets the clock of its own
+            uint32_t baud = spi_get_baudrate(spi0);
+
+            err = hdf_map_open(batch_buf);
+
+            spi_set_baudrate(spi0, baud);
+            set_spi_mode(active_target->mode);
+        }
+
+        gpio_put_masked(0xff, err);
+
+        if (err != SD_OK)
+            return;
+
+        for (int i = 0; i < SD_INFO_SIZE; i++) {
+            if (!wait_clk(&pins, &prev_clk))
+                return;
+
+            gpio_put_masked(0xff, batch_buf[i]);
+        }
+    } else if (op == LBA_READ || op == LBA_READ_UNIFORM) {
+        // Sectors come from the cache when read-ahead got them, otherwise
+        // from the card, and the read is left open afterwards to carry on
+        // from there.
+        int err = SD_OK;
+        uint32_t i;
+
+        for (i = 0; ; i++) {
+            if (i) {
+                if (!wait_clk(&pins, &prev_clk)) {
+                    sd_cache_sync();
+                    return;
+                }
+
+                gpio_put_masked(0xff, STATUS_BUSY);
+            }
+
+            if (i == count)
+                break;
+
+            const uint8_t *data = sd_cache_lookup(lba + i);
+
+            if (!data && op == LBA_READ_UNIFORM)
+                err = sd_cache_read_sector(lba + i, &data);
+
+            if (err != SD_OK)
+                break;
+
+            bool sent;
+
+            if (op == LBA_READ_UNIFORM) {
+                sent = send_sector_uniform(&pins, &prev_clk, data);
+            } else if (data) {
+                gpio_put_masked(0xff, STATUS_OK);
+                sent = send_bytes(&pins, &prev_clk, data, SD_SECTOR_SIZE);
+            } else {
+                uint8_t *slot;
+
+                err = sd_cache_stream_begin(lba + i, &slot);
+                if (err != SD_OK)
+                    break;
+
+                gpio_put_masked(0xff, STATUS_OK);
+
+                sent = true;
+                for (int j = 0; j < SD_SECTOR_SIZE; j++) {
+                    slot[j] = sd_spi_xfer(0xff);
+
+                    if (!wait_clk(&pins, &prev_clk)) {
+                        sent = false;
+                        break;
+                    }
+
+                    gpio_put_masked(0xff, slot[j]);
+                }
+
+                if (sent)
+                    sd_cache_stream_end();
+            }
+
+            if (!sent) {
+                sd_cache_sync();
+                return;
+            }
+        }
+
+        sd_cache_read_done(lba, i);
+        gpio_put_masked(0xff, err);
+    } else if (op == LBA_WRITE) {
+        // Sectors go to the write buffer and are acknowledged at once,
+        // the main loop programs them afterwards. The slot for the next
+        // sector is found before each status, while the Amiga waits.
+        int err = sd_cache_write_begin(lba, count);
+        uint8_t *slot = NULL;
+
+        if (err == SD_OK && count)
+            slot = sd_cache_write_slot();
+
+        gpio_put_masked(0xff, err);
+
+        if (err != SD_OK)
+            return;
+
+        for (uint32_t i = 0; i < count; i++) {
+            // Let go of the port so the Amiga can write the sector.
+            if (!wait_clk(&pins, &prev_clk))
+                return;
+
+            gpio_set_dir_in_masked(0xff);
+
+            for (int j = 0; j < SD_SECTOR_SIZE; j++) {
+                if (!wait_clk(&pins, &prev_clk))
+                    return;
+
+                slot[j] = pins & 0xff;
+            }
+
+            if (!wait_clk(&pins, &prev_clk))
+                return;
+
+            gpio_put_masked(0xff, STATUS_BUSY);
+            gpio_set_dir_out_masked(0xff);
+
+            sd_cache_write_commit(lba + i);
+            if (i + 1 < count)
+                slot = sd_cache_write_slot();
+
+            gpio_put_masked(0xff, SD_OK);
+        }
+
+        if (wait_clk(&pins, &prev_clk))
+            gpio_put_masked(0xff, SD_OK);
+    } else if (op == LBA_READ_LZ4) {
+        lba_read_lz4(pins, prev_clk, lba, count);
+    } else if (op == LBA_FILL) {
+        sd_cache_sync();
+        sd_cache_invalidate(lba, count);
+
+        int err = hdf_map_check(lba, count);
+
+        for (uint32_t i = 0; i < count && err == SD_OK; ) {
+            uint32_t sector;
+            uint32_t run;
+
+            err = hdf_map_lookup(lba + i, &sector, &run);
+            if (err != SD_OK)
+                break;
+
+            uint32_t n = count - i < run ? count - i : run;
+
+            err = fill_sectors(sector, n, value);
+            i += n;
+        }
+
+        gpio_put_masked(0xff, err);
+    } else if (op == LBA_SYNC) {
+        gpio_put_masked(0xff, sd_cache_sync());
+    }
+}
+
+#ifdef PAR_SPI_FILES
+// The parameter block of a FILE_WRITE is the handle and the data, and
+// sd_files.c ends paths with a terminator after the block.
+static uint8_t file_params[SD_FILES_CHUNK + 2];
+static uint8_t file_reply[SD_FILES_CHUNK];
+
+// The Amiga writes an op byte, the size of the parameter block and the
+// largest reply it takes (16 bit each) and the parameter block. Then,
+// as with the LBA commands, a CLK toggle is followed by STATUS_BUSY
+// until the status is ready. An OK status is followed by the 16 bit size
+// of the reply and the reply, one byte per CLK toggle. FatFS runs the
+// request, see sd_files.c, with the LBA write buffer programmed first and
+// the sector cache dropped afterwards.
+static void REQUEST_FUNC(handle_file)(uint32_t pins, uint32_t prev_clk) {
+    uint8_t op;
+    uint8_t b[4];
+
+    if (!read_byte(&pins, &prev_clk, &op))
+        return;
+
+    if (active_target != &targets[0])
+        use_target(0);
+
+    for (int i = 0; i < 4; i++) {
+        if (!read_byte(&pins, &prev_clk, &b[i]))
+            return;
+    }
+
+    uint32_t size = (b[0] << 8) | b[1];
+    uint32_t reply_max = (b[2] << 8) | b[3];
+
+    for (uint32_t i = 0; i < size; i++) {
+        uint8_t value;
+
+        if (!read_byte(&pins, &prev_clk, &value))
+            return;
+
+        if (i < sizeof(file_params) - 1)
+            file_params[i] = value;
+    }
+
+    if (!wait_clk(&pins, &prev_clk))
+        return;
+
+    gpio_put_masked(0xff, STATUS_BUSY);
+    gpio_set_dir_out_masked(0xff);
+
+    if (reply_max > SD_FILES_CHUNK)
+        reply_max = SD_FILES_CHUNK;
+
+    uint32_t reply_size = 0;
+    int err = SD_ERROR;
+
+    if (size < sizeof(file_params)) {
+        // FatFS's driver sets the clock of its own
+        uint32_t baud = spi_get_baudrate(spi0);
+
+        sd_cache_sync();
+        err = sd_files_request(op, file_params, size, file_reply, reply_max, &reply_size);
+        sd_cache_invalidate(0, UINT32_MAX);
+
+        spi_set_baudrate(spi0, baud);
+        set_spi_mode(active_target->mode);
+    }
+
+    gpio_put_masked(0xff, err);
+
+    if (err != SD_OK)
+        return;
+
+    uint8_t hdr[2] = { reply_size >> 8, reply_size };
+
+    if (send_bytes(&pins, &prev_clk, hdr, 2))
+        send_bytes(&pins, &prev_clk, file_reply, reply_size);
+}
+#endif
+
+#ifdef PAR_SPI_NET
+static uint8_t net_params[NET_BATCH_MAX];
+static uint8_t net_reply[NET_BATCH_MAX];
+
+// Framed like FILE: an op byte, the 16 bit sizes of the parameter block
+// and of the largest reply, the parameter block, a CLK toggle, then
+// STATUS_BUSY until the status, and after an OK status the 16 bit size
+// of the reply and the reply. See net_bridge.h for the ops.
+static void REQUEST_FUNC(handle_net)(uint32_t pins, uint32_t prev_clk) {
+    uint8_t op;
+    uint8_t b[4];
+
+    if (!read_byte(&pins, &prev_clk, &op))
+        return;
+
+    for (int i = 0; i < 4; i++) {
+        if (!read_byte(&pins, &prev_clk, &b[i]))
+            return;
+    }
+
+    uint32_t size = (b[0] << 8) | b[1];
+    uint32_t reply_max = (b[2] << 8) | b[3];
 
-// Button monitoring interval (check button every 100ms when idle)
-#define BUTTON_CHECK_INTERVAL_MS 100
-static absolute_time_t last_button_check_time;
+    for (uint32_t i = 0; i < size; i++) {
+        uint8_t value;
 
-/*
- * EXCLUSIVE GPIO interrupt handler 
- * Handles both REQ (time-critical) and CDET (debounced)
- */
-void __not_in_flash_func(gpio_irq_exclusive_handler)(void) {
-    uint32_t events_req = gpio_get_irq_event_mask(PIN_REQ);
-    uint32_t events_cdet = gpio_get_irq_event_mask(PIN_CDET);
-    
-    // Handle REQ interrupt (time-critical, no debouncing)
-    if (events_req) {
-        gpio_acknowledge_irq(PIN_REQ, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL);
-        
-        if (events_req & GPIO_IRQ_EDGE_FALL) {
-            // REQ went low - transfer starting
-            req_triggered = true;
-            
-            // Disable card detect during transfer (matches AVR)
-            card_detect_enabled = false;
-        }
-        
-        if (events_req & GPIO_IRQ_EDGE_RISE) {
-            // REQ went high - transfer ending
-            // Re-enable card detect when idle
-            card_detect_enabled = true;
+        if (!read_byte(&pins, &prev_clk, &value))
+            return;
+
+        if (i < sizeof(net_params))
+            net_params[i] = value;
+    }
+
+    if (!wait_clk(&pins, &prev_clk))
+        return;
+
+    gpio_put_masked(0xff, STATUS_BUSY);
+    gpio_set_dir_out_masked(0xff);
+
+    if (reply_max > sizeof(net_reply))
+        reply_max = sizeof(net_reply);
+
+    uint32_t reply_size = 0;
+    int err = SD_ERROR;
+
+    if (size <= sizeof(net_params))
+        err = net_bridge_request(op, net_params, size, net_reply, reply_max, &reply_size);
+
+    // The IRQ pulse the Amiga waits on may have been a card change
+    if (err == SD_OK && op == NET_RECEIVE && card_changed)
+        net_reply[0] |= NET_CARD_CHANGED;
+
+    gpio_put_masked(0xff, err);
+
+    if (err != SD_OK)
+        return;
+
+    uint8_t hdr[2] = { reply_size >> 8, reply_size };
+
+    if (send_bytes(&pins, &prev_clk, hdr, 2))
+        send_bytes(&pins, &prev_clk, net_reply, reply_size);
+}
+#endif
+
+#define CAPS_MAGIC          0x43
+#define FIRMWARE_ID         3
+#define PROTOCOL_VERSION    1
+#if defined(PAR_SPI_FILES)
+#define COMMANDS            0x3ffff // Control commands 0 to 15, uniform and LZ4 LBA reads
+#elif defined(PAR_SPI_NET)
+#define COMMANDS            0x77fff // Control commands 0 to 14, uniform and LZ4 LBA reads, NET
+#else
+#define COMMANDS            0x37fff // Control commands 0 to 14, uniform and LZ4 LBA reads
+#endif
+
+// SD cards in SPI mode are specified up to 25 MHz. The actual rates depend
+// on the peripheral clock, and are what GET_CAPS reports.
+static const uint32_t spi_tiers[] = {
+    SPI_SLOW_FREQUENCY,
+    1000*1000,
+    2000*1000,
+    4000*1000,
+    8000*1000,
+    12000*1000,
+    SPI_FAST_FREQUENCY,
+    25000*1000,
+};
+
+#define TIER_COUNT          (sizeof(spi_tiers) / sizeof(spi_tiers[0]))
+
+static uint8_t caps[8 + 2 * TIER_COUNT];
+
+static void build_caps() {
+    uint8_t *p = caps;
+
+    *p++ = CAPS_MAGIC;
+    *p++ = FIRMWARE_ID;
+    *p++ = PROTOCOL_VERSION;
+    *p++ = (COMMANDS >> 24) & 0xff;
+    *p++ = (COMMANDS >> 16) & 0xff;
+    *p++ = (COMMANDS >> 8) & 0xff;
+    *p++ = COMMANDS & 0xff;
+    *p++ = TIER_COUNT;
+
+    for (int i = 0; i < TIER_COUNT; i++) {
+        uint32_t khz = spi_set_baudrate(spi0, spi_tiers[i]) / 1000;
+        *p++ = khz >> 8;
+        *p++ = khz;
+    }
+
+    spi_set_baudrate(spi0, SPI_SLOW_FREQUENCY);
+}
+
+// The caps are driven one byte per CLK toggle after the turnaround CLK.
+static void REQUEST_FUNC(handle_caps)(uint32_t pins, uint32_t prev_clk) {
+    for (int i = 0; i < sizeof(caps); i++) {
+        if (!wait_clk(&pins, &prev_clk))
+            return;
+
+        gpio_put_masked(0xff, caps[i]);
+        gpio_set_dir_out_masked(0xff);
+    }
+}
+
+// The Amiga writes the tier index, and the index is echoed back after the
+// turnaround CLK once the new rate is in effect, or 0xff if there is no
+// such tier.
+static void REQUEST_FUNC(handle_tier)(uint32_t pins, uint32_t prev_clk) {
+    uint8_t tier;
+
+    if (!read_byte(&pins, &prev_clk, &tier))
+        return;
+
+    if (tier < TIER_COUNT)
+        spi_set_baudrate(spi0, spi_tiers[tier]);
+    else
+        tier = 0xff;
+
+    if (!wait_clk(&pins, &prev_clk))
+        return;
+
+    gpio_put_masked(0xff, tier);
+    gpio_set_dir_out_masked(0xff);
+}
+
+// The Amiga writes the target index. Its settings are applied and, with
+// the A bit set, its chip select asserted, so switching to another device
+// costs a single command.
+static void REQUEST_FUNC(handle_target)(uint32_t pins, uint32_t prev_clk) {
+    bool select = pins & 1;
+    uint8_t t;
+
+    if (!read_byte(&pins, &prev_clk, &t) || t >= TARGET_COUNT)
+        return;
+
+    use_target(t);
+
+    if (select)
+        gpio_put(active_target->pin, 0);
+}
+
+// The Amiga writes the SPI mode of the active target.
+static void REQUEST_FUNC(handle_spi_mode)(uint32_t pins, uint32_t prev_clk) {
+    uint8_t mode;
+
+    if (!read_byte(&pins, &prev_clk, &mode))
+        return;
+
+    active_target->mode = mode & 3;
+    set_spi_mode(active_target->mode);
+}
+
+// With the A bit set the Amiga first writes a new read-ahead depth in
+// sectors. The reply is the cache size and depth in sectors (16 bit), the
+// hit and miss counts (32 bit), the write buffer size and the sectors in
+// it not yet programmed (16 bit) and the count of buffered sectors lost
+// to errors or card removal (32 bit), big endian, one byte per CLK toggle
+// after the turnaround CLK.
+static void REQUEST_FUNC(handle_cache)(uint32_t pins, uint32_t prev_clk) {
+    if (pins & 1) {
+        uint8_t depth;
+
+        if (!read_byte(&pins, &prev_clk, &depth))
+            return;
+
+        sd_cache_set_depth(depth);
+    }
+
+    struct sd_cache_stats stats;
+    sd_cache_get_stats(&stats);
+
+    uint8_t reply[20] = {
+        stats.sectors >> 8, stats.sectors,
+        stats.depth >> 8, stats.depth,
+        stats.hits >> 24, stats.hits >> 16, stats.hits >> 8, stats.hits,
+        stats.misses >> 24, stats.misses >> 16, stats.misses >> 8, stats.misses,
+        stats.write_sectors >> 8, stats.write_sectors,
+        stats.dirty >> 8, stats.dirty,
+        stats.lost >> 24, stats.lost >> 16, stats.lost >> 8, stats.lost,
+    };
+
+    for (int i = 0; i < sizeof(reply); i++) {
+        if (!wait_clk(&pins, &prev_clk))
+            return;
+
+        gpio_put_masked(0xff, reply[i]);
+        gpio_set_dir_out_masked(0xff);
+    }
+}
+
+// The Amiga writes a 16 bit limit in ms and releases REQ. From then on
+// the main loop calls poll_notify() instead of sleeping.
+static void REQUEST_FUNC(handle_notify)(uint32_t pins, uint32_t prev_clk) {
+    uint8_t hi, lo;
+
+    if (!read_byte(&pins, &prev_clk, &hi) ||
+            !read_byte(&pins, &prev_clk, &lo))
+        return;
+
+    notify_limit = (hi << 8) | lo;
+    notify_start = time_us_32();
+    notify_armed = true;
+}
+
+// Reads one byte with CS as the Amiga left it, and pulses IRQ once the
+// card no longer reads busy or the limit has passed.
+static void poll_notify() {
+    uint8_t byte;
+
+    spi_read_blocking(spi0, 0xff, &byte, 1);
+
+    if (byte == 0xff || time_us_32() - notify_start >= notify_limit * 1000) {
+        notify_armed = false;
+        pulse_irq();
+    }
+}
+
+#define TEST_PATTERN(i)     (((i) + ((i) >> 8)) & 0xff)
+
+static bool test_mode;
+static uint32_t test_errors;
+
+// In test mode reads send TEST_PATTERN(i) as byte i and writes are checked
+// against it, without touching SPI, so that only the parallel link is
+// exercised.
+static void REQUEST_FUNC(transfer_test)(uint32_t pins, uint32_t prev_clk, bool read, uint32_t byte_count) {
+    uint32_t prev_ss = pins & SS_MASK;
+
+    for (uint32_t i = 0; i <= byte_count; i++) {
+        if (read) {
+            // The first byte is always clocked by CLK, see read_strobe().
+            if (i == 0 || !strobe_mode) {
+                if (!wait_clk(&pins, &prev_clk))
+                    return;
+                strobe_edge_clear();
+            } else if (!wait_strobe()) {
+                return;
+            }
+
+            gpio_put_all(prev_ss | TEST_PATTERN(i));
+            gpio_set_dir_out_masked(0xff);
+        } else {
+            if (strobe_mode) {
+                if (!wait_strobe())
+                    return;
+                pins = gpio_get_all();
+            } else if (!wait_clk(&pins, &prev_clk)) {
+                return;
+            }
+
+            if ((pins & 0xff) != TEST_PATTERN(i))
+                test_errors++;
         }
     }
-    
-    // Handle card detect interrupt (not time-critical, debounced)
-    if (events_cdet) {
-        // Always acknowledge first
-        gpio_acknowledge_irq(PIN_CDET, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL);
-        
-        // Only process if enabled (not during transfer)
-        if (!card_detect_enabled) {
-            return;  // Ignore during transfer (but acknowledged)
+}
+
+// Turns test mode on or off with the A bit, and replies with the number of
+// mismatched test writes since the last TEST_MODE, big endian, one byte
+// per CLK toggle after the turnaround CLK.
+static void REQUEST_FUNC(handle_test_mode)(uint32_t pins, uint32_t prev_clk) {
+    uint32_t errors = test_errors;
+
+    test_mode = pins & 1;
+    test_errors = 0;
+
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        if (!wait_clk(&pins, &prev_clk))
+            return;
+
+        gpio_put_masked(0xff, errors >> shift);
+        gpio_set_dir_out_masked(0xff);
+    }
+}
+
+static void REQUEST_FUNC(transfer)(uint32_t pins, uint32_t prev_clk, bool read, uint32_t byte_count) {
+    if (test_mode) {
+        transfer_test(pins, prev_clk, read, byte_count);
+        return;
+    }
+
+    telemetry_transfer(read, byte_count + 1);
+
+    if (read && strobe_mode) {
+        read_strobe(pins, prev_clk, byte_count);
+#if defined(PAR_SPI_PIO)
+    } else if (read) {
+        if (!par_engine_read(prev_clk, byte_count + 1))
+            telemetry_abort();
+    } else if (!strobe_mode) {
+        if (!par_engine_write(prev_clk, byte_count + 1))
+            telemetry_abort();
+#elif defined(PAR_SPI_PIPE)
+    } else if (read) {
+        read_pipe(pins, prev_clk, byte_count);
+    } else if (!strobe_mode) {
+        write_pipe(pins, prev_clk, byte_count);
+#endif
+    } else if (read) {
+        uint32_t prev_ss = pins & SS_MASK;
+        uint32_t spi_wait = 0;
+
+        spi_prefetch_start(byte_count + 1);
+        PROFILE_START();
+
+        for (uint32_t i = 0; i <= byte_count; i++) {
+            uint32_t start = telemetry_now();
+            uint32_t value = spi_prefetch_get(i);
+            spi_wait += telemetry_now() - start;
+            PROFILE_READY();
+
+            if (!wait_clk(&pins, &prev_clk))
+                break;
+
+            PROFILE_EDGE();
+            gpio_put_all(prev_ss | value);
+            gpio_set_dir_out_masked(0xff);
         }
-        
-        // Debouncing: Ignore if too soon after last event
-        uint32_t now = to_ms_since_boot(get_absolute_time());
-        if ((now - last_card_detect_time) < CARD_DETECT_DEBOUNCE_MS) {
-            return;  // Too soon, ignore (mechanical bouncing)
+
+        spi_prefetch_finish();
+        telemetry_spi_wait(spi_wait);
+    } else if (strobe_mode) {
+        write_strobe(byte_count);
+    } else {
+        // WRITE operation
+        uint32_t spi_wait = 0;
+
+        PROFILE_START();
+
+        while (1) {
+            while (1) {
+                pins = gpio_get_all();
+                if ((pins & (1 << PIN_CLK)) != prev_clk)
+                    break;
+
+                if (pins & (1 << PIN_REQ)) {
+                    telemetry_abort();
+                    telemetry_spi_wait(spi_wait);
+                    return;  // Aborted - flag NOT set
+                }
+            }
+
+            PROFILE_EDGE();
+            spi_get_hw(spi0)->dr = pins & 0xff;
+
+            uint32_t start = telemetry_now();
+
+            while (!spi_is_readable(spi0))
+                tight_loop_contents();
+
+            spi_wait += telemetry_now() - start;
+            (void)spi_get_hw(spi0)->dr;
+            PROFILE_READY();
+
+            if (!byte_count)
+                break;
+
+            prev_clk = pins & (1 << PIN_CLK);
+            byte_count--;
         }
-        last_card_detect_time = now;
-        
-        // Card inserted or removed - signal Amiga
-        gpio_put(PIN_IRQ, false);
-        gpio_set_dir(PIN_IRQ, true);
-        
-        // Brief pulse (10μs)
-        busy_wait_us(10);
-        
-        // Release (back to input, pulled up externally)
-        gpio_set_dir(PIN_IRQ, false);
-        
-        // Update state
-        prev_cdet = gpio_get_all() & (1 << PIN_CDET);
+
+        telemetry_spi_wait(spi_wait);
     }
 }
 
-static void handle_request() {
+static void REQUEST_FUNC(handle_request)() {
     uint32_t pins;
 
     // Wait for REQ low - but now just check flag instead of busy-wait
@@ -111,8 +1519,17 @@ static void handle_request() {
         tight_loop_contents();
     }
 
+    PROFILE_COMMAND();
+    telemetry_command();
+
+    // Any command ends a NOTIFY_READY watch.
+    notify_armed = false;
+
     uint32_t prev_clk = pins & (1 << PIN_CLK);
 
+    // Forget the edge caused by writing the command byte.
+    strobe_edge_clear();
+
     if ((pins & 0xc0) != 0xc0) {
         uint32_t byte_count = 0;
         bool read = false;
@@ -128,100 +1545,149 @@ static void handle_request() {
                 if ((pins & (1 << PIN_CLK)) != prev_clk)
                     break;
 
-                if (pins & (1 << PIN_REQ))
+                if (pins & (1 << PIN_REQ)) {
+                    telemetry_abort();
                     return;
+                }
             }
 
             read = !!(pins & 0x80);
             byte_count |= pins & 0x7f;
             prev_clk = pins & (1 << PIN_CLK);
+            strobe_edge_clear();
         }
 
-        if (read) {
-            spi_get_hw(spi0)->dr = 0xff;
-
-            uint32_t prev_ss = pins & (1 << PIN_SS);
-
-            while (1) {
-                while (!spi_is_readable(spi0))
-                    tight_loop_contents();
+        transfer(pins, prev_clk, read, byte_count);
+    } else {
+        telemetry_control((pins & 0x3e) >> 1);
 
-                uint32_t value = spi_get_hw(spi0)->dr;
+        switch ((pins & 0x3e) >> 1) {
+            case 0: { // SPI_SELECT
+                if (pins & 1) {
+                    gpio_put(active_target->pin, 0);
+#ifdef PAR_SPI_COMBINED
+                    // Any raw access to the SD card may be a write
+                    if (active_target == &targets[0])
+                        sd_share_amiga_used(true);
+#endif
+                } else
+                    gpio_put_masked(SS_MASK, SS_MASK);
+                break;
+            }
+            case 1: { // CARD_PRESENT
+                bool changed = card_changed;
+                card_changed = false;
 
                 while (1) {
                     pins = gpio_get_all();
                     if ((pins & (1 << PIN_CLK)) != prev_clk)
                         break;
 
-                    if (pins & (1 << PIN_REQ))
+                    if (pins & (1 << PIN_REQ)) {
+                        telemetry_abort();
                         return;
+                    }
                 }
 
-                gpio_put_all(prev_ss | value);
+                // Read actual card detect GPIO
+                bool card_present = !gpio_get(PIN_CDET);
+                
+                gpio_put(PIN_D(0), card_present);
+                gpio_put(PIN_D(1), changed);
                 gpio_set_dir_out_masked(0xff);
-
-                if (!byte_count)
-                    break;
-
-                spi_get_hw(spi0)->dr = 0xff;
-                prev_clk = pins & (1 << PIN_CLK);
-                byte_count--;
+                break;
             }
-        } else {
-            // WRITE operation
-            while (1) {
-                while (1) {
-                    pins = gpio_get_all();
-                    if ((pins & (1 << PIN_CLK)) != prev_clk)
-                        break;
+            case 2: { // SPEED
+                spi_set_baudrate(spi0, pins & 1 ?
+                        SPI_FAST_FREQUENCY :
+                        SPI_SLOW_FREQUENCY);
+                break;
+            }
+            case 3: { // XFER_MODE
+                bool want_strobe = pins & 1;
 
-                    if (pins & (1 << PIN_REQ))
-                        return;  // Aborted - flag NOT set
-                }
+                // The Amiga writes two probe bytes, each followed by a CLK
+                // toggle. Only accept strobe mode if the second write was
+                // seen on /STROBE, i.e. the line is actually connected.
+                if (!wait_clk(&pins, &prev_clk))
+                    return;
 
-                spi_get_hw(spi0)->dr = pins & 0xff;
+                strobe_edge_clear();
 
-                while (!spi_is_readable(spi0))
-                    tight_loop_contents();
+                if (!wait_clk(&pins, &prev_clk))
+                    return;
 
-                (void)spi_get_hw(spi0)->dr;
+                strobe_mode = want_strobe && strobe_edge_seen();
 
-                if (!byte_count)
-                    break;
+                if (!wait_clk(&pins, &prev_clk))
+                    return;
 
-                prev_clk = pins & (1 << PIN_CLK);
-                byte_count--;
+                gpio_put_masked(0xff, strobe_mode ? 1 : 0);
+                gpio_set_dir_out_masked(0xff);
+                break;
             }
-        }
-    } else {
-        switch ((pins & 0x3e) >> 1) {
-            case 0: { // SPI_SELECT
-                gpio_put(PIN_SS, !(pins & 1));
+            case 4: { // BATCH
+                handle_batch(pins, prev_clk);
                 break;
             }
-            case 1: { // CARD_PRESENT
-                gpio_set_dir(PIN_IRQ, false);
-
-                while (1) {
-                    pins = gpio_get_all();
-                    if ((pins & (1 << PIN_CLK)) != prev_clk)
-                        break;
+            case 5: { // POLL
+                handle_poll(pins, prev_clk);
+                break;
+            }
+            case 6: { // LBA
+                handle_lba(pins, prev_clk);
+                break;
+            }
+            case 7: { // READ3 or WRITE3
+                bool read = pins & 1;
+                uint8_t len[3];
 
-                    if (pins & (1 << PIN_REQ))
+                for (int i = 0; i < 3; i++) {
+                    if (!read_byte(&pins, &prev_clk, &len[i]))
                         return;
                 }
 
-                // Read actual card detect GPIO
-                bool card_present = !gpio_get(PIN_CDET);
-                
-                gpio_put(PIN_D(0), card_present);
-                gpio_set_dir_out_masked(0xff);
+                strobe_edge_clear();
+                transfer(pins, prev_clk, read, (len[0] << 16) | (len[1] << 8) | len[2]);
                 break;
             }
-            case 2: { // SPEED
-                spi_set_baudrate(spi0, pins & 1 ?
-                        SPI_FAST_FREQUENCY :
-                        SPI_SLOW_FREQUENCY);
+            case 8: { // GET_CAPS
+                handle_caps(pins, prev_clk);
+                break;
+            }
+            case 9: { // SPEED_TIER
+                handle_tier(pins, prev_clk);
+                break;
+            }
+            case 10: { // NOTIFY_READY
+                handle_notify(pins, prev_clk);
+                break;
+            }
+            case 11: { // TEST_MODE
+                handle_test_mode(pins, prev_clk);
+                break;
+            }
+            case 12: { // TARGET
+                handle_target(pins, prev_clk);
+                break;
+            }
+            case 13: { // SPI_MODE
+                handle_spi_mode(pins, prev_clk);
+                break;
+            }
+            case 14: { // CACHE
+                handle_cache(pins, prev_clk);
+                break;
+            }
+            case 15: { // FILE or NET
+#ifdef PAR_SPI_FILES
+                if (!(pins & 1))
+                    handle_file(pins, prev_clk);
+#endif
+#ifdef PAR_SPI_NET
+                if (pins & 1)
+                    handle_net(pins, prev_clk);
+#endif
                 break;
             }
         }
@@ -243,24 +1709,92 @@ static void handle_request() {
 // Called from launch_bare_metal_mode() in main.c
 // ============================================================================
 
+// Programs buffered writes before a reboot to the other mode. spi-lib
+// ends LBA work before switching targets, so the SD card is the active
+// target whenever there is any.
+void par_spi_flush(void) {
+    int err = sd_cache_sync();
+
+#ifdef PAR_SPI_FILES
+    sd_files_sync();
+#endif
+
+    struct sd_cache_stats stats;
+    sd_cache_get_stats(&stats);
+
+    if (err != SD_OK)
+        printf("Amiga SPI Bridge: write error %d, %lu buffered sectors lost\n", err, stats.lost);
+}
+
+// Single letter commands from the USB serial console, read when the
+// button is checked
+static void poll_console() {
+    switch (getchar_timeout_us(0)) {
+#ifdef PAR_SPI_TRACE
+        case 't':
+            trace_start_dump();
+            break;
+#endif
+#ifdef PAR_SPI_TELEMETRY
+        case 's':
+            telemetry_print();
+            break;
+        case 'z':
+            telemetry_clear();
+            break;
+#endif
+#ifdef PAR_SPI_NET
+        case 'n': {
+            struct net_bridge_stats stats;
+            net_bridge_get_stats(&stats);
+            printf("net rx=%lu rx_dropped=%lu tx=%lu tx_dropped=%lu\n",
+                   stats.rx_frames, stats.rx_dropped, stats.tx_frames, stats.tx_dropped);
+            break;
+        }
+#endif
+        default:
+            break;
+    }
+}
+
 void par_spi_main(void) {
     printf("Amiga SPI Bridge: Initializing on Core %d...\n", get_core_num());
     
     // Initialize SPI
     spi_init(spi0, SPI_SLOW_FREQUENCY);
+    sd_spi_setup(spi0, PIN_SS, SPI_FAST_FREQUENCY);
+    build_caps();
+    spi_prefetch_init(spi0);
+#if defined(PAR_SPI_PIO)
+    par_engine_init(spi0, PIN_CLK, PIN_REQ);
+#elif defined(PAR_SPI_PIPE)
+    spi_pipe_init();
+#endif
+#ifdef PAR_SPI_PROFILE
+    m33_hw->demcr |= M33_DEMCR_TRCENA_BITS;
+    m33_hw->dwt_ctrl |= M33_DWT_CTRL_CYCCNTENA_BITS;
+#endif
+#ifdef PAR_SPI_TELEMETRY
+    telemetry_init();
+#endif
 
     gpio_set_function(PIN_SCK, GPIO_FUNC_SPI);
     gpio_set_function(PIN_MOSI, GPIO_FUNC_SPI);
     gpio_set_function(PIN_MISO, GPIO_FUNC_SPI);
     gpio_pull_up(PIN_MISO);
 
-    gpio_init(PIN_SS);
-    gpio_put(PIN_SS, 1);
-    gpio_set_dir(PIN_SS, GPIO_OUT);
+    for (int i = 0; i < TARGET_COUNT; i++) {
+        gpio_init(targets[i].pin);
+        gpio_put(targets[i].pin, 1);
+        gpio_set_dir(targets[i].pin, GPIO_OUT);
+    }
 
     gpio_init(PIN_CDET);
     gpio_pull_up(PIN_CDET);
 
+    gpio_init(PIN_STB);
+    gpio_pull_up(PIN_STB);
+
     for (int i = 0; i < 12; i++)
         gpio_init(i);
 
@@ -274,19 +1808,50 @@ void par_spi_main(void) {
     // === Initialize PIO for ACT mirroring (use PIO1, PIO0 used by WiFi) ===
     PIO pio = pio1;
     uint sm = 0;
+    pio_sm_claim(pio, sm);
+#ifdef PAR_SPI_COMBINED
+    // ACT waits while core 1 has the SD card
+    uint offset = pio_add_program(pio, &act_mirror_gated_program);
+    act_mirror_gated_program_init(pio, sm, offset, PIN_REQ, PIN_ACT);
+    sd_share_init(pio);
+#else
     uint offset = pio_add_program(pio, &act_mirror_program);
     act_mirror_program_init(pio, sm, offset, PIN_REQ, PIN_ACT);
+#endif
+
+    irq_pulse_sm = pio_claim_unused_sm(pio, true);
+    offset = pio_add_program(pio, &irq_pulse_program);
+    irq_pulse_program_init(pio, irq_pulse_sm, offset, PIN_IRQ);
+    irq_pulse_cycles = clock_get_hz(clk_sys) / 1000000 * IRQ_PULSE_US;
 
-    prev_cdet = gpio_get_all() & (1 << PIN_CDET);
+#ifdef PAR_SPI_TRACE
+    // IRQ, ACT, CLK, REQ and /STROBE are GPIO 8-12
+    trace_init(pio, PIN_IRQ, PIN_STB - PIN_IRQ + 1);
+#endif
+
+    prev_cdet = cdet_sample = gpio_get_all() & (1 << PIN_CDET);
 
     // === Setup exclusive interrupt handler ===
     
-    // Enable GPIO interrupts for both REQ and CDET
+    // Enable GPIO interrupts for REQ
+#ifdef PAR_SPI_LOW_LATENCY
+    // REQ only interrupts background work, see the main loop
+    req_edge_clear();
+    add_repeating_timer_ms(BUTTON_CHECK_INTERVAL_MS, button_timer_callback, NULL, &button_timer);
+#else
     gpio_set_irq_enabled(PIN_REQ, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true);
-    gpio_set_irq_enabled(PIN_CDET, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true);
+#endif
+    add_repeating_timer_ms(CARD_DETECT_POLL_MS, card_detect_callback, NULL, &card_detect_timer);
     
     // Use exclusive handler for maximum speed
+#ifdef PAR_SPI_COMBINED
+    // The CYW43 driver on core 1 adds its own GPIO handler, and both
+    // cores share the vector table
+    irq_add_shared_handler(IO_IRQ_BANK0, gpio_irq_exclusive_handler,
+                           PICO_SHARED_IRQ_HANDLER_HIGHEST_ORDER_PRIORITY);
+#else
     irq_set_exclusive_handler(IO_IRQ_BANK0, gpio_irq_exclusive_handler);
+#endif
     irq_set_priority(IO_IRQ_BANK0, 0);  // Highest priority
     irq_set_enabled(IO_IRQ_BANK0, true);
 
@@ -310,10 +1875,7 @@ void par_spi_main(void) {
             printf("Amiga SPI Bridge: SD card detected, signaling Amiga (mode switch)...\n");
             
             // Signal Amiga
-            gpio_put(PIN_IRQ, false);
-            gpio_set_dir(PIN_IRQ, true);
-            busy_wait_us(10);
-            gpio_set_dir(PIN_IRQ, false);
+            pulse_irq();
             
             // Clear the flag after using it
             *BOOT_FLAG_ADDR = 0;
@@ -334,11 +1896,78 @@ void par_spi_main(void) {
     while (1) {
         req_triggered = false;
         
-        // Wait for interrupt with timeout for button checking
-        // Using best_effort_wfe_or_timeout instead of __wfe() to allow periodic button checks
-        absolute_time_t timeout_time = make_timeout_time_ms(BUTTON_CHECK_INTERVAL_MS);
-        best_effort_wfe_or_timeout(timeout_time);
-        
+        if (cache_stale) {
+            cache_stale = false;
+#ifdef PAR_SPI_COMBINED
+            sd_share_reclaim();
+            sd_share_card_changed();
+#endif
+            sd_cache_reset();
+            hdf_map_reset();
+#ifdef PAR_SPI_FILES
+            sd_files_reset();
+#endif
+        }
+
+#ifdef PAR_SPI_NET
+        // A frame came in while the Amiga waits for one
+        if (net_bridge_notify_due())
+            pulse_irq();
+#endif
+
+        if (notify_armed) {
+            // Watching for card ready - poll instead of sleeping
+            poll_notify();
+        } else if (active_target == &targets[0] && sd_cache_work_pending()) {
+            // Program buffered writes or read ahead until the next
+            // request comes in
+#ifdef PAR_SPI_LOW_LATENCY
+            req_irq_enable(true);
+            sd_cache_work(&req_triggered);
+            req_irq_enable(false);
+#else
+            sd_cache_work(&req_triggered);
+#endif
+#ifdef PAR_SPI_COMBINED
+        } else if (sd_share_wanted() && (gpio_get_all() & SS_MASK) == SS_MASK) {
+            // Lend the SD card to the FTP server for one block transfer
+            sd_share_lend(spi_get_baudrate(spi0), active_target->mode);
+#endif
+#ifdef PAR_SPI_TRACE
+        } else if (trace_dump_pending()) {
+            trace_dump_line();
+#endif
+        } else {
+#ifdef PAR_SPI_LOW_LATENCY
+            while (!req_edge_seen() && !button_check_due && !cache_stale && !share_wanted() && !net_wanted())
+                tight_loop_contents();
+#else
+            // Wait for interrupt with timeout for button checking
+            // Using best_effort_wfe_or_timeout instead of __wfe() to allow periodic button checks
+            absolute_time_t timeout_time = make_timeout_time_ms(BUTTON_CHECK_INTERVAL_MS);
+            best_effort_wfe_or_timeout(timeout_time);
+#endif
+        }
+
+#ifdef PAR_SPI_LOW_LATENCY
+        if (req_edge_seen()) {
+            PROFILE_REQ();
+            telemetry_req_noticed();
+            req_edge_clear();
+            req_triggered = true;
+        }
+
+        // Not while a request is waiting
+        if (button_check_due && !req_triggered) {
+            button_check_due = false;
+            extern void monitor_button_for_mode_switch(uint32_t current_mode);
+            monitor_button_for_mode_switch(BOOT_MODE_BARE_METAL);
+            poll_console();
+#ifdef PAR_SPI_PROFILE
+            profile_report();
+#endif
+        }
+#else
         // Check if it's time to monitor button (every 100ms)
         absolute_time_t now = get_absolute_time();
         if (absolute_time_diff_us(last_button_check_time, now) >= (BUTTON_CHECK_INTERVAL_MS * 1000)) {
@@ -347,15 +1976,29 @@ void par_spi_main(void) {
             extern void monitor_button_for_mode_switch(uint32_t current_mode);
             // BOOT_MODE_BARE_METAL is a #define from main.c, available via main.h
             monitor_button_for_mode_switch(BOOT_MODE_BARE_METAL);
+            poll_console();
+#ifdef PAR_SPI_PROFILE
+            profile_report();
+#endif
             
             last_button_check_time = now;
         }
+#endif
         
         if (req_triggered) {
+#ifdef PAR_SPI_LOW_LATENCY
+            // Nothing may stall the request once it has started
+            uint32_t status = save_and_disable_interrupts();
+#endif
+#ifdef PAR_SPI_COMBINED
+            // ACT is held back until the FTP server is done with the card
+            sd_share_reclaim();
+#endif
             gpio_put(PIN_LED, 1);  // SPI activity LED on (GPIO 28)
             
             // Process the Amiga request
             handle_request();
+            telemetry_request_done();
 
             // Cleanup after transfer
             gpio_set_dir_in_masked(0xff);
@@ -369,6 +2012,11 @@ void par_spi_main(void) {
                 (void)spi_get_hw(spi0)->dr;
             
             gpio_put(PIN_LED, 0);  // SPI activity LED off
+#ifdef PAR_SPI_LOW_LATENCY
+            // The REQ interrupt isn't there to do this
+            card_detect_enabled = true;
+            restore_interrupts(status);
+#endif
         }
     }
     
@@ -0,0 +1,564 @@
+/*
+ * sd_cache.c - read-ahead and write-back sector cache for the LBA commands
+ *
+ * The window holds sectors first to first + count - 1, sector lba in slot
+ * lba % SD_CACHE_SECTORS. An open multi-block read always continues at
+ * the end of the window, so reading ahead appends to it, and the oldest
+ * sector is dropped once the window is full.
+ *
+ * The write buffer is a FIFO of sectors, programmed oldest first, so the
+ * card always ends up with the last data written to a sector. A run of
+ * adjacent LBAs at its head is programmed with a single CMD25. The card
+ * is either reading or writing: accepting a write ends the open read,
+ * and a read that misses the cache first programs the whole buffer.
+ *
+ * Background work stops at the first byte after stop is set, which the
+ * REQ interrupt does, so the Amiga never waits for it. The read or write
+ * is then left open part way through a sector and picked up again later.
+ *
+ * LBAs are those the Amiga sees, which hdf_map.c turns into card sectors.
+ * A multi-block read or write never goes past the end of a run of
+ * consecutive card sectors.
+ */
+
+#include "sd_cache.h"
+#include "sd_spi.h"
+#include "hdf_map.h"
+#include "hardware/timer.h"
+
+// Time read-ahead waits for a data token before giving up.
+#define PREFETCH_TOKEN_TIMEOUT_US   (100*1000)
+
+// Time a sector or the end of a write may keep the card busy.
+#define WRITE_BUSY_TIMEOUT_US       (500*1000)
+
+static uint8_t cache_data[SD_CACHE_SECTORS][SD_SECTOR_SIZE];
+
+static uint32_t first;
+static uint32_t count;
+
+// Set while a multi-block read is open. The card sends sector first +
+// count next; stream_token is set once its data token has been read and
+// stream_pos bytes of it are in its slot. Read-ahead times its wait for
+// the token from token_start. The run of card sectors it reads ends before
+// sector stream_end.
+static bool stream_open;
+static bool stream_token;
+static uint32_t stream_pos;
+static bool token_wait;
+static uint32_t token_start;
+static uint32_t stream_end;
+
+// End of the last LBA read, and whether it started where the one before
+// ended.
+static uint32_t read_end;
+static bool sequential;
+
+static uint32_t depth = SD_CACHE_DEFAULT_DEPTH;
+static uint32_t hits;
+static uint32_t misses;
+
+static uint8_t write_data[SD_WRITE_SECTORS][SD_SECTOR_SIZE];
+static uint32_t write_lba[SD_WRITE_SECTORS];
+static uint32_t write_head;
+static uint32_t write_count;
+
+// The open write covers run_count sectors from the head of the buffer.
+// The head sector is in run_state, with run_pos bytes sent after its
+// token.
+enum run_state {
+    RUN_NONE,       // No write open, card idle
+    RUN_DATA,       // Sending the head sector
+    RUN_BUSY,       // Card programming the head sector
+    RUN_STOP,       // Card finishing the write after STOP_TRAN
+};
+
+static enum run_state run_state;
+static uint32_t run_count;
+static uint32_t run_done;
+static uint32_t run_pos;
+static bool run_token;
+static uint32_t busy_start;
+
+// First error from programming buffered sectors, reported by the next
+// LBA_WRITE or LBA_SYNC, and the number of sectors lost that way.
+static int write_error;
+static uint32_t lost_writes;
+
+static inline uint32_t stream_lba(void) {
+    return first + count;
+}
+
+static inline uint8_t *slot(uint32_t lba) {
+    return cache_data[lba % SD_CACHE_SECTORS];
+}
+
+// Drops the oldest sector if the next one would overwrite it.
+static void make_room(void) {
+    if (count == SD_CACHE_SECTORS) {
+        first++;
+        count--;
+    }
+}
+
+// CS may have been released by a target switch since the read was left
+// open, so it is asserted again before each use.
+static int stream_close(void) {
+    if (!stream_open)
+        return SD_OK;
+
+    stream_open = false;
+    stream_token = false;
+    stream_pos = 0;
+    token_wait = false;
+
+    sd_spi_select();
+    return sd_spi_read_stop(2);
+}
+
+// Starts a multi-block read at sector lba, after closing the open one.
+// Always CMD18, so the read can go on past the request.
+static int stream_start(uint32_t lba) {
+    uint32_t sector;
+    uint32_t run;
+
+    stream_close();
+
+    int err = hdf_map_lookup(lba, &sector, &run);
+    if (err == SD_OK)
+        err = sd_spi_read_start(sector, 2);
+    if (err != SD_OK)
+        return err;
+
+    stream_open = true;
+    stream_end = lba + run;
+    return SD_OK;
+}
+
+// Reads the rest of a sector that read-ahead was stopped in.
+static void stream_finish_sector(void) {
+    uint8_t *p = slot(stream_lba());
+
+    sd_spi_select();
+    while (stream_pos < SD_SECTOR_SIZE)
+        p[stream_pos++] = sd_spi_xfer(0xff);
+
+    sd_cache_stream_end();
+}
+
+static void pop_write(void) {
+    write_head = (write_head + 1) % SD_WRITE_SECTORS;
+    write_count--;
+}
+
+// Gives up on the head sector and closes the write.
+static void fail_write(int err) {
+    if (write_error == SD_OK)
+        write_error = err;
+
+    lost_writes++;
+    pop_write();
+
+    if (run_count > 1)
+        sd_spi_write_stop(run_count);
+    else
+        sd_spi_deselect();
+
+    run_state = RUN_NONE;
+}
+
+// Reads until the card stops reading busy. Returns false if stop was set
+// first, and sets *err if the card stays busy too long.
+static bool wait_not_busy(volatile bool *stop, int *err) {
+    while (sd_spi_xfer(0xff) != 0xff) {
+        if (*stop)
+            return false;
+
+        if (time_us_32() - busy_start >= WRITE_BUSY_TIMEOUT_US) {
+            *err = SD_TIMEOUT;
+            return true;
+        }
+    }
+
+    *err = SD_OK;
+    return true;
+}
+
+// Takes the write one step further: opens it, sends the head sector or
+// waits for the card to program it or to finish the write.
+static void write_step(volatile bool *stop) {
+    int err;
+
+    sd_spi_select();
+
+    switch (run_state) {
+    case RUN_NONE: {
+        uint32_t lba = write_lba[write_head];
+        uint32_t sector;
+        uint32_t run;
+
+        err = hdf_map_lookup(lba, &sector, &run);
+
+        run_count = 1;
+        while (run_count < write_count && run_count < run &&
+                write_lba[(write_head + run_count) % SD_WRITE_SECTORS] == lba + run_count)
+            run_count++;
+
+        if (err == SD_OK)
+            err = sd_spi_write_start(sector, run_count);
+        if (err != SD_OK) {
+            sd_spi_deselect();
+            if (write_error == SD_OK)
+                write_error = err;
+            lost_writes++;
+            pop_write();
+            return;
+        }
+
+        run_done = 0;
+        run_pos = 0;
+        run_token = false;
+        run_state = RUN_DATA;
+        break;
+    }
+
+    case RUN_DATA: {
+        const uint8_t *p = write_data[write_head];
+
+        if (!run_token) {
+            sd_spi_write_token(run_count);
+            run_token = true;
+        }
+
+        while (run_pos < SD_SECTOR_SIZE) {
+            if (*stop)
+                return;
+
+            sd_spi_xfer(p[run_pos++]);
+        }
+
+        err = sd_spi_write_response();
+        if (err != SD_OK) {
+            fail_write(err);
+            return;
+        }
+
+        busy_start = time_us_32();
+        run_state = RUN_BUSY;
+        break;
+    }
+
+    case RUN_BUSY:
+        if (!wait_not_busy(stop, &err))
+            return;
+
+        if (err != SD_OK) {
+            fail_write(err);
+            return;
+        }
+
+        pop_write();
+
+        if (++run_done < run_count) {
+            run_pos = 0;
+            run_token = false;
+            run_state = RUN_DATA;
+        } else if (run_count > 1) {
+            sd_spi_write_stop_token();
+            busy_start = time_us_32();
+            run_state = RUN_STOP;
+        } else {
+            sd_spi_deselect();
+            run_state = RUN_NONE;
+        }
+        break;
+
+    case RUN_STOP:
+        if (!wait_not_busy(stop, &err))
+            return;
+
+        if (err != SD_OK && write_error == SD_OK)
+            write_error = err;
+
+        sd_spi_deselect();
+        run_state = RUN_NONE;
+        break;
+    }
+}
+
+static bool write_pending(void) {
+    return write_count || run_state != RUN_NONE;
+}
+
+// Programs the whole write buffer and leaves the card idle.
+static void write_flush(void) {
+    volatile bool never = false;
+
+    while (write_pending())
+        write_step(&never);
+}
+
+// Starts an LBA write. Returns an error left from programming earlier
+// sectors, if any, which the Amiga then sees as the status of this write.
+int sd_cache_write_begin(uint32_t lba, uint32_t n) {
+    if (write_error != SD_OK) {
+        int err = write_error;
+        write_error = SD_OK;
+        return err;
+    }
+
+    if (!sd_spi_is_open())
+        return SD_NO_CARD;
+
+    int err = hdf_map_check(lba, n);
+    if (err != SD_OK)
+        return err;
+
+    stream_close();
+    sd_cache_invalidate(lba, n);
+    return SD_OK;
+}
+
+// Returns the buffer slot the next written sector goes to, programming
+// the oldest sectors first if the buffer is full.
+uint8_t *sd_cache_write_slot(void) {
+    volatile bool never = false;
+
+    while (write_count == SD_WRITE_SECTORS)
+        write_step(&never);
+
+    return write_data[(write_head + write_count) % SD_WRITE_SECTORS];
+}
+
+// Queues the sector in the slot from sd_cache_write_slot() for programming.
+void sd_cache_write_commit(uint32_t lba) {
+    write_lba[(write_head + write_count) % SD_WRITE_SECTORS] = lba;
+    write_count++;
+}
+
+// Returns the cached copy of sector lba, or NULL if it has to be read.
+const uint8_t *sd_cache_lookup(uint32_t lba) {
+    // Newest first, a sector may have been written more than once.
+    for (uint32_t i = write_count; i-- > 0; ) {
+        uint32_t n = (write_head + i) % SD_WRITE_SECTORS;
+
+        if (write_lba[n] == lba) {
+            hits++;
+            return write_data[n];
+        }
+    }
+
+    if (stream_open && stream_token && lba == stream_lba())
+        stream_finish_sector();
+
+    if (lba - first < count) {
+        hits++;
+        return slot(lba);
+    }
+
+    return NULL;
+}
+
+// Positions the open read at sector lba, opening a new one if needed, and
+// waits for its data token. On success the caller reads the sector into
+// *slot with sd_spi_xfer() and then calls sd_cache_stream_end().
+int sd_cache_stream_begin(uint32_t lba, uint8_t **p) {
+    int err;
+
+    misses++;
+
+    if (!stream_open || lba != stream_lba() || lba == stream_end) {
+        stream_close();
+        write_flush();
+
+        if (lba != stream_lba()) {
+            first = lba;
+            count = 0;
+        }
+
+        err = stream_start(lba);
+        if (err != SD_OK)
+            return err;
+    }
+
+    sd_spi_select();
+    token_wait = false;
+
+    err = sd_spi_read_token();
+    if (err != SD_OK) {
+        stream_close();
+        return err;
+    }
+
+    make_room();
+    *p = slot(lba);
+    return SD_OK;
+}
+
+void sd_cache_stream_end(void) {
+    sd_spi_read_crc();
+
+    stream_token = false;
+    stream_pos = 0;
+    count++;
+}
+
+// Gets the whole of sector lba, from the cache or the card.
+int sd_cache_read_sector(uint32_t lba, const uint8_t **data) {
+    *data = sd_cache_lookup(lba);
+    if (*data)
+        return SD_OK;
+
+    uint8_t *p;
+    int err = sd_cache_stream_begin(lba, &p);
+    if (err != SD_OK)
+        return err;
+
+    for (int i = 0; i < SD_SECTOR_SIZE; i++)
+        p[i] = sd_spi_xfer(0xff);
+
+    sd_cache_stream_end();
+
+    *data = p;
+    return SD_OK;
+}
+
+// Called at the end of each LBA read, to detect sequential access.
+void sd_cache_read_done(uint32_t lba, uint32_t n) {
+    sequential = lba == read_end;
+    read_end = lba + n;
+}
+
+static bool prefetch_pending(void) {
+    return stream_open && sequential && (int32_t)(stream_lba() - read_end) < (int32_t)depth;
+}
+
+// Reads ahead until depth sectors past the last read are cached, or stop
+// is set.
+static void prefetch(volatile bool *stop) {
+    sd_spi_select();
+
+    while (prefetch_pending() && !*stop) {
+        // On to the next run of the image
+        if (stream_lba() == stream_end) {
+            if (stream_start(stream_lba()) != SD_OK)
+                return;
+
+            sd_spi_select();
+        }
+
+        if (!stream_token) {
+            uint8_t token = sd_spi_xfer(0xff);
+
+            if (token == 0xff) {
+                if (!token_wait) {
+                    token_start = time_us_32();
+                    token_wait = true;
+                } else if (time_us_32() - token_start >= PREFETCH_TOKEN_TIMEOUT_US) {
+                    stream_close();
+                }
+                continue;
+            }
+
+            if (token != 0xfe) {
+                stream_close();
+                return;
+            }
+
+            stream_token = true;
+            token_wait = false;
+            make_room();
+        }
+
+        uint8_t *p = slot(stream_lba());
+
+        while (stream_pos < SD_SECTOR_SIZE) {
+            if (*stop)
+                return;
+
+            p[stream_pos++] = sd_spi_xfer(0xff);
+        }
+
+        sd_cache_stream_end();
+    }
+}
+
+bool sd_cache_work_pending(void) {
+    return write_pending() || prefetch_pending();
+}
+
+// Programs buffered writes, and once there are none reads ahead, until
+// stop is set.
+void sd_cache_work(volatile bool *stop) {
+    while (write_pending() && !*stop)
+        write_step(stop);
+
+    if (!write_pending())
+        prefetch(stop);
+}
+
+// Programs the write buffer and ends the open read, so the card is idle
+// for other commands. Returns the first error since the last sync.
+int sd_cache_sync(void) {
+    int err = stream_close();
+
+    write_flush();
+
+    if (write_error != SD_OK) {
+        err = write_error;
+        write_error = SD_OK;
+    }
+
+    return err;
+}
+
+// Ends the open read, so the card is idle for someone else. Unlike
+// sd_cache_sync() it leaves the write buffer and its errors alone.
+void sd_cache_release(void) {
+    stream_close();
+}
+
+// Drops the window if it holds any of the sectors. Call after
+// sd_cache_sync(), before writing them.
+void sd_cache_invalidate(uint32_t lba, uint32_t n) {
+    if (lba < first + count && lba + n > first)
+        count = 0;
+}
+
+// Forgets everything after a card change, without talking to the card.
+// Sectors still in the write buffer are lost, which the next LBA_WRITE or
+// LBA_SYNC reports as SD_NO_CARD.
+void sd_cache_reset(void) {
+    if (write_pending()) {
+        lost_writes += write_count;
+        write_error = SD_NO_CARD;
+    }
+
+    write_head = 0;
+    write_count = 0;
+    run_state = RUN_NONE;
+
+    sd_spi_deselect();
+
+    stream_open = false;
+    stream_token = false;
+    stream_pos = 0;
+    token_wait = false;
+    count = 0;
+    read_end = 0;
+    sequential = false;
+}
+
+void sd_cache_set_depth(uint32_t d) {
+    depth = d < SD_CACHE_SECTORS ? d : SD_CACHE_SECTORS - 1;
+}
+
+void sd_cache_get_stats(struct sd_cache_stats *stats) {
+    stats->sectors = SD_CACHE_SECTORS;
+    stats->depth = depth;
+    stats->hits = hits;
+    stats->misses = misses;
+    stats->write_sectors = SD_WRITE_SECTORS;
+    stats->dirty = write_count;
+    stats->lost = lost_writes;
+}
@@ -0,0 +1,64 @@
+/*
+ * sd_cache.h - read-ahead and write-back sector cache for the LBA commands
+ *
+ * Keeps a window of consecutive sectors in SRAM. After an LBA read the
+ * multi-block read is left open, and when the Amiga reads sequentially
+ * the main loop keeps reading ahead into the window between requests.
+ * Written sectors go to a write buffer and are acknowledged at once; the
+ * main loop then programs them, adjacent sectors as one multi-block write.
+ */
+
+#ifndef SD_CACHE_H
+#define SD_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Size of the cache in sectors, 64 kB by default.
+#ifndef SD_CACHE_SECTORS
+#define SD_CACHE_SECTORS        128
+#endif
+
+// Sectors read ahead of the last sequential read, until changed by the
+// CACHE command. 0 turns read-ahead off.
+#ifndef SD_CACHE_DEFAULT_DEPTH
+#define SD_CACHE_DEFAULT_DEPTH  32
+#endif
+
+// Size of the write buffer in sectors, 32 kB by default.
+#ifndef SD_WRITE_SECTORS
+#define SD_WRITE_SECTORS        64
+#endif
+
+struct sd_cache_stats {
+    uint16_t sectors;
+    uint16_t depth;
+    uint32_t hits;
+    uint32_t misses;
+    uint16_t write_sectors;
+    uint16_t dirty;         // Buffered sectors not yet programmed
+    uint32_t lost;          // Buffered sectors that couldn't be programmed
+};
+
+const uint8_t *sd_cache_lookup(uint32_t lba);
+int sd_cache_stream_begin(uint32_t lba, uint8_t **slot);
+void sd_cache_stream_end(void);
+int sd_cache_read_sector(uint32_t lba, const uint8_t **data);
+void sd_cache_read_done(uint32_t lba, uint32_t count);
+
+int sd_cache_write_begin(uint32_t lba, uint32_t count);
+uint8_t *sd_cache_write_slot(void);
+void sd_cache_write_commit(uint32_t lba);
+
+bool sd_cache_work_pending(void);
+void sd_cache_work(volatile bool *stop);
+
+int sd_cache_sync(void);
+void sd_cache_release(void);
+void sd_cache_invalidate(uint32_t lba, uint32_t count);
+void sd_cache_reset(void);
+
+void sd_cache_set_depth(uint32_t depth);
+void sd_cache_get_stats(struct sd_cache_stats *stats);
+
+#endif // SD_CACHE_H
@@ -0,0 +1,370 @@
+/*
+ * sd_files.c - file-level access to the FAT volume for the FILE command
+ *
+ * Runs on the bridge core with its own FATFS object, between Amiga
+ * requests, so FatFS and the LBA commands never use the card at the
+ * same time. par_spi.c programs the LBA write buffer before each
+ * request and drops the sector cache after it.
+ *
+ * FILE_MOUNT mounts the volume again and forgets all handles, which the
+ * Amiga does when it starts and after a card change.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "sd_files.h"
+#include "sd_spi.h"
+#include "hdf_map.h"
+#include "ff.h"
+
+struct file_slot {
+    FIL fil;
+    bool used;
+};
+
+struct dir_slot {
+    DIR dir;
+    bool used;
+};
+
+static FATFS fs;
+static bool mounted;
+static struct file_slot files[SD_FILES_OPEN];
+static struct dir_slot dirs[SD_FILES_DIRS];
+
+static int status(FRESULT res) {
+    switch (res) {
+    case FR_OK:                 return SD_OK;
+    case FR_NO_FILE:
+    case FR_NO_PATH:            return FILE_NOT_FOUND;
+    case FR_EXIST:              return FILE_EXISTS;
+    case FR_DENIED:             return FILE_DENIED;
+    case FR_WRITE_PROTECTED:    return FILE_PROTECTED;
+    case FR_NOT_READY:          return SD_NO_CARD;
+    case FR_NO_FILESYSTEM:      return FILE_NO_FS;
+    case FR_INVALID_NAME:       return FILE_BAD_NAME;
+    case FR_LOCKED:             return FILE_IN_USE;
+    case FR_TOO_MANY_OPEN_FILES: return FILE_NO_HANDLE;
+    case FR_TIMEOUT:            return SD_TIMEOUT;
+    default:                    return SD_ERROR;
+    }
+}
+
+static inline uint32_t ld32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline uint8_t *st16(uint8_t *p, uint32_t v) {
+    *p++ = v >> 8;
+    *p++ = v;
+    return p;
+}
+
+static inline uint8_t *st32(uint8_t *p, uint32_t v) {
+    p = st16(p, v >> 16);
+    return st16(p, v);
+}
+
+// Makes the path at params[offset] a string. The parameter block has a
+// spare byte at the end for the terminator.
+static const char *path_at(uint8_t *params, uint32_t size, uint32_t offset) {
+    if (offset > size)
+        offset = size;
+
+    params[size] = 0;
+    return (const char *)&params[offset];
+}
+
+static FIL *get_file(uint8_t handle) {
+    return handle < SD_FILES_OPEN && files[handle].used ? &files[handle].fil : NULL;
+}
+
+static DIR *get_dir(uint8_t handle) {
+    return handle < SD_FILES_DIRS && dirs[handle].used ? &dirs[handle].dir : NULL;
+}
+
+// Writes the record of fno, and returns its size.
+static uint32_t put_record(uint8_t *p, const FILINFO *fno) {
+    uint32_t len = strlen(fno->fname);
+
+    if (len > FILE_NAME_MAX)
+        len = FILE_NAME_MAX;
+
+    *p++ = FILE_RECORD_HEADER + len;
+    *p++ = fno->fattrib;
+    p = st32(p, fno->fsize);
+    p = st16(p, fno->fdate);
+    p = st16(p, fno->ftime);
+    memcpy(p, fno->fname, len);
+
+    return FILE_RECORD_HEADER + len;
+}
+
+static int do_open(uint8_t *params, uint32_t size, uint8_t *reply, uint32_t *reply_size) {
+    if (size < 1)
+        return SD_ERROR;
+
+    uint8_t mode = params[0] & (FA_READ | FA_WRITE | FA_CREATE_NEW | FA_CREATE_ALWAYS | FA_OPEN_ALWAYS);
+    int h;
+
+    for (h = 0; h < SD_FILES_OPEN && files[h].used; h++)
+        ;
+
+    if (h == SD_FILES_OPEN)
+        return FILE_NO_HANDLE;
+
+    const char *path = path_at(params, size, 1);
+
+    // The image may only be read while the LBA commands use it
+    if ((mode & (FA_WRITE | FA_CREATE_ALWAYS)) && hdf_map_is_image(path))
+        return FILE_IN_USE;
+
+    FRESULT res = f_open(&files[h].fil, path, mode);
+    if (res != FR_OK)
+        return status(res);
+
+    files[h].used = true;
+
+    reply[0] = h;
+    st32(&reply[1], f_size(&files[h].fil));
+    *reply_size = 5;
+    return SD_OK;
+}
+
+static int do_read(uint8_t *params, uint32_t size, uint8_t *reply, uint32_t reply_max, uint32_t *reply_size) {
+    FIL *fil = size >= 1 ? get_file(params[0]) : NULL;
+    UINT n;
+
+    if (!fil)
+        return FILE_BAD_HANDLE;
+
+    FRESULT res = f_read(fil, reply, reply_max, &n);
+    *reply_size = n;
+    return status(res);
+}
+
+static int do_write(uint8_t *params, uint32_t size) {
+    FIL *fil = size >= 1 ? get_file(params[0]) : NULL;
+    UINT n;
+
+    if (!fil)
+        return FILE_BAD_HANDLE;
+
+    FRESULT res = f_write(fil, &params[1], size - 1, &n);
+    if (res != FR_OK)
+        return status(res);
+
+    return n == size - 1 ? SD_OK : FILE_FULL;
+}
+
+// whence is 0 for the start of the file, 1 for the current position and
+// 2 for the end, like OFFSET_BEGINNING to OFFSET_END plus one. Past the
+// end is an error, as in AmigaDOS.
+static int do_seek(uint8_t *params, uint32_t size, uint8_t *reply, uint32_t *reply_size) {
+    FIL *fil = size >= 6 ? get_file(params[0]) : NULL;
+
+    if (!fil)
+        return FILE_BAD_HANDLE;
+
+    uint32_t old = f_tell(fil);
+    uint32_t end = f_size(fil);
+    int32_t offset = (int32_t)ld32(&params[2]);
+    int64_t pos;
+
+    switch (params[1]) {
+    case 0:     pos = offset; break;
+    case 1:     pos = (int64_t)old + offset; break;
+    case 2:     pos = (int64_t)end + offset; break;
+    default:    return FILE_BAD_SEEK;
+    }
+
+    if (pos < 0 || pos > end)
+        return FILE_BAD_SEEK;
+
+    FRESULT res = f_lseek(fil, pos);
+    if (res != FR_OK)
+        return status(res);
+
+    st32(reply, old);
+    st32(&reply[4], end);
+    *reply_size = 8;
+    return SD_OK;
+}
+
+static int do_close(uint8_t *params, uint32_t size) {
+    FIL *fil = size >= 1 ? get_file(params[0]) : NULL;
+
+    if (!fil)
+        return FILE_BAD_HANDLE;
+
+    files[params[0]].used = false;
+    return status(f_close(fil));
+}
+
+static int do_stat(uint8_t *params, uint32_t size, uint8_t *reply, uint32_t *reply_size) {
+    const char *path = path_at(params, size, 0);
+    FILINFO fno;
+
+    // FatFS has no entry for the root directory
+    if (!*path) {
+        memset(&fno, 0, sizeof(fno));
+        fno.fattrib = AM_DIR;
+    } else {
+        FRESULT res = f_stat(path, &fno);
+        if (res != FR_OK)
+            return status(res);
+    }
+
+    *reply_size = put_record(reply, &fno);
+    return SD_OK;
+}
+
+static int do_dir_open(uint8_t *params, uint32_t size, uint8_t *reply, uint32_t *reply_size) {
+    int h;
+
+    for (h = 0; h < SD_FILES_DIRS && dirs[h].used; h++)
+        ;
+
+    if (h == SD_FILES_DIRS)
+        return FILE_NO_HANDLE;
+
+    FRESULT res = f_opendir(&dirs[h].dir, path_at(params, size, 0));
+    if (res != FR_OK)
+        return status(res);
+
+    dirs[h].used = true;
+
+    reply[0] = h;
+    *reply_size = 1;
+    return SD_OK;
+}
+
+// Sends records while another of the largest size fits, so no entry read
+// from the directory is ever left over.
+static int do_dir_read(uint8_t *params, uint32_t size, uint8_t *reply, uint32_t reply_max, uint32_t *reply_size) {
+    DIR *dir = size >= 1 ? get_dir(params[0]) : NULL;
+    uint32_t n = 0;
+
+    if (!dir)
+        return FILE_BAD_HANDLE;
+
+    while (reply_max - n >= FILE_RECORD_MAX) {
+        FILINFO fno;
+
+        FRESULT res = f_readdir(dir, &fno);
+        if (res != FR_OK)
+            return status(res);
+
+        if (!fno.fname[0])
+            break;
+
+        n += put_record(&reply[n], &fno);
+    }
+
+    *reply_size = n;
+    return SD_OK;
+}
+
+static int do_dir_close(uint8_t *params, uint32_t size) {
+    DIR *dir = size >= 1 ? get_dir(params[0]) : NULL;
+
+    if (!dir)
+        return FILE_BAD_HANDLE;
+
+    dirs[params[0]].used = false;
+    return status(f_closedir(dir));
+}
+
+static int do_delete(uint8_t *params, uint32_t size) {
+    const char *path = path_at(params, size, 0);
+
+    if (hdf_map_is_image(path))
+        return FILE_IN_USE;
+
+    return status(f_unlink(path));
+}
+
+static int do_rename(uint8_t *params, uint32_t size) {
+    const char *from = path_at(params, size, 0);
+    uint32_t split = strlen(from) + 1;
+
+    if (split > size)
+        return SD_ERROR;
+
+    if (hdf_map_is_image(from))
+        return FILE_IN_USE;
+
+    return status(f_rename(from, path_at(params, size, split)));
+}
+
+static int do_info(uint8_t *reply, uint32_t *reply_size) {
+    FATFS *f;
+    DWORD free_clusters;
+
+    FRESULT res = f_getfree("", &free_clusters, &f);
+    if (res != FR_OK)
+        return status(res);
+
+    st32(reply, (f->n_fatent - 2) * f->csize);
+    st32(&reply[4], free_clusters * f->csize);
+    *reply_size = 8;
+    return SD_OK;
+}
+
+static int do_mount(void) {
+    sd_files_reset();
+
+    FRESULT res = f_mount(&fs, "", 1);
+    mounted = res == FR_OK;
+    return status(res);
+}
+
+// Runs one request. params has size bytes and room for one more, reply
+// room for reply_max bytes, at least FILE_RECORD_MAX, and *reply_size is
+// set to what the reply holds.
+int sd_files_request(uint8_t op, uint8_t *params, uint32_t size,
+                     uint8_t *reply, uint32_t reply_max, uint32_t *reply_size) {
+    *reply_size = 0;
+
+    if (op == FILE_MOUNT)
+        return do_mount();
+
+    if (!mounted)
+        return SD_NO_CARD;
+
+    switch (op) {
+    case FILE_OPEN:         return do_open(params, size, reply, reply_size);
+    case FILE_READ:         return do_read(params, size, reply, reply_max, reply_size);
+    case FILE_WRITE:        return do_write(params, size);
+    case FILE_SEEK:         return do_seek(params, size, reply, reply_size);
+    case FILE_CLOSE:        return do_close(params, size);
+    case FILE_STAT:         return do_stat(params, size, reply, reply_size);
+    case FILE_DIR_OPEN:     return do_dir_open(params, size, reply, reply_size);
+    case FILE_DIR_READ:     return do_dir_read(params, size, reply, reply_max, reply_size);
+    case FILE_DIR_CLOSE:    return do_dir_close(params, size);
+    case FILE_DELETE:       return do_delete(params, size);
+    case FILE_RENAME:       return do_rename(params, size);
+    case FILE_MKDIR:        return status(f_mkdir(path_at(params, size, 0)));
+    case FILE_INFO:         return do_info(reply, reply_size);
+    default:                return SD_ERROR;
+    }
+}
+
+// Writes out what FatFS still holds of the open files, before a reboot.
+void sd_files_sync(void) {
+    for (int i = 0; i < SD_FILES_OPEN; i++)
+        if (files[i].used)
+            f_sync(&files[i].fil);
+}
+
+// Forgets the volume and every handle, without touching the card, after
+// a card change. Data not yet written from open files is lost.
+void sd_files_reset(void) {
+    memset(files, 0, sizeof(files));
+    memset(dirs, 0, sizeof(dirs));
+
+    if (mounted)
+        f_mount(NULL, "", 0);
+
+    mounted = false;
+}
@@ -0,0 +1,68 @@
+/*
+ * sd_files.h - file-level access to the FAT volume for the FILE command
+ *
+ * The Amiga sends requests like open, read, write, seek and read
+ * directory, and FatFS runs them here. Only file data and compact
+ * directory records go over the parallel port; the FAT, the directories
+ * and the cluster chains are never seen by the Amiga.
+ *
+ * A request is an op with a parameter block, and its reply a status and
+ * a block of at most the size the Amiga asked for. Files and directories
+ * are referred to by a handle byte from FILE_OPEN or FILE_DIR_OPEN, and
+ * paths are relative to the root of the volume, with / between names.
+ */
+
+#ifndef SD_FILES_H
+#define SD_FILES_H
+
+#include <stdint.h>
+
+// Largest parameter block and reply, the most one FILE_READ or
+// FILE_WRITE moves
+#define SD_FILES_CHUNK      8192
+
+// Files and directories open at once
+#define SD_FILES_OPEN       8
+#define SD_FILES_DIRS       4
+
+#define FILE_MOUNT          0   // () -> ()
+#define FILE_OPEN           1   // (mode, path) -> (handle, size.l)
+#define FILE_READ           2   // (handle) -> (data)
+#define FILE_WRITE          3   // (handle, data) -> ()
+#define FILE_SEEK           4   // (handle, whence, offset.l) -> (old.l, size.l)
+#define FILE_CLOSE          5   // (handle) -> ()
+#define FILE_STAT           6   // (path) -> (record)
+#define FILE_DIR_OPEN       7   // (path) -> (handle)
+#define FILE_DIR_READ       8   // (handle) -> (records)
+#define FILE_DIR_CLOSE      9   // (handle) -> ()
+#define FILE_DELETE         10  // (path) -> ()
+#define FILE_RENAME         11  // (path, 0, new path) -> ()
+#define FILE_MKDIR          12  // (path) -> ()
+#define FILE_INFO           13  // () -> (sectors.l, free sectors.l)
+
+// Status codes from 4 on, after SD_OK to SD_NO_CARD
+#define FILE_NOT_FOUND      4
+#define FILE_EXISTS         5
+#define FILE_DENIED         6   // Directory not empty, read-only, or full
+#define FILE_NO_HANDLE      7
+#define FILE_BAD_HANDLE     8
+#define FILE_FULL           9
+#define FILE_PROTECTED      10
+#define FILE_NO_FS          11
+#define FILE_BAD_NAME       12
+#define FILE_IN_USE         13
+#define FILE_BAD_SEEK       14
+
+// A directory record: length of the record, attributes, size, FAT date
+// and time, and the name without a terminator, big endian. FILE_DIR_READ
+// sends as many as fit, and none at the end of the directory.
+#define FILE_RECORD_HEADER  10
+#define FILE_NAME_MAX       107
+#define FILE_RECORD_MAX     (FILE_RECORD_HEADER + FILE_NAME_MAX)
+
+int sd_files_request(uint8_t op, uint8_t *params, uint32_t size,
+                     uint8_t *reply, uint32_t reply_max, uint32_t *reply_size);
+void sd_files_sync(void);
+void sd_files_reset(void);
+
+#endif // SD_FILES_H
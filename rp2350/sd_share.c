@@ -0,0 +1,272 @@
+/*
+ * sd_share.c - SD card shared between the bridge and the FTP server
+ *
+ * Core 1 asks for the card by setting wanted and waking core 0. Between
+ * requests, with no chip select asserted, core 0 sets PIO IRQ flag 0,
+ * which stops the ACT mirror from answering a new REQ, and then checks
+ * that REQ is still high. If it is, the card is lent: core 1 runs up to
+ * SD_SHARE_CHUNK sectors with sd_spi.c, puts back the SPI settings of
+ * the active target and clears the flag. A request that came in
+ * meanwhile gets ACT then, and core 0 waits for the card to be back
+ * before it handles it.
+ *
+ * The FatFS disk functions at the end run on core 1 and replace the
+ * driver in lib/fatfs.
+ */
+
+#include "sd_share.h"
+#include "main.h"
+#include "sd_spi.h"
+#include "sd_cache.h"
+#include "hardware/gpio.h"
+#include "hardware/spi.h"
+#include "hardware/sync.h"
+#include "act_mirror.pio.h"
+#include "ff.h"
+#include "diskio.h"
+#include <FreeRTOS.h>
+#include <task.h>
+
+// How long core 1 spins for the card before it sleeps between checks
+#define SD_SHARE_SPIN_US    200
+
+static PIO gate_pio;
+
+static volatile bool wanted;
+static volatile bool lent;
+static uint32_t lent_baud;
+static uint8_t lent_mode;
+
+// Set once the Amiga has used the card, until it is changed
+static volatile bool amiga_mounted;
+// Counts Amiga writes and card changes, so FatFS knows to mount again
+static volatile uint32_t generation;
+static volatile bool reopen = true;
+
+void sd_share_init(PIO pio) {
+    gate_pio = pio;
+}
+
+// ============================================================================
+// Core 0
+// ============================================================================
+
+bool sd_share_wanted(void) {
+    return wanted && !lent;
+}
+
+// Lends the card to core 1 unless a request has started. baud and mode
+// are the SPI settings core 1 restores when it gives the card back.
+bool sd_share_lend(uint32_t baud, uint8_t mode) {
+    gate_pio->irq_force = 1u << ACT_MIRROR_GATE_IRQ;
+
+    // The flag is set once this read completes. A REQ that went low
+    // before that may already have ACT, so it is seen low below.
+    (void)gate_pio->irq;
+
+    if (!(gpio_get_all() & (1 << PIN_REQ))) {
+        pio_interrupt_clear(gate_pio, ACT_MIRROR_GATE_IRQ);
+        return false;
+    }
+
+    // Leave the card idle, with nothing buffered
+    sd_cache_release();
+
+    lent_baud = baud;
+    lent_mode = mode;
+    __dmb();
+    lent = true;
+    return true;
+}
+
+// Waits until core 1 has given the card back.
+void sd_share_reclaim(void) {
+    while (lent)
+        tight_loop_contents();
+
+    __dmb();
+}
+
+void sd_share_amiga_used(bool wrote) {
+    amiga_mounted = true;
+
+    if (wrote)
+        generation++;
+}
+
+void sd_share_card_changed(void) {
+    amiga_mounted = false;
+    reopen = true;
+    generation++;
+}
+
+// ============================================================================
+// Core 1
+// ============================================================================
+
+static void borrow(void) {
+    uint32_t start = time_us_32();
+
+    wanted = true;
+    __dmb();
+    __sev();
+
+    // Core 0 may be asleep, or the Amiga may hold a chip select
+    while (!lent) {
+        if (time_us_32() - start >= SD_SHARE_SPIN_US) {
+            vTaskDelay(1);
+            __sev();
+        }
+    }
+
+    wanted = false;
+    __dmb();
+
+    spi_set_format(spi0, 8, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
+    spi_set_baudrate(spi0, SPI_FAST_FREQUENCY);
+}
+
+static void give_back(void) {
+    spi_set_format(spi0, 8,
+            lent_mode & 2 ? SPI_CPOL_1 : SPI_CPOL_0,
+            lent_mode & 1 ? SPI_CPHA_1 : SPI_CPHA_0,
+            SPI_MSB_FIRST);
+    spi_set_baudrate(spi0, lent_baud);
+
+    __dmb();
+    lent = false;
+    pio_interrupt_clear(gate_pio, ACT_MIRROR_GATE_IRQ);
+}
+
+static int read_sectors(uint8_t *buf, uint32_t lba, uint32_t n) {
+    int err = sd_spi_read_start(lba, n);
+    if (err != SD_OK)
+        return err;
+
+    for (uint32_t i = 0; i < n && err == SD_OK; i++) {
+        err = sd_spi_read_token();
+        if (err == SD_OK) {
+            sd_spi_read_data(buf + i * SD_SECTOR_SIZE, SD_SECTOR_SIZE);
+            sd_spi_read_crc();
+        }
+    }
+
+    int stop = sd_spi_read_stop(n);
+    return err != SD_OK ? err : stop;
+}
+
+static int write_sectors(const uint8_t *buf, uint32_t lba, uint32_t n) {
+    int err = sd_spi_write_start(lba, n);
+    if (err != SD_OK)
+        return err;
+
+    for (uint32_t i = 0; i < n && err == SD_OK; i++) {
+        sd_spi_write_token(n);
+        sd_spi_write_data(buf + i * SD_SECTOR_SIZE, SD_SECTOR_SIZE);
+        err = sd_spi_write_finish();
+    }
+
+    int stop = sd_spi_write_stop(n);
+    return err != SD_OK ? err : stop;
+}
+
+static bool card_ready;
+static uint32_t seen_generation;
+
+DSTATUS disk_status(BYTE pdrv) {
+    DSTATUS stat = 0;
+
+    if (pdrv)
+        return STA_NOINIT;
+
+    if (!card_ready || seen_generation != generation)
+        stat |= STA_NOINIT;
+
+    if (amiga_mounted)
+        stat |= STA_PROTECT;
+
+    return stat;
+}
+
+DSTATUS disk_initialize(BYTE pdrv) {
+    if (pdrv)
+        return STA_NOINIT;
+
+    borrow();
+    seen_generation = generation;
+
+    if (reopen || !sd_spi_is_open()) {
+        uint8_t info[SD_INFO_SIZE];
+        card_ready = sd_spi_open(info) == SD_OK;
+        reopen = !card_ready;
+    } else {
+        card_ready = true;
+    }
+
+    give_back();
+    return disk_status(pdrv);
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
+    if (pdrv || !card_ready)
+        return RES_NOTRDY;
+
+    while (count) {
+        UINT n = count < SD_SHARE_CHUNK ? count : SD_SHARE_CHUNK;
+
+        borrow();
+        int err = read_sectors(buff, sector, n);
+        give_back();
+
+        if (err != SD_OK)
+            return RES_ERROR;
+
+        buff += n * SD_SECTOR_SIZE;
+        sector += n;
+        count -= n;
+    }
+
+    return RES_OK;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count) {
+    if (pdrv || !card_ready)
+        return RES_NOTRDY;
+
+    if (amiga_mounted)
+        return RES_WRPRT;
+
+    while (count) {
+        UINT n = count < SD_SHARE_CHUNK ? count : SD_SHARE_CHUNK;
+
+        borrow();
+        sd_cache_invalidate(sector, n);
+        int err = write_sectors(buff, sector, n);
+        give_back();
+
+        if (err != SD_OK)
+            return RES_ERROR;
+
+        buff += n * SD_SECTOR_SIZE;
+        sector += n;
+        count -= n;
+    }
+
+    return RES_OK;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff) {
+    if (pdrv)
+        return RES_PARERR;
+
+    if (!card_ready)
+        return RES_NOTRDY;
+
+    switch (cmd) {
+        case CTRL_SYNC:
+            // Sectors are programmed before disk_write() returns
+            return RES_OK;
+        default:
+            return RES_PARERR;
+    }
+}
@@ -0,0 +1,36 @@
+/*
+ * sd_share.h - SD card shared between the bridge and the FTP server
+ *
+ * In the combined mode the bridge runs on core 0 and FreeRTOS with the
+ * FTP server on core 1. Core 0 owns the card, and lends it to FatFS on
+ * core 1 for one short block transfer at a time, between Amiga requests.
+ * While it is lent, the ACT mirror holds ACT high, so a new request
+ * waits until the card is back.
+ *
+ * FatFS gets the card read-only once the Amiga has used it, until the
+ * card is changed, since the Amiga caches the filesystem itself. Writes
+ * from the Amiga make FatFS mount the volume again before its next
+ * access.
+ */
+
+#ifndef SD_SHARE_H
+#define SD_SHARE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hardware/pio.h"
+
+// Sectors core 1 moves per loan, which bounds how long a request waits
+#ifndef SD_SHARE_CHUNK
+#define SD_SHARE_CHUNK      8
+#endif
+
+// Core 0
+void sd_share_init(PIO pio);
+bool sd_share_wanted(void);
+bool sd_share_lend(uint32_t baud, uint8_t mode);
+void sd_share_reclaim(void);
+void sd_share_amiga_used(bool wrote);
+void sd_share_card_changed(void);
+
+#endif // SD_SHARE_H
@@ -0,0 +1,331 @@
+/*
+ * sd_spi.c - SD card protocol over SPI, run by the bridge firmware
+ *
+ * Follows examples/spisd/sd.c on the Amiga side, which in turn is based on
+ * Mike Stirling's k1208-drivers. The sector data itself is not moved here,
+ * par_spi.c clocks it between the card and the parallel port one byte at a
+ * time with sd_spi_xfer(), keeping a copy of read sectors in sd_cache.c.
+ */
+
+#include "sd_spi.h"
+#include "hardware/gpio.h"
+#include "hardware/timer.h"
+
+#define SD_SLOW_FREQUENCY   (400*1000)
+
+#define READY_TIMEOUT_MS    500
+#define INIT_TIMEOUT_MS     1000
+#define MAX_RESPONSE_POLLS  10
+
+#define CMD0    (0)         // GO_IDLE_STATE
+#define CMD1    (1)         // SEND_OP_COND (MMC)
+#define ACMD41  (0x80+41)   // SEND_OP_COND (SDC)
+#define CMD8    (8)         // SEND_IF_COND
+#define CMD9    (9)         // SEND_CSD
+#define CMD10   (10)        // SEND_CID
+#define CMD12   (12)        // STOP_TRANSMISSION
+#define CMD16   (16)        // SET_BLOCKLEN
+#define CMD17   (17)        // READ_SINGLE_BLOCK
+#define CMD18   (18)        // READ_MULTIPLE_BLOCK
+#define ACMD23  (0x80+23)   // SET_WR_BLK_ERASE_COUNT (SDC)
+#define CMD24   (24)        // WRITE_BLOCK
+#define CMD25   (25)        // WRITE_MULTIPLE_BLOCK
+#define CMD55   (55)        // APP_CMD
+#define CMD58   (58)        // READ_OCR
+
+static spi_inst_t *sd_spi;
+static uint sd_pin_ss;
+static uint sd_fast_frequency;
+static uint8_t sd_type;
+
+void sd_spi_setup(spi_inst_t *spi, uint pin_ss, uint fast_frequency) {
+    sd_spi = spi;
+    sd_pin_ss = pin_ss;
+    sd_fast_frequency = fast_frequency;
+}
+
+uint8_t sd_spi_xfer(uint8_t value) {
+    uint8_t in;
+    spi_write_read_blocking(sd_spi, &value, &in, 1);
+    return in;
+}
+
+static bool expired(uint32_t start, uint32_t ms) {
+    return time_us_32() - start >= ms * 1000;
+}
+
+static int wait_ready(void) {
+    uint32_t start = time_us_32();
+
+    do {
+        if (sd_spi_xfer(0xff) == 0xff)
+            return SD_OK;
+    } while (!expired(start, READY_TIMEOUT_MS));
+
+    return SD_TIMEOUT;
+}
+
+static void deselect(void) {
+    gpio_put(sd_pin_ss, 1);
+}
+
+// Assert and release CS around the reads and writes that sd_cache.c
+// leaves open between requests.
+void sd_spi_select(void) {
+    gpio_put(sd_pin_ss, 0);
+}
+
+void sd_spi_deselect(void) {
+    deselect();
+}
+
+static uint8_t send_cmd(uint8_t cmd, uint32_t arg) {
+    uint8_t res;
+
+    if (cmd & 0x80) {
+        // Send CMD55 prior to ACMD
+        cmd &= 0x7f;
+        res = send_cmd(CMD55, 0);
+        if (res > 1)
+            return res;
+    }
+
+    // Select the card and wait for ready except for abort
+    if (cmd != CMD12) {
+        deselect();
+        gpio_put(sd_pin_ss, 0);
+
+        if (wait_ready() != SD_OK) {
+            deselect();
+            return 0xff;
+        }
+    }
+
+    uint8_t crc = 0x01;
+    if (cmd == CMD0)
+        crc = 0x95;
+    else if (cmd == CMD8)
+        crc = 0x87;
+
+    uint8_t buf[6] = {
+        0x40 | cmd, arg >> 24, arg >> 16, arg >> 8, arg, crc
+    };
+    spi_write_blocking(sd_spi, buf, sizeof(buf));
+
+    // Skip the stuff byte after CMD12
+    if (cmd == CMD12)
+        sd_spi_xfer(0xff);
+
+    for (int n = 0; n < MAX_RESPONSE_POLLS; n++) {
+        res = sd_spi_xfer(0xff);
+        if (!(res & 0x80))
+            break;
+    }
+
+    return res;
+}
+
+static uint32_t get_r7_resp(void) {
+    uint8_t buf[4];
+    spi_read_blocking(sd_spi, 0xff, buf, 4);
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+static int read_block(uint8_t *buf, uint32_t size) {
+    int err = sd_spi_read_token();
+    if (err != SD_OK)
+        return err;
+
+    sd_spi_read_data(buf, size);
+    sd_spi_read_crc();
+    return SD_OK;
+}
+
+static bool wait_init(uint8_t cmd, uint32_t arg) {
+    uint32_t start = time_us_32();
+
+    while (send_cmd(cmd, arg) > 0) {
+        if (expired(start, INIT_TIMEOUT_MS))
+            return false;
+    }
+
+    return true;
+}
+
+int sd_spi_open(uint8_t *info) {
+    sd_type = SD_TYPE_NONE;
+    spi_set_baudrate(sd_spi, SD_SLOW_FREQUENCY);
+
+    // Send dummy clocks with CS high
+    deselect();
+    for (int i = 0; i < 12; i++)
+        sd_spi_xfer(0xff);
+
+    if (send_cmd(CMD0, 0) == 1) {
+        if (send_cmd(CMD8, 0x1aa) == 1) {
+            if (get_r7_resp() == 0x1aa && wait_init(ACMD41, 1ul << 30)) {
+                sd_type = SD_TYPE_SD2;
+
+                if (send_cmd(CMD58, 0) == 0) {
+                    if (get_r7_resp() & (1ul << 30))
+                        sd_type = SD_TYPE_SDHC;
+                } else {
+                    sd_type = SD_TYPE_NONE;
+                }
+            }
+        } else {
+            uint8_t cmd;
+
+            if (send_cmd(ACMD41, 0) <= 1) {
+                sd_type = SD_TYPE_SD1;
+                cmd = ACMD41;
+            } else {
+                sd_type = SD_TYPE_MMC;
+                cmd = CMD1;
+            }
+
+            if (!wait_init(cmd, 0) || send_cmd(CMD16, SD_SECTOR_SIZE) > 0)
+                sd_type = SD_TYPE_NONE;
+        }
+    }
+
+    int err = SD_NO_CARD;
+
+    if (sd_type != SD_TYPE_NONE) {
+        info[0] = sd_type;
+
+        err = SD_ERROR;
+        if (send_cmd(CMD10, 0) == 0 && read_block(&info[1], 16) == SD_OK &&
+                send_cmd(CMD9, 0) == 0 && read_block(&info[17], 16) == SD_OK)
+            err = SD_OK;
+
+        spi_set_baudrate(sd_spi, sd_fast_frequency);
+    }
+
+    if (err != SD_OK)
+        sd_type = SD_TYPE_NONE;
+
+    deselect();
+    return err;
+}
+
+bool sd_spi_is_open(void) {
+    return sd_type != SD_TYPE_NONE;
+}
+
+static uint32_t card_address(uint32_t lba) {
+    // Only SDHC cards use block addressing
+    return sd_type == SD_TYPE_SDHC ? lba : lba << 9;
+}
+
+int sd_spi_read_start(uint32_t lba, uint32_t count) {
+    if (sd_type == SD_TYPE_NONE)
+        return SD_NO_CARD;
+
+    if (send_cmd(count == 1 ? CMD17 : CMD18, card_address(lba)) != 0) {
+        deselect();
+        return SD_ERROR;
+    }
+
+    return SD_OK;
+}
+
+// Waits for the data start token of the next block.
+int sd_spi_read_token(void) {
+    uint32_t start = time_us_32();
+    uint8_t token;
+
+    do {
+        token = sd_spi_xfer(0xff);
+    } while (token == 0xff && !expired(start, READY_TIMEOUT_MS));
+
+    if (token == 0xfe)
+        return SD_OK;
+
+    return token == 0xff ? SD_TIMEOUT : SD_ERROR;
+}
+
+void sd_spi_read_data(uint8_t *buf, uint32_t size) {
+    spi_read_blocking(sd_spi, 0xff, buf, size);
+}
+
+void sd_spi_read_crc(void) {
+    sd_spi_xfer(0xff);
+    sd_spi_xfer(0xff);
+}
+
+int sd_spi_read_stop(uint32_t count) {
+    int err = SD_OK;
+
+    if (count > 1 && send_cmd(CMD12, 0) != 0)
+        err = SD_ERROR;
+
+    deselect();
+    return err;
+}
+
+int sd_spi_write_start(uint32_t lba, uint32_t count) {
+    if (sd_type == SD_TYPE_NONE)
+        return SD_NO_CARD;
+
+    // Pre-defined sector count
+    if (count > 1 && sd_type != SD_TYPE_MMC)
+        send_cmd(ACMD23, count);
+
+    if (send_cmd(count == 1 ? CMD24 : CMD25, card_address(lba)) != 0) {
+        deselect();
+        return SD_ERROR;
+    }
+
+    return SD_OK;
+}
+
+void sd_spi_write_token(uint32_t count) {
+    sd_spi_xfer(count == 1 ? 0xfe : 0xfc);
+}
+
+void sd_spi_write_data(const uint8_t *buf, uint32_t size) {
+    spi_write_blocking(sd_spi, buf, size);
+}
+
+// Sends the dummy CRC after a block and checks the data response. The
+// card is busy programming the block afterwards.
+int sd_spi_write_response(void) {
+    sd_spi_xfer(0xff);
+    sd_spi_xfer(0xff);
+
+    uint8_t resp = sd_spi_xfer(0xff);
+    if ((resp & 0x1f) != 0x05)
+        return SD_ERROR;
+
+    return SD_OK;
+}
+
+// Like sd_spi_write_response(), and waits for the card to finish
+// programming.
+int sd_spi_write_finish(void) {
+    int err = sd_spi_write_response();
+    if (err != SD_OK)
+        return err;
+
+    return wait_ready();
+}
+
+// STOP_TRAN. The byte after it is undefined, the card goes busy after
+// that.
+void sd_spi_write_stop_token(void) {
+    sd_spi_xfer(0xfd);
+    sd_spi_xfer(0xff);
+}
+
+int sd_spi_write_stop(uint32_t count) {
+    int err = SD_OK;
+
+    if (count > 1) {
+        sd_spi_write_stop_token();
+        err = wait_ready();
+    }
+
+    deselect();
+    return err;
+}
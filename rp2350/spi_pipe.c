@@ -0,0 +1,122 @@
+/*
+ * spi_pipe.c - core 1 SPI worker for the byte-pump READ/WRITE transfers
+ *
+ * Jobs are posted through the SIO FIFO, one word per transfer holding the
+ * direction and the byte count. Core 1 keeps up to SPI_IN_FLIGHT bytes in
+ * the SPI FIFO, so the bus clocks back to back. Reads run ahead of the
+ * Amiga until the ring is full; the Amiga asked for exactly count bytes,
+ * so nothing is clocked that it won't read unless it aborts.
+ */
+
+#include "spi_pipe.h"
+#include "hardware/spi.h"
+#include "pico/multicore.h"
+
+#define JOB_READ        0x80000000
+#define JOB_COUNT_MASK  0x01ffffff
+
+// Bytes core 1 keeps in the 8 entry SPI FIFO
+#define SPI_IN_FLIGHT   4
+
+struct spi_pipe_ring spi_pipe_rx;
+struct spi_pipe_ring spi_pipe_tx;
+
+static volatile bool busy;
+static volatile bool abort_job;
+
+static void __not_in_flash_func(run_read)(uint32_t count) {
+    uint32_t sent = 0;
+    uint32_t received = 0;
+
+    while (received < count && !abort_job) {
+        uint32_t queued = sent - received;
+
+        if (sent < count && queued < SPI_IN_FLIGHT &&
+            spi_pipe_used(&spi_pipe_rx) + queued < SPI_PIPE_RING_SIZE) {
+            spi_get_hw(spi0)->dr = 0xff;
+            sent++;
+        }
+
+        if (spi_is_readable(spi0)) {
+            spi_pipe_put(&spi_pipe_rx, spi_get_hw(spi0)->dr);
+            received++;
+        }
+    }
+}
+
+static void __not_in_flash_func(run_write)(uint32_t count) {
+    uint32_t sent = 0;
+    uint32_t received = 0;
+
+    while (received < count) {
+        uint32_t value;
+
+        if (sent - received < SPI_IN_FLIGHT && spi_pipe_get(&spi_pipe_tx, &value)) {
+            spi_get_hw(spi0)->dr = value;
+            sent++;
+        } else if (sent == received && abort_job && !spi_pipe_used(&spi_pipe_tx)) {
+            // Core 0 sets abort_job after its last put
+            break;
+        }
+
+        if (spi_is_readable(spi0)) {
+            (void)spi_get_hw(spi0)->dr;
+            received++;
+        }
+    }
+}
+
+static void __not_in_flash_func(core1_main)(void) {
+    while (1) {
+        uint32_t job = multicore_fifo_pop_blocking();
+        uint32_t count = job & JOB_COUNT_MASK;
+
+        if (job & JOB_READ)
+            run_read(count);
+        else
+            run_write(count);
+
+        // Bytes still on their way in after an aborted read
+        while (spi_is_busy(spi0))
+            tight_loop_contents();
+
+        while (spi_is_readable(spi0))
+            (void)spi_get_hw(spi0)->dr;
+
+        __dmb();
+        busy = false;
+    }
+}
+
+void spi_pipe_init(void) {
+    multicore_launch_core1(core1_main);
+}
+
+static void post(uint32_t job) {
+    busy = true;
+    __dmb();
+    multicore_fifo_push_blocking(job);
+}
+
+void spi_pipe_read(uint32_t count) {
+    post(JOB_READ | count);
+}
+
+void spi_pipe_write(uint32_t count) {
+    post(count);
+}
+
+void __not_in_flash_func(spi_pipe_finish)(bool aborted) {
+    if (aborted) {
+        __dmb();
+        abort_job = true;
+    }
+
+    while (busy)
+        tight_loop_contents();
+
+    __dmb();
+    spi_pipe_rx.head = spi_pipe_rx.tail = 0;
+    spi_pipe_tx.head = spi_pipe_tx.tail = 0;
+    abort_job = false;
+}
@@ -0,0 +1,80 @@
+/*
+ * spi_pipe.h - core 1 SPI worker for the byte-pump READ/WRITE transfers
+ *
+ * Core 0 keeps the parallel port handshake and core 1 clocks the SPI
+ * bus. The bytes go through two single-producer/single-consumer rings in
+ * SRAM, so the Amiga's CLK edge is answered from the ring instead of
+ * waiting for the SPI FIFO. Core 1 is only given a job for the length of
+ * one transfer, and core 0 waits for it to finish before it touches the
+ * SPI bus again, so nothing else has to change hands.
+ */
+
+#ifndef SPI_PIPE_H
+#define SPI_PIPE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hardware/sync.h"
+
+// Ring size in bytes, a power of two
+#ifndef SPI_PIPE_RING_SIZE
+#define SPI_PIPE_RING_SIZE      512
+#endif
+
+// Bytes core 0 lets pile up in front of the SPI bus on writes. Whatever
+// is queued when the transfer ends has to be clocked out before the next
+// command byte can be read, so this stays well below the 1-2 us the
+// Amiga gives us at the fast SPI speed.
+#ifndef SPI_PIPE_WRITE_AHEAD
+#define SPI_PIPE_WRITE_AHEAD    2
+#endif
+
+struct spi_pipe_ring {
+    volatile uint32_t head;     // Written by the producer only
+    volatile uint32_t tail;     // Written by the consumer only
+    uint8_t data[SPI_PIPE_RING_SIZE];
+};
+
+extern struct spi_pipe_ring spi_pipe_rx;   // Core 1 -> core 0, READ
+extern struct spi_pipe_ring spi_pipe_tx;   // Core 0 -> core 1, WRITE
+
+static inline uint32_t spi_pipe_used(const struct spi_pipe_ring *ring) {
+    return ring->head - ring->tail;
+}
+
+// Returns false if the ring is empty.
+static inline bool spi_pipe_get(struct spi_pipe_ring *ring, uint32_t *value) {
+    uint32_t tail = ring->tail;
+
+    if (ring->head == tail)
+        return false;
+
+    __dmb();
+    *value = ring->data[tail & (SPI_PIPE_RING_SIZE - 1)];
+    __dmb();
+    ring->tail = tail + 1;
+    return true;
+}
+
+// The caller checks for space first.
+static inline void spi_pipe_put(struct spi_pipe_ring *ring, uint32_t value) {
+    uint32_t head = ring->head;
+
+    ring->data[head & (SPI_PIPE_RING_SIZE - 1)] = value;
+    __dmb();
+    ring->head = head + 1;
+}
+
+void spi_pipe_init(void);
+
+// Starts clocking count bytes from SPI into spi_pipe_rx.
+void spi_pipe_read(uint32_t count);
+
+// Starts sending count bytes from spi_pipe_tx to SPI.
+void spi_pipe_write(uint32_t count);
+
+// Waits for the job to end and empties the rings. If the transfer was
+// aborted, core 1 stops reading, but still sends what was written.
+void spi_pipe_finish(bool aborted);
+
+#endif // SPI_PIPE_H
@@ -0,0 +1,78 @@
+/*
+ * spi_prefetch.c - DMA read-ahead for the CPU read loops
+ *
+ * One channel writes 0xff to the SPI data register and the other moves
+ * the bytes clocked in to the ring, wrapping its write address. The
+ * receive channel has the higher priority, so the SPI RX FIFO is emptied
+ * before the TX side can run more than a FIFO ahead.
+ *
+ * The transmit channel is given at most a ring less one byte ahead of
+ * the byte the loop waits for, half a ring at a time after the first, so
+ * a READ3 larger than the ring never overwrites bytes not yet sent.
+ */
+
+#include "spi_prefetch.h"
+
+uint8_t spi_prefetch_buf[SPI_PREFETCH_SIZE] __attribute__((aligned(SPI_PREFETCH_SIZE)));
+int spi_prefetch_rx_chan;
+
+static spi_inst_t *prefetch_spi;
+static int tx_chan;
+
+static uint32_t total;
+static uint32_t sent;
+
+static const uint8_t fill_byte = 0xff;
+
+void spi_prefetch_init(spi_inst_t *spi) {
+    prefetch_spi = spi;
+    tx_chan = dma_claim_unused_channel(true);
+    spi_prefetch_rx_chan = dma_claim_unused_channel(true);
+}
+
+void spi_prefetch_start(uint32_t count) {
+    dma_channel_config c = dma_channel_get_default_config(spi_prefetch_rx_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_ring(&c, true, SPI_PREFETCH_BITS);
+    channel_config_set_dreq(&c, spi_get_dreq(prefetch_spi, false));
+    channel_config_set_high_priority(&c, true);
+    dma_channel_configure(spi_prefetch_rx_chan, &c, spi_prefetch_buf,
+                          &spi_get_hw(prefetch_spi)->dr, count, true);
+
+    total = count;
+    sent = count < SPI_PREFETCH_SIZE ? count : SPI_PREFETCH_SIZE - 1;
+
+    c = dma_channel_get_default_config(tx_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, spi_get_dreq(prefetch_spi, true));
+    dma_channel_configure(tx_chan, &c, &spi_get_hw(prefetch_spi)->dr,
+                          &fill_byte, sent, true);
+}
+
+void spi_prefetch_more(uint32_t i) {
+    if (sent == total || dma_channel_is_busy(tx_chan))
+        return;
+
+    uint32_t room = i + SPI_PREFETCH_SIZE - 1 - sent;
+    if (room < SPI_PREFETCH_SIZE / 2 && room < total - sent)
+        return;
+
+    uint32_t n = room < total - sent ? room : total - sent;
+    dma_channel_set_trans_count(tx_chan, n, true);
+    sent += n;
+}
+
+void spi_prefetch_finish(void) {
+    dma_channel_abort(tx_chan);
+    dma_channel_abort(spi_prefetch_rx_chan);
+
+    while (spi_is_busy(prefetch_spi))
+        tight_loop_contents();
+
+    while (spi_is_readable(prefetch_spi))
+        (void)spi_get_hw(prefetch_spi)->dr;
+}
@@ -0,0 +1,63 @@
+/*
+ * telemetry.c - request counters and latency histograms for the bridge
+ *
+ * telemetry_print() writes one record:
+ *
+ *   stats hz=<clk_sys Hz>
+ *   cmd select=<n> card_present=<n> ... other=<n>
+ *   xfer reads=<n> writes=<n> read_bytes=<n> write_bytes=<n> aborts=<n>
+ *   hist req <32 bins>
+ *   hist request <32 bins>
+ *   hist spi_wait <32 bins>
+ *   hist irq <32 bins>
+ *   end
+ *
+ * Bin b counts times of 2^b to 2^(b+1)-1 CPU cycles, bin 0 also 0.
+ */
+
+#include "telemetry.h"
+#include <stdio.h>
+#include <string.h>
+#include "hardware/clocks.h"
+
+struct telemetry telemetry;
+uint32_t telemetry_req_seen;
+uint32_t telemetry_command_seen;
+
+static const char *const control_names[TELEMETRY_CONTROL] = {
+    "select", "card_present", "speed", "xfer_mode", "batch", "poll", "lba",
+    "long", "get_caps", "speed_tier", "notify", "test_mode", "target",
+    "spi_mode", "cache", "file", "other",
+};
+
+void telemetry_init(void) {
+    m33_hw->demcr |= M33_DEMCR_TRCENA_BITS;
+    m33_hw->dwt_ctrl |= M33_DWT_CTRL_CYCCNTENA_BITS;
+}
+
+static void print_hist(const char *name, const uint32_t *hist) {
+    printf("hist %s", name);
+    for (int i = 0; i < TELEMETRY_BINS; i++)
+        printf(" %lu", hist[i]);
+    printf("\n");
+}
+
+void telemetry_print(void) {
+    // Copy first, so the record is consistent if a request comes in
+    struct telemetry t = telemetry;
+
+    printf("stats hz=%lu\ncmd", clock_get_hz(clk_sys));
+    for (int i = 0; i < TELEMETRY_CONTROL; i++)
+        printf(" %s=%lu", control_names[i], t.control[i]);
+    printf("\nxfer reads=%lu writes=%lu read_bytes=%lu write_bytes=%lu aborts=%lu\n",
+           t.reads, t.writes, t.read_bytes, t.write_bytes, t.aborts);
+    print_hist("req", t.req);
+    print_hist("request", t.request);
+    print_hist("spi_wait", t.spi_wait);
+    print_hist("irq", t.irq);
+    printf("end\n");
+}
+
+void telemetry_clear(void) {
+    memset(&telemetry, 0, sizeof(telemetry));
+}
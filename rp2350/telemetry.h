@@ -0,0 +1,101 @@
+/*
+ * telemetry.h - request counters and latency histograms for the bridge
+ *
+ * The request path only bumps counters and log2 histogram bins of CPU
+ * cycles. Nothing is formatted until the 's' command on the USB serial
+ * console asks for it. Without PAR_SPI_TELEMETRY the calls compile to
+ * nothing.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hardware/structs/m33.h"
+
+// Control commands 0-15 have their own counter, the rest share one
+#define TELEMETRY_CONTROL   17
+#define TELEMETRY_BINS      32
+
+struct telemetry {
+    uint32_t control[TELEMETRY_CONTROL];
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t read_bytes;
+    uint32_t write_bytes;
+    uint32_t aborts;                    // REQ released before the end
+    uint32_t req[TELEMETRY_BINS];       // REQ noticed to command read
+    uint32_t request[TELEMETRY_BINS];   // Command read to REQ released
+    uint32_t spi_wait[TELEMETRY_BINS];  // CPU waiting on SPI per transfer
+    uint32_t irq[TELEMETRY_BINS];       // GPIO interrupt handler
+};
+
+extern struct telemetry telemetry;
+extern uint32_t telemetry_req_seen;
+extern uint32_t telemetry_command_seen;
+
+void telemetry_init(void);
+void telemetry_print(void);
+void telemetry_clear(void);
+
+#ifdef PAR_SPI_TELEMETRY
+static inline uint32_t telemetry_now(void) {
+    return m33_hw->dwt_cyccnt;
+}
+
+static inline void telemetry_bin(uint32_t *hist, uint32_t cycles) {
+    hist[31 - __builtin_clz(cycles | 1)]++;
+}
+
+static inline void telemetry_req_noticed(void) {
+    telemetry_req_seen = telemetry_now();
+}
+
+static inline void telemetry_command(void) {
+    telemetry_command_seen = telemetry_now();
+    telemetry_bin(telemetry.req, telemetry_command_seen - telemetry_req_seen);
+}
+
+static inline void telemetry_control(uint32_t command) {
+    telemetry.control[command < TELEMETRY_CONTROL ? command : TELEMETRY_CONTROL - 1]++;
+}
+
+static inline void telemetry_transfer(bool read, uint32_t count) {
+    if (read) {
+        telemetry.reads++;
+        telemetry.read_bytes += count;
+    } else {
+        telemetry.writes++;
+        telemetry.write_bytes += count;
+    }
+}
+
+static inline void telemetry_abort(void) {
+    telemetry.aborts++;
+}
+
+static inline void telemetry_spi_wait(uint32_t cycles) {
+    telemetry_bin(telemetry.spi_wait, cycles);
+}
+
+static inline void telemetry_request_done(void) {
+    telemetry_bin(telemetry.request, telemetry_now() - telemetry_command_seen);
+}
+
+static inline void telemetry_irq(uint32_t start) {
+    telemetry_bin(telemetry.irq, telemetry_now() - start);
+}
+#else
+static inline uint32_t telemetry_now(void) { return 0; }
+static inline void telemetry_req_noticed(void) {}
+static inline void telemetry_command(void) {}
+static inline void telemetry_control(uint32_t command) {}
+static inline void telemetry_transfer(bool read, uint32_t count) {}
+static inline void telemetry_abort(void) {}
+static inline void telemetry_spi_wait(uint32_t cycles) {}
+static inline void telemetry_request_done(void) {}
+static inline void telemetry_irq(uint32_t start) {}
+#endif
+
+#endif // TELEMETRY_H
@@ -0,0 +1,15 @@
+// Host stand-in for FreeRTOS.h
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+#include <stdint.h>
+
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define configMINIMAL_STACK_SIZE    256
+
+#endif
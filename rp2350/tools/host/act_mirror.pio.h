@@ -0,0 +1,7 @@
+// Host stand-in for the header generated from act_mirror.pio
+#ifndef HOST_ACT_MIRROR_PIO_H
+#define HOST_ACT_MIRROR_PIO_H
+
+#define ACT_MIRROR_GATE_IRQ 0
+
+#endif
@@ -0,0 +1,11 @@
+// Host stand-in for FatFS's ff.h, the types of the disk functions
+#ifndef HOST_FF_H
+#define HOST_FF_H
+
+#include <stdint.h>
+
+typedef unsigned char BYTE;
+typedef unsigned int UINT;
+typedef uint32_t LBA_t;
+
+#endif
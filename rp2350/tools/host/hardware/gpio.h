@@ -0,0 +1,18 @@
+// Host stand-in for the Pico SDK hardware/gpio.h
+#ifndef HOST_HARDWARE_GPIO_H
+#define HOST_HARDWARE_GPIO_H
+
+#include <sched.h>
+#include <stdint.h>
+#include "hardware/timer.h"
+
+// Pin reads are ordered after earlier stores, as on the RP2350's
+// device memory, so a store and a pin read can't pass each other
+uint32_t gpio_get_all(void);
+
+// Gives up the host CPU, so spinning threads make progress on one
+static inline void tight_loop_contents(void) {
+    sched_yield();
+}
+
+#endif
@@ -0,0 +1,20 @@
+// Host stand-in for the Pico SDK hardware/pio.h
+#ifndef HOST_HARDWARE_PIO_H
+#define HOST_HARDWARE_PIO_H
+
+#include <stdint.h>
+
+typedef unsigned int uint;
+
+// Only the IRQ flags. A store to irq_force sets flags, which the tool
+// reads back as set until pio_interrupt_clear().
+typedef struct {
+    volatile uint32_t irq;
+    volatile uint32_t irq_force;
+} pio_hw_t;
+
+typedef pio_hw_t *PIO;
+
+void pio_interrupt_clear(PIO pio, uint irq);
+
+#endif
@@ -0,0 +1,8 @@
+// Host stand-in for the Pico SDK hardware/sync.h
+#ifndef HOST_HARDWARE_SYNC_H
+#define HOST_HARDWARE_SYNC_H
+
+#define __dmb()     __sync_synchronize()
+#define __sev()     ((void)0)
+
+#endif
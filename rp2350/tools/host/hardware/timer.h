@@ -0,0 +1,15 @@
+// Host stand-in for the Pico SDK hardware/timer.h
+#ifndef HOST_HARDWARE_TIMER_H
+#define HOST_HARDWARE_TIMER_H
+
+#include <stdint.h>
+#include <time.h>
+
+static inline uint32_t time_us_32(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+#endif
@@ -0,0 +1,5 @@
+// Host stand-in for the Pico SDK hardware/watchdog.h
+#ifndef HOST_HARDWARE_WATCHDOG_H
+#define HOST_HARDWARE_WATCHDOG_H
+
+#endif
@@ -0,0 +1,19 @@
+// Host stand-in for lwIP's netif.h
+#ifndef HOST_LWIP_NETIF_H
+#define HOST_LWIP_NETIF_H
+
+#include <stdint.h>
+#include "lwip/pbuf.h"
+
+typedef int8_t err_t;
+
+#define ERR_OK  0
+
+struct netif;
+typedef err_t (*netif_input_fn)(struct pbuf *p, struct netif *inp);
+
+struct netif {
+    netif_input_fn input;
+};
+
+#endif
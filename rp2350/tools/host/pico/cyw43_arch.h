@@ -0,0 +1,24 @@
+// Host stand-in for the Pico SDK pico/cyw43_arch.h
+#ifndef HOST_PICO_CYW43_ARCH_H
+#define HOST_PICO_CYW43_ARCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "lwip/netif.h"
+
+#define CYW43_ITF_STA   0
+#define CYW43_ITF_AP    1
+
+typedef struct {
+    uint8_t mac[6];
+    struct netif netif[2];
+} cyw43_t;
+
+extern cyw43_t cyw43_state;
+
+int cyw43_send_ethernet(cyw43_t *self, int itf, size_t len, const void *buf, bool is_pbuf);
+void cyw43_arch_lwip_begin(void);
+void cyw43_arch_lwip_end(void);
+
+#endif
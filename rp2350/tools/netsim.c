@@ -0,0 +1,428 @@
+/*
+ * netsim.c - runs net_bridge.c on the host against a fake CYW43
+ *
+ * Build on the host, from rp2350, with
+ *
+ *   cc -O2 -pthread -I tools/host -I . -o netsim tools/netsim.c net_bridge.c
+ *
+ * tools/host has headers that stand in for the Pico SDK, the CYW43
+ * driver, lwIP and FreeRTOS; the functions behind them are here. The
+ * transmit task of net_bridge.c runs on a thread of its own, as it does
+ * on core 1, and the fake WiFi hands frames to the wrapped netif input
+ * from another. The main thread is core 0 and makes NET requests as
+ * par_spi.c does for the Amiga.
+ *
+ * First a few fixed cases check the replies, the NET_MORE flag, IRQ
+ * notification and the ring limits. Then both directions run at once
+ * for a while, and every frame is checked for order and contents, with
+ * the frames dropped on the way in matching the drop count. It prints
+ * what failed and exits with 1 if anything did.
+ *
+ *   netsim [frames]
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "net_bridge.h"
+#include "sd_spi.h"
+#include "pico/cyw43_arch.h"
+#include "task.h"
+
+#define STRESS_FRAMES   50000
+
+// Frame header: destination and source MAC, EtherType, then a sequence
+// number, and the rest is made from the sequence number
+#define SEQ_OFFSET      14
+#define MIN_LEN         (SEQ_OFFSET + 4)
+
+static int failures;
+
+#define CHECK(cond) do {                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+// ============================================================================
+// Fake CYW43, lwIP and FreeRTOS
+// ============================================================================
+
+cyw43_t cyw43_state = {
+    .mac = { 0x28, 0xcd, 0xc1, 0x01, 0x02, 0x03 },
+};
+
+static pthread_mutex_t lwip_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cyw43_arch_lwip_begin(void) {
+    pthread_mutex_lock(&lwip_lock);
+}
+
+void cyw43_arch_lwip_end(void) {
+    pthread_mutex_unlock(&lwip_lock);
+}
+
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset) {
+    u16_t copied = 0;
+
+    for (; p && copied < len; p = p->next) {
+        if (offset >= p->len) {
+            offset -= p->len;
+            continue;
+        }
+
+        u16_t n = p->len - offset;
+        if (n > len - copied)
+            n = len - copied;
+
+        memcpy((uint8_t *)dataptr + copied, (uint8_t *)p->payload + offset, n);
+        copied += n;
+        offset = 0;
+    }
+
+    return copied;
+}
+
+struct task {
+    TaskFunction_t code;
+    void *params;
+};
+
+static void *task_thread(void *arg) {
+    struct task t = *(struct task *)arg;
+
+    free(arg);
+    t.code(t.params);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint32_t stack,
+                       void *params, UBaseType_t priority, TaskHandle_t *handle) {
+    struct task *t = malloc(sizeof(*t));
+    pthread_t thread;
+
+    t->code = code;
+    t->params = params;
+    pthread_create(&thread, NULL, task_thread, t);
+    pthread_detach(thread);
+    return 1;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    usleep(ticks * 1000);
+}
+
+// Frames that reached lwIP
+static volatile uint32_t lwip_frames;
+
+static err_t lwip_input(struct pbuf *p, struct netif *netif) {
+    __sync_fetch_and_add(&lwip_frames, 1);
+    return ERR_OK;
+}
+
+// Frames sent on the WiFi, in order, with the next sequence number
+// expected. While the link is held, sends wait.
+static volatile bool link_held;
+static volatile uint32_t wifi_sent;
+static volatile uint32_t wifi_bad;
+static uint32_t wifi_next_seq;
+
+static void make_frame(uint8_t *f, uint32_t len, uint32_t seq) {
+    memset(f, 0xff, 6);
+    memcpy(&f[6], cyw43_state.mac, 6);
+    f[12] = 0x08;
+    f[13] = 0x00;
+    f[SEQ_OFFSET] = seq >> 24;
+    f[SEQ_OFFSET + 1] = seq >> 16;
+    f[SEQ_OFFSET + 2] = seq >> 8;
+    f[SEQ_OFFSET + 3] = seq;
+
+    for (uint32_t i = MIN_LEN; i < len; i++)
+        f[i] = seq * 31 + i;
+}
+
+// Gets the sequence number of f, or fails if any byte isn't as made.
+static bool check_frame(const uint8_t *f, uint32_t len, uint32_t *seq) {
+    uint8_t expect[NET_FRAME_MAX];
+
+    if (len < MIN_LEN || len > NET_FRAME_MAX)
+        return false;
+
+    *seq = (f[SEQ_OFFSET] << 24) | (f[SEQ_OFFSET + 1] << 16) |
+           (f[SEQ_OFFSET + 2] << 8) | f[SEQ_OFFSET + 3];
+    make_frame(expect, len, *seq);
+    return memcmp(f, expect, len) == 0;
+}
+
+int cyw43_send_ethernet(cyw43_t *self, int itf, size_t len, const void *buf, bool is_pbuf) {
+    uint32_t seq = wifi_next_seq;
+
+    while (link_held)
+        usleep(100);
+
+    if (itf != CYW43_ITF_STA || is_pbuf || !check_frame(buf, len, &seq) || seq != wifi_next_seq)
+        wifi_bad++;
+
+    wifi_next_seq = seq + 1;
+    wifi_sent++;
+    return 0;
+}
+
+// Hands a frame to the netif input, as the CYW43 driver does, split
+// over two pbufs.
+static void wifi_receive(uint32_t len, uint32_t seq) {
+    static uint8_t data[NET_FRAME_MAX];
+    struct pbuf second = { NULL, &data[len / 2], len - len / 2, len - len / 2 };
+    struct pbuf first = { &second, data, len, len / 2 };
+    struct netif *netif = &cyw43_state.netif[CYW43_ITF_STA];
+
+    make_frame(data, len, seq);
+
+    cyw43_arch_lwip_begin();
+    netif->input(&first, netif);
+    cyw43_arch_lwip_end();
+}
+
+// ============================================================================
+// Core 0
+// ============================================================================
+
+static uint8_t params[NET_BATCH_MAX];
+static uint8_t reply[NET_BATCH_MAX];
+static uint32_t reply_size;
+
+static int request(uint8_t op, uint32_t size, uint32_t reply_max) {
+    return net_bridge_request(op, params, size, reply, reply_max, &reply_size);
+}
+
+// Puts a frame into params at pos as a NET_SEND does, and returns the
+// position after it.
+static uint32_t add_frame(uint32_t pos, uint32_t len, uint32_t seq) {
+    params[pos] = len >> 8;
+    params[pos + 1] = len;
+    make_frame(&params[pos + 2], len, seq);
+    return pos + 2 + len;
+}
+
+// Checks the frames of a NET_RECEIVE reply, which follow from seq on
+// with gaps for frames dropped, and returns how many there were.
+static uint32_t check_reply(uint32_t *seq, uint32_t *gaps) {
+    uint32_t n = 0;
+
+    for (uint32_t pos = 1; pos < reply_size; n++) {
+        uint32_t len = (reply[pos] << 8) | reply[pos + 1];
+        uint32_t s;
+
+        if (pos + 2 + len > reply_size || !check_frame(&reply[pos + 2], len, &s) || s < *seq) {
+            CHECK(!"bad frame in NET_RECEIVE reply");
+            return n;
+        }
+
+        *gaps += s - *seq;
+        *seq = s + 1;
+        pos += 2 + len;
+    }
+
+    return n;
+}
+
+static void wait_sent(uint32_t count) {
+    for (int i = 0; i < 1000 && wifi_sent < count; i++)
+        usleep(1000);
+}
+
+static void fixed_cases(void) {
+    struct net_bridge_stats st;
+    uint32_t seq;
+    uint32_t gaps = 0;
+
+    CHECK(request(NET_OPEN, 0, NET_BATCH_MAX) == NET_OFFLINE);
+
+    cyw43_state.netif[CYW43_ITF_STA].input = lwip_input;
+    net_bridge_start();
+
+    CHECK(request(NET_SEND, add_frame(0, 60, 0), NET_BATCH_MAX) == NET_NOT_OPEN);
+    CHECK(request(NET_RECEIVE, 0, NET_BATCH_MAX) == NET_NOT_OPEN);
+
+    // Not queued before the Amiga opens, but lwIP still gets it
+    wifi_receive(60, 0);
+    CHECK(lwip_frames == 1);
+
+    CHECK(request(NET_OPEN, 0, NET_BATCH_MAX) == SD_OK);
+    CHECK(reply_size == 6 && memcmp(reply, cyw43_state.mac, 6) == 0);
+
+    CHECK(request(NET_RECEIVE, 0, NET_BATCH_MAX) == SD_OK);
+    CHECK(reply_size == 1 && reply[0] == 0);
+
+    // The Amiga found nothing, so the next frame pulses IRQ, once
+    CHECK(!net_bridge_notify_pending());
+    wifi_receive(100, 1);
+    CHECK(net_bridge_notify_pending());
+    CHECK(net_bridge_notify_due());
+    CHECK(!net_bridge_notify_due());
+
+    seq = 1;
+    CHECK(request(NET_RECEIVE, 0, NET_BATCH_MAX) == SD_OK);
+    CHECK(check_reply(&seq, &gaps) == 1 && reply[0] == 0);
+
+    // A reply too small for the largest frame
+    CHECK(request(NET_RECEIVE, 0, NET_FRAME_MAX + 2) == SD_ERROR);
+
+    // More frames than fit in one reply
+    for (uint32_t i = 0; i < 10; i++)
+        wifi_receive(1000, seq + i);
+
+    CHECK(request(NET_RECEIVE, 0, NET_BATCH_MAX) == SD_OK);
+    CHECK(check_reply(&seq, &gaps) == 8 && (reply[0] & NET_MORE));
+    CHECK(!net_bridge_notify_pending());
+    CHECK(request(NET_RECEIVE, 0, NET_BATCH_MAX) == SD_OK);
+    CHECK(check_reply(&seq, &gaps) == 2 && reply[0] == 0);
+
+    // A full receive ring drops what comes after, as a busy Ethernet
+    net_bridge_get_stats(&st);
+    uint32_t dropped = st.rx_dropped;
+
+    for (uint32_t i = 0; i < NET_RX_FRAMES + 4; i++)
+        wifi_receive(MIN_LEN, seq + i);
+
+    net_bridge_get_stats(&st);
+    CHECK(st.rx_dropped - dropped == 4);
+
+    CHECK(request(NET_RECEIVE, 0, NET_BATCH_MAX) == SD_OK);
+    CHECK(check_reply(&seq, &gaps) == NET_RX_FRAMES && gaps == 0);
+
+    // While the WiFi is busy sending, the transmit ring fills up and the
+    // rest of a batch is refused
+    link_held = true;
+
+    uint32_t pos = 0;
+    for (uint32_t i = 0; i < NET_TX_FRAMES + 4; i++)
+        pos = add_frame(pos, 300, i);
+
+    CHECK(request(NET_SEND, pos, NET_BATCH_MAX) == SD_OK);
+    CHECK(reply_size == 1 && reply[0] == NET_TX_FRAMES);
+
+    link_held = false;
+    wait_sent(NET_TX_FRAMES);
+    CHECK(wifi_sent == NET_TX_FRAMES && wifi_bad == 0);
+
+    // A frame with a bad length ends the batch
+    pos = add_frame(0, 60, NET_TX_FRAMES);
+    params[pos] = (NET_FRAME_MAX + 1) >> 8;
+    params[pos + 1] = (NET_FRAME_MAX + 1) & 0xff;
+    CHECK(request(NET_SEND, pos + 2, NET_BATCH_MAX) == SD_ERROR);
+    CHECK(reply_size == 1 && reply[0] == 1);
+
+    wait_sent(NET_TX_FRAMES + 1);
+    CHECK(wifi_sent == NET_TX_FRAMES + 1 && wifi_bad == 0);
+
+    // Closed, frames are no longer queued
+    CHECK(request(NET_CLOSE, 0, NET_BATCH_MAX) == SD_OK);
+    CHECK(!net_bridge_notify_pending());
+    wifi_receive(60, 0);
+    CHECK(request(NET_RECEIVE, 0, NET_BATCH_MAX) == NET_NOT_OPEN);
+    CHECK(request(NET_OPEN, 0, NET_BATCH_MAX) == SD_OK);
+    CHECK(request(NET_RECEIVE, 0, NET_BATCH_MAX) == SD_OK);
+    CHECK(reply_size == 1);
+}
+
+// ============================================================================
+// Both directions at once
+// ============================================================================
+
+static uint32_t stress_frames;
+static volatile bool wifi_done;
+
+static uint32_t frame_len(uint32_t seq) {
+    return MIN_LEN + (seq * 2654435761u) % (NET_FRAME_MAX - MIN_LEN + 1);
+}
+
+static void *wifi_thread(void *arg) {
+    uint32_t first = *(uint32_t *)arg;
+
+    for (uint32_t i = 0; i < stress_frames; i++) {
+        wifi_receive(frame_len(first + i), first + i);
+
+        // Bursts of a few frames, with gaps for the Amiga to catch up
+        if (i % 8 == 7)
+            usleep(100);
+    }
+
+    wifi_done = true;
+    return NULL;
+}
+
+static void stress(void) {
+    struct net_bridge_stats before;
+    struct net_bridge_stats after;
+    pthread_t thread;
+    uint32_t rx_first = 1000000;
+    uint32_t rx_seq = rx_first;
+    uint32_t rx_got = 0;
+    uint32_t gaps = 0;
+    uint32_t tx_first = wifi_next_seq;
+    uint32_t tx_seq = tx_first;
+    uint32_t wifi_first = wifi_sent;
+
+    net_bridge_get_stats(&before);
+    pthread_create(&thread, NULL, wifi_thread, &rx_first);
+
+    bool done;
+
+    do {
+        // Everything the WiFi had before this is taken below
+        done = wifi_done;
+
+        // Send a batch of what fits, then take what has come in
+        uint32_t pos = 0;
+        uint32_t batch = tx_seq;
+
+        while (batch - tx_first < stress_frames && pos + 2 + frame_len(batch) <= NET_BATCH_MAX) {
+            pos = add_frame(pos, frame_len(batch), batch);
+            batch++;
+        }
+
+        if (pos) {
+            CHECK(request(NET_SEND, pos, NET_BATCH_MAX) == SD_OK);
+            tx_seq += reply[0];
+        }
+
+        int err;
+
+        do {
+            err = request(NET_RECEIVE, 0, NET_BATCH_MAX);
+            CHECK(err == SD_OK);
+            rx_got += check_reply(&rx_seq, &gaps);
+        } while (err == SD_OK && (reply[0] & NET_MORE));
+    } while (!done || tx_seq - tx_first < stress_frames);
+
+    pthread_join(thread, NULL);
+    wait_sent(wifi_first + stress_frames);
+    net_bridge_get_stats(&after);
+
+    uint32_t dropped = after.rx_dropped - before.rx_dropped;
+
+    printf("to the Amiga: %u frames, %u dropped\n", rx_got, dropped);
+    printf("to the WiFi: %u frames\n", wifi_sent - wifi_first);
+
+    CHECK(rx_got + dropped == stress_frames);
+    CHECK(gaps + (rx_first + stress_frames - rx_seq) == dropped);
+    CHECK(after.rx_frames - before.rx_frames == rx_got);
+    CHECK(wifi_sent - wifi_first == stress_frames && wifi_bad == 0);
+    CHECK(after.tx_frames - before.tx_frames == stress_frames && after.tx_dropped == 0);
+}
+
+int main(int argc, char **argv) {
+    stress_frames = argc > 1 ? strtoul(argv[1], NULL, 0) : STRESS_FRAMES;
+
+    fixed_cases();
+    stress();
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * partrace.c - turns an edge trace dump from the RP2350 bridge into
+ * per-command timings
+ *
+ * Build on the host with
+ *
+ *   cc -O2 -o partrace partrace.c -lm
+ *
+ * Capture the dump by sending 't' on the USB serial console of a firmware
+ * built with PAR_SPI_TRACE, save everything from the TRACE line to the
+ * END line, and run
+ *
+ *   partrace < dump.txt
+ *
+ * A command lasts from REQ going low until it goes high again. For each
+ * one it prints the time from REQ to ACT, REQ to the first CLK edge,
+ * the bytes moved (CLK edges and /STROBE pulses) with their rate, and
+ * the time from the last byte to REQ going high. A summary follows with
+ * histograms of the time between bytes and of the command byte rates.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Pin bits in an entry, GPIO 8-12
+#define PIN_IRQ     (1u << 27)
+#define PIN_ACT     (1u << 28)
+#define PIN_CLK     (1u << 29)
+#define PIN_REQ     (1u << 30)
+#define PIN_STB     (1u << 31)
+
+#define COUNT_MASK  0x07ffffff
+
+#define HIST_BINS   32
+
+struct event {
+    double ns;
+    uint32_t pins;
+};
+
+struct command {
+    double start;           // REQ low
+    double act;             // ACT low, or -1
+    double first;           // First byte, or -1
+    double last;            // Last byte, or -1
+    uint32_t bytes;
+};
+
+static uint32_t hist_interval[HIST_BINS];
+static uint32_t hist_rate[HIST_BINS];
+
+static int log2_bin(double value) {
+    int bin = value < 1 ? 0 : (int)log2(value);
+    return bin < HIST_BINS ? bin : HIST_BINS - 1;
+}
+
+static void print_hist(const char *title, const char *unit, const uint32_t *hist) {
+    uint32_t max = 0;
+
+    for (int i = 0; i < HIST_BINS; i++)
+        if (hist[i] > max)
+            max = hist[i];
+
+    if (!max)
+        return;
+
+    printf("\n%s\n", title);
+
+    for (int i = 0; i < HIST_BINS; i++) {
+        if (!hist[i])
+            continue;
+
+        int width = (int)(50.0 * hist[i] / max);
+        printf("%10.0f-%-10.0f %-4s %8u ", pow(2, i), pow(2, i + 1), unit, hist[i]);
+        for (int j = 0; j < width; j++)
+            putchar('#');
+        putchar('\n');
+    }
+}
+
+static void report(int n, const struct command *cmd, double end) {
+    printf("%5d  %9.3f ms  ", n, cmd->start / 1e6);
+
+    if (cmd->act >= 0)
+        printf("REQ>ACT %6.0f ns  ", cmd->act - cmd->start);
+    else
+        printf("REQ>ACT      - ns  ");
+
+    if (cmd->first < 0) {
+        printf("no bytes, %8.0f ns\n", end - cmd->start);
+        return;
+    }
+
+    printf("REQ>byte %6.0f ns  %5u bytes", cmd->first - cmd->start, cmd->bytes);
+
+    if (cmd->bytes > 1) {
+        double rate = (cmd->bytes - 1) / ((cmd->last - cmd->first) / 1e9) / 1000;
+        printf(" %8.1f kB/s", rate);
+        hist_rate[log2_bin(rate)]++;
+    } else {
+        printf("              ");
+    }
+
+    printf("  byte>REL %6.0f ns\n", end - cmd->last);
+}
+
+int main(void) {
+    char line[256];
+    unsigned entries = 0, loop_cycles = 0, event_cycles = 0;
+    unsigned long hz = 0;
+
+    while (fgets(line, sizeof(line), stdin)) {
+        if (sscanf(line, "TRACE %u %lu %u %u", &entries, &hz, &loop_cycles, &event_cycles) == 4)
+            break;
+    }
+
+    if (!entries || !hz) {
+        fprintf(stderr, "partrace: no TRACE header found\n");
+        return 1;
+    }
+
+    uint32_t *raw = malloc(entries * sizeof(uint32_t));
+    struct event *events = malloc(entries * sizeof(struct event));
+    unsigned count = 0;
+
+    while (count < entries && fgets(line, sizeof(line), stdin)) {
+        if (!strncmp(line, "END", 3))
+            break;
+
+        char *p = line;
+        char *next;
+
+        while (count < entries) {
+            uint32_t value = strtoul(p, &next, 16);
+            if (next == p)
+                break;
+            raw[count++] = value;
+            p = next;
+        }
+    }
+
+    // Entries never written are 0, and only ever come before the others
+    unsigned n_events = 0;
+    double ns_per_cycle = 1e9 / hz;
+    double ns = 0;
+    uint32_t prev_count = 0;
+
+    for (unsigned i = 0; i < count; i++) {
+        if (!raw[i])
+            continue;
+
+        uint32_t c = raw[i] & COUNT_MASK;
+
+        if (n_events)
+            ns += (((prev_count - c) & COUNT_MASK) * loop_cycles + event_cycles) * ns_per_cycle;
+
+        events[n_events].ns = ns;
+        events[n_events].pins = raw[i] & ~COUNT_MASK;
+        n_events++;
+        prev_count = c;
+    }
+
+    printf("%u edges over %.3f ms\n\n", n_events, ns / 1e6);
+
+    struct command cmd;
+    int in_command = 0;
+    int n_commands = 0;
+    uint32_t irq_pulses = 0;
+    double prev_byte = -1;
+
+    for (unsigned i = 1; i < n_events; i++) {
+        uint32_t prev = events[i - 1].pins;
+        uint32_t pins = events[i].pins;
+        uint32_t fell = prev & ~pins;
+        uint32_t changed = prev ^ pins;
+        double t = events[i].ns;
+
+        if (fell & PIN_IRQ)
+            irq_pulses++;
+
+        if (fell & PIN_REQ) {
+            memset(&cmd, 0, sizeof(cmd));
+            cmd.start = t;
+            cmd.act = cmd.first = cmd.last = -1;
+            in_command = 1;
+            prev_byte = -1;
+        }
+
+        if (!in_command)
+            continue;
+
+        if ((fell & PIN_ACT) && cmd.act < 0)
+            cmd.act = t;
+
+        if ((changed & PIN_CLK) || (fell & PIN_STB)) {
+            if (cmd.first < 0)
+                cmd.first = t;
+            if (prev_byte >= 0)
+                hist_interval[log2_bin(t - prev_byte)]++;
+            cmd.last = prev_byte = t;
+            cmd.bytes++;
+        }
+
+        if (changed & pins & PIN_REQ) {
+            report(++n_commands, &cmd, t);
+            in_command = 0;
+        }
+    }
+
+    printf("\n%d commands, %u IRQ pulses\n", n_commands, irq_pulses);
+    print_hist("Time between bytes", "ns", hist_interval);
+    print_hist("Command byte rate", "kB/s", hist_rate);
+
+    free(raw);
+    free(events);
+    return 0;
+}
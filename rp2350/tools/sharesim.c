@@ -0,0 +1,471 @@
+/*
+ * sharesim.c - runs sd_share.c on the host, with LBA requests and FatFS
+ * transfers on the card at once
+ *
+ * Build on the host, from rp2350, with
+ *
+ *   cc -O2 -pthread -I tools/host -I . -o sharesim tools/sharesim.c sd_share.c
+ *
+ * Three threads stand in for the combined mode. The Amiga makes LBA
+ * requests, and plays the ACT mirror, which only answers REQ while the
+ * gate flag is clear. Core 0 runs a main loop like that of par_spi.c,
+ * lending the card when core 1 wants it and reclaiming it for a
+ * request. Core 1 reads and writes through the FatFS disk functions, as
+ * the FTP server does. The card is a RAM array behind fake sd_spi.c
+ * functions.
+ *
+ * The checks:
+ * - The card is never used by both cores at once.
+ * - The Amiga never has ACT while the card is lent.
+ * - Core 0 gets its SPI clock and mode back.
+ * - Every sector read holds what was last written to it.
+ * - FatFS writes are refused once the Amiga has used the card.
+ * - FatFS writes are allowed again after a card change.
+ *
+ * It prints what failed and exits with 1 if anything did.
+ *
+ *   sharesim [requests]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sd_share.h"
+#include "sd_spi.h"
+#include "sd_cache.h"
+#include "hardware/gpio.h"
+#include "hardware/spi.h"
+#include "act_mirror.pio.h"
+#include "main.h"
+#include "diskio.h"
+#include "task.h"
+
+#define REQUESTS        20000
+
+// The Amiga's sectors come first, then those FatFS writes
+#define CARD_SECTORS    4096
+#define AMIGA_SECTORS   2048
+#define MAX_COUNT       24
+
+// SPI settings of the bridge while the card is lent
+#define BRIDGE_BAUD     24000000
+#define BRIDGE_MODE     3
+
+static int failures;
+
+#define CHECK(cond) do {                                            \
+        if (!(cond)) {                                              \
+            printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+enum user { NOBODY, CORE0, CORE1 };
+
+static __thread enum user me;
+
+// ============================================================================
+// Fake pins, PIO, SPI and FreeRTOS
+// ============================================================================
+
+static volatile uint32_t pins = 1 << PIN_REQ;
+static pio_hw_t gate_pio;
+
+// The other threads may run right after a pin read, as the other core
+// and the Amiga would
+uint32_t gpio_get_all(void) {
+    __sync_synchronize();
+    uint32_t p = pins;
+    sched_yield();
+    return p;
+}
+
+void pio_interrupt_clear(PIO pio, uint irq) {
+    __sync_fetch_and_and(&pio->irq_force, ~(1u << irq));
+}
+
+static volatile uint spi_baud = BRIDGE_BAUD;
+static volatile uint spi_mode = BRIDGE_MODE;
+
+void spi_set_format(spi_inst_t *spi, uint data_bits, spi_cpol_t cpol, spi_cpha_t cpha, spi_order_t order) {
+    spi_mode = (cpol == SPI_CPOL_1 ? 2 : 0) | (cpha == SPI_CPHA_1 ? 1 : 0);
+}
+
+uint spi_set_baudrate(spi_inst_t *spi, uint baudrate) {
+    spi_baud = baudrate;
+    return baudrate;
+}
+
+uint spi_get_baudrate(const spi_inst_t *spi) {
+    return spi_baud;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    usleep(ticks * 1000);
+}
+
+// ============================================================================
+// Fake card
+// ============================================================================
+
+static uint8_t card[CARD_SECTORS][SD_SECTOR_SIZE];
+static volatile enum user bus = NOBODY;
+static volatile bool act;   // The Amiga has ACT
+static volatile uint32_t conflicts;
+static uint32_t cursor;
+static bool card_open;
+
+static int take_bus(uint32_t lba, uint32_t count) {
+    if (!__sync_bool_compare_and_swap(&bus, NOBODY, me))
+        conflicts++;
+
+    // Core 1 runs the card at its own clock and mode 0, and never while
+    // the Amiga has ACT
+    if (me == CORE1) {
+        CHECK(spi_baud == SPI_FAST_FREQUENCY && spi_mode == 0);
+        CHECK(!act);
+    }
+
+    if (lba + count > CARD_SECTORS)
+        return SD_ERROR;
+
+    cursor = lba;
+    return SD_OK;
+}
+
+static void free_bus(void) {
+    __sync_bool_compare_and_swap(&bus, me, NOBODY);
+}
+
+int sd_spi_open(uint8_t *info) {
+    take_bus(0, 0);
+    memset(info, 0, SD_INFO_SIZE);
+    card_open = true;
+    free_bus();
+    return SD_OK;
+}
+
+bool sd_spi_is_open(void) {
+    return card_open;
+}
+
+int sd_spi_read_start(uint32_t lba, uint32_t count) {
+    return take_bus(lba, count);
+}
+
+int sd_spi_read_token(void) {
+    return SD_OK;
+}
+
+// A sector takes a while on SPI, which lets the other threads run
+void sd_spi_read_data(uint8_t *buf, uint32_t size) {
+    memcpy(buf, card[cursor++], size);
+    sched_yield();
+}
+
+void sd_spi_read_crc(void) {
+}
+
+int sd_spi_read_stop(uint32_t count) {
+    free_bus();
+    return SD_OK;
+}
+
+int sd_spi_write_start(uint32_t lba, uint32_t count) {
+    return take_bus(lba, count);
+}
+
+void sd_spi_write_token(uint32_t count) {
+}
+
+void sd_spi_write_data(const uint8_t *buf, uint32_t size) {
+    memcpy(card[cursor++], buf, size);
+    sched_yield();
+}
+
+int sd_spi_write_finish(void) {
+    return SD_OK;
+}
+
+int sd_spi_write_stop(uint32_t count) {
+    free_bus();
+    return SD_OK;
+}
+
+static volatile uint32_t releases;
+
+void sd_cache_release(void) {
+    CHECK(me == CORE0 && bus == NOBODY);
+    releases++;
+}
+
+void sd_cache_invalidate(uint32_t lba, uint32_t count) {
+}
+
+// Each sector holds its number and a version, and bytes made from them
+static void fill(uint8_t *buf, uint32_t lba, uint32_t version) {
+    for (int i = 0; i < SD_SECTOR_SIZE; i += 4) {
+        uint32_t v = (lba * 2654435761u) ^ (version * 40503u) ^ i;
+
+        memcpy(&buf[i], &v, 4);
+    }
+}
+
+static bool holds(const uint8_t *buf, uint32_t lba, uint32_t version) {
+    uint8_t expect[SD_SECTOR_SIZE];
+
+    fill(expect, lba, version);
+    return memcmp(buf, expect, SD_SECTOR_SIZE) == 0;
+}
+
+// Last version written to each sector, by whoever owns it
+static uint32_t versions[CARD_SECTORS];
+
+// ============================================================================
+// The Amiga and the ACT mirror
+// ============================================================================
+
+struct request {
+    bool write;
+    uint32_t lba;
+    uint32_t count;
+};
+
+static struct request amiga_req;
+static volatile bool served;
+static volatile bool amiga_done;
+static volatile uint32_t gate_waits;
+
+// Pulls REQ low, and gives ACT once the gate is clear, as the PIO does.
+static void amiga_request(const struct request *r) {
+    amiga_req = *r;
+
+    __sync_fetch_and_and(&pins, ~(1u << PIN_REQ));
+    __sync_synchronize();
+
+    if (gate_pio.irq_force & (1u << ACT_MIRROR_GATE_IRQ))
+        gate_waits++;
+
+    while (gate_pio.irq_force & (1u << ACT_MIRROR_GATE_IRQ))
+        sched_yield();
+
+    // The card must be back with core 0 by now
+    CHECK(bus != CORE1);
+    act = true;
+
+    while (!served)
+        sched_yield();
+
+    act = false;
+    __sync_fetch_and_or(&pins, 1u << PIN_REQ);
+
+    // Core 0 has seen REQ go high
+    while (served)
+        sched_yield();
+}
+
+static void *amiga_thread(void *arg) {
+    uint32_t requests = *(uint32_t *)arg;
+
+    for (uint32_t i = 0; i < requests; i++) {
+        struct request r = {
+            .write = rand() % 3 == 0,
+            .lba = rand() % (AMIGA_SECTORS - MAX_COUNT),
+            .count = 1 + rand() % MAX_COUNT,
+        };
+
+        amiga_request(&r);
+
+        if (rand() % 4 == 0)
+            usleep(rand() % 200);
+    }
+
+    amiga_done = true;
+    return NULL;
+}
+
+// ============================================================================
+// Core 0
+// ============================================================================
+
+static volatile bool card_change;
+static volatile uint32_t lends;
+static volatile uint32_t lends_refused;
+
+// An LBA request, with the card
+static void handle_lba(void) {
+    uint8_t buf[SD_SECTOR_SIZE];
+    const struct request *r = &amiga_req;
+
+    CHECK(spi_baud == BRIDGE_BAUD && spi_mode == BRIDGE_MODE);
+
+    if (r->write) {
+        CHECK(sd_spi_write_start(r->lba, r->count) == SD_OK);
+
+        for (uint32_t i = 0; i < r->count; i++) {
+            uint32_t lba = r->lba + i;
+
+            fill(buf, lba, ++versions[lba]);
+            sd_spi_write_data(buf, SD_SECTOR_SIZE);
+        }
+
+        sd_spi_write_stop(r->count);
+    } else {
+        CHECK(sd_spi_read_start(r->lba, r->count) == SD_OK);
+
+        for (uint32_t i = 0; i < r->count; i++) {
+            uint32_t lba = r->lba + i;
+
+            sd_spi_read_data(buf, SD_SECTOR_SIZE);
+            CHECK(holds(buf, lba, versions[lba]));
+        }
+
+        sd_spi_read_stop(r->count);
+    }
+
+    sd_share_amiga_used(r->write);
+}
+
+static void *core0_thread(void *arg) {
+    me = CORE0;
+
+    while (1) {
+        if (card_change) {
+            sd_share_reclaim();
+            sd_share_card_changed();
+            card_change = false;
+        }
+
+        if (!(gpio_get_all() & (1 << PIN_REQ))) {
+            // ACT is held back until core 1 is done with the card
+            sd_share_reclaim();
+
+            while (!act)
+                sched_yield();
+
+            handle_lba();
+            served = true;
+
+            while (!(gpio_get_all() & (1 << PIN_REQ)))
+                sched_yield();
+
+            served = false;
+        } else if (sd_share_wanted()) {
+            if (sd_share_lend(spi_get_baudrate(spi0), BRIDGE_MODE))
+                lends++;
+            else
+                lends_refused++;
+        } else {
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+// ============================================================================
+// Core 1
+// ============================================================================
+
+static uint8_t ftp_buf[MAX_COUNT * 2][SD_SECTOR_SIZE];
+
+// Writes count sectors of the FatFS area from lba, and reads them back
+static DRESULT ftp_write(uint32_t lba, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++)
+        fill(ftp_buf[i], lba + i, versions[lba + i] + 1);
+
+    DRESULT res = disk_write(0, ftp_buf[0], lba, count);
+    if (res != RES_OK)
+        return res;
+
+    for (uint32_t i = 0; i < count; i++)
+        versions[lba + i]++;
+
+    return RES_OK;
+}
+
+static void ftp_read(uint32_t lba, uint32_t count) {
+    CHECK(disk_read(0, ftp_buf[0], lba, count) == RES_OK);
+
+    for (uint32_t i = 0; i < count; i++)
+        CHECK(holds(ftp_buf[i], lba + i, versions[lba + i]));
+}
+
+static uint32_t ftp_lba(uint32_t count) {
+    return AMIGA_SECTORS + rand() % (CARD_SECTORS - AMIGA_SECTORS - count);
+}
+
+static void ftp_session(uint32_t rounds) {
+    for (uint32_t i = 0; i < rounds; i++) {
+        uint32_t count = 1 + rand() % (MAX_COUNT * 2);
+        uint32_t lba = ftp_lba(count);
+
+        CHECK(ftp_write(lba, count) == RES_OK);
+        ftp_read(lba, count);
+    }
+}
+
+int main(int argc, char **argv) {
+    uint32_t requests = argc > 1 ? strtoul(argv[1], NULL, 0) : REQUESTS;
+    pthread_t core0;
+    pthread_t amiga;
+
+    me = CORE1;
+    srand(1);
+
+    for (uint32_t lba = 0; lba < CARD_SECTORS; lba++)
+        fill(card[lba], lba, 0);
+
+    sd_share_init(&gate_pio);
+    pthread_create(&core0, NULL, core0_thread, NULL);
+
+    // The FTP server on its own, before the Amiga has used the card
+    CHECK(disk_initialize(0) == 0);
+    ftp_session(200);
+
+    // FatFS reads alongside LBA requests, and its writes are refused
+    pthread_create(&amiga, NULL, amiga_thread, &requests);
+
+    uint32_t ftp_reads = 0;
+
+    while (!amiga_done) {
+        uint32_t count = 1 + rand() % (MAX_COUNT * 2);
+        uint32_t lba = ftp_lba(count);
+
+        ftp_read(lba, count);
+        ftp_reads++;
+
+        if (ftp_reads % 16 == 0) {
+            CHECK(disk_status(0) & STA_PROTECT);
+            CHECK(ftp_write(lba, count) == RES_WRPRT);
+        }
+    }
+
+    pthread_join(amiga, NULL);
+
+    // The Amiga wrote, so FatFS is told to mount again
+    CHECK(disk_status(0) & STA_NOINIT);
+
+    // A card change gives FatFS the card back for writing
+    card_change = true;
+    while (card_change)
+        sched_yield();
+
+    CHECK(disk_initialize(0) == 0);
+    ftp_session(200);
+
+    printf("Amiga requests: %u, %u waited for the card\n", requests, gate_waits);
+    printf("FatFS reads alongside: %u\n", ftp_reads);
+    printf("loans: %u, %u refused for a request\n", lends, lends_refused);
+
+    CHECK(conflicts == 0);
+    CHECK(releases == lends);
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
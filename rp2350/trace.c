@@ -0,0 +1,85 @@
+/*
+ * trace.c - PIO edge tracer for the parallel port handshake
+ *
+ * The dump starts with a header line
+ *
+ *   TRACE <entries> <clk_sys Hz> <loop cycles> <event cycles>
+ *
+ * followed by the ring, oldest entry first, eight hex words per line,
+ * and ends with END. Entries never written are 0.
+ */
+
+#include "trace.h"
+#include <stdio.h>
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "edge_trace.pio.h"
+
+#define LINE_WORDS  8
+
+static uint32_t ring[TRACE_ENTRIES] __attribute__((aligned(1 << TRACE_RING_BITS)));
+
+static PIO trace_pio;
+static uint trace_sm;
+static int trace_chan;
+
+static bool dumping;
+static uint32_t dump_first;
+static uint32_t dump_pos;
+
+void trace_init(PIO pio, uint pin_base, uint pin_count) {
+    trace_pio = pio;
+    trace_sm = pio_claim_unused_sm(pio, true);
+    uint offset = pio_add_program(pio, &edge_trace_program);
+    edge_trace_program_init(pio, trace_sm, offset, pin_base, pin_count);
+
+    trace_chan = dma_claim_unused_channel(true);
+    dma_channel_config c = dma_channel_get_default_config(trace_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_ring(&c, true, TRACE_RING_BITS);
+    channel_config_set_dreq(&c, pio_get_dreq(pio, trace_sm, false));
+    dma_channel_configure(trace_chan, &c, ring, &pio->rxf[trace_sm],
+                          dma_encode_endless_transfer_count(), true);
+
+    pio_sm_set_enabled(pio, trace_sm, true);
+}
+
+void trace_start_dump(void) {
+    if (dumping)
+        return;
+
+    // X and Y survive, so the trace carries on where it stopped
+    pio_sm_set_enabled(trace_pio, trace_sm, false);
+
+    while (!pio_sm_is_rx_fifo_empty(trace_pio, trace_sm))
+        tight_loop_contents();
+
+    // The next entry to be written is the oldest one
+    dump_first = (dma_channel_hw_addr(trace_chan)->write_addr - (uintptr_t)ring) / 4;
+    dump_pos = 0;
+    dumping = true;
+
+    printf("TRACE %u %lu %u %u\n", TRACE_ENTRIES, clock_get_hz(clk_sys),
+           EDGE_TRACE_LOOP_CYCLES, EDGE_TRACE_EVENT_CYCLES);
+}
+
+bool trace_dump_pending(void) {
+    return dumping;
+}
+
+void trace_dump_line(void) {
+    for (int i = 0; i < LINE_WORDS; i++) {
+        uint32_t entry = ring[(dump_first + dump_pos + i) % TRACE_ENTRIES];
+        printf("%08lx%c", entry, i == LINE_WORDS - 1 ? '\n' : ' ');
+    }
+
+    dump_pos += LINE_WORDS;
+
+    if (dump_pos == TRACE_ENTRIES) {
+        printf("END\n");
+        dumping = false;
+        pio_sm_set_enabled(trace_pio, trace_sm, true);
+    }
+}
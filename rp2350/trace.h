@@ -0,0 +1,33 @@
+/*
+ * trace.h - PIO edge tracer for the parallel port handshake
+ *
+ * A PIO state machine timestamps every change of IRQ, ACT, CLK, REQ and
+ * /STROBE, and DMA keeps the last TRACE_ENTRIES changes in a ring in
+ * SRAM. The 't' command on the USB serial console dumps the ring as
+ * text, which tools/partrace.c turns into per-command timings.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hardware/pio.h"
+
+// The ring takes 1 << TRACE_RING_BITS bytes, 16 kB by default.
+#ifndef TRACE_RING_BITS
+#define TRACE_RING_BITS     14
+#endif
+
+#define TRACE_ENTRIES       (1 << (TRACE_RING_BITS - 2))
+
+void trace_init(PIO pio, uint pin_base, uint pin_count);
+
+// Stops tracing and starts a dump, which the main loop sends a line at a
+// time with trace_dump_line() between requests. Tracing resumes after
+// the last line.
+void trace_start_dump(void);
+bool trace_dump_pending(void);
+void trace_dump_line(void);
+
+#endif // TRACE_H
@@ -3,8 +3,12 @@
  * Updated in July 2021 by Niklas Ekström to handle Card Present signal.
  */
 #include <exec/types.h>
+#include <exec/execbase.h>
 #include <exec/interrupts.h>
 #include <exec/libraries.h>
+#include <exec/memory.h>
+#include <exec/semaphores.h>
+#include <exec/tasks.h>
 #include <hardware/cia.h>
 #include <resources/cia.h>
 #include <resources/misc.h>
@@ -25,6 +29,20 @@
 
 extern void spi_read_fast(__reg("a0") UBYTE *buf, __reg("d0") ULONG size);
 extern void spi_write_fast(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_read_fast16(__reg("a0") UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_write_fast16(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_read_fast020(__reg("a0") UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_write_fast020(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_read_strobe(__reg("a0") UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_write_strobe(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_clock_in(__reg("a0") UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_clock_out(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_strobe_in(__reg("a0") UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_strobe_out(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_fill(__reg("a0") UBYTE *buf, __reg("d0") ULONG size, __reg("d1") UBYTE value);
+extern LONG spi_lz4_decode(__reg("a0") const UBYTE *src, __reg("a1") UBYTE *dst, __reg("d0") ULONG src_size, __reg("d1") ULONG dst_size);
+
+extern struct ExecBase *SysBase;
 
 static volatile UBYTE *cia_a_prb = (volatile UBYTE *)0xbfe101;
 static volatile UBYTE *cia_a_ddrb = (volatile UBYTE *)0xbfe301;
@@ -33,13 +51,98 @@ static volatile UBYTE *cia_b_pra = (volatile UBYTE *)0xbfd000;
 static volatile UBYTE *cia_b_ddra = (volatile UBYTE *)0xbfd200;
 
 static long current_speed = SPI_SPEED_SLOW;
+static long current_xfer_mode = SPI_XFER_CLK;
+static int batch_supported;
+static int long_supported;
+
+// Reply to the last XFER_MODE command, or -1 if the adapter didn't activate.
+static int xfer_mode_reply = -1;
+
+// Set if the adapter accepted strobe mode in spi_initialize().
+static int strobe_capable;
+
+// CLK mode transfer loops in spi_low.asm; spi_initialize() times the ones
+// the CPU can run and keeps the fastest.
+struct fast_kernel
+{
+	void (*read)(__reg("a0") UBYTE *buf, __reg("d0") ULONG size);
+	void (*write)(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+	UWORD cpu_flags;
+};
+
+static const struct fast_kernel fast_kernels[] =
+{
+	{ spi_read_fast, spi_write_fast, 0 },
+	{ spi_read_fast16, spi_write_fast16, 0 },
+	{ spi_read_fast020, spi_write_fast020, AFF_68020 },
+};
+
+#define FAST_KERNEL_COUNT	(sizeof(fast_kernels) / sizeof(fast_kernels[0]))
+
+static const struct fast_kernel *fast_kernel = &fast_kernels[0];
+
+// Filled in by spi_initialize() if the firmware answers GET_CAPS.
+static struct spi_caps caps;
+static int caps_valid;
 
 static const char spi_lib_name[] = "spi-lib";
 
-static struct Library *miscbase;
-static struct Library *ciaabase;
+#define MAX_USERS	4
 
-static struct Interrupt flag_interrupt;
+// State shared by every copy of spi-lib that uses the adapter, so that
+// several drivers can take turns with it. The first spi_initialize()
+// allocates it, claims the parallel port and publishes it as a semaphore
+// named spi-lib; later ones find it and join. The FLG interrupt runs the
+// flag_isr() of one of the copies, which calls every change handler.
+struct spi_shared
+{
+	struct SignalSemaphore sem;
+	struct Interrupt flag_interrupt;
+
+	// Opened by the copy that claims the port, and used by whichever copy
+	// is the last to shut down.
+	struct Library *miscbase;
+	struct Library *ciaabase;
+
+	char name[sizeof(spi_lib_name)];
+	UWORD users;
+	BYTE active_target;	// Target whose settings the adapter has applied
+	BYTE strobe_capable;
+	BYTE kernel;
+
+	// Set after an LBA read or write on firmware that then keeps reading
+	// ahead or programming buffered sectors.
+	BYTE lba_streaming;
+
+	// Speed and transfer mode last set on each target.
+	BYTE target_speed[SPI_MAX_TARGETS];
+	BYTE target_xfer_mode[SPI_MAX_TARGETS];
+
+	// Set while spi_wait_ready() sleeps; the next FLG interrupt then goes
+	// to the waiting task instead of the change handlers.
+	volatile BYTE notify_armed;
+	struct Task *notify_task;
+	ULONG notify_signals;
+
+	// Set while the network driver waits for a frame; the FLG interrupt
+	// then signals it instead of calling the change handlers.
+	volatile BYTE net_armed;
+	struct Task *net_task;
+	ULONG net_signals;
+
+	void (*flag_isr[MAX_USERS])();
+	void (*change_handler[MAX_USERS])();
+};
+
+static struct spi_shared *shared;
+static int user_slot;
+
+// Target (chip select) this copy talks to.
+static long target;
+
+// Bits of the CARD_PRESENT reply.
+#define CARD_PRESENT_BIT	0x01
+#define CARD_CHANGED_BIT	0x02
 
 static int wait_until_active()
 {
@@ -53,8 +156,49 @@ static int wait_until_active()
 	return count;
 }
 
+// Has the adapter apply the clock, SPI mode and transfer mode of this
+// copy's target, if another target was used last. With select set the
+// chip select is asserted by the same command. Returns 1 if the target
+// was switched.
+static int switch_target(int select)
+{
+	// The card has to be idle before it is used directly, or before the
+	// bus goes to another target.
+	if (shared->lba_streaming)
+		spi_lba_sync();
+
+	if (shared->active_target == target)
+		return 0;
+
+	*cia_a_prb = 0xd8 | (select ? 1 : 0);
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		return 0;
+	}
+
+	*cia_a_prb = target;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	shared->active_target = target;
+	return 1;
+}
+
 void spi_select()
 {
+	if (switch_target(1))
+		return;
+
 	*cia_a_prb = 0xc1;
 
 	UBYTE prev = *cia_b_pra;
@@ -77,7 +221,10 @@ void spi_deselect()
 	*cia_b_pra = prev;
 }
 
-int spi_get_card_present()
+// Returns the CARD_PRESENT reply, or -1 if the adapter didn't activate.
+// Firmware that can signal card ready sets CARD_CHANGED_BIT when it has
+// raised IRQ for a card change since the last query.
+static int card_status()
 {
 	*cia_a_prb = 0xc2;
 
@@ -97,18 +244,33 @@ int spi_get_card_present()
 	ctrl ^= CLK_MASK;
 	*cia_b_pra = ctrl;
 
-	int present = *cia_a_prb & 1;
+	int status = *cia_a_prb;
 
 	ctrl |= REQ_MASK;
 	*cia_b_pra = ctrl;
 
 	*cia_a_ddrb = 0xff;
 
-	return present;
+	return status;
+}
+
+int spi_get_card_present()
+{
+	int status = card_status();
+	return status < 0 ? -1 : status & CARD_PRESENT_BIT;
+}
+
+static void use_strobe(int on)
+{
+	long mode = on ? SPI_XFER_STROBE : SPI_XFER_CLK;
+	if (strobe_capable && current_xfer_mode != mode)
+		spi_set_xfer_mode(mode);
 }
 
 void spi_set_speed(long speed)
 {
+	switch_target(0);
+
 	*cia_a_prb = speed == SPI_SPEED_FAST ? 0xc5 : 0xc4;
 
 	UBYTE prev = *cia_b_pra;
@@ -119,6 +281,294 @@ void spi_set_speed(long speed)
 	*cia_b_pra = prev;
 
 	current_speed = speed;
+
+	if (speed == SPI_SPEED_FAST)
+		use_strobe(1);
+}
+
+// Asks the firmware to clock data bytes on the /STROBE pulses from CIA-A
+// instead of on CLK toggles. Two probe bytes are written so the firmware
+// can check that /STROBE is actually wired to it. Firmware that doesn't
+// know the command either never activates (AVR, RP2040 before strobe
+// support) or leaves the data port floating, which reads as 0xff; in both
+// cases we stay in CLK mode. Returns the mode in effect.
+long spi_set_xfer_mode(long mode)
+{
+	switch_target(0);
+
+	*cia_a_prb = 0xc6 | (mode == SPI_XFER_STROBE ? 1 : 0);
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		xfer_mode_reply = -1;
+		current_xfer_mode = SPI_XFER_CLK;
+		return current_xfer_mode;
+	}
+
+	*cia_a_prb = 0x5a;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_prb = 0xa5;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0x00;
+
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	UBYTE reply = *cia_a_prb;
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0xff;
+
+	xfer_mode_reply = reply;
+
+	if (mode == SPI_XFER_STROBE && reply == SPI_XFER_STROBE)
+		current_xfer_mode = SPI_XFER_STROBE;
+	else
+		current_xfer_mode = SPI_XFER_CLK;
+
+	return current_xfer_mode;
+}
+
+#define CAPS_MAGIC		0x43
+#define CAPS_HEADER_SIZE	8
+
+// Asks the firmware what it supports. The reply is a magic byte, the
+// firmware ID, the protocol version, a 32 bit bitmap of the supported
+// control commands, the number of clock tiers and the frequency of each
+// tier in kHz, big endian and one byte per CLK toggle. Firmware without
+// GET_CAPS either never activates or leaves the port floating at 0xff.
+static int read_caps(struct spi_caps *c)
+{
+	UBYTE hdr[CAPS_HEADER_SIZE];
+
+	*cia_a_prb = 0xd0;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		return -1;
+	}
+
+	*cia_a_ddrb = 0x00;
+
+	for (int i = 0; i < CAPS_HEADER_SIZE; i++)
+	{
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
+		hdr[i] = *cia_a_prb;
+	}
+
+	int count = hdr[7] < SPI_MAX_TIERS ? hdr[7] : SPI_MAX_TIERS;
+
+	if (hdr[0] == CAPS_MAGIC)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			ctrl ^= CLK_MASK;
+			*cia_b_pra = ctrl;
+			UBYTE hi = *cia_a_prb;
+
+			ctrl ^= CLK_MASK;
+			*cia_b_pra = ctrl;
+			c->tier_khz[i] = (hi << 8) | *cia_a_prb;
+		}
+	}
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0xff;
+
+	if (hdr[0] != CAPS_MAGIC)
+		return -1;
+
+	c->firmware = hdr[1];
+	c->version = hdr[2];
+	c->commands = ((ULONG)hdr[3] << 24) | ((ULONG)hdr[4] << 16) | ((ULONG)hdr[5] << 8) | hdr[6];
+	c->tier_count = count;
+	return 0;
+}
+
+// Returns -1 if the firmware doesn't support GET_CAPS.
+int spi_get_caps(struct spi_caps *c)
+{
+	if (!caps_valid)
+		return -1;
+
+	*c = caps;
+	return 0;
+}
+
+// The CLK-toggled routines need the firmware to shift a byte out within
+// two CIA accesses, the strobe-clocked routines within one. Below that the
+// slow routines, which wait 40 us per byte, are used.
+#define FAST_MIN_KHZ		4000
+#define STROBE_MIN_KHZ		12000
+
+// Selects one of the clock tiers reported by spi_get_caps(). The firmware
+// echoes the tier it switched to. Returns the tier frequency in kHz, or -1
+// if the tier doesn't exist or the firmware doesn't support tiers.
+long spi_set_tier(long tier)
+{
+	if (!caps_valid || !(caps.commands & SPI_CAP_TIER) || tier < 0 || tier >= caps.tier_count)
+		return -1;
+
+	switch_target(0);
+
+	*cia_a_prb = 0xd2;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		return -1;
+	}
+
+	*cia_a_prb = tier;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0x00;
+
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	UBYTE reply = *cia_a_prb;
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0xff;
+
+	if (reply != tier)
+		return -1;
+
+	long khz = caps.tier_khz[tier];
+
+	current_speed = khz >= FAST_MIN_KHZ ? SPI_SPEED_FAST : SPI_SPEED_SLOW;
+	use_strobe(khz >= STROBE_MIN_KHZ);
+
+	return khz;
+}
+
+// Gives the calling task the adapter until the matching spi_release(), and
+// makes the calls in between talk to target. Calls nest. Returns -1, and
+// doesn't obtain the adapter, if the firmware has no such target.
+int spi_obtain(long t)
+{
+	if (t < 0 || t >= SPI_MAX_TARGETS || (t != 0 && !(caps.commands & SPI_CAP_TARGET)))
+		return -1;
+
+	ObtainSemaphore(&shared->sem);
+
+	// Another copy may have changed the settings since.
+	target = t;
+	current_speed = shared->target_speed[t];
+	current_xfer_mode = shared->target_xfer_mode[t];
+
+	return 0;
+}
+
+void spi_release()
+{
+	shared->target_speed[target] = current_speed;
+	shared->target_xfer_mode[target] = current_xfer_mode;
+
+	ReleaseSemaphore(&shared->sem);
+}
+
+// Sets the SPI mode (CPOL << 1 | CPHA) of the current target, which the
+// firmware remembers along with its clock. Returns -1 if the firmware
+// only does mode 0.
+int spi_set_clock_mode(long mode)
+{
+	if (!(caps.commands & SPI_CAP_SPI_MODE))
+		return mode == 0 ? 0 : -1;
+
+	switch_target(0);
+
+	*cia_a_prb = 0xda;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		return -1;
+	}
+
+	*cia_a_prb = mode & 3;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	return 0;
+}
+
+// Turns the firmware test mode on or off. The firmware replies with the
+// number of bytes written in test mode that didn't match the pattern since
+// the last TEST_MODE command, big endian. Returns the count, or -1 if the
+// firmware doesn't have a test mode.
+long spi_set_test_mode(long on)
+{
+	if (!(caps.commands & SPI_CAP_TEST))
+		return -1;
+
+	*cia_a_prb = 0xd6 | (on ? 1 : 0);
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		return -1;
+	}
+
+	*cia_a_ddrb = 0x00;
+
+	ULONG errors = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
+		errors = (errors << 8) | *cia_a_prb;
+	}
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0xff;
+
+	return errors & 0x7fffffff;
 }
 
 // A slow SPI transfer takes 32 us (8 bits times 4us (250kHz)).
@@ -218,66 +668,1402 @@ static void spi_read_slow(__reg("a0") UBYTE *buf, __reg("d0") ULONG size)
 	*cia_a_ddrb = 0xff;
 }
 
-void spi_read(__reg("a0") UBYTE *buf, __reg("d0") ULONG size)
+// Sends READ3/WRITE3 = 1100111A followed by size - 1 in three bytes.
+static UBYTE long_begin(UBYTE cmd, ULONG size)
 {
-	if (current_speed == SPI_SPEED_FAST)
-		spi_read_fast(buf, size);
-	else
-		spi_read_slow(buf, size);
-}
+	ULONG n = size - 1;
 
-void spi_write(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size)
-{
-	if (current_speed == SPI_SPEED_FAST)
-		spi_write_fast(buf, size);
-	else
-		spi_write_slow(buf, size);
+	*cia_a_prb = cmd;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	wait_until_active();
+
+	*cia_a_prb = n >> 16;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_prb = n >> 8;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_prb = n;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	return ctrl;
 }
 
-int spi_initialize(void (*change_isr)())
+#define LONG_CHUNK	0x8000
+
+static void spi_read_long(UBYTE *buf, ULONG size)
 {
-	int success = 0;
+	UBYTE ctrl = long_begin(0xcf, size);
+
+	*cia_a_ddrb = 0x00;
 
-	miscbase = (struct Library *)OpenResource(MISCNAME);
-	if (!miscbase)
+	if (current_xfer_mode == SPI_XFER_STROBE)
 	{
-		success = -1;
-		goto fail_out1;
+		// The first byte is clocked by CLK.
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
 	}
 
-	ciaabase = (struct Library *)OpenResource(CIAANAME);
-	if (!ciaabase)
+	while (size)
 	{
-		success = -2;
-		goto fail_out1;
+		ULONG n = size < LONG_CHUNK ? size : LONG_CHUNK;
+
+		if (current_xfer_mode == SPI_XFER_STROBE)
+			spi_strobe_in(buf, n);
+		else
+			spi_clock_in(buf, n);
+
+		buf += n;
+		size -= n;
 	}
 
-	if (AllocMiscResource(miscbase, MR_PARALLELPORT, spi_lib_name))
-	{
+	ctrl = *cia_b_pra;
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0xff;
+}
+
+static void spi_write_long(const UBYTE *buf, ULONG size)
+{
+	long_begin(0xce, size);
+
+	while (size)
+	{
+		ULONG n = size < LONG_CHUNK ? size : LONG_CHUNK;
+
+		if (current_xfer_mode == SPI_XFER_STROBE)
+			spi_strobe_out(buf, n);
+		else
+			spi_clock_out(buf, n);
+
+		buf += n;
+		size -= n;
+	}
+
+	UBYTE ctrl = *cia_b_pra;
+	*cia_b_pra = ctrl;			// Delay to allow write to complete
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+}
+
+// Only firmware that answered XFER_MODE knows READ3/WRITE3, except for
+// the AVR, which doesn't answer XFER_MODE at all. Old RP2350 firmware
+// activates on anything, so it must not be probed with WRITE3.
+static int probe_long()
+{
+	if (xfer_mode_reply == SPI_XFER_CLK || xfer_mode_reply == SPI_XFER_STROBE)
+		return 1;
+
+	if (xfer_mode_reply >= 0)
+		return 0;
+
+	// Write a single 0xff, which is harmless with CS released.
+	*cia_a_prb = 0xce;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	int active = wait_until_active();
+
+	if (active)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			*cia_a_prb = i < 3 ? 0x00 : 0xff;
+			ctrl ^= CLK_MASK;
+			*cia_b_pra = ctrl;
+		}
+		*cia_b_pra = ctrl;
+	}
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	return active != 0;
+}
+
+#define MAX_SHORT_SIZE	8192
+
+void spi_read(__reg("a0") UBYTE *buf, __reg("d0") ULONG size)
+{
+	switch_target(0);
+
+	if (size > MAX_SHORT_SIZE)
+	{
+		if (current_speed == SPI_SPEED_FAST && long_supported)
+		{
+			spi_read_long(buf, size);
+			return;
+		}
+
+		while (size > MAX_SHORT_SIZE)
+		{
+			spi_read(buf, MAX_SHORT_SIZE);
+			buf += MAX_SHORT_SIZE;
+			size -= MAX_SHORT_SIZE;
+		}
+	}
+
+	if (current_speed != SPI_SPEED_FAST)
+		spi_read_slow(buf, size);
+	else if (current_xfer_mode == SPI_XFER_STROBE)
+		spi_read_strobe(buf, size);
+	else
+		fast_kernel->read(buf, size);
+}
+
+void spi_write(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size)
+{
+	switch_target(0);
+
+	if (size > MAX_SHORT_SIZE)
+	{
+		if (current_speed == SPI_SPEED_FAST && long_supported)
+		{
+			spi_write_long(buf, size);
+			return;
+		}
+
+		while (size > MAX_SHORT_SIZE)
+		{
+			spi_write(buf, MAX_SHORT_SIZE);
+			buf += MAX_SHORT_SIZE;
+			size -= MAX_SHORT_SIZE;
+		}
+	}
+
+	if (current_speed != SPI_SPEED_FAST)
+		spi_write_slow(buf, size);
+	else if (current_xfer_mode == SPI_XFER_STROBE)
+		spi_write_strobe(buf, size);
+	else
+		fast_kernel->write(buf, size);
+}
+
+#define STATUS_BUSY		0x5a
+#define STATUS_OK		0x00
+#define STATUS_TIMEOUT		0x01
+
+// Reads of the data port per ms while waiting for the firmware, at one
+// CIA access per 1.4 us.
+#define BUSY_LOOPS_PER_MS	700
+
+// Give the firmware about a second and a half on top of any poll limits
+// before deciding that it is gone.
+#define BUSY_LOOPS_MIN		(1500 * BUSY_LOOPS_PER_MS)
+
+static volatile UBYTE *cia_a_todl = (volatile UBYTE *)0xbfe801;
+static volatile UBYTE *cia_a_todm = (volatile UBYTE *)0xbfe901;
+static volatile UBYTE *cia_a_todh = (volatile UBYTE *)0xbfea01;
+
+static int poll_supported;
+
+// CIA-A TOD counts vertical blanks, so this has 50 (or 60) Hz resolution.
+static ULONG tod_ticks()
+{
+	UBYTE l, m, h;
+
+	// The TOD registers latch on reading MSB and unlatch on reading LSB.
+	h = *cia_a_todh;
+	m = *cia_a_todm;
+	l = *cia_a_todl;
+	return ((ULONG)h << 16) | ((ULONG)m << 8) | l;
+}
+
+// The port is an input and the firmware drives STATUS_BUSY while it works.
+// Spins until the value changes, and returns the settled status.
+static UBYTE wait_while_busy(ULONG loops)
+{
+	UBYTE status = *cia_a_prb;
+	while (status == STATUS_BUSY && loops)
+	{
+		loops--;
+		status = *cia_a_prb;
+	}
+
+	// Let all eight data lines settle before trusting the status.
+	return *cia_a_prb;
+}
+
+// The worst case is the AVR at 250 kHz, roughly 50 us per polled byte.
+static ULONG poll_busy_loops(long flags, long limit)
+{
+	if (flags & SPI_POLL_BYTES)
+		return limit / 20 * BUSY_LOOPS_PER_MS;
+	else
+		return limit * BUSY_LOOPS_PER_MS;
+}
+
+static int poll_matched(UBYTE byte, UBYTE mask, UBYTE value, long flags)
+{
+	int match = (byte & mask) == value;
+	return (flags & SPI_POLL_MISMATCH) ? !match : match;
+}
+
+// Firmware that doesn't know the poll command gets polled the old way.
+static int poll_slow(UBYTE mask, UBYTE value, long flags, long limit, UBYTE *result)
+{
+	UBYTE byte;
+
+	if (flags & SPI_POLL_BYTES)
+	{
+		long n = 0;
+		do
+		{
+			spi_read(&byte, 1);
+			n++;
+		} while (!poll_matched(byte, mask, value, flags) && n < limit);
+	}
+	else
+	{
+		// Round up, and add one since the first tick may be about to expire.
+		ULONG ticks = (limit * 50 + 999) / 1000 + 1;
+		ULONG start = tod_ticks();
+		do
+		{
+			spi_read(&byte, 1);
+		} while (!poll_matched(byte, mask, value, flags) && tod_ticks() - start < ticks);
+	}
+
+	*result = byte;
+	return poll_matched(byte, mask, value, flags) ? 0 : -1;
+}
+
+// Has the firmware read bytes until (byte & mask) == value (or != value
+// with SPI_POLL_MISMATCH), for at most limit ms (or limit bytes with
+// SPI_POLL_BYTES). The last byte read is stored in *result. Returns 0 if
+// the condition was met and -1 on timeout.
+int spi_poll(unsigned char mask, unsigned char value, long flags, long limit, unsigned char *result)
+{
+	switch_target(0);
+
+	if (!poll_supported)
+		return poll_slow(mask, value, flags, limit, result);
+
+	*cia_a_prb = 0xca;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		poll_supported = 0;
+		return poll_slow(mask, value, flags, limit, result);
+	}
+
+	*cia_a_prb = mask;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_prb = value;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_prb = flags;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_prb = limit >> 8;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_prb = limit & 0xff;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0x00;
+
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	UBYTE status = wait_while_busy(BUSY_LOOPS_MIN + poll_busy_loops(flags, limit));
+
+	if (status == STATUS_OK || status == STATUS_TIMEOUT)
+	{
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
+
+		*result = *cia_a_prb;
+	}
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0xff;
+
+	if (status == STATUS_OK)
+		return 0;
+	else if (status == STATUS_TIMEOUT)
+		return -1;
+
+	poll_supported = 0;
+	return poll_slow(mask, value, flags, limit, result);
+}
+
+static void call_change_handlers()
+{
+	for (int i = 0; i < MAX_USERS; i++)
+	{
+		if (shared->change_handler[i])
+			shared->change_handler[i]();
+	}
+}
+
+// Waits for the selected card to stop reading busy, for at most limit ms.
+// Firmware that reports SPI_CAP_NOTIFY watches MISO itself and pulses IRQ
+// when the card reads 0xff or the limit has passed, and the calling task
+// sleeps on signals meanwhile. Otherwise this is spi_poll(). Returns 0 if
+// the card is ready and -1 on timeout.
+int spi_wait_ready(unsigned long signals, long limit)
+{
+	UBYTE in;
+
+	if (!signals || !(caps.commands & SPI_CAP_NOTIFY))
+		return spi_poll(0xff, 0xff, SPI_POLL_MATCH | SPI_POLL_MS, limit, &in);
+
+	if (limit > 0xffff)
+		limit = 0xffff;
+
+	switch_target(0);
+
+	shared->notify_task = FindTask(NULL);
+	shared->notify_signals = signals;
+	SetSignal(0, signals);
+	shared->notify_armed = 1;
+
+	*cia_a_prb = 0xd4;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		shared->notify_armed = 0;
+		return spi_poll(0xff, 0xff, SPI_POLL_MATCH | SPI_POLL_MS, limit, &in);
+	}
+
+	*cia_a_prb = limit >> 8;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_prb = limit & 0xff;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	Wait(signals);
+
+	// The pulse may have been a card change rather than the card going
+	// ready; pass that on to the change handler.
+	int status = card_status();
+	if (status >= 0 && (status & CARD_CHANGED_BIT))
+		call_change_handlers();
+
+	return spi_poll(0xff, 0xff, SPI_POLL_MATCH | SPI_POLL_BYTES, 1, &in);
+}
+
+// Installed as the FLG interrupt handler.
+static void flag_isr()
+{
+	if (shared->notify_armed || shared->net_armed)
+	{
+		if (shared->notify_armed)
+		{
+			shared->notify_armed = 0;
+			Signal(shared->notify_task, shared->notify_signals);
+		}
+
+		// A pulse for the card going ready may also be a frame, and the
+		// network driver just checks.
+		if (shared->net_armed)
+		{
+			shared->net_armed = 0;
+			Signal(shared->net_task, shared->net_signals);
+		}
+	}
+	else
+		call_change_handlers();
+}
+
+// Sends the whole batch in one REQ cycle: flags, segment count, a three
+// byte descriptor per segment (six for polls) and then the write payloads.
+// After turning the port around the firmware drives STATUS_BUSY while it
+// runs the segments, then a status byte followed by the data of the read
+// segments, including the last byte read by each poll. If a poll times
+// out the remaining segments are skipped and the status is 0x80 plus the
+// index of the poll. Returns the number of segments run, or -1 if the
+// firmware didn't run the batch.
+static long batch_send(const struct spi_segment *segs, long count, long flags)
+{
+	*cia_a_prb = 0xc8;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		return -1;
+	}
+
+	*cia_a_prb = flags;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_prb = count;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	ULONG loops = BUSY_LOOPS_MIN;
+
+	for (int i = 0; i < count; i++)
+	{
+		*cia_a_prb = segs[i].type;
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
+
+		*cia_a_prb = segs[i].size >> 8;
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
+
+		*cia_a_prb = segs[i].size & 0xff;
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
+
+		if (segs[i].type == SPI_SEG_POLL)
+		{
+			*cia_a_prb = segs[i].mask;
+			ctrl ^= CLK_MASK;
+			*cia_b_pra = ctrl;
+
+			*cia_a_prb = segs[i].value;
+			ctrl ^= CLK_MASK;
+			*cia_b_pra = ctrl;
+
+			*cia_a_prb = segs[i].flags;
+			ctrl ^= CLK_MASK;
+			*cia_b_pra = ctrl;
+
+			loops += poll_busy_loops(segs[i].flags, segs[i].size);
+		}
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		if (segs[i].type != SPI_SEG_WRITE)
+			continue;
+
+		const UBYTE *p = segs[i].buf;
+		for (int j = 0; j < segs[i].size; j++)
+		{
+			*cia_a_prb = *p++;
+			ctrl ^= CLK_MASK;
+			*cia_b_pra = ctrl;
+		}
+	}
+
+	*cia_a_ddrb = 0x00;
+
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	UBYTE status = wait_while_busy(loops);
+
+	long done = -1;
+	if (status == STATUS_OK)
+		done = count;
+	else if (status >= 0x80 && status - 0x80 < count && segs[status - 0x80].type == SPI_SEG_POLL)
+		done = status - 0x80;
+
+	if (done >= 0)
+	{
+		// Segments after a failed poll have nothing worth reading.
+		long last = done < count ? done + 1 : count;
+
+		for (int i = 0; i < last; i++)
+		{
+			UBYTE *p = segs[i].buf;
+			int size;
+
+			if (segs[i].type == SPI_SEG_READ)
+				size = segs[i].size;
+			else if (segs[i].type == SPI_SEG_POLL)
+				size = 1;
+			else
+				continue;
+
+			for (int j = 0; j < size; j++)
+			{
+				ctrl ^= CLK_MASK;
+				*cia_b_pra = ctrl;
+				*p++ = *cia_a_prb;
+			}
+		}
+	}
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0xff;
+
+	return done;
+}
+
+// Runs a list of segments with as few handshakes as possible. If the
+// firmware doesn't support batches, or the batch is too big for it, the
+// segments are run one by one instead. Returns the number of segments run,
+// which is less than count if a poll timed out.
+long spi_transfer_batch(const struct spi_segment *segs, long count, long flags)
+{
+	switch_target(0);
+
+	if (batch_supported && count > 0 && count <= SPI_BATCH_MAX_SEGMENTS)
+	{
+		long bytes = 0;
+		for (int i = 0; i < count; i++)
+		{
+			if (segs[i].type == SPI_SEG_WRITE || segs[i].type == SPI_SEG_READ)
+				bytes += segs[i].size;
+			else if (segs[i].type == SPI_SEG_POLL)
+				bytes++;
+		}
+
+		if (bytes <= SPI_BATCH_MAX_BYTES)
+		{
+			long done = batch_send(segs, count, flags);
+			if (done >= 0)
+				return done;
+
+			// Remember that the firmware didn't run it, and don't ask again.
+			batch_supported = 0;
+		}
+	}
+
+	if (flags & SPI_BATCH_SELECT)
+		spi_select();
+
+	long done = 0;
+	for (; done < count; done++)
+	{
+		int i = done;
+
+		switch (segs[i].type)
+		{
+			case SPI_SEG_WRITE:
+				if (segs[i].size)
+					spi_write(segs[i].buf, segs[i].size);
+				break;
+			case SPI_SEG_READ:
+				if (segs[i].size)
+					spi_read(segs[i].buf, segs[i].size);
+				break;
+			case SPI_SEG_SELECT:
+				spi_select();
+				break;
+			case SPI_SEG_DESELECT:
+				spi_deselect();
+				break;
+			case SPI_SEG_POLL:
+				if (spi_poll(segs[i].mask, segs[i].value, segs[i].flags, segs[i].size, segs[i].buf))
+					goto out;
+				break;
+		}
+	}
+
+out:
+	if (flags & SPI_BATCH_DESELECT)
+		spi_deselect();
+
+	return done;
+}
+
+#define LBA_OPEN		0
+#define LBA_READ		1
+#define LBA_WRITE		2
+#define LBA_READ_UNIFORM	3
+#define LBA_FILL		4
+#define LBA_READ_LZ4		5
+#define LBA_SYNC		6
+
+// Status of a sector that is sent as a single value byte.
+#define LBA_UNIFORM		0x10
+
+// Status of a block of sectors that is sent LZ4 compressed.
+#define LBA_LZ4			0x11
+
+#define LZ4_BLOCK_SECTORS	8
+#define LZ4_BLOCK_SIZE		(LZ4_BLOCK_SECTORS * SPI_LBA_SECTOR_SIZE)
+
+// Set by spi_initialize() if the firmware can compress and the CPU is fast
+// enough to decompress quicker than the port delivers.
+static int lz4_enabled;
+static UBYTE lz4_buf[LZ4_BLOCK_SIZE];
+
+// The write buffer of the firmware may take a while to program.
+#define LBA_SYNC_LOOPS		(LBA_BUSY_LOOPS + 64 * 500 * BUSY_LOOPS_PER_MS)
+
+// Sectors per LBA_FILL command, which bounds the time spent busy.
+#define LBA_FILL_MAX		128
+
+// Card initialization may take a second or more, data tokens and write
+// busy periods up to half a second each.
+#define LBA_BUSY_LOOPS		(BUSY_LOOPS_MIN + 2000 * BUSY_LOOPS_PER_MS)
+
+// Starts an LBA command: op, a 32 bit LBA and a 16 bit sector count, and
+// for LBA_FILL the fill value. Leaves REQ low and the data port as an
+// input. Returns the control port value, or -1 if the adapter didn't
+// respond.
+static int lba_begin(UBYTE op, ULONG lba, UWORD count, UBYTE value)
+{
+	UBYTE params[8];
+	int n = op == LBA_FILL ? 8 : 7;
+	params[0] = op;
+	params[1] = lba >> 24;
+	params[2] = lba >> 16;
+	params[3] = lba >> 8;
+	params[4] = lba;
+	params[5] = count >> 8;
+	params[6] = count;
+	params[7] = value;
+
+	if (caps_valid && !(caps.commands & SPI_CAP_LBA))
+		return -1;
+
+	*cia_a_prb = 0xcc;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		*cia_a_prb = params[i];
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
+	}
+
+	*cia_a_ddrb = 0x00;
+
+	// The firmware runs the SD card on target 0 in LBA mode.
+	shared->active_target = 0;
+
+	return ctrl;
+}
+
+static void lba_end(UBYTE ctrl)
+{
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0xff;
+}
+
+// Toggles CLK and waits for the status that the firmware then prepares.
+// The marker status extra (LBA_UNIFORM or LBA_LZ4) is passed on if given.
+static int lba_status(UBYTE *ctrl, ULONG loops, int extra)
+{
+	*ctrl ^= CLK_MASK;
+	*cia_b_pra = *ctrl;
+
+	UBYTE status = wait_while_busy(loops);
+	if (extra && status == extra)
+		return status;
+	if (status > SPI_LBA_NO_CARD)
+		return SPI_LBA_UNSUPPORTED;
+
+	return status;
+}
+
+// Lets the firmware initialize the card. On success info receives the card
+// type followed by the raw CID and CSD registers.
+int spi_lba_open(unsigned char *info)
+{
+	int ctrl = lba_begin(LBA_OPEN, 0, 0, 0);
+	if (ctrl < 0)
+		return SPI_LBA_UNSUPPORTED;
+
+	UBYTE c = ctrl;
+	int status = lba_status(&c, LBA_BUSY_LOOPS, 0);
+
+	if (status == SPI_LBA_OK)
+		spi_clock_in(info, SPI_LBA_INFO_SIZE);
+
+	lba_end(*cia_b_pra);
+	return status;
+}
+
+// Reads LZ4_BLOCK_SECTORS sectors at a time, each block either stored or
+// as an LZ4 block that is decoded straight into buf.
+static int lba_read_lz4(unsigned char *buf, unsigned long lba, long count)
+{
+	int ctrl = lba_begin(LBA_READ_LZ4, lba, count, 0);
+	if (ctrl < 0)
+		return SPI_LBA_UNSUPPORTED;
+
+	shared->lba_streaming = (caps.commands & SPI_CAP_CACHE) != 0;
+
+	UBYTE c = ctrl;
+	int status;
+
+	// Reading a block takes up to eight token waits.
+	ULONG loops = LBA_BUSY_LOOPS + LZ4_BLOCK_SECTORS * 500 * BUSY_LOOPS_PER_MS;
+
+	for (long i = 0; ; )
+	{
+		status = lba_status(&c, loops, i < count ? LBA_LZ4 : 0);
+		if ((status != SPI_LBA_OK && status != LBA_LZ4) || i == count)
+			break;
+
+		long n = count - i < LZ4_BLOCK_SECTORS ? count - i : LZ4_BLOCK_SECTORS;
+		ULONG size = n * SPI_LBA_SECTOR_SIZE;
+
+		if (status == LBA_LZ4)
+		{
+			UBYTE len[2];
+			spi_clock_in(len, 2);
+
+			ULONG packed = (len[0] << 8) | len[1];
+			if (packed == 0 || packed >= size)
+			{
+				status = SPI_LBA_ERROR;
+				break;
+			}
+
+			spi_clock_in(lz4_buf, packed);
+
+			if (spi_lz4_decode(lz4_buf, buf, packed, size) != size)
+			{
+				status = SPI_LBA_ERROR;
+				break;
+			}
+		}
+		else
+			spi_clock_in(buf, size);
+
+		buf += size;
+		i += n;
+	}
+
+	lba_end(c);
+	return status;
+}
+
+// Firmware that supports it sends sectors with all bytes the same as an
+// LBA_UNIFORM status followed by the value, which saves 511 CLK toggles
+// for each empty or erased sector.
+int spi_lba_read(unsigned char *buf, unsigned long lba, long count)
+{
+	if (lz4_enabled)
+		return lba_read_lz4(buf, lba, count);
+
+	int uniform = caps_valid && (caps.commands & SPI_CAP_LBA_UNIFORM);
+
+	int ctrl = lba_begin(uniform ? LBA_READ_UNIFORM : LBA_READ, lba, count, 0);
+	if (ctrl < 0)
+		return SPI_LBA_UNSUPPORTED;
+
+	shared->lba_streaming = (caps.commands & SPI_CAP_CACHE) != 0;
+
+	UBYTE c = ctrl;
+	int status;
+
+	// A status before each sector, and one after the last.
+	for (long i = 0; ; i++)
+	{
+		status = lba_status(&c, LBA_BUSY_LOOPS, uniform && i < count ? LBA_UNIFORM : 0);
+		if (status == LBA_UNIFORM)
+		{
+			UBYTE value;
+			spi_clock_in(&value, 1);
+			spi_fill(buf, SPI_LBA_SECTOR_SIZE, value);
+			buf += SPI_LBA_SECTOR_SIZE;
+			continue;
+		}
+
+		if (status != SPI_LBA_OK || i == count)
+			break;
+
+		spi_clock_in(buf, SPI_LBA_SECTOR_SIZE);
+		buf += SPI_LBA_SECTOR_SIZE;
+	}
+
+	lba_end(c);
+	return status;
+}
+
+int spi_lba_write(const unsigned char *buf, unsigned long lba, long count)
+{
+	int ctrl = lba_begin(LBA_WRITE, lba, count, 0);
+	if (ctrl < 0)
+		return SPI_LBA_UNSUPPORTED;
+
+	shared->lba_streaming = (caps.commands & SPI_CAP_CACHE) != 0;
+
+	UBYTE c = ctrl;
+	int status = lba_status(&c, LBA_BUSY_LOOPS, 0);
+
+	for (long i = 0; i < count && status == SPI_LBA_OK; i++)
+	{
+		// The firmware lets go of the data port on this toggle.
+		c ^= CLK_MASK;
+		*cia_b_pra = c;
+
+		*cia_a_ddrb = 0xff;
+		spi_clock_out(buf, SPI_LBA_SECTOR_SIZE);
+		buf += SPI_LBA_SECTOR_SIZE;
+		*cia_a_ddrb = 0x00;
+
+		status = lba_status(&c, LBA_BUSY_LOOPS, 0);
+	}
+
+	if (status == SPI_LBA_OK)
+		status = lba_status(&c, LBA_BUSY_LOOPS, 0);
+
+	lba_end(c);
+	return status;
+}
+
+// Writes count sectors with every byte set to value, without sending the
+// sectors over the port. Returns SPI_LBA_UNSUPPORTED if the firmware can't
+// do it, and the caller should then write the sectors itself.
+int spi_lba_fill(unsigned char value, unsigned long lba, long count)
+{
+	if (!caps_valid || !(caps.commands & SPI_CAP_LBA_UNIFORM))
+		return SPI_LBA_UNSUPPORTED;
+
+	int status = SPI_LBA_OK;
+
+	while (count && status == SPI_LBA_OK)
+	{
+		long n = count < LBA_FILL_MAX ? count : LBA_FILL_MAX;
+
+		int ctrl = lba_begin(LBA_FILL, lba, n, value);
+		if (ctrl < 0)
+			return SPI_LBA_UNSUPPORTED;
+
+		// Allow up to half a second of programming time per sector.
+		UBYTE c = ctrl;
+		status = lba_status(&c, LBA_BUSY_LOOPS + n * 500 * BUSY_LOOPS_PER_MS, 0);
+
+		lba_end(c);
+
+		lba += n;
+		count -= n;
+	}
+
+	return status;
+}
+
+// Firmware with a cache reads ahead after LBA reads, and acknowledges LBA
+// writes before the sectors are programmed. This waits for the writes and
+// ends the read-ahead, leaving the card idle, and returns the first error
+// from programming since the last sync. spi-lib does this itself before
+// the card is used directly.
+int spi_lba_sync()
+{
+	if (!(caps.commands & SPI_CAP_CACHE))
+		return SPI_LBA_OK;
+
+	shared->lba_streaming = 0;
+
+	int ctrl = lba_begin(LBA_SYNC, 0, 0, 0);
+	if (ctrl < 0)
+		return SPI_LBA_UNSUPPORTED;
+
+	UBYTE c = ctrl;
+	int status = lba_status(&c, LBA_SYNC_LOOPS, 0);
+
+	lba_end(c);
+	return status;
+}
+
+// Sets the number of sectors the firmware reads ahead of sequential LBA
+// reads, unless depth is negative, and fills stats with the cache size,
+// depth and hit and miss counts, the write buffer size, the sectors in it
+// not yet programmed and the count of buffered sectors that were lost.
+// Returns -1 if the firmware has no cache.
+int spi_cache_control(long depth, struct spi_cache_stats *stats)
+{
+	if (!(caps.commands & SPI_CAP_CACHE))
+		return -1;
+
+	*cia_a_prb = 0xdc | (depth >= 0 ? 1 : 0);
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		return -1;
+	}
+
+	if (depth >= 0)
+	{
+		*cia_a_prb = depth > 255 ? 255 : depth;
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
+	}
+
+	*cia_a_ddrb = 0x00;
+
+	UBYTE reply[20];
+	for (int i = 0; i < 20; i++)
+	{
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
+		reply[i] = *cia_a_prb;
+	}
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0xff;
+
+	stats->sectors = (reply[0] << 8) | reply[1];
+	stats->depth = (reply[2] << 8) | reply[3];
+	stats->hits = ((ULONG)reply[4] << 24) | ((ULONG)reply[5] << 16) | (reply[6] << 8) | reply[7];
+	stats->misses = ((ULONG)reply[8] << 24) | ((ULONG)reply[9] << 16) | (reply[10] << 8) | reply[11];
+	stats->write_sectors = (reply[12] << 8) | reply[13];
+	stats->dirty = (reply[14] << 8) | reply[15];
+	stats->lost = ((ULONG)reply[16] << 24) | ((ULONG)reply[17] << 16) | (reply[18] << 8) | reply[19];
+
+	return 0;
+}
+
+// FatFS on the firmware may wait for the card several times per request.
+#define FILE_BUSY_LOOPS		(BUSY_LOOPS_MIN + 5000 * BUSY_LOOPS_PER_MS)
+
+// SD_ERROR of the firmware, SPI_FILE_ERROR and SPI_NET_ERROR.
+#define EXCHANGE_ERROR		2
+
+// Runs a FILE or NET request (command 1101111A): an op, the 16 bit sizes
+// of the parameter block and of the largest reply, and the parameter
+// block, which is params followed by data. After a status like that of
+// the LBA commands, an OK status is followed by the 16 bit size of the
+// reply and the reply. Returns the status, STATUS_BUSY on a timeout or
+// -1 if the firmware didn't answer, with the reply in reply and its size
+// in *reply_size. A reply larger than reply_max gives EXCHANGE_ERROR.
+static int exchange(UBYTE cmd, long op, const UBYTE *params, long size, const UBYTE *data, long data_size,
+		UBYTE *reply, long reply_max, long *reply_size, ULONG loops)
+{
+	long total = size + data_size;
+	UBYTE hdr[5];
+	hdr[0] = op;
+	hdr[1] = total >> 8;
+	hdr[2] = total;
+	hdr[3] = reply_max >> 8;
+	hdr[4] = reply_max;
+
+	*reply_size = 0;
+
+	*cia_a_prb = cmd;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		return -1;
+	}
+
+	spi_clock_out(hdr, sizeof(hdr));
+	if (size)
+		spi_clock_out(params, size);
+	if (data_size)
+		spi_clock_out(data, data_size);
+
+	*cia_a_ddrb = 0x00;
+
+	ctrl = *cia_b_pra ^ CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	int status = wait_while_busy(loops);
+
+	if (status == 0)
+	{
+		UBYTE n[2];
+		spi_clock_in(n, 2);
+
+		long len = (n[0] << 8) | n[1];
+		if (len > reply_max)
+			status = EXCHANGE_ERROR;
+		else
+		{
+			spi_clock_in(reply, len);
+			*reply_size = len;
+		}
+	}
+
+	lba_end(*cia_b_pra);
+	return status;
+}
+
+// Runs a request on the FAT volume of the SD card, which the firmware
+// mounts itself. Returns a SPI_FILE_* status, with the reply in reply
+// and its size in *reply_size.
+int spi_file_request(long op, const unsigned char *params, long size, const unsigned char *data, long data_size,
+		unsigned char *reply, long reply_max, long *reply_size)
+{
+	*reply_size = 0;
+
+	if (!caps_valid || !(caps.commands & SPI_CAP_FILE))
+		return SPI_FILE_UNSUPPORTED;
+
+	// The firmware programs buffered LBA writes before the request.
+	shared->lba_streaming = 0;
+
+	int status = exchange(0xde, op, params, size, data, data_size, reply, reply_max, reply_size, FILE_BUSY_LOOPS);
+	if (status < 0)
+		return SPI_FILE_UNSUPPORTED;
+
+	// The firmware runs FatFS on the SD card, target 0.
+	shared->active_target = 0;
+
+	if (status == STATUS_BUSY)
+		return SPI_FILE_TIMEOUT;
+	if (status > SPI_FILE_BAD_SEEK)
+		return SPI_FILE_ERROR;
+
+	return status;
+}
+
+// NET requests only wait for the rings on the adapter.
+#define NET_BUSY_LOOPS		BUSY_LOOPS_MIN
+
+#define NET_OPEN		0
+#define NET_CLOSE		1
+#define NET_SEND		2
+#define NET_RECEIVE		3
+
+static int net_request(long op, const UBYTE *params, long size, UBYTE *reply, long reply_max, long *reply_size)
+{
+	if (!caps_valid || !(caps.commands & SPI_CAP_NET))
+		return SPI_NET_UNSUPPORTED;
+
+	int status = exchange(0xdf, op, params, size, NULL, 0, reply, reply_max, reply_size, NET_BUSY_LOOPS);
+	if (status < 0)
+		return SPI_NET_UNSUPPORTED;
+	if (status == STATUS_BUSY)
+		return SPI_NET_TIMEOUT;
+	if (status > SPI_NET_NOT_OPEN)
+		return SPI_NET_ERROR;
+
+	return status;
+}
+
+// Starts forwarding frames between the WiFi of the adapter and the
+// Amiga, dropping any that were queued, and fills mac with the address
+// the Amiga has to send from.
+int spi_net_open(unsigned char *mac)
+{
+	long n;
+	UBYTE reply[6];
+
+	int status = net_request(NET_OPEN, NULL, 0, reply, sizeof(reply), &n);
+	if (status == SPI_NET_OK)
+		CopyMem(reply, mac, 6);
+
+	return status;
+}
+
+int spi_net_close()
+{
+	long n;
+	UBYTE reply[1];
+
+	shared->net_armed = 0;
+	return net_request(NET_CLOSE, NULL, 0, reply, 0, &n);
+}
+
+// Queues the frames in buf, each a 16 bit length and the frame, on the
+// adapter. *accepted is set to how many of them were taken; the rest
+// didn't fit and can be sent again later.
+int spi_net_send(const unsigned char *buf, long size, long *accepted)
+{
+	long n;
+	UBYTE reply[1];
+
+	*accepted = 0;
+
+	int status = net_request(NET_SEND, buf, size, reply, sizeof(reply), &n);
+	if (n == 1)
+		*accepted = reply[0];
+
+	return status;
+}
+
+// Fetches as many received frames as fit in buf, each a 16 bit length and
+// the frame, after a flag byte. If SPI_NET_MORE isn't set in it, the
+// adapter pulses IRQ for the next frame, and signals, if not 0, are then
+// sent to the calling task instead of calling the change handlers. A
+// card change reported here is passed on to the change handlers.
+int spi_net_receive(unsigned char *buf, long buf_max, long *size, unsigned long signals)
+{
+	if (signals)
+	{
+		shared->net_task = FindTask(NULL);
+		shared->net_signals = signals;
+		shared->net_armed = 1;
+	}
+
+	int status = net_request(NET_RECEIVE, NULL, 0, buf, buf_max, size);
+
+	if (status != SPI_NET_OK || !*size || (buf[0] & SPI_NET_MORE))
+		shared->net_armed = 0;
+
+	if (status == SPI_NET_OK && *size && (buf[0] & SPI_NET_CARD_CHANGED))
+	{
+		int card = card_status();
+		if (card >= 0 && (card & CARD_CHANGED_BIT))
+			call_change_handlers();
+	}
+
+	return status;
+}
+
+// Bytes per timed transfer and TOD ticks per kernel in select_kernel().
+#define TIMING_SIZE		256
+#define TIMING_TICKS		4
+
+static UBYTE timing_buf[TIMING_SIZE];
+
+// Counts the TIMING_SIZE reads and writes the kernel gets through in
+// TIMING_TICKS, starting on a tick edge.
+static ULONG time_kernel(const struct fast_kernel *k)
+{
+	ULONG start = tod_ticks();
+	while (tod_ticks() == start)
+		;
+
+	start = tod_ticks();
+	ULONG runs = 0;
+	while (tod_ticks() - start < TIMING_TICKS)
+	{
+		k->read(timing_buf, TIMING_SIZE);
+		k->write(timing_buf, TIMING_SIZE);
+		runs++;
+	}
+	return runs;
+}
+
+// Picks the CLK mode kernel for spi_read() and spi_write(). The timing
+// runs with no chip selected, so the card ignores the clocked bytes.
+static void select_kernel()
+{
+	long mode = current_xfer_mode;
+
+	spi_set_speed(SPI_SPEED_FAST);
+	use_strobe(0);
+
+	ULONG best = 0;
+	for (int i = 0; i < FAST_KERNEL_COUNT; i++)
+	{
+		const struct fast_kernel *k = &fast_kernels[i];
+		if ((SysBase->AttnFlags & k->cpu_flags) != k->cpu_flags)
+			continue;
+
+		ULONG runs = time_kernel(k);
+		if (runs > best)
+		{
+			best = runs;
+			fast_kernel = k;
+		}
+	}
+
+	spi_set_speed(SPI_SPEED_SLOW);
+	use_strobe(mode == SPI_XFER_STROBE);
+}
+
+// Takes the optional features from the caps reply.
+static void use_caps()
+{
+	long_supported = (caps.commands & SPI_CAP_LONG) != 0;
+	batch_supported = (caps.commands & SPI_CAP_BATCH) != 0;
+	poll_supported = (caps.commands & SPI_CAP_POLL) != 0;
+
+	// A 68000 decompresses slower than the port transfers.
+	lz4_enabled = (caps.commands & SPI_CAP_LBA_LZ4) && (SysBase->AttnFlags & AFF_68020);
+}
+
+// Registers change_isr and this copy's flag_isr in the shared state.
+// Returns the slot, or -1 if all are taken.
+static int add_user(void (*change_isr)())
+{
+	for (int i = 0; i < MAX_USERS; i++)
+	{
+		if (!shared->flag_isr[i])
+		{
+			shared->flag_isr[i] = flag_isr;
+			shared->change_handler[i] = change_isr;
+			shared->users++;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void remove_user()
+{
+	Disable();
+	shared->flag_isr[user_slot] = NULL;
+	shared->change_handler[user_slot] = NULL;
+	shared->users--;
+
+	// Hand the interrupt over to a copy that stays, as this one's code
+	// may be unloaded.
+	if (shared->flag_interrupt.is_Code == flag_isr)
+	{
+		for (int i = 0; i < MAX_USERS; i++)
+		{
+			if (shared->flag_isr[i])
+			{
+				shared->flag_interrupt.is_Code = shared->flag_isr[i];
+				break;
+			}
+		}
+	}
+	Enable();
+}
+
+// Joins the copy of spi-lib that owns the adapter. This takes firmware
+// with several targets, as each driver needs a chip select of its own.
+static int join_shared()
+{
+	int card_present = -3;
+
+	ObtainSemaphore(&shared->sem);
+
+	caps_valid = read_caps(&caps) == 0;
+	if (caps_valid && (caps.commands & SPI_CAP_TARGET))
+	{
+		use_caps();
+		strobe_capable = shared->strobe_capable;
+		fast_kernel = &fast_kernels[shared->kernel];
+
+		card_present = spi_get_card_present();
+		if (card_present < 0)
+			card_present = -6;
+	}
+
+	ReleaseSemaphore(&shared->sem);
+
+	if (card_present < 0)
+	{
+		remove_user();
+		shared = NULL;
+	}
+
+	return card_present;
+}
+
+int spi_initialize(void (*change_isr)())
+{
+	int success = 0;
+
+	Forbid();
+	shared = (struct spi_shared *)FindSemaphore((STRPTR)spi_lib_name);
+	if (shared)
+	{
+		user_slot = add_user(change_isr);
+		Permit();
+
+		if (user_slot < 0)
+		{
+			shared = NULL;
+			return -3;
+		}
+
+		return join_shared();
+	}
+
+	shared = (struct spi_shared *)AllocMem(sizeof(struct spi_shared), MEMF_PUBLIC | MEMF_CLEAR);
+	if (!shared)
+	{
+		Permit();
+		return -7;
+	}
+
+	// Published right away, so that a driver starting meanwhile waits on
+	// the semaphore instead of trying to claim the port itself.
+	CopyMem((APTR)spi_lib_name, shared->name, sizeof(spi_lib_name));
+	shared->sem.ss_Link.ln_Name = shared->name;
+	AddSemaphore(&shared->sem);
+	ObtainSemaphore(&shared->sem);
+	user_slot = add_user(change_isr);
+	Permit();
+
+	shared->miscbase = (struct Library *)OpenResource(MISCNAME);
+	if (!shared->miscbase)
+	{
+		success = -1;
+		goto fail_out1;
+	}
+
+	shared->ciaabase = (struct Library *)OpenResource(CIAANAME);
+	if (!shared->ciaabase)
+	{
+		success = -2;
+		goto fail_out1;
+	}
+
+	if (AllocMiscResource(shared->miscbase, MR_PARALLELPORT, shared->name))
+	{
 		success = -3;
 		goto fail_out1;
 	}
 
-	if (AllocMiscResource(miscbase, MR_PARALLELBITS, spi_lib_name))
+	if (AllocMiscResource(shared->miscbase, MR_PARALLELBITS, shared->name))
 	{
 		success = -4;
 		goto fail_out2;
 	}
 
-	flag_interrupt.is_Node.ln_Name = (char *)spi_lib_name;
-	flag_interrupt.is_Node.ln_Type = NT_INTERRUPT;
-	flag_interrupt.is_Code = change_isr;
+	shared->flag_interrupt.is_Node.ln_Name = shared->name;
+	shared->flag_interrupt.is_Node.ln_Type = NT_INTERRUPT;
+	shared->flag_interrupt.is_Code = flag_isr;
 
 	Disable();
-	if (AddICRVector(ciaabase, CIAICRB_FLG, &flag_interrupt))
+	if (AddICRVector(shared->ciaabase, CIAICRB_FLG, &shared->flag_interrupt))
 	{
 		Enable();
 		success = -5;
 		goto fail_out3;
 	}
 
-	AbleICR(ciaabase, CIAICRF_FLG);
-	SetICR(ciaabase, CIAICRF_FLG);
+	AbleICR(shared->ciaabase, CIAICRF_FLG);
+	SetICR(shared->ciaabase, CIAICRF_FLG);
 	Enable();
 
 	*cia_b_pra = (*cia_b_pra & ~ACT_MASK) | (REQ_MASK | CLK_MASK);
@@ -293,7 +2079,30 @@ int spi_initialize(void (*change_isr)())
 		goto fail_out4;
 	}
 
-	AbleICR(ciaabase, CIAICRF_SETCLR | CIAICRF_FLG);
+	caps_valid = read_caps(&caps) == 0;
+
+	if (!caps_valid || (caps.commands & SPI_CAP_XFER_MODE))
+		strobe_capable = spi_set_xfer_mode(SPI_XFER_STROBE) == SPI_XFER_STROBE;
+
+	if (caps_valid)
+		use_caps();
+	else
+	{
+		long_supported = probe_long();
+		batch_supported = 1;
+		poll_supported = 1;
+	}
+
+	select_kernel();
+
+	shared->strobe_capable = strobe_capable;
+	shared->kernel = fast_kernel - fast_kernels;
+	shared->target_speed[0] = current_speed;
+	shared->target_xfer_mode[0] = current_xfer_mode;
+
+	AbleICR(shared->ciaabase, CIAICRF_SETCLR | CIAICRF_FLG);
+
+	ReleaseSemaphore(&shared->sem);
 
 	return card_present;
 
@@ -301,27 +2110,53 @@ fail_out4:
 	*cia_b_ddra &= ~(ACT_MASK | REQ_MASK | CLK_MASK);
 	*cia_a_ddrb = 0;
 
-	RemICRVector(ciaabase, CIAICRB_FLG, &flag_interrupt);
+	RemICRVector(shared->ciaabase, CIAICRB_FLG, &shared->flag_interrupt);
 
 fail_out3:
-	FreeMiscResource(miscbase, MR_PARALLELBITS);
+	FreeMiscResource(shared->miscbase, MR_PARALLELBITS);
 
 fail_out2:
-	FreeMiscResource(miscbase, MR_PARALLELPORT);
+	FreeMiscResource(shared->miscbase, MR_PARALLELPORT);
 
 fail_out1:
+	Forbid();
+	RemSemaphore(&shared->sem);
+	ReleaseSemaphore(&shared->sem);
+	FreeMem(shared, sizeof(struct spi_shared));
+	Permit();
+	shared = NULL;
+
 	return success;
 }
 
 void spi_shutdown()
 {
-	AbleICR(ciaabase, CIAICRF_FLG);
+	ObtainSemaphore(&shared->sem);
+	remove_user();
+
+	Forbid();
+	if (shared->users)
+	{
+		Permit();
+		ReleaseSemaphore(&shared->sem);
+		shared = NULL;
+		return;
+	}
+
+	RemSemaphore(&shared->sem);
+	Permit();
+	ReleaseSemaphore(&shared->sem);
+
+	AbleICR(shared->ciaabase, CIAICRF_FLG);
 
 	*cia_b_ddra &= ~(ACT_MASK | REQ_MASK | CLK_MASK);
 	*cia_a_ddrb = 0;
 
-	RemICRVector(ciaabase, CIAICRB_FLG, &flag_interrupt);
+	RemICRVector(shared->ciaabase, CIAICRB_FLG, &shared->flag_interrupt);
+
+	FreeMiscResource(shared->miscbase, MR_PARALLELBITS);
+	FreeMiscResource(shared->miscbase, MR_PARALLELPORT);
 
-	FreeMiscResource(miscbase, MR_PARALLELBITS);
-	FreeMiscResource(miscbase, MR_PARALLELPORT);
+	FreeMem(shared, sizeof(struct spi_shared));
+	shared = NULL;
 }
@@ -8,13 +8,203 @@
 #define SPI_SPEED_SLOW 0
 #define SPI_SPEED_FAST 1
 
+#define SPI_XFER_CLK 0
+#define SPI_XFER_STROBE 1
+
+// Segment types for spi_transfer_batch().
+#define SPI_SEG_WRITE 0
+#define SPI_SEG_READ 1
+#define SPI_SEG_SELECT 2
+#define SPI_SEG_DESELECT 3
+#define SPI_SEG_POLL 4
+
+// Flags for spi_transfer_batch().
+#define SPI_BATCH_SELECT 1
+#define SPI_BATCH_DESELECT 2
+
+// Flags for spi_poll() and SPI_SEG_POLL segments.
+#define SPI_POLL_MATCH 0
+#define SPI_POLL_MISMATCH 1
+#define SPI_POLL_MS 0
+#define SPI_POLL_BYTES 2
+
+#define SPI_BATCH_MAX_SEGMENTS 16
+#define SPI_BATCH_MAX_BYTES 1024
+
+// A SPI_SEG_POLL segment uses size as the limit (in ms or bytes) and
+// stores the last byte read in buf[0].
+#define SPI_LBA_SECTOR_SIZE 512
+#define SPI_LBA_INFO_SIZE 33
+
+// Return values of the spi_lba_*() functions.
+#define SPI_LBA_OK 0
+#define SPI_LBA_TIMEOUT 1
+#define SPI_LBA_ERROR 2
+#define SPI_LBA_NO_CARD 3
+#define SPI_LBA_UNSUPPORTED -1
+
+// Requests of spi_file_request(), with their parameter blocks and
+// replies. Numbers are big endian, .l 32 bit, paths have no terminator.
+#define SPI_FILE_MOUNT 0	// () -> ()
+#define SPI_FILE_OPEN 1		// (mode, path) -> (handle, size.l)
+#define SPI_FILE_READ 2		// (handle) -> (data)
+#define SPI_FILE_WRITE 3	// (handle, data) -> ()
+#define SPI_FILE_SEEK 4		// (handle, whence, offset.l) -> (old.l, size.l)
+#define SPI_FILE_CLOSE 5	// (handle) -> ()
+#define SPI_FILE_STAT 6		// (path) -> (record)
+#define SPI_FILE_DIR_OPEN 7	// (path) -> (handle)
+#define SPI_FILE_DIR_READ 8	// (handle) -> (records)
+#define SPI_FILE_DIR_CLOSE 9	// (handle) -> ()
+#define SPI_FILE_DELETE 10	// (path) -> ()
+#define SPI_FILE_RENAME 11	// (path, 0, new path) -> ()
+#define SPI_FILE_MKDIR 12	// (path) -> ()
+#define SPI_FILE_INFO 13	// () -> (sectors.l, free sectors.l)
+
+// Return values of spi_file_request(), the first four as for LBA.
+#define SPI_FILE_OK 0
+#define SPI_FILE_TIMEOUT 1
+#define SPI_FILE_ERROR 2
+#define SPI_FILE_NO_CARD 3
+#define SPI_FILE_NOT_FOUND 4
+#define SPI_FILE_EXISTS 5
+#define SPI_FILE_DENIED 6
+#define SPI_FILE_NO_HANDLE 7
+#define SPI_FILE_BAD_HANDLE 8
+#define SPI_FILE_FULL 9
+#define SPI_FILE_PROTECTED 10
+#define SPI_FILE_NO_FS 11
+#define SPI_FILE_BAD_NAME 12
+#define SPI_FILE_IN_USE 13
+#define SPI_FILE_BAD_SEEK 14
+#define SPI_FILE_UNSUPPORTED -1
+
+// Bits of the SPI_FILE_OPEN mode, as FA_* in FatFS.
+#define SPI_FILE_MODE_READ 0x01
+#define SPI_FILE_MODE_WRITE 0x02
+#define SPI_FILE_MODE_CREATE_NEW 0x04
+#define SPI_FILE_MODE_CREATE_ALWAYS 0x08
+#define SPI_FILE_MODE_OPEN_ALWAYS 0x10
+
+// A directory record: its length, the attributes (AM_* in FatFS), size.l,
+// FAT date and time (16 bit each) and the name.
+#define SPI_FILE_RECORD_HEADER 10
+#define SPI_FILE_RECORD_MAX 117
+#define SPI_FILE_ATTR_READONLY 0x01
+#define SPI_FILE_ATTR_DIR 0x10
+#define SPI_FILE_ATTR_ARCHIVE 0x20
+
+// Largest reply, and parameter block after the handle of SPI_FILE_WRITE.
+#define SPI_FILE_CHUNK 8192
+
+// Return values of the spi_net_* functions.
+#define SPI_NET_OK 0
+#define SPI_NET_TIMEOUT 1
+#define SPI_NET_ERROR 2
+#define SPI_NET_OFFLINE 3	// The adapter isn't connected to the WiFi
+#define SPI_NET_NOT_OPEN 4
+#define SPI_NET_UNSUPPORTED -1
+
+// Flags in the first byte filled in by spi_net_receive().
+#define SPI_NET_MORE 0x01
+#define SPI_NET_CARD_CHANGED 0x02
+
+// Largest frame, without the FCS, and size of the frame batches.
+#define SPI_NET_FRAME_MAX 1518
+#define SPI_NET_BATCH_MAX 8192
+
+// Firmware IDs reported by spi_get_caps().
+#define SPI_FW_AVR 1
+#define SPI_FW_RP2040 2
+#define SPI_FW_RP2350 3
+
+// Bits in spi_caps.commands, one per control command.
+#define SPI_CAP_SELECT (1 << 0)
+#define SPI_CAP_CARD_PRESENT (1 << 1)
+#define SPI_CAP_SPEED (1 << 2)
+#define SPI_CAP_XFER_MODE (1 << 3)
+#define SPI_CAP_BATCH (1 << 4)
+#define SPI_CAP_POLL (1 << 5)
+#define SPI_CAP_LBA (1 << 6)
+#define SPI_CAP_LONG (1 << 7)
+#define SPI_CAP_GET_CAPS (1 << 8)
+#define SPI_CAP_TIER (1 << 9)
+#define SPI_CAP_NOTIFY (1 << 10)
+#define SPI_CAP_TEST (1 << 11)
+#define SPI_CAP_TARGET (1 << 12)
+#define SPI_CAP_SPI_MODE (1 << 13)
+#define SPI_CAP_CACHE (1 << 14)
+#define SPI_CAP_FILE (1 << 15)
+
+// Bits from 16 up are optional features of the commands above.
+#define SPI_CAP_LBA_UNIFORM (1 << 16)
+#define SPI_CAP_LBA_LZ4 (1 << 17)
+#define SPI_CAP_NET (1 << 18)	// Command 15 with A set
+
+#define SPI_MAX_TIERS 8
+#define SPI_MAX_TARGETS 4
+
+// Byte i of each transfer in test mode, see spi_set_test_mode().
+#define SPI_TEST_PATTERN(i) (((i) + ((i) >> 8)) & 0xff)
+
+struct spi_segment
+{
+	unsigned char type;
+	unsigned char flags;
+	unsigned short size;
+	unsigned char *buf;
+	unsigned char mask;
+	unsigned char value;
+};
+
+struct spi_cache_stats
+{
+	unsigned short sectors;
+	unsigned short depth;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned short write_sectors;
+	unsigned short dirty;
+	unsigned long lost;
+};
+
+struct spi_caps
+{
+	unsigned char firmware;
+	unsigned char version;
+	unsigned long commands;
+	unsigned char tier_count;
+	unsigned short tier_khz[SPI_MAX_TIERS];
+};
+
 int spi_initialize(void (*change_isr)());
 int spi_get_card_present();
 void spi_shutdown();
 void spi_set_speed(long speed);
+long spi_set_xfer_mode(long mode);
+int spi_get_caps(struct spi_caps *caps);
+long spi_set_tier(long tier);
+long spi_set_test_mode(long on);
+int spi_obtain(long target);
+void spi_release();
+int spi_set_clock_mode(long mode);
 void spi_select();
 void spi_deselect();
 void spi_read(__reg("a0") unsigned char *buf, __reg("d0") unsigned long size);
 void spi_write(__reg("a0") const unsigned char *buf, __reg("d0") unsigned long size);
+int spi_poll(unsigned char mask, unsigned char value, long flags, long limit, unsigned char *result);
+int spi_wait_ready(unsigned long signals, long limit);
+long spi_transfer_batch(const struct spi_segment *segs, long count, long flags);
+int spi_lba_open(unsigned char *info);
+int spi_lba_read(unsigned char *buf, unsigned long lba, long count);
+int spi_lba_write(const unsigned char *buf, unsigned long lba, long count);
+int spi_lba_fill(unsigned char value, unsigned long lba, long count);
+int spi_lba_sync();
+int spi_cache_control(long depth, struct spi_cache_stats *stats);
+int spi_file_request(long op, const unsigned char *params, long size, const unsigned char *data, long data_size,
+		unsigned char *reply, long reply_max, long *reply_size);
+int spi_net_open(unsigned char *mac);
+int spi_net_close();
+int spi_net_send(const unsigned char *buf, long size, long *accepted);
+int spi_net_receive(unsigned char *buf, long buf_max, long *size, unsigned long signals);
 
 #endif
@@ -3,6 +3,18 @@
 
         XDEF        _spi_read_fast
         XDEF        _spi_write_fast
+        XDEF        _spi_read_fast16
+        XDEF        _spi_write_fast16
+        XDEF        _spi_read_fast020
+        XDEF        _spi_write_fast020
+        XDEF        _spi_read_strobe
+        XDEF        _spi_write_strobe
+        XDEF        _spi_clock_in
+        XDEF        _spi_clock_out
+        XDEF        _spi_strobe_in
+        XDEF        _spi_strobe_out
+        XDEF        _spi_fill
+        XDEF        _spi_lz4_decode
         CODE
 
 CIAB_PRTRSEL	equ	(2)
@@ -23,10 +35,10 @@ ACT_BIT         equ     CIAB_PRTRBUSY
 
                 ; a0 = unsigned char *buf
                 ; d0 = unsigned int size
-                ; assert: 1 <= size < 2^13 (three top bits are zeros)
+                ; assert: 1 <= size <= 2^13 (two top bits are zeros)
 
 _spi_write_fast:
-                and     #$1fff,d0
+                and     #$3fff,d0
                 bne.b   .not_zero
                 rts
 .not_zero:
@@ -101,10 +113,10 @@ _spi_write_fast:
 
                 ; a0 = unsigned char *buf
                 ; d0 = unsigned int size
-                ; assert: 1 <= size < 2^13 (three top bits are zeros)
+                ; assert: 1 <= size <= 2^13 (two top bits are zeros)
 
 _spi_read_fast:
-                and     #$1fff,d0
+                and     #$3fff,d0
                 bne.b   .not_zero
                 rts
 .not_zero:
@@ -181,3 +193,821 @@ _spi_read_fast:
 
                 movem.l (a7)+,d2/a5
                 rts
+
+                ; Variants of _spi_read_fast and _spi_write_fast with less
+                ; CPU work between the CIA accesses. spi_initialize() picks
+                ; the fastest one for the CPU with a short timing run.
+                ;
+                ; The CIA is accessed once per E-cycle (10 CPU clocks at
+                ; 7.09 MHz) at best, and any CPU clocks between the accesses
+                ; that don't fit the remaining E-cycle stretch it. Per byte,
+                ; with the buffer in chip RAM or 16 bit fast RAM:
+                ;
+                ;                CIA      68000 clocks      E-cycles
+                ; kernel         access   between accesses  68000    68020
+                ; fast           2        17                ~3.7     ~2.2
+                ; fast16         2        12.6              ~3.3     ~2.1
+                ; fast020        2        (68020+ only)     -        ~2.0
+                ;
+                ; fast loops two bytes per dbra. fast16 enters a 16 byte
+                ; loop body with a computed jump (Duff's device), so dbra
+                ; is paid once per 16 bytes. fast020 moves four bytes to or
+                ; from memory with one unaligned longword access, which the
+                ; 68000 can't do, so it runs fewer bus cycles beside the CIA.
+
+                ; Sends READ1/READ2 and turns the data port around.
+                ; In: d0 = size - 1, d2 = control pins, a1 = data, a5 = control
+                ; Out: d0 = size, d2 = control pins
+
+read_cmd:       cmp     #63,d0
+                ble.b   .one_byte_cmd
+
+                ; READ2 = 10xxxxxx 1xxxxxxx
+                move    d0,d1
+                lsr     #7,d1
+                or.b    #$80,d1
+                move.b  d1,(a1)
+                bclr    #REQ_BIT,d2
+                move.b  d2,(a5)
+
+.act_wait2:     move.b  (a5),d2
+                btst    #ACT_BIT,d2
+                bne.b   .act_wait2
+
+                move.b  d0,d1
+                or.b    #$80,d1
+                move.b  d1,(a1)
+                bchg    #CLK_BIT,d2
+                move.b  d2,(a5)
+                bra.b   .cmd_sent
+
+.one_byte_cmd:  ; READ1 = 01xxxxxx
+                move.b  d0,d1
+                or.b    #$40,d1
+                move.b  d1,(a1)
+                bclr    #REQ_BIT,d2
+                move.b  d2,(a5)
+
+.act_wait1:     move.b  (a5),d2
+                btst    #ACT_BIT,d2
+                bne.b   .act_wait1
+
+.cmd_sent:      move.b  #0,$200(a1)             ; Stop driving data pins
+
+                addq    #1,d0                   ; d0 = size
+                rts
+
+                ; Sends WRITE1/WRITE2.
+                ; In: d0 = size - 1, d2 = control pins, a1 = data, a5 = control
+                ; Out: d0 = size, d2 = control pins
+
+write_cmd:      cmp     #63,d0
+                ble.b   .one_byte_cmd
+
+                ; WRITE2 = 10xxxxxx 0xxxxxxx
+                move    d0,d1
+                lsr     #7,d1
+                or.b    #$80,d1
+                move.b  d1,(a1)
+                bclr    #REQ_BIT,d2
+                move.b  d2,(a5)
+
+.act_wait2:     move.b  (a5),d2
+                btst    #ACT_BIT,d2
+                bne.b   .act_wait2
+
+                move.b  d0,d1
+                and.b   #$7f,d1
+                move.b  d1,(a1)
+                bchg    #CLK_BIT,d2
+                move.b  d2,(a5)
+                bra.b   .cmd_sent
+
+.one_byte_cmd:  ; WRITE1 = 00xxxxxx
+                move.b  d0,(a1)
+                bclr    #REQ_BIT,d2
+                move.b  d2,(a5)
+
+.act_wait1:     move.b  (a5),d2
+                btst    #ACT_BIT,d2
+                bne.b   .act_wait1
+
+.cmd_sent:      addq    #1,d0                   ; d0 = size
+                rts
+
+                ; a0 = unsigned char *buf
+                ; d0 = unsigned int size
+                ; assert: 1 <= size <= 2^13 (two top bits are zeros)
+
+_spi_read_fast16:
+                and     #$3fff,d0
+                bne.b   .not_zero
+                rts
+.not_zero:
+                movem.l d2-d3/a5,-(a7)
+
+                lea.l   CIAA_BASE+CIAPRB,a1      ; Data
+                lea.l   CIAB_BASE+CIAPRA,a5      ; Control pins
+
+                move.b  (a5),d2
+
+                subq    #1,d0                   ; d0 = size - 1
+                bsr     read_cmd
+
+                btst    #0,d0
+                beq.b   .even
+
+                bchg    #CLK_BIT,d2
+                move.b  d2,(a5)
+                move.b  (a1),(a0)+
+
+.even:          lsr     #1,d0                   ; d0 = byte pairs
+                beq.b   .done
+
+                move    d0,d1
+                neg     d1
+                and     #7,d1                   ; Pairs skipped in the first pass
+                lsl     #3,d1                   ; Eight bytes of code per pair
+                addq    #7,d0
+                lsr     #3,d0
+                subq    #1,d0                   ; Passes - 1
+
+                move.b  d2,d3
+                bchg    #CLK_BIT,d3
+
+                jmp     .loop(pc,d1.w)
+
+.loop:          move.b  d3,(a5)
+                move.b  (a1),(a0)+
+                move.b  d2,(a5)
+                move.b  (a1),(a0)+
+                move.b  d3,(a5)
+                move.b  (a1),(a0)+
+                move.b  d2,(a5)
+                move.b  (a1),(a0)+
+                move.b  d3,(a5)
+                move.b  (a1),(a0)+
+                move.b  d2,(a5)
+                move.b  (a1),(a0)+
+                move.b  d3,(a5)
+                move.b  (a1),(a0)+
+                move.b  d2,(a5)
+                move.b  (a1),(a0)+
+                move.b  d3,(a5)
+                move.b  (a1),(a0)+
+                move.b  d2,(a5)
+                move.b  (a1),(a0)+
+                move.b  d3,(a5)
+                move.b  (a1),(a0)+
+                move.b  d2,(a5)
+                move.b  (a1),(a0)+
+                move.b  d3,(a5)
+                move.b  (a1),(a0)+
+                move.b  d2,(a5)
+                move.b  (a1),(a0)+
+                move.b  d3,(a5)
+                move.b  (a1),(a0)+
+                move.b  d2,(a5)
+                move.b  (a1),(a0)+
+                dbra    d0,.loop
+
+.done:          bset    #REQ_BIT,d2
+                move.b  d2,(a5)
+
+                move.b  #$ff,$200(a1)             ; Start driving data pins
+
+                movem.l (a7)+,d2-d3/a5
+                rts
+
+                ; a0 = unsigned char *buf
+                ; d0 = unsigned int size
+                ; assert: 1 <= size <= 2^13 (two top bits are zeros)
+
+_spi_write_fast16:
+                and     #$3fff,d0
+                bne.b   .not_zero
+                rts
+.not_zero:
+                movem.l d2-d3/a5,-(a7)
+
+                lea.l   CIAA_BASE+CIAPRB,a1     ; Data
+                lea.l   CIAB_BASE+CIAPRA,a5     ; Control pins
+
+                move.b  (a5),d2
+
+                subq    #1,d0                   ; d0 = size - 1
+                bsr     write_cmd
+
+                btst    #0,d0
+                beq.b   .even
+
+                move.b  (a0)+,(a1)
+                bchg    #CLK_BIT,d2
+                move.b  d2,(a5)
+
+.even:          lsr     #1,d0                   ; d0 = byte pairs
+                beq.b   .done
+
+                move    d0,d1
+                neg     d1
+                and     #7,d1                   ; Pairs skipped in the first pass
+                lsl     #3,d1                   ; Eight bytes of code per pair
+                addq    #7,d0
+                lsr     #3,d0
+                subq    #1,d0                   ; Passes - 1
+
+                move.b  d2,d3
+                bchg    #CLK_BIT,d3
+
+                jmp     .loop(pc,d1.w)
+
+.loop:          move.b  (a0)+,(a1)
+                move.b  d3,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d2,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d3,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d2,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d3,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d2,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d3,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d2,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d3,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d2,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d3,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d2,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d3,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d2,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d3,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d2,(a5)
+                dbra    d0,.loop
+
+.done:          move.b	d2,(a5)                 ; Delay to allow write to complete
+                bset    #REQ_BIT,d2
+                move.b  d2,(a5)
+
+                movem.l (a7)+,d2-d3/a5
+                rts
+
+                ; a0 = unsigned char *buf
+                ; d0 = unsigned int size
+                ; assert: 1 <= size <= 2^13 (two top bits are zeros)
+                ; assert: 68020 or better
+
+_spi_read_fast020:
+                and     #$3fff,d0
+                bne.b   .not_zero
+                rts
+.not_zero:
+                movem.l d2-d3/a5,-(a7)
+
+                lea.l   CIAA_BASE+CIAPRB,a1      ; Data
+                lea.l   CIAB_BASE+CIAPRA,a5      ; Control pins
+
+                move.b  (a5),d2
+
+                subq    #1,d0                   ; d0 = size - 1
+                bsr     read_cmd
+
+                move.b  d2,d3
+                bchg    #CLK_BIT,d3
+
+                btst    #0,d0
+                beq.b   .even
+
+                move.b  d3,(a5)
+                move.b  (a1),(a0)+
+                exg     d2,d3
+
+.even:          btst    #1,d0
+                beq.b   .quad
+
+                move.b  d3,(a5)
+                move.b  (a1),(a0)+
+                move.b  d2,(a5)
+                move.b  (a1),(a0)+
+
+.quad:          lsr     #2,d0
+                beq.b   .done
+                subq    #1,d0
+
+.loop:          move.b  d3,(a5)
+                move.b  (a1),d1
+                lsl.w   #8,d1
+                move.b  d2,(a5)
+                move.b  (a1),d1
+                swap    d1
+                move.b  d3,(a5)
+                move.b  (a1),d1
+                lsl.w   #8,d1
+                move.b  d2,(a5)
+                move.b  (a1),d1
+                move.l  d1,(a0)+                ; May be unaligned
+                dbra    d0,.loop
+
+.done:          bset    #REQ_BIT,d2
+                move.b  d2,(a5)
+
+                move.b  #$ff,$200(a1)             ; Start driving data pins
+
+                movem.l (a7)+,d2-d3/a5
+                rts
+
+                ; a0 = unsigned char *buf
+                ; d0 = unsigned int size
+                ; assert: 1 <= size <= 2^13 (two top bits are zeros)
+                ; assert: 68020 or better
+
+_spi_write_fast020:
+                and     #$3fff,d0
+                bne.b   .not_zero
+                rts
+.not_zero:
+                movem.l d2-d3/a5,-(a7)
+
+                lea.l   CIAA_BASE+CIAPRB,a1     ; Data
+                lea.l   CIAB_BASE+CIAPRA,a5     ; Control pins
+
+                move.b  (a5),d2
+
+                subq    #1,d0                   ; d0 = size - 1
+                bsr     write_cmd
+
+                move.b  d2,d3
+                bchg    #CLK_BIT,d3
+
+                btst    #0,d0
+                beq.b   .even
+
+                move.b  (a0)+,(a1)
+                move.b  d3,(a5)
+                exg     d2,d3
+
+.even:          btst    #1,d0
+                beq.b   .quad
+
+                move.b  (a0)+,(a1)
+                move.b  d3,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d2,(a5)
+
+.quad:          lsr     #2,d0
+                beq.b   .done
+                subq    #1,d0
+
+.loop:          move.l  (a0)+,d1                ; May be unaligned
+                rol.l   #8,d1
+                move.b  d1,(a1)
+                move.b  d3,(a5)
+                rol.l   #8,d1
+                move.b  d1,(a1)
+                move.b  d2,(a5)
+                rol.l   #8,d1
+                move.b  d1,(a1)
+                move.b  d3,(a5)
+                rol.l   #8,d1
+                move.b  d1,(a1)
+                move.b  d2,(a5)
+                dbra    d0,.loop
+
+.done:          move.b	d2,(a5)                 ; Delay to allow write to complete
+                bset    #REQ_BIT,d2
+                move.b  d2,(a5)
+
+                movem.l (a7)+,d2-d3/a5
+                rts
+
+                ; Strobe-clocked variants of the routines above.
+                ; The firmware advances on the /STROBE pulse that CIA-A
+                ; generates on every access to PRB, so the data loops
+                ; only touch PRB: one E-cycle per byte instead of two.
+
+                ; a0 = unsigned char *buf
+                ; d0 = unsigned int size
+                ; assert: 1 <= size <= 2^13 (two top bits are zeros)
+
+_spi_write_strobe:
+                and     #$3fff,d0
+                bne.b   .not_zero
+                rts
+.not_zero:
+                movem.l d2/a5,-(a7)
+
+                lea.l   CIAA_BASE+CIAPRB,a1     ; Data
+                lea.l   CIAB_BASE+CIAPRA,a5     ; Control pins
+
+                move.b  (a5),d2
+
+                subq    #1,d0                   ; d0 = size - 1
+
+                cmp     #63,d0
+                ble.b   .one_byte_cmd
+
+                ; WRITE2 = 10xxxxxx 0xxxxxxx
+                move    d0,d1
+                lsr     #7,d1
+                or.b    #$80,d1
+                move.b  d1,(a1)
+                bclr    #REQ_BIT,d2
+                move.b  d2,(a5)
+
+.act_wait2:     move.b  (a5),d2
+                btst    #ACT_BIT,d2
+                bne.b   .act_wait2
+
+                move.b  d0,d1
+                and.b   #$7f,d1
+                move.b  d1,(a1)
+                bchg    #CLK_BIT,d2
+                move.b  d2,(a5)
+                bra.b   .cmd_sent
+
+.one_byte_cmd:  ; WRITE1 = 00xxxxxx
+                move.b  d0,(a1)
+                bclr    #REQ_BIT,d2
+                move.b  d2,(a5)
+
+.act_wait1:     move.b  (a5),d2
+                btst    #ACT_BIT,d2
+                bne.b   .act_wait1
+
+.cmd_sent:      addq    #1,d0                   ; d0 = size
+
+                btst    #0,d0
+                beq.b   .even
+
+                move.b  (a0)+,(a1)
+
+.even:          lsr     #1,d0
+                beq.b   .done
+                subq    #1,d0
+
+.loop:          move.b  (a0)+,(a1)              ; Each write pulses /STROBE
+                move.b  (a0)+,(a1)
+                dbra    d0,.loop
+
+.done:          move.b	d2,(a5)                 ; Delay to allow write to complete
+                bset    #REQ_BIT,d2
+                move.b  d2,(a5)
+
+                movem.l (a7)+,d2/a5
+                rts
+
+                ; a0 = unsigned char *buf
+                ; d0 = unsigned int size
+                ; assert: 1 <= size <= 2^13 (two top bits are zeros)
+
+_spi_read_strobe:
+                and     #$3fff,d0
+                bne.b   .not_zero
+                rts
+.not_zero:
+                movem.l d2/a5,-(a7)
+
+                lea.l   CIAA_BASE+CIAPRB,a1      ; Data
+                lea.l   CIAB_BASE+CIAPRA,a5      ; Control pins
+
+                move.b  (a5),d2
+
+                subq    #1,d0                   ; d0 = size - 1
+
+                cmp     #63,d0
+                ble.b   .one_byte_cmd
+
+                ; READ2 = 10xxxxxx 1xxxxxxx
+                move    d0,d1
+                lsr     #7,d1
+                or.b    #$80,d1
+                move.b  d1,(a1)
+                bclr    #REQ_BIT,d2
+                move.b  d2,(a5)
+
+.act_wait2:     move.b  (a5),d2
+                btst    #ACT_BIT,d2
+                bne.b   .act_wait2
+
+                move.b  d0,d1
+                or.b    #$80,d1
+                move.b  d1,(a1)
+                bchg    #CLK_BIT,d2
+                move.b  d2,(a5)
+                bra.b   .cmd_sent
+
+.one_byte_cmd:  ; READ1 = 01xxxxxx
+                move.b  d0,d1
+                or.b    #$40,d1
+                move.b  d1,(a1)
+                bclr    #REQ_BIT,d2
+                move.b  d2,(a5)
+
+.act_wait1:     move.b  (a5),d2
+                btst    #ACT_BIT,d2
+                bne.b   .act_wait1
+
+.cmd_sent:      move.b  #0,$200(a1)             ; Stop driving data pins
+
+                bchg    #CLK_BIT,d2             ; First byte is clocked by CLK
+                move.b  d2,(a5)
+
+                addq    #1,d0                   ; d0 = size
+
+                btst    #0,d0
+                beq.b   .even
+
+                move.b  (a1),(a0)+
+
+.even:          lsr     #1,d0
+                beq.b   .done
+                subq    #1,d0
+
+.loop:          move.b  (a1),(a0)+              ; Each read pulses /STROBE
+                move.b  (a1),(a0)+
+                dbra    d0,.loop
+
+.done:          bset    #REQ_BIT,d2
+                move.b  d2,(a5)
+
+                move.b  #$ff,$200(a1)             ; Start driving data pins
+
+                movem.l (a7)+,d2/a5
+                rts
+
+                ; Data loops for commands that are already running, i.e.
+                ; REQ is low and the data port direction has been set.
+                ; One byte per CLK toggle, just like the loops above.
+
+                ; a0 = unsigned char *buf
+                ; d0 = unsigned int size
+                ; assert: 1 <= size <= 65535
+
+_spi_clock_in:
+                movem.l d2/a5,-(a7)
+
+                lea.l   CIAA_BASE+CIAPRB,a1      ; Data
+                lea.l   CIAB_BASE+CIAPRA,a5      ; Control pins
+
+                move.b  (a5),d2
+
+                btst    #0,d0
+                beq.b   .even
+
+                bchg    #CLK_BIT,d2
+                move.b  d2,(a5)
+                move.b  (a1),(a0)+
+
+.even:          lsr.l   #1,d0
+                beq.b   .done
+                subq.l  #1,d0
+
+                move.b  d2,d1
+                bchg    #CLK_BIT,d1
+
+.loop:          move.b  d1,(a5)
+                move.b  (a1),(a0)+
+                move.b  d2,(a5)
+                move.b  (a1),(a0)+
+                dbra    d0,.loop
+
+.done:          movem.l (a7)+,d2/a5
+                rts
+
+                ; a0 = unsigned char *buf
+                ; d0 = unsigned int size
+                ; assert: 1 <= size <= 65535
+
+_spi_clock_out:
+                movem.l d2/a5,-(a7)
+
+                lea.l   CIAA_BASE+CIAPRB,a1     ; Data
+                lea.l   CIAB_BASE+CIAPRA,a5     ; Control pins
+
+                move.b  (a5),d2
+
+                btst    #0,d0
+                beq.b   .even
+
+                move.b  (a0)+,(a1)
+                bchg    #CLK_BIT,d2
+                move.b  d2,(a5)
+
+.even:          lsr.l   #1,d0
+                beq.b   .done
+                subq.l  #1,d0
+
+                move.b  d2,d1
+                bchg    #CLK_BIT,d1
+
+.loop:          move.b  (a0)+,(a1)
+                move.b  d1,(a5)
+                move.b  (a0)+,(a1)
+                move.b  d2,(a5)
+                dbra    d0,.loop
+
+.done:          movem.l (a7)+,d2/a5
+                rts
+
+                ; Strobe-clocked data loops for commands that are already
+                ; running. For reads, the caller must already have clocked
+                ; the first byte with CLK.
+
+                ; a0 = unsigned char *buf
+                ; d0 = unsigned int size
+                ; assert: 1 <= size <= 65535
+
+_spi_strobe_in:
+                lea.l   CIAA_BASE+CIAPRB,a1      ; Data
+
+                btst    #0,d0
+                beq.b   .even
+
+                move.b  (a1),(a0)+
+
+.even:          lsr.l   #1,d0
+                beq.b   .done
+                subq.l  #1,d0
+
+.loop:          move.b  (a1),(a0)+              ; Each read pulses /STROBE
+                move.b  (a1),(a0)+
+                dbra    d0,.loop
+
+.done:          rts
+
+                ; a0 = unsigned char *buf
+                ; d0 = unsigned int size
+                ; assert: 1 <= size <= 65535
+
+_spi_strobe_out:
+                lea.l   CIAA_BASE+CIAPRB,a1     ; Data
+
+                btst    #0,d0
+                beq.b   .even
+
+                move.b  (a0)+,(a1)
+
+.even:          lsr.l   #1,d0
+                beq.b   .done
+                subq.l  #1,d0
+
+.loop:          move.b  (a0)+,(a1)              ; Each write pulses /STROBE
+                move.b  (a0)+,(a1)
+                dbra    d0,.loop
+
+.done:          rts
+
+                ; Fills a buffer with one value, for sectors that the
+                ; firmware sent as uniform instead of clocking them out.
+
+                ; a0 = unsigned char *buf
+                ; d0 = unsigned int size
+                ; d1 = unsigned char value
+                ; assert: 16 <= size <= 65535, size is a multiple of 16
+
+_spi_fill:
+                move.l  d2,-(a7)
+
+                move.l  a0,d2
+                btst    #0,d2
+                beq.b   .aligned
+
+                subq.l  #1,d0                   ; Odd address, byte by byte
+.bytes:         move.b  d1,(a0)+
+                dbra    d0,.bytes
+                bra.b   .done
+
+.aligned:       move.b  d1,d2
+                lsl.w   #8,d2
+                move.b  d1,d2
+                move.w  d2,d1
+                swap    d1
+                move.w  d2,d1                   ; Value in all four bytes
+
+                lsr.l   #4,d0
+                subq.l  #1,d0
+
+.loop:          move.l  d1,(a0)+
+                move.l  d1,(a0)+
+                move.l  d1,(a0)+
+                move.l  d1,(a0)+
+                dbra    d0,.loop
+
+.done:          move.l  (a7)+,d2
+                rts
+
+                ; Decodes an LZ4 block sent by the firmware for a compressed
+                ; LBA read. Only used on a 68020 or better, where this runs
+                ; faster than the port can deliver the uncompressed data.
+                ; Every length and offset is checked, so a corrupted block
+                ; can't write outside of dst.
+
+                ; a0 = const unsigned char *src
+                ; a1 = unsigned char *dst
+                ; d0 = unsigned int src_size
+                ; d1 = unsigned int dst_size
+                ; returns d0 = bytes written to dst, or -1 if corrupt
+
+_spi_lz4_decode:
+                movem.l d2-d4/a2-a5,-(a7)
+
+                lea.l   (a0,d0.l),a2            ; End of src
+                lea.l   (a1,d1.l),a3            ; End of dst
+                move.l  a1,a4                   ; Start of dst
+
+.token:         cmp.l   a2,a0
+                bhs     .corrupt
+                moveq   #0,d2
+                move.b  (a0)+,d2                ; Token
+                move.l  d2,d3
+                lsr.b   #4,d3                   ; Literal length
+                cmp.b   #15,d3
+                bne.b   .literals
+
+.lit_len:       cmp.l   a2,a0
+                bhs     .corrupt
+                moveq   #0,d4
+                move.b  (a0)+,d4
+                add.l   d4,d3
+                cmp.b   #255,d4
+                beq.b   .lit_len
+
+.literals:      move.l  a2,d4
+                sub.l   a0,d4
+                cmp.l   d3,d4
+                blo     .corrupt
+                move.l  a3,d4
+                sub.l   a1,d4
+                cmp.l   d3,d4
+                blo     .corrupt
+                bra.b   .lit_next
+
+.lit_copy:      move.b  (a0)+,(a1)+
+.lit_next:      subq.l  #1,d3
+                bcc.b   .lit_copy
+
+                cmp.l   a2,a0                   ; The last sequence has
+                beq.b   .done                   ; no match
+
+                move.l  a2,d4
+                sub.l   a0,d4
+                moveq   #2,d3
+                cmp.l   d3,d4
+                blo     .corrupt
+
+                moveq   #0,d3
+                move.b  (a0)+,d3
+                moveq   #0,d4
+                move.b  (a0)+,d4
+                lsl.w   #8,d4
+                or.w    d4,d3                   ; Offset, little endian
+                beq     .corrupt
+                move.l  a1,d4
+                sub.l   a4,d4
+                cmp.l   d3,d4
+                blo     .corrupt
+                move.l  a1,a5
+                sub.l   d3,a5                   ; Match source
+
+                and.w   #15,d2                  ; Match length - 4
+                cmp.b   #15,d2
+                bne.b   .match
+
+.match_len:     cmp.l   a2,a0
+                bhs     .corrupt
+                moveq   #0,d4
+                move.b  (a0)+,d4
+                add.l   d4,d2
+                cmp.b   #255,d4
+                beq.b   .match_len
+
+.match:         addq.l  #4,d2
+                move.l  a3,d4
+                sub.l   a1,d4
+                cmp.l   d2,d4
+                blo     .corrupt
+                bra.b   .match_next
+
+.match_copy:    move.b  (a5)+,(a1)+             ; May overlap, byte by byte
+.match_next:    subq.l  #1,d2
+                bcc.b   .match_copy
+                bra     .token
+
+.done:          move.l  a1,d0
+                sub.l   a4,d0
+                bra.b   .out
+
+.corrupt:       moveq   #-1,d0
+
+.out:           movem.l (a7)+,d2-d4/a2-a5
+                rts